@@ -1,5 +1,6 @@
 #include "allegro5/allegro_acodec.h"
 #include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern_audio.h"
 #include "allegro5/internal/aintern_acodec_cfg.h"
 #include "acodec.h"
 
@@ -25,6 +26,7 @@ bool al_init_acodec_addon(void)
    ret &= al_register_sample_loader_f(".wav", _al_load_wav_f);
    ret &= al_register_sample_saver_f(".wav", _al_save_wav_f);
    ret &= al_register_audio_stream_loader_f(".wav", _al_load_wav_audio_stream_f);
+   ret &= _al_kcm_register_sample_mapper(".wav", _al_map_wav);
 
    /* buil-in VOC loader */
    ret &= al_register_sample_loader(".voc", _al_load_voc);
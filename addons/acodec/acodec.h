@@ -5,6 +5,7 @@
 
 ALLEGRO_SAMPLE *_al_load_wav(const char *filename);
 ALLEGRO_SAMPLE *_al_load_wav_f(ALLEGRO_FILE *fp);
+ALLEGRO_SAMPLE *_al_map_wav(const char *filename);
 ALLEGRO_AUDIO_STREAM *_al_load_wav_audio_stream(const char *filename,
    size_t buffer_count, unsigned int samples);
 ALLEGRO_AUDIO_STREAM *_al_load_wav_audio_stream_f(ALLEGRO_FILE* f,
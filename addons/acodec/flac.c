@@ -31,10 +31,17 @@ typedef struct FLACFILE {
    int sample_size;
    int channels;
 
-   /* The file buffer. */
-   uint64_t buffer_pos, buffer_size;
+   /* The file buffer.  When streaming it only holds the part of the last
+    * decoded frame which didn't fit into the stream fragment, starting at
+    * buffer_read.
+    */
+   uint64_t buffer_pos, buffer_size, buffer_read;
    char *buffer;
 
+   /* The stream fragment currently being decoded into, if any. */
+   char *out;
+   uint64_t out_pos, out_size;
+
    /* Number of samples in the complete FLAC. */
    uint64_t total_samples;
 
@@ -256,39 +263,26 @@ static void error_callback(const FLAC__StreamDecoder *decoder,
 }
 
 
-static FLAC__StreamDecoderWriteStatus write_callback(
-   const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
-   const FLAC__int32 * const buffer[], void *client_data)
+/* Interleave 'count' samples starting at 'first' into 'dest', converting
+ * them to our own format.
+ */
+static bool flatten_samples(FLACFILE *ff, const FLAC__int32 * const buffer[],
+   long first, long count, char *dest)
 {
-   FLACFILE *ff = (FLACFILE *) client_data;
-   long len = frame->header.blocksize;
-   long bytes = len * ff->channels * ff->sample_size;
-   FLAC__uint8 *buf8;
-   FLAC__int16 *buf16;
-   float *buf32;
-   int sample_index;
+   FLAC__uint8 *buf8 = (FLAC__uint8 *) dest;
+   FLAC__int16 *buf16 = (FLAC__int16 *) buf8;
+   float *buf32 = (float *) buf8;
+   long end = first + count;
+   long sample_index;
    int channel_index;
    int out_index;
 
-   if (ff->buffer_pos + bytes > ff->buffer_size) {
-      ff->buffer = al_realloc(ff->buffer, ff->buffer_pos + bytes);
-      ff->buffer_size = ff->buffer_pos + bytes;
-   }
-
-   /* FLAC returns FLAC__int32 and I need to convert it to my own format. */
-   buf8 = (FLAC__uint8 *) (ff->buffer + ff->buffer_pos);
-   buf16 = (FLAC__int16 *) buf8;
-   buf32 = (float *) buf8;
-
-   (void)decoder;
-   (void)client_data;
-
    /* Flatten the array */
    /* TODO: test this array flattening process on 5.1 and higher flac files */
    out_index = 0;
    switch (ff->sample_size) {
       case 1:
-         for (sample_index = 0; sample_index < len; sample_index++) {
+         for (sample_index = first; sample_index < end; sample_index++) {
              for (channel_index = 0;
                   channel_index < ff->channels;
                   channel_index++) {
@@ -299,7 +293,7 @@ static FLAC__StreamDecoderWriteStatus write_callback(
          break;
 
       case 2:
-         for (sample_index = 0; sample_index < len; sample_index++) {
+         for (sample_index = first; sample_index < end; sample_index++) {
              for (channel_index = 0; channel_index < ff->channels;
                    channel_index++) {
                 buf16[out_index++] =
@@ -309,7 +303,7 @@ static FLAC__StreamDecoderWriteStatus write_callback(
          break;
 
       case 3:
-         for (sample_index = 0; sample_index < len; sample_index++) {
+         for (sample_index = first; sample_index < end; sample_index++) {
              for (channel_index = 0; channel_index < ff->channels;
                 channel_index++)
              {
@@ -325,7 +319,7 @@ static FLAC__StreamDecoderWriteStatus write_callback(
          break;
 
       case 4:
-         for (sample_index = 0; sample_index < len; sample_index++) {
+         for (sample_index = first; sample_index < end; sample_index++) {
              for (channel_index = 0; channel_index < ff->channels;
                    channel_index++) {
                 buf32[out_index++] =
@@ -336,9 +330,47 @@ static FLAC__StreamDecoderWriteStatus write_callback(
 
       default:
          /* Word_size not supported. */
+         return false;
+   }
+
+   return true;
+}
+
+
+static FLAC__StreamDecoderWriteStatus write_callback(
+   const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+   const FLAC__int32 * const buffer[], void *client_data)
+{
+   FLACFILE *ff = (FLACFILE *) client_data;
+   long len = frame->header.blocksize;
+   long bytes_per_sample = ff->channels * ff->sample_size;
+   long direct = 0;
+   long bytes;
+
+   (void)decoder;
+
+   /* While streaming, decode straight into the stream fragment and only
+    * keep what doesn't fit for the next fragment.
+    */
+   if (ff->out) {
+      direct = (ff->out_size - ff->out_pos) / bytes_per_sample;
+      if (direct > len)
+         direct = len;
+      if (!flatten_samples(ff, buffer, 0, direct, ff->out + ff->out_pos))
          return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+      ff->out_pos += direct * bytes_per_sample;
+   }
+
+   bytes = (len - direct) * bytes_per_sample;
+   if (ff->buffer_pos + bytes > ff->buffer_size) {
+      ff->buffer = al_realloc(ff->buffer, ff->buffer_pos + bytes);
+      ff->buffer_size = ff->buffer_pos + bytes;
    }
 
+   if (!flatten_samples(ff, buffer, direct, len - direct,
+         ff->buffer + ff->buffer_pos))
+      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
    ff->decoded_samples += len;
    ff->buffer_pos += bytes;
    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
@@ -384,35 +416,42 @@ static size_t flac_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
          return 0;
    }
 
-   while (wanted_samples > 0) {
-      read_samples = ff->decoded_samples - ff->streamed_samples;
-
-      /* If the buffer size is small, we shouldn't read a new frame or our
-       * buffer keeps growing - so only refill when needed.
-       */
-      if (!read_samples) {
-         if (!lib.FLAC__stream_decoder_process_single(ff->decoder))
-            break;
-         read_samples = ff->decoded_samples - ff->streamed_samples;
-         if (!read_samples) {
-            break;
-         }
-      }
-
+   /* Hand out what was left over from the previous frame first. */
+   read_samples = (ff->buffer_pos - ff->buffer_read) / bytes_per_sample;
+   if (read_samples > 0) {
       if (read_samples > wanted_samples)
          read_samples = wanted_samples;
+      read_bytes = read_samples * bytes_per_sample;
+      memcpy(data, ff->buffer + ff->buffer_read, read_bytes);
+      ff->buffer_read += read_bytes;
+      if (ff->buffer_read == ff->buffer_pos) {
+         ff->buffer_read = 0;
+         ff->buffer_pos = 0;
+      }
       ff->streamed_samples += read_samples;
       wanted_samples -= read_samples;
-      read_bytes = read_samples * bytes_per_sample;
-      /* Copy data from the FLAC file buffer to the stream buffer. */
-      memcpy((uint8_t *)data + written_bytes, ff->buffer, read_bytes);
-      /* Make room in the FLACFILE buffer. */
-      memmove(ff->buffer, ff->buffer + read_bytes,
-         ff->buffer_pos - read_bytes);
-      ff->buffer_pos -= read_bytes;
       written_bytes += read_bytes;
    }
 
+   /* Decode the rest directly into the stream fragment.  The buffer is
+    * empty at this point unless the fragment is already full.
+    */
+   ff->out = (char *)data + written_bytes;
+   ff->out_pos = 0;
+   ff->out_size = wanted_samples * bytes_per_sample;
+
+   while (ff->out_pos < ff->out_size) {
+      uint64_t decoded = ff->decoded_samples;
+      if (!lib.FLAC__stream_decoder_process_single(ff->decoder))
+         break;
+      if (ff->decoded_samples == decoded)
+         break;
+   }
+
+   ff->streamed_samples += ff->out_pos / bytes_per_sample;
+   written_bytes += ff->out_pos;
+   ff->out = NULL;
+
    return written_bytes;
 }
 
@@ -439,6 +478,7 @@ static bool real_seek(ALLEGRO_AUDIO_STREAM *stream, uint64_t sample)
    lib.FLAC__stream_decoder_seek_absolute(ff->decoder, sample);
 
    ff->buffer_pos = 0;
+   ff->buffer_read = 0;
    ff->streamed_samples = sample;
    ff->decoded_samples = sample;
    return true;
@@ -549,6 +589,44 @@ ALLEGRO_SAMPLE *_al_load_flac(const char *filename)
    return spl;
 }
 
+/* Decodes samples [start, end) with a decoder of its own.  Runs in one of
+ * the threads started by _al_acodec_decode_in_parallel.
+ */
+static bool flac_decode_range(ALLEGRO_FILE *fp, uint64_t start, uint64_t end,
+   void *out, void *arg)
+{
+   FLACFILE *ff;
+   bool ok;
+   (void)arg;
+
+   ff = flac_open(fp);
+   if (!ff)
+      return false;
+
+   /* Decode straight into our part of the sample, the same way streams
+    * decode into a fragment.  The tail of the last frame spills into
+    * ff->buffer and is dropped.
+    */
+   ff->out = out;
+   ff->out_pos = 0;
+   ff->out_size = (end - start) * ff->channels * ff->sample_size;
+
+   ok = (start == 0 ||
+      lib.FLAC__stream_decoder_seek_absolute(ff->decoder, start));
+   while (ok && ff->out_pos < ff->out_size) {
+      uint64_t decoded = ff->decoded_samples;
+      if (!lib.FLAC__stream_decoder_process_single(ff->decoder))
+         break;
+      if (ff->decoded_samples == decoded)
+         break;
+   }
+   ok = ok && ff->out_pos == ff->out_size;
+
+   al_free(ff->buffer);
+   flac_close(ff);
+   return ok;
+}
+
 ALLEGRO_SAMPLE *_al_load_flac_f(ALLEGRO_FILE *f)
 {
    ALLEGRO_SAMPLE *sample;
@@ -561,8 +639,19 @@ ALLEGRO_SAMPLE *_al_load_flac_f(ALLEGRO_FILE *f)
 
    ff->buffer_size = ff->total_samples * ff->channels * ff->sample_size;
    ff->buffer = al_malloc(ff->buffer_size);
+   if (!ff->buffer) {
+      flac_close(ff);
+      return NULL;
+   }
 
-   lib.FLAC__stream_decoder_process_until_end_of_stream(ff->decoder);
+   /* Long files are split into ranges decoded concurrently.  Otherwise, or
+    * if that fails, decode the file in one go.
+    */
+   if (!_al_acodec_decode_in_parallel(f, ff->total_samples,
+         ff->channels * ff->sample_size, ff->buffer, flac_decode_range,
+         NULL)) {
+      lib.FLAC__stream_decoder_process_until_end_of_stream(ff->decoder);
+   }
 
    sample = al_create_sample(ff->buffer, ff->total_samples, ff->sample_rate,
       _al_word_size_to_depth_conf(ff->sample_size),
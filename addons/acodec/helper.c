@@ -5,32 +5,190 @@
 #include "allegro5/internal/aintern_system.h"
 #include "helper.h"
 
+#if defined(ALLEGRO_WINDOWS)
+   #include <windows.h>
+#elif defined(ALLEGRO_HAVE_SYSCONF)
+   #include <unistd.h>
+#endif
+
+ALLEGRO_DEBUG_CHANNEL("acodec")
+
+/* The streams are fed by a thread shared between all streams, which lives in
+ * the audio addon.
+ */
 void _al_acodec_start_feed_thread(ALLEGRO_AUDIO_STREAM *stream)
 {
-   stream->feed_thread = al_create_thread(_al_kcm_feed_stream, stream);
-   stream->feed_thread_started_cond = al_create_cond();
-   stream->feed_thread_started_mutex = al_create_mutex();
-   al_start_thread(stream->feed_thread);
+   _al_kcm_start_feeding_stream(stream);
 }
 
 void _al_acodec_stop_feed_thread(ALLEGRO_AUDIO_STREAM *stream)
 {
-   ALLEGRO_EVENT quit_event;
+   _al_kcm_stop_feeding_stream(stream);
+}
+
+
+/* Parallel decoding of whole samples.  The file is read into memory once
+ * and each thread decodes its own range of samples from a separate memory
+ * file, straight into the final sample buffer.
+ */
+
+#define DEFAULT_MIN_SAMPLES_PER_THREAD (1 << 18)
+
+typedef struct DECODE_RANGE_JOB {
+   _al_acodec_decode_range_t decode_range;
+   void *arg;
+   const void *data;
+   int64_t size;
+   uint64_t start, end;
+   void *out;
+   bool ok;
+} DECODE_RANGE_JOB;
+
+
+static int get_cpu_count(void)
+{
+#if defined(ALLEGRO_WINDOWS)
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return info.dwNumberOfProcessors;
+#elif defined(ALLEGRO_HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+   long n = sysconf(_SC_NPROCESSORS_ONLN);
+   return n > 0 ? n : 1;
+#else
+   return 1;
+#endif
+}
+
+
+/* Number of threads to use for decoding, 0 or 1 meaning serial. */
+static int get_decode_threads(void)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *p = NULL;
+
+   if (config)
+      p = al_get_config_value(config, "acodec", "decode_threads");
+   if (p && p[0] != '\0' && atoi(p) > 0)
+      return atoi(p);
+
+   return get_cpu_count();
+}
 
-   /* Need to wait for the thread to start, otherwise the quit event may be
-    * sent before the event source is registered with the queue. */
-   al_lock_mutex(stream->feed_thread_started_mutex);
-   while (!stream->feed_thread_started) {
-      al_wait_cond(stream->feed_thread_started_cond, stream->feed_thread_started_mutex);
+
+static void run_decode_range_job(DECODE_RANGE_JOB *job)
+{
+   ALLEGRO_FILE *fp = _al_kcm_open_memory_file(job->data, job->size);
+
+   job->ok = false;
+   if (fp) {
+      job->ok = job->decode_range(fp, job->start, job->end, job->out,
+         job->arg);
+      al_fclose(fp);
    }
-   al_unlock_mutex(stream->feed_thread_started_mutex);
+}
 
-   quit_event.type = _KCM_STREAM_FEEDER_QUIT_EVENT_TYPE;
-   al_emit_user_event(al_get_audio_stream_event_source(stream), &quit_event, NULL);
-   al_join_thread(stream->feed_thread, NULL);
-   al_destroy_thread(stream->feed_thread);
-   al_destroy_cond(stream->feed_thread_started_cond);
-   al_destroy_mutex(stream->feed_thread_started_mutex);
 
-   stream->feed_thread = NULL;
+static void *decode_range_thread(ALLEGRO_THREAD *thread, void *arg)
+{
+   (void)thread;
+   run_decode_range_job(arg);
+   return NULL;
 }
+
+
+/* _al_acodec_decode_in_parallel:
+ *  Decodes all of 'total_samples' into 'dest', splitting the work over
+ *  several threads with decode_range.  The whole file, from offset 0, must
+ *  be a single seekable stream.  Returns false if the file is too short to
+ *  be worth it, or if anything failed; the caller should then decode it
+ *  serially.  The position of 'f' is left unchanged.
+ */
+bool _al_acodec_decode_in_parallel(ALLEGRO_FILE *f, uint64_t total_samples,
+   size_t sample_bytes, void *dest, _al_acodec_decode_range_t decode_range,
+   void *arg)
+{
+   DECODE_RANGE_JOB *jobs;
+   ALLEGRO_THREAD **threads;
+   uint64_t chunk;
+   int64_t pos, size;
+   char *data;
+   bool ok = true;
+   int count;
+   int i;
+
+   count = get_decode_threads();
+   if ((uint64_t)count > total_samples / DEFAULT_MIN_SAMPLES_PER_THREAD)
+      count = total_samples / DEFAULT_MIN_SAMPLES_PER_THREAD;
+   if (count < 2)
+      return false;
+
+   pos = al_ftell(f);
+   size = al_fsize(f);
+   if (pos < 0 || size <= 0 || !al_fseek(f, 0, ALLEGRO_SEEK_SET))
+      return false;
+
+   data = al_malloc(size);
+   if (!data) {
+      al_fseek(f, pos, ALLEGRO_SEEK_SET);
+      return false;
+   }
+   if ((int64_t)al_fread(f, data, size) != size) {
+      al_free(data);
+      al_fseek(f, pos, ALLEGRO_SEEK_SET);
+      return false;
+   }
+   al_fseek(f, pos, ALLEGRO_SEEK_SET);
+
+   jobs = al_calloc(count, sizeof(*jobs));
+   threads = al_calloc(count, sizeof(*threads));
+   if (!jobs || !threads) {
+      al_free(jobs);
+      al_free(threads);
+      al_free(data);
+      return false;
+   }
+
+   ALLEGRO_DEBUG("Decoding %lu samples with %d threads\n",
+      (unsigned long)total_samples, count);
+
+   chunk = total_samples / count;
+   for (i = 0; i < count; i++) {
+      jobs[i].decode_range = decode_range;
+      jobs[i].arg = arg;
+      jobs[i].data = data;
+      jobs[i].size = size;
+      jobs[i].start = i * chunk;
+      jobs[i].end = (i == count - 1) ? total_samples : (i + 1) * chunk;
+      jobs[i].out = (char *)dest + jobs[i].start * sample_bytes;
+   }
+
+   /* The calling thread decodes the first range itself. */
+   for (i = 1; i < count; i++) {
+      threads[i] = al_create_thread(decode_range_thread, &jobs[i]);
+      if (threads[i])
+         al_start_thread(threads[i]);
+      else
+         run_decode_range_job(&jobs[i]);
+   }
+   run_decode_range_job(&jobs[0]);
+
+   for (i = 0; i < count; i++) {
+      if (threads[i]) {
+         al_join_thread(threads[i], NULL);
+         al_destroy_thread(threads[i]);
+      }
+      if (!jobs[i].ok) {
+         ALLEGRO_WARN("Failed to decode samples %lu to %lu\n",
+            (unsigned long)jobs[i].start, (unsigned long)jobs[i].end);
+         ok = false;
+      }
+   }
+
+   al_free(threads);
+   al_free(jobs);
+   al_free(data);
+
+   return ok;
+}
+
+/* vim: set sts=3 sw=3 et: */
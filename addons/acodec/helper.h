@@ -4,4 +4,12 @@
 void _al_acodec_start_feed_thread(ALLEGRO_AUDIO_STREAM *stream);
 void _al_acodec_stop_feed_thread(ALLEGRO_AUDIO_STREAM *stream);
 
+/* Decodes samples [start, end) of the file into 'out'. */
+typedef bool (*_al_acodec_decode_range_t)(ALLEGRO_FILE *fp, uint64_t start,
+   uint64_t end, void *out, void *arg);
+
+bool _al_acodec_decode_in_parallel(ALLEGRO_FILE *f, uint64_t total_samples,
+   size_t sample_bytes, void *dest, _al_acodec_decode_range_t decode_range,
+   void *arg);
+
 #endif
@@ -36,8 +36,22 @@ struct AL_OV_DATA {
    int bitstream;
    double loop_start;
    double loop_end;
+   int word_size;             /* 2 for int16, 4 for float32 */
+
+   /* Decoded data not yet handed to the stream.  Refilled several
+    * fragments at a time, so the decoder state stays hot in the cache.
+    * The refill happens inside the stream callback and costs an extra
+    * copy, so it is off by default.
+    */
+   unsigned int readahead_fragments;
+   char *readahead;
+   unsigned long readahead_size;
+   unsigned long readahead_pos;
+   unsigned long readahead_len;
 };
 
+#define DEFAULT_READAHEAD_FRAGMENTS 0
+
 
 /* dynamic loading support (Windows only currently) */
 #ifdef ALLEGRO_CFG_ACODEC_VORBISFILE_DLL
@@ -56,12 +70,15 @@ static struct
    int (*ov_time_seek_lap)(OggVorbis_File *, double);
    double (*ov_time_tell)(OggVorbis_File *);
    long (*ov_read)(OggVorbis_File *, char *, int, int, int, int, int *);
+   long (*ov_read_float)(OggVorbis_File *, float ***, int, int *);
+   int (*ov_pcm_seek)(OggVorbis_File *, ogg_int64_t);
 #else
    int (*ov_open_callbacks)(void *, OggVorbis_File *, const char *, long, ov_callbacks);
    ogg_int64_t (*ov_time_total)(OggVorbis_File *, int);
    int (*ov_time_seek)(OggVorbis_File *, ogg_int64_t);
    ogg_int64_t (*ov_time_tell)(OggVorbis_File *);
    long (*ov_read)(OggVorbis_File *, char *, int, int *);
+   int (*ov_pcm_seek)(OggVorbis_File *, ogg_int64_t);
 #endif
 } lib;
 
@@ -123,11 +140,14 @@ static bool init_dynlib(void)
    INITSYM(ov_time_seek_lap);
    INITSYM(ov_time_tell);
    INITSYM(ov_read);
+   INITSYM(ov_read_float);
+   INITSYM(ov_pcm_seek);
 #else
    INITSYM(ov_time_total);
    INITSYM(ov_time_seek);
    INITSYM(ov_time_tell);
    INITSYM(ov_read);
+   INITSYM(ov_pcm_seek);
 #endif
 
    return true;
@@ -194,6 +214,10 @@ static ov_callbacks callbacks = {
 };
 
 
+static bool ogg_decode_range(ALLEGRO_FILE *fp, uint64_t start, uint64_t end,
+   void *out, void *arg);
+
+
 ALLEGRO_SAMPLE *_al_load_ogg_vorbis(const char *filename)
 {
    ALLEGRO_FILE *f;
@@ -267,10 +291,21 @@ ALLEGRO_SAMPLE *_al_load_ogg_vorbis_f(ALLEGRO_FILE *file)
 
    buffer = al_malloc(total_size);
    if (!buffer) {
+      lib.ov_clear(&vf);
       return NULL;
    }
 
-   pos = 0;
+   /* Long files are split into ranges decoded concurrently.  Otherwise, or
+    * if that fails, decode the file in one go.
+    */
+   if (_al_acodec_decode_in_parallel(file, total_samples, channels * word_size,
+         buffer, ogg_decode_range, NULL)) {
+      pos = total_size;
+   }
+   else {
+      pos = 0;
+   }
+
    while (pos < total_size) {
       const int read_size = _ALLEGRO_MIN(packet_size, total_size - pos);
       ASSERT(pos + read_size <= total_size);
@@ -308,6 +343,7 @@ static bool ogg_stream_seek(ALLEGRO_AUDIO_STREAM *stream, double time)
    AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
    if (time >= extra->loop_end)
       return false;
+   extra->readahead_pos = extra->readahead_len = 0;
 #ifndef TREMOR
    return (lib.ov_time_seek_lap(extra->vf, time) != -1);
 #else
@@ -326,10 +362,12 @@ static bool ogg_stream_rewind(ALLEGRO_AUDIO_STREAM *stream)
 static double ogg_stream_get_position(ALLEGRO_AUDIO_STREAM *stream)
 {
    AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
+   double buffered = (double)(extra->readahead_len - extra->readahead_pos) /
+      (extra->word_size * extra->vi->channels) / extra->vi->rate;
 #ifndef TREMOR
-   return lib.ov_time_tell(extra->vf);
+   return lib.ov_time_tell(extra->vf) - buffered;
 #else
-   return lib.ov_time_tell(extra->vf)/1000.0;
+   return lib.ov_time_tell(extra->vf)/1000.0 - buffered;
 #endif
 }
 
@@ -350,6 +388,19 @@ static bool ogg_stream_set_loop(ALLEGRO_AUDIO_STREAM *stream, double start, doub
 {
    AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
 
+   /* The read-ahead may already extend past the new end point; rewind the
+    * decoder to where the stream really is.
+    */
+   if (extra->readahead_pos != extra->readahead_len) {
+      double pos = ogg_stream_get_position(stream);
+#ifndef TREMOR
+      lib.ov_time_seek_lap(extra->vf, pos);
+#else
+      lib.ov_time_seek(extra->vf, pos*1000);
+#endif
+      extra->readahead_pos = extra->readahead_len = 0;
+   }
+
    extra->loop_start = start;
    extra->loop_end = end;
    
@@ -368,71 +419,232 @@ static void ogg_stream_close(ALLEGRO_AUDIO_STREAM *stream)
 
    lib.ov_clear(extra->vf);
    al_free(extra->vf);
+   al_free(extra->readahead);
    al_free(extra);
    stream->extra = NULL;
 }
 
 
-static size_t ogg_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
-                                size_t buf_size)
+/* Decodes at most 'bytes' bytes of interleaved PCM in the stream's format.
+ * Returns the number of bytes decoded, or 0 at the end of the stream.
+ */
+static unsigned long decode_pcm(AL_OV_DATA *extra, char *dest,
+   unsigned long bytes)
 {
-   AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
-	
 #ifdef ALLEGRO_LITTLE_ENDIAN
    const int endian = 0;      /* 0 for Little-Endian, 1 for Big-Endian */
 #else
    const int endian = 1;      /* 0 for Little-Endian, 1 for Big-Endian */
 #endif
-   const int word_size = 2;   /* 1 = 8bit, 2 = 16-bit. nothing else */
    const int signedness = 1;  /* 0 for unsigned, 1 for signed */
+   const int channels = extra->vi->channels;
+   long read;
 
-   unsigned long pos = 0;
-   int read_length = buf_size;
+   for (;;) {
 #ifndef TREMOR
-   double ctime = lib.ov_time_tell(extra->vf);
-#else
-   double ctime = lib.ov_time_tell(extra->vf)/1000.0;
-#endif
-   double rate = extra->vi->rate;
-   double btime = ((double)buf_size / ((double)word_size * (double)extra->vi->channels)) / rate;
-   unsigned long read;
-   
-   if (stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
-      if (ctime + btime > extra->loop_end) {
-         read_length = (extra->loop_end - ctime) * rate * (double)word_size * (double)extra->vi->channels;
-         if (read_length < 0)
-            return 0;
-         read_length += read_length % word_size;
+      if (extra->word_size == 4) {
+         /* The decoder works in float anyway; interleave its output
+          * directly instead of having it convert to int16 for us.
+          */
+         float **pcm;
+         float *out = (float *)dest;
+         long i;
+         int c;
+
+         read = lib.ov_read_float(extra->vf, &pcm,
+            bytes / (sizeof(float) * channels), &extra->bitstream);
+         for (i = 0; i < read; i++) {
+            for (c = 0; c < channels; c++)
+               *out++ = pcm[c][i];
+         }
+         if (read > 0)
+            read *= sizeof(float) * channels;
+      }
+      else {
+         read = lib.ov_read(extra->vf, dest, bytes, endian,
+            extra->word_size, signedness, &extra->bitstream);
       }
-   }
-   while (pos < (unsigned long)read_length) {
-#ifndef TREMOR
-      read = lib.ov_read(extra->vf, (char *)data + pos,
-         read_length - pos, endian, word_size, signedness, &extra->bitstream);
 #else
       (void)endian;
       (void)signedness;
-      read = lib.ov_read(extra->vf, (char *)data + pos,
-         read_length - pos, &extra->bitstream);
+      (void)channels;
+      read = lib.ov_read(extra->vf, dest, bytes, &extra->bitstream);
 #endif
+
+      /* A hole is an interruption in the data; carry on after it. */
+      if (read != OV_HOLE)
+         return read > 0 ? read : 0;
+   }
+}
+
+
+/* Decodes samples [start, end) as int16 with a decoder of its own.  Runs in
+ * one of the threads started by _al_acodec_decode_in_parallel.
+ */
+static bool ogg_decode_range(ALLEGRO_FILE *fp, uint64_t start, uint64_t end,
+   void *out, void *arg)
+{
+   OggVorbis_File vf;
+   AL_OV_DATA ov;
+   unsigned long pos = 0;
+   unsigned long size;
+   bool ok = true;
+   (void)arg;
+
+   memset(&ov, 0, sizeof(ov));
+   ov.file = fp;
+   if (lib.ov_open_callbacks(&ov, &vf, NULL, 0, callbacks) < 0)
+      return false;
+
+   ov.vf = &vf;
+   ov.vi = lib.ov_info(&vf, -1);
+   ov.word_size = 2;
+   ov.bitstream = -1;
+   size = (end - start) * ov.vi->channels * ov.word_size;
+
+   if (start > 0 && lib.ov_pcm_seek(&vf, start) < 0)
+      ok = false;
+
+   while (ok && pos < size) {
+      unsigned long read = decode_pcm(&ov, (char *)out + pos, size - pos);
+      if (read == 0)
+         break;
       pos += read;
-	   
-      /* If nothing read then now to silence from here to the end. */
-      if (read == 0) {
-         unsigned long silence_samples = (buf_size - pos) /
-            (al_get_audio_depth_size(stream->spl.spl_data.depth) *
-             al_get_channel_count(stream->spl.spl_data.chan_conf));
-         al_fill_silence((char *)data + pos, silence_samples,
-            stream->spl.spl_data.depth, stream->spl.spl_data.chan_conf);
-         /* Return the number of useful bytes written. */
-         return pos;
+   }
+
+   lib.ov_clear(&vf);
+   return ok && pos == size;
+}
+
+
+/* Like decode_pcm, but stops at the loop end point. */
+static unsigned long decode_until_loop_end(ALLEGRO_AUDIO_STREAM *stream,
+   char *dest, unsigned long bytes)
+{
+   AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
+   const int frame_size = extra->word_size * extra->vi->channels;
+
+   if (stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+#ifndef TREMOR
+      double ctime = lib.ov_time_tell(extra->vf);
+#else
+      double ctime = lib.ov_time_tell(extra->vf)/1000.0;
+#endif
+      double frames_left = (extra->loop_end - ctime) * extra->vi->rate;
+
+      if (frames_left < 1.0)
+         return 0;
+      if (frames_left * frame_size < bytes)
+         bytes = (unsigned long)frames_left * frame_size;
+   }
+
+   return decode_pcm(extra, dest, bytes);
+}
+
+
+/* Refills the read-ahead buffer.  Returns false at the end of the stream. */
+static bool fill_readahead(ALLEGRO_AUDIO_STREAM *stream)
+{
+   AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
+   unsigned long len = 0;
+
+   while (len < extra->readahead_size) {
+      unsigned long read = decode_until_loop_end(stream,
+         extra->readahead + len, extra->readahead_size - len);
+      if (read == 0)
+         break;
+      len += read;
+   }
+
+   extra->readahead_pos = 0;
+   extra->readahead_len = len;
+   return len > 0;
+}
+
+
+static size_t ogg_stream_update(ALLEGRO_AUDIO_STREAM *stream, void *data,
+                                size_t buf_size)
+{
+   AL_OV_DATA *extra = (AL_OV_DATA *) stream->extra;
+   char *out = data;
+   unsigned long pos = 0;
+
+   if (extra->readahead_fragments > 0 && !extra->readahead) {
+      extra->readahead_size = extra->readahead_fragments * buf_size;
+      extra->readahead = al_malloc(extra->readahead_size);
+      if (!extra->readahead) {
+         ALLEGRO_WARN("Could not allocate read-ahead buffer.\n");
+         extra->readahead_fragments = 0;
+         extra->readahead_size = 0;
+      }
+   }
+
+   while (pos < buf_size) {
+      unsigned long n;
+
+      if (!extra->readahead) {
+         /* No read-ahead; decode straight into the fragment. */
+         n = decode_until_loop_end(stream, out + pos, buf_size - pos);
+         if (n == 0)
+            break;
+         pos += n;
+         continue;
       }
+
+      if (extra->readahead_pos == extra->readahead_len &&
+            !fill_readahead(stream)) {
+         break;
+      }
+
+      n = _ALLEGRO_MIN(buf_size - pos,
+         extra->readahead_len - extra->readahead_pos);
+      memcpy(out + pos, extra->readahead + extra->readahead_pos, n);
+      extra->readahead_pos += n;
+      pos += n;
+   }
+
+   /* If nothing more could be read then fill the rest with silence. */
+   if (pos < buf_size) {
+      unsigned long silence_samples = (buf_size - pos) /
+         (al_get_audio_depth_size(stream->spl.spl_data.depth) *
+          al_get_channel_count(stream->spl.spl_data.chan_conf));
+      al_fill_silence(out + pos, silence_samples,
+         stream->spl.spl_data.depth, stream->spl.spl_data.chan_conf);
    }
 
+   /* Return the number of useful bytes written. */
    return pos;
 }
 
 
+/* The stream depth and read-ahead can be tuned in the [acodec] section of
+ * the system configuration.
+ */
+static void read_stream_config(AL_OV_DATA *extra)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *p;
+
+   extra->word_size = 2;
+   extra->readahead_fragments = DEFAULT_READAHEAD_FRAGMENTS;
+
+   if (!config)
+      return;
+
+#ifndef TREMOR
+   p = al_get_config_value(config, "acodec", "vorbis_stream_depth");
+   if (p && !_al_stricmp(p, "float32"))
+      extra->word_size = 4;
+#endif
+
+   p = al_get_config_value(config, "acodec", "vorbis_readahead");
+   if (p && p[0] != '\0') {
+      int n = atoi(p);
+      extra->readahead_fragments = n > 0 ? n : 0;
+   }
+}
+
+
 ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream(const char *filename,
    size_t buffer_count, unsigned int samples)
 {
@@ -459,7 +671,7 @@ ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream(const char *filename,
 ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream_f(ALLEGRO_FILE *file,
    size_t buffer_count, unsigned int samples)
 {
-   const int word_size = 2; /* 1 = 8bit, 2 = 16-bit. nothing else */
+   int word_size;
    OggVorbis_File* vf;
    vorbis_info* vi;
    int channels;
@@ -473,13 +685,15 @@ ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream_f(ALLEGRO_FILE *file,
       return NULL;
    }
 
-   extra = al_malloc(sizeof(AL_OV_DATA));
+   extra = al_calloc(1, sizeof(AL_OV_DATA));
    if (extra == NULL) {
       ALLEGRO_ERROR("Failed to allocate AL_OV_DATA struct.\n");
       return NULL;
    }
 
    extra->file = file;
+   read_stream_config(extra);
+   word_size = extra->word_size;
    
    vf = al_malloc(sizeof(OggVorbis_File));
    if (lib.ov_open_callbacks(extra, vf, NULL, 0, callbacks) < 0) {
@@ -518,7 +732,6 @@ ALLEGRO_AUDIO_STREAM *_al_load_ogg_vorbis_audio_stream_f(ALLEGRO_FILE *file,
 
    extra->loop_start = 0.0;
    extra->loop_end = ogg_stream_get_length(stream);
-   stream->quit_feed_thread = false;
    stream->feeder = ogg_stream_update;
    stream->rewind_feeder = ogg_stream_rewind;
    stream->seek_feeder = ogg_stream_seek;
@@ -10,6 +10,13 @@
 #include "acodec.h"
 #include "helper.h"
 
+#if defined(ALLEGRO_HAVE_MMAP) && defined(ALLEGRO_LITTLE_ENDIAN)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 ALLEGRO_DEBUG_CHANNEL("wav")
 
 
@@ -272,7 +279,6 @@ static void wav_stream_close(ALLEGRO_AUDIO_STREAM *stream)
    al_fclose(wavfile->f);
    wav_close(wavfile);
    stream->extra = NULL;
-   stream->feed_thread = NULL;
 }
 
 
@@ -326,6 +332,114 @@ ALLEGRO_SAMPLE *_al_load_wav_f(ALLEGRO_FILE *fp)
 }
 
 
+#if defined(ALLEGRO_HAVE_MMAP) && defined(ALLEGRO_LITTLE_ENDIAN)
+
+static void wav_unmap(void *file_data, size_t file_size)
+{
+   munmap(file_data, file_size);
+}
+
+
+/* _al_map_wav:
+ *  Maps a RIFF WAV file into memory and returns an ALLEGRO_SAMPLE whose
+ *  buffer points straight at the PCM data, so that it is paged in from disk
+ *  as it is played.  Returns NULL if the file cannot be played in place.
+ */
+ALLEGRO_SAMPLE *_al_map_wav(const char *filename)
+{
+   const ALLEGRO_FILE_INTERFACE *file_interface;
+   _AL_SAMPLE_BACKING *backing;
+   ALLEGRO_SAMPLE *spl;
+   ALLEGRO_FILE *f;
+   WAVFILE *wavfile;
+   struct stat st;
+   size_t data_end;
+   void *map;
+   int fd;
+   ASSERT(filename);
+
+   /* Only files opened through the standard file interface are on disk. */
+   file_interface = al_get_new_file_interface();
+   al_set_standard_file_interface();
+   if (al_get_new_file_interface() != file_interface) {
+      al_set_new_file_interface(file_interface);
+      return NULL;
+   }
+
+   f = al_fopen(filename, "rb");
+   if (!f)
+      return NULL;
+
+   wavfile = wav_open(f);
+   al_fclose(f);
+   if (!wavfile)
+      return NULL;
+
+   data_end = wavfile->dpos + wavfile->samples * wavfile->sample_size;
+   if (wavfile->dpos % (wavfile->bits / 8) != 0) {
+      ALLEGRO_DEBUG("Sample data of %s is misaligned, not mapping.\n",
+         filename);
+      wav_close(wavfile);
+      return NULL;
+   }
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) {
+      wav_close(wavfile);
+      return NULL;
+   }
+
+   /* A truncated file is padded with silence by the normal loader. */
+   if (fstat(fd, &st) != 0 || (size_t)st.st_size < data_end) {
+      close(fd);
+      wav_close(wavfile);
+      return NULL;
+   }
+
+   /* Writable so that the data can be edited through al_get_sample_data,
+    * like that of a loaded sample.  Being private, touched pages are copied
+    * and the file is never changed.
+    */
+   map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      wav_close(wavfile);
+      return NULL;
+   }
+
+   backing = al_calloc(1, sizeof(*backing));
+   spl = al_create_sample((char *)map + wavfile->dpos, wavfile->samples,
+      wavfile->freq, _al_word_size_to_depth_conf(wavfile->bits / 8),
+      _al_count_to_channel_conf(wavfile->channels), false);
+   wav_close(wavfile);
+
+   if (!backing || !spl) {
+      al_free(backing);
+      al_destroy_sample(spl);
+      munmap(map, st.st_size);
+      return NULL;
+   }
+
+   backing->owner = spl;
+   backing->file_data = map;
+   backing->file_size = st.st_size;
+   backing->unmap = wav_unmap;
+   spl->backing = backing;
+
+   return spl;
+}
+
+#else
+
+ALLEGRO_SAMPLE *_al_map_wav(const char *filename)
+{
+   (void)filename;
+   return NULL;
+}
+
+#endif
+
+
 /* _al_load_wav_audio_stream:
 */
 ALLEGRO_AUDIO_STREAM *_al_load_wav_audio_stream(const char *filename,
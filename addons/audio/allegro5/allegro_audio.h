@@ -53,6 +53,8 @@ extern "C" {
 
 #define ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT       (515)
 
+#define ALLEGRO_EVENT_AUDIO_VOICE_TIMING     (516)
+
 typedef struct ALLEGRO_AUDIO_RECORDER_EVENT ALLEGRO_AUDIO_RECORDER_EVENT;
 struct ALLEGRO_AUDIO_RECORDER_EVENT
 {
@@ -63,6 +65,21 @@ struct ALLEGRO_AUDIO_RECORDER_EVENT
 };
 
 
+/* Type: ALLEGRO_VOICE_TIMING
+ */
+typedef struct ALLEGRO_VOICE_TIMING ALLEGRO_VOICE_TIMING;
+struct ALLEGRO_VOICE_TIMING
+{
+   double mix_time;
+   double period;
+   float load;
+   float average_load;
+   float max_load;
+   unsigned int updates;
+   unsigned int xruns;
+};
+
+
 /* Enum: ALLEGRO_AUDIO_DEPTH
  */
 enum ALLEGRO_AUDIO_DEPTH
@@ -128,7 +145,16 @@ enum ALLEGRO_MIXER_QUALITY
 {
    ALLEGRO_MIXER_QUALITY_POINT   = 0x110,
    ALLEGRO_MIXER_QUALITY_LINEAR  = 0x111,
-   ALLEGRO_MIXER_QUALITY_CUBIC   = 0x112
+   ALLEGRO_MIXER_QUALITY_CUBIC   = 0x112,
+   ALLEGRO_MIXER_QUALITY_SINC    = 0x113
+};
+
+
+/*
+ * Sample loader flag
+ */
+enum {
+   ALLEGRO_SAMPLE_LAZY           = 0x0001
 };
 
 
@@ -203,6 +229,8 @@ ALLEGRO_KCM_AUDIO_FUNC(unsigned int, al_get_sample_length, (const ALLEGRO_SAMPLE
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, al_get_sample_depth, (const ALLEGRO_SAMPLE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_CHANNEL_CONF, al_get_sample_channels, (const ALLEGRO_SAMPLE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(void *, al_get_sample_data, (const ALLEGRO_SAMPLE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_sample_preconvert, (const ALLEGRO_SAMPLE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_sample_preconvert, (ALLEGRO_SAMPLE *spl, bool preconvert));
 
 ALLEGRO_KCM_AUDIO_FUNC(unsigned int, al_get_sample_instance_frequency, (const ALLEGRO_SAMPLE_INSTANCE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(unsigned int, al_get_sample_instance_length, (const ALLEGRO_SAMPLE_INSTANCE *spl));
@@ -231,6 +259,15 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_sample_instance_playmode, (ALLEGRO_SAMPLE_IN
 
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_sample_instance_playing, (ALLEGRO_SAMPLE_INSTANCE *spl, bool val));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_detach_sample_instance, (ALLEGRO_SAMPLE_INSTANCE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_schedule_sample_instance_playing, (ALLEGRO_SAMPLE_INSTANCE *spl,
+	bool val, uint64_t frame));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_schedule_sample_instance_gain, (ALLEGRO_SAMPLE_INSTANCE *spl,
+	float val, uint64_t frame));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_schedule_sample_instance_pan, (ALLEGRO_SAMPLE_INSTANCE *spl,
+	float val, uint64_t frame));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_schedule_sample_instance_speed, (ALLEGRO_SAMPLE_INSTANCE *spl,
+	float val, uint64_t frame));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_unschedule_sample_instance, (ALLEGRO_SAMPLE_INSTANCE *spl));
 
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_sample, (ALLEGRO_SAMPLE_INSTANCE *spl, ALLEGRO_SAMPLE *data));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_get_sample, (ALLEGRO_SAMPLE_INSTANCE *spl));
@@ -298,6 +335,7 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_mixer_postprocess_callback, (
       void *data));
 
 ALLEGRO_KCM_AUDIO_FUNC(unsigned int, al_get_mixer_frequency, (const ALLEGRO_MIXER *mixer));
+ALLEGRO_KCM_AUDIO_FUNC(uint64_t, al_get_mixer_played_samples, (const ALLEGRO_MIXER *mixer));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_CHANNEL_CONF, al_get_mixer_channels, (const ALLEGRO_MIXER *mixer));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, al_get_mixer_depth, (const ALLEGRO_MIXER *mixer));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_MIXER_QUALITY, al_get_mixer_quality, (const ALLEGRO_MIXER *mixer));
@@ -330,6 +368,17 @@ ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, al_get_voice_depth, (const ALLEGRO_V
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_get_voice_playing, (const ALLEGRO_VOICE *voice));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_voice_position, (ALLEGRO_VOICE *voice, unsigned int val));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_set_voice_playing, (ALLEGRO_VOICE *voice, bool val));
+ALLEGRO_KCM_AUDIO_FUNC(bool, al_render_voice, (ALLEGRO_VOICE *voice,
+	void *buffer, unsigned int samples));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_set_new_voice_buffers, (unsigned int buffer_size,
+	unsigned int num_buffers));
+ALLEGRO_KCM_AUDIO_FUNC(unsigned int, al_get_voice_xrun_count, (const ALLEGRO_VOICE *voice));
+ALLEGRO_KCM_AUDIO_FUNC(double, al_get_voice_latency, (const ALLEGRO_VOICE *voice));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_get_voice_timing, (const ALLEGRO_VOICE *voice,
+	ALLEGRO_VOICE_TIMING *timing));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_set_voice_timing_window, (ALLEGRO_VOICE *voice,
+	double seconds));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_EVENT_SOURCE *, al_get_voice_event_source, (ALLEGRO_VOICE *voice));
 
 /* Misc. audio functions */
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_install_audio, (void));
@@ -371,17 +420,31 @@ ALLEGRO_KCM_AUDIO_FUNC(bool, al_register_audio_stream_loader_f, (const char *ext
 	    size_t buffer_count, unsigned int samples)));
 
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_load_sample, (const char *filename));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_load_sample_flags, (const char *filename,
+	int flags));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_save_sample, (const char *filename,
 	ALLEGRO_SAMPLE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_STREAM *, al_load_audio_stream, (const char *filename,
 	size_t buffer_count, unsigned int samples));
    
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_load_sample_f, (ALLEGRO_FILE* fp, const char *ident));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_load_sample_flags_f, (ALLEGRO_FILE* fp, const char *ident,
+	int flags));
 ALLEGRO_KCM_AUDIO_FUNC(bool, al_save_sample_f, (ALLEGRO_FILE* fp, const char *ident,
 	ALLEGRO_SAMPLE *spl));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_STREAM *, al_load_audio_stream_f, (ALLEGRO_FILE* fp, const char *ident,
 	size_t buffer_count, unsigned int samples));
 
+/* Sample cache */
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_load_cached_sample, (const char *filename));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_SAMPLE *, al_load_cached_sample_f, (ALLEGRO_FILE *fp,
+	const char *ident));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_release_cached_sample, (ALLEGRO_SAMPLE *spl));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_set_sample_cache_budget, (size_t bytes));
+ALLEGRO_KCM_AUDIO_FUNC(size_t, al_get_sample_cache_budget, (void));
+ALLEGRO_KCM_AUDIO_FUNC(size_t, al_get_sample_cache_usage, (void));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_clear_sample_cache, (void));
+
 /* Recording functions */
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_RECORDER *, al_create_audio_recorder, (size_t fragment_count,
    unsigned int samples, unsigned int freq, ALLEGRO_AUDIO_DEPTH depth, ALLEGRO_CHANNEL_CONF chan_conf));
@@ -392,6 +455,11 @@ ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_EVENT_SOURCE *, al_get_audio_recorder_event_sourc
    (ALLEGRO_AUDIO_RECORDER *r));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_RECORDER_EVENT *, al_get_audio_recorder_event, (ALLEGRO_EVENT *event));
 ALLEGRO_KCM_AUDIO_FUNC(void, al_destroy_audio_recorder, (ALLEGRO_AUDIO_RECORDER *r));
+ALLEGRO_KCM_AUDIO_FUNC(void *, al_get_audio_recorder_span, (ALLEGRO_AUDIO_RECORDER *r,
+	unsigned int *samples));
+ALLEGRO_KCM_AUDIO_FUNC(void, al_consume_audio_recorder_span, (ALLEGRO_AUDIO_RECORDER *r,
+	unsigned int samples));
+ALLEGRO_KCM_AUDIO_FUNC(unsigned int, al_get_audio_recorder_overruns, (ALLEGRO_AUDIO_RECORDER *r));
    
 #ifdef __cplusplus
 } /* End extern "C" */
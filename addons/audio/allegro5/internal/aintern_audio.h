@@ -6,6 +6,7 @@
 #define AINTERN_AUDIO_H
 
 #include "allegro5/allegro.h"
+#include "allegro5/internal/aintern_atomicops.h"
 #include "allegro5/internal/aintern_vector.h"
 #include "../allegro_audio.h"
 
@@ -20,7 +21,8 @@ typedef enum ALLEGRO_AUDIO_DRIVER_ENUM
    ALLEGRO_AUDIO_DRIVER_AQUEUE     = 0x20005,
    ALLEGRO_AUDIO_DRIVER_PULSEAUDIO = 0x20006,
    ALLEGRO_AUDIO_DRIVER_OPENSL     = 0x20007,
-   ALLEGRO_AUDIO_DRIVER_SDL        = 0x20008
+   ALLEGRO_AUDIO_DRIVER_SDL        = 0x20008,
+   ALLEGRO_AUDIO_DRIVER_NULL       = 0x20009
 } ALLEGRO_AUDIO_DRIVER_ENUM;
 
 typedef struct ALLEGRO_AUDIO_DRIVER ALLEGRO_AUDIO_DRIVER;
@@ -47,9 +49,15 @@ struct ALLEGRO_AUDIO_DRIVER {
    
    int            (*allocate_recorder)(ALLEGRO_AUDIO_RECORDER *);
    void           (*deallocate_recorder)(ALLEGRO_AUDIO_RECORDER *);
+
+   double         (*get_voice_latency)(const ALLEGRO_VOICE*);
+
+   /* Only drivers which are not tied to a device, for al_render_voice. */
+   bool           (*render_voice)(ALLEGRO_VOICE*, void*, unsigned int);
 };
 
 extern ALLEGRO_AUDIO_DRIVER *_al_kcm_driver;
+extern ALLEGRO_MUTEX *_al_kcm_mutex;
 
 const void *_al_voice_update(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
    unsigned int *samples);
@@ -69,6 +77,32 @@ struct ALLEGRO_VOICE {
    size_t               num_buffers;
                         /* If non-0, they must be honored by the driver. */
 
+   unsigned int         requested_buffer_size;
+   unsigned int         requested_num_buffers;
+                        /* Device buffering (size in samples, and count)
+                         * asked for with al_set_new_voice_buffers. A hint
+                         * for allocate_voice; 0 means the driver default.
+                         */
+
+   volatile unsigned int xrun_count;
+                        /* Incremented by the driver whenever the device
+                         * ran out of data.
+                         */
+
+   ALLEGRO_VOICE_TIMING timing;
+   double               timing_window;
+   double               window_mix_time;
+   double               window_period;
+   float                window_max_load;
+                        /* Cost of _al_voice_update, protected by mutex.
+                         * The window_* fields accumulate until
+                         * timing_window seconds of audio have been produced,
+                         * then they are published in 'timing'.
+                         */
+
+   ALLEGRO_EVENT_SOURCE es;
+                        /* Emits ALLEGRO_EVENT_AUDIO_VOICE_TIMING. */
+
    ALLEGRO_SAMPLE_INSTANCE       *attached_stream;
                         /* The stream that is attached to the voice, or NULL.
                          * May be an ALLEGRO_SAMPLE_INSTANCE or ALLEGRO_MIXER object.
@@ -101,6 +135,59 @@ typedef union {
    void     *ptr;
 } any_buffer_t;
 
+/* Where the data of a sample loaded with ALLEGRO_SAMPLE_LAZY comes from. */
+typedef struct _AL_SAMPLE_BACKING _AL_SAMPLE_BACKING;
+
+struct _AL_SAMPLE_BACKING {
+   ALLEGRO_SAMPLE       *owner;
+   void                 *file_data;
+   size_t               file_size;
+                        /* The file contents, either read into memory or
+                         * mapped in from disk.
+                         */
+   ALLEGRO_SAMPLE *     (*decoder)(ALLEGRO_FILE *fp);
+                        /* Decodes file_data into the owner's buffer while
+                         * any sample instance uses it.  NULL if the owner's
+                         * buffer points into file_data permanently.
+                         */
+   void                 (*unmap)(void *file_data, size_t file_size);
+                        /* Releases mapped file_data.  NULL if file_data was
+                         * allocated with al_malloc.
+                         */
+   int                  users;
+                        /* Number of sample instances using the decoded data. */
+   ALLEGRO_MUTEX        *mutex;
+                        /* Guards users and the owner's buffer.  Instances of
+                         * one sample may belong to different mixers, so the
+                         * mixer locks don't cover this.  Only created when
+                         * there is a decoder.
+                         */
+};
+
+/* A copy of a sample's data resampled and rechannelled to a mixer's format,
+ * so that playing it back at normal speed only needs a gain and an add.
+ */
+typedef struct _AL_SAMPLE_CONVERSION {
+   unsigned int            frequency;
+   ALLEGRO_CHANNEL_CONF    chan_conf;
+   ALLEGRO_AUDIO_DEPTH     depth;
+   ALLEGRO_MIXER_QUALITY   quality;
+                           /* The mixer format the data was converted for. */
+   unsigned int            source_len;
+                           /* The length of the sample that was converted. */
+   unsigned int            len;
+   any_buffer_t            buffer;
+} _AL_SAMPLE_CONVERSION;
+
+/* The conversions made of a sample with al_set_sample_preconvert.  Sample
+ * instances copy the pointer, like `backing' below.
+ */
+typedef struct _AL_SAMPLE_CONVERSIONS {
+   ALLEGRO_MUTEX           *mutex;
+   _AL_VECTOR              entries;
+                           /* Vector of _AL_SAMPLE_CONVERSION*. */
+} _AL_SAMPLE_CONVERSIONS;
+
 struct ALLEGRO_SAMPLE {
    ALLEGRO_AUDIO_DEPTH  depth;
    ALLEGRO_CHANNEL_CONF chan_conf;
@@ -111,6 +198,17 @@ struct ALLEGRO_SAMPLE {
                         /* Whether `buffer' needs to be freed when the sample
                          * is destroyed, or when `buffer' changes.
                          */
+   _AL_SAMPLE_BACKING   *backing;
+                        /* Non-NULL for samples loaded with ALLEGRO_SAMPLE_LAZY.
+                         * Sample instances copy the pointer, so they can
+                         * release the decoded data again.
+                         */
+   bool                 is_cached;
+                        /* Whether the sample is owned by the sample cache. */
+   _AL_SAMPLE_CONVERSIONS *conversions;
+                        /* Non-NULL if instances attached to mixers of a
+                         * different format should play a converted copy.
+                         */
 };
 
 /* Read some samples into a mixer buffer.
@@ -181,6 +279,16 @@ struct ALLEGRO_SAMPLE_INSTANCE {
                          * The gain is premultiplied in.
                          */
 
+   const _AL_SAMPLE_CONVERSION *converted;
+   float                converted_gain[ALLEGRO_MAX_CHANNELS];
+   stream_reader_t      converted_fallback;
+                        /* The copy of the sample data converted to the
+                         * attached mixer's format, if any, the gain of
+                         * each of its channels, and the resampling reader
+                         * used where the copy does not apply.  Protected
+                         * by the mutex.
+                         */
+
    bool                 is_mixer;
    stream_reader_t      spl_read;
                         /* Reads sample data into the provided buffer, using
@@ -254,11 +362,15 @@ struct ALLEGRO_AUDIO_STREAM {
                           * the stream was started.
                           */
 
-   ALLEGRO_THREAD        *feed_thread;
-   ALLEGRO_MUTEX         *feed_thread_started_mutex;
-   ALLEGRO_COND          *feed_thread_started_cond;
-   bool                  feed_thread_started;
-   volatile bool         quit_feed_thread;
+   bool                  is_fed;
+                         /* Set while the stream is registered with the shared
+                          * stream feeder thread.  The fields below are owned
+                          * by the feeder and protected by its mutex.
+                          */
+   unsigned int          feed_requests;
+   bool                  feed_draining;
+   bool                  feed_finished;
+
    unload_feeder_t       unload_feeder;
    rewind_feeder_t       rewind_feeder;
    seek_feeder_t         seek_feeder;
@@ -288,6 +400,8 @@ typedef void (*postprocess_callback_t)(void *buf, unsigned int samples,
  * will be set to a different function that will call the read method of all
  * attached streams (which may be a sample, or another mixer).
  */
+#define _AL_KCM_DITHER_LANES   8
+
 struct ALLEGRO_MIXER {
    ALLEGRO_SAMPLE_INSTANCE          ss;
                            /* ALLEGRO_MIXER is derived from ALLEGRO_SAMPLE_INSTANCE. */
@@ -301,10 +415,65 @@ struct ALLEGRO_MIXER {
                            /* Vector of ALLEGRO_SAMPLE_INSTANCE*.  Holds the list of
                             * streams being mixed together.
                             */
+
+   uint64_t                played_samples;
+                           /* Number of sample frames mixed so far; this is
+                            * the timeline that scheduled changes refer to.
+                            */
+   _AL_VECTOR              scheduled;
+                           /* Vector of scheduled_change_t, sorted by frame.
+                            * Protected by ss.mutex.
+                            */
+
+   bool                    dither;
+   uint32_t                dither_state[_AL_KCM_DITHER_LANES];
+                           /* Whether to dither when converting to an integer
+                            * voice depth, and the noise generator state.
+                            */
 };
 
+typedef enum {
+   SCHEDULED_PLAYING,
+   SCHEDULED_GAIN,
+   SCHEDULED_PAN,
+   SCHEDULED_SPEED
+} scheduled_change_type_t;
+
+typedef struct scheduled_change_t {
+   uint64_t                frame;
+   ALLEGRO_SAMPLE_INSTANCE *spl;
+   scheduled_change_type_t type;
+   float                   value;
+} scheduled_change_t;
+
+/* Operations on whole mixer buffers, in the fastest versions the CPU
+ * supports.  The conversions clamp, add `off' to each value to make it
+ * unsigned if required, and add dither noise if `dither' is not NULL.  They
+ * may convert a buffer in place.
+ */
+typedef struct _AL_KCM_DSP {
+   const char *name;
+   void (*gain_f32)(float *buf, size_t n, float gain);
+   void (*add_f32)(float *dst, const float *src, size_t n);
+   void (*add_s16)(int16_t *dst, const int16_t *src, size_t n);
+   void (*f32_to_s8)(int8_t *dst, const float *src, size_t n, int8_t off,
+      uint32_t *dither);
+   void (*f32_to_s16)(int16_t *dst, const float *src, size_t n, int16_t off,
+      uint32_t *dither);
+   void (*f32_to_s24)(int32_t *dst, const float *src, size_t n, int32_t off,
+      uint32_t *dither);
+} _AL_KCM_DSP;
+
+extern _AL_KCM_DSP _al_kcm_dsp;
+void _al_kcm_init_dsp(void);
+void _al_kcm_init_dither(uint32_t *state);
+
 extern void _al_kcm_mixer_rejig_sample_matrix(ALLEGRO_MIXER *mixer,
    ALLEGRO_SAMPLE_INSTANCE *spl);
+extern bool _al_kcm_mixer_schedule(ALLEGRO_SAMPLE_INSTANCE *spl,
+   scheduled_change_type_t type, float value, uint64_t frame);
+extern void _al_kcm_mixer_unschedule(ALLEGRO_MIXER *mixer,
+   ALLEGRO_SAMPLE_INSTANCE *spl);
 extern void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
    ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc);
 
@@ -319,7 +488,11 @@ typedef enum {
 extern void _al_set_error(int error, char* string);
 
 /* Supposedly internal */
-ALLEGRO_KCM_AUDIO_FUNC(void*, _al_kcm_feed_stream, (ALLEGRO_THREAD *self, void *vstream));
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_start_feeding_stream, (ALLEGRO_AUDIO_STREAM *stream));
+ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_stop_feeding_stream, (ALLEGRO_AUDIO_STREAM *stream));
+ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_FILE *, _al_kcm_open_memory_file, (const void *data, int64_t size));
+void _al_kcm_init_stream_feeder(void);
+void _al_kcm_shutdown_stream_feeder(void);
 
 /* Helper to emit an event that the stream has got a buffer ready to be refilled. */
 void _al_kcm_emit_stream_events(ALLEGRO_AUDIO_STREAM *stream);
@@ -334,6 +507,19 @@ void _al_kcm_foreach_destructor(
 
 ALLEGRO_KCM_AUDIO_FUNC(void, _al_kcm_shutdown_default_mixer, (void));
 
+ALLEGRO_KCM_AUDIO_FUNC(bool, _al_kcm_register_sample_mapper, (const char *ext,
+   ALLEGRO_SAMPLE *(*mapper)(const char *filename)));
+ALLEGRO_SAMPLE *_al_kcm_acquire_sample_data(ALLEGRO_SAMPLE *spl);
+void _al_kcm_release_sample_data(ALLEGRO_SAMPLE *spl);
+void _al_kcm_destroy_sample_backing(_AL_SAMPLE_BACKING *backing);
+const _AL_SAMPLE_CONVERSION *_al_kcm_get_sample_conversion(
+   const ALLEGRO_SAMPLE *spl, ALLEGRO_MIXER *mixer);
+void _al_kcm_destroy_sample_conversions(_AL_SAMPLE_CONVERSIONS *conversions);
+
+void _al_kcm_init_sample_cache(void);
+void _al_kcm_shutdown_sample_cache(void);
+bool _al_kcm_uncache_sample(ALLEGRO_SAMPLE *spl);
+
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_CHANNEL_CONF, _al_count_to_channel_conf, (int num_channels));
 ALLEGRO_KCM_AUDIO_FUNC(ALLEGRO_AUDIO_DEPTH, _al_word_size_to_depth_conf, (int word_size));
 
@@ -378,8 +564,37 @@ struct ALLEGRO_AUDIO_RECORDER {
                               
   void                     *extra;
                            /* custom data for the driver to use as needed */
+
+  /* The fragments are consecutive slices of one ring buffer. The driver
+   * thread is the only writer of fragments_written/write_fill/scratch, the
+   * application the only writer of fragments_read/read_offset/has_reader.
+   */
+  void                     *ring;
+  void                     *scratch;
+                           /* written instead of the ring while it is full */
+  unsigned int             *fragment_samples;
+                           /* valid samples in each fragment */
+  volatile _AL_ATOMIC      *fragment_held;
+                           /* non-zero while the FRAGMENT event of a
+                              fragment has not been released */
+  volatile _AL_ATOMIC      fragments_written;
+  volatile _AL_ATOMIC      fragments_read;
+  unsigned int             write_fill;
+  bool                     writing_scratch;
+  unsigned int             read_offset;
+  volatile bool            has_reader;
+                           /* set by the first al_get_audio_recorder_span;
+                              from then on unread fragments are never
+                              overwritten */
+  volatile unsigned int    overrun_samples;
 };
 
+void *_al_kcm_recorder_begin_fragment(ALLEGRO_AUDIO_RECORDER *r);
+void _al_kcm_recorder_end_fragment(ALLEGRO_AUDIO_RECORDER *r,
+   unsigned int samples);
+void _al_kcm_recorder_write(ALLEGRO_AUDIO_RECORDER *r, const void *data,
+   unsigned int samples);
+
 
 #endif
 
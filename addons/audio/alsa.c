@@ -24,6 +24,8 @@
 #include "allegro5/internal/aintern_audio.h"
 
 #include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <sched.h>
 
 ALLEGRO_DEBUG_CHANNEL("alsa")
 
@@ -53,6 +55,8 @@ typedef struct ALSA_VOICE {
 
    struct pollfd *ufds;
    int ufds_count;
+   int poll_timeout; /* in milliseconds, about one period */
+   int rt_priority; /* SCHED_FIFO priority for poll_thread, 0 if not used */
 
    ALLEGRO_THREAD *poll_thread;
 
@@ -112,10 +116,65 @@ static void alsa_close(void)
 }
 
 
+/* Reads an unsigned integer from the [alsa] config section, returning 'def'
+   if the key is missing or invalid. */
+static unsigned int get_config_uint(const char *key, unsigned int def)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *value;
+   int n;
+
+   if (!config)
+      return def;
+   value = al_get_config_value(config, "alsa", key);
+   if (!value || value[0] == '\0')
+      return def;
+   n = atoi(value);
+   if (n < 0) {
+      ALLEGRO_WARN("Ignoring invalid %s: %s\n", key, value);
+      return def;
+   }
+   return n;
+}
+
+
+/* Raise the calling update thread to SCHED_FIFO if that was requested in the
+   config. This usually needs RLIMIT_RTPRIO or CAP_SYS_NICE; without them we
+   just keep running at normal priority. */
+static void set_thread_priority(ALSA_VOICE *alsa_voice)
+{
+   struct sched_param param;
+   int min, max;
+   int err;
+
+   if (alsa_voice->rt_priority <= 0)
+      return;
+
+   min = sched_get_priority_min(SCHED_FIFO);
+   max = sched_get_priority_max(SCHED_FIFO);
+   param.sched_priority = alsa_voice->rt_priority;
+   if (param.sched_priority < min)
+      param.sched_priority = min;
+   if (param.sched_priority > max)
+      param.sched_priority = max;
+
+   err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+   if (err != 0) {
+      ALLEGRO_WARN("Could not set realtime priority %d: %s\n",
+         param.sched_priority, strerror(err));
+   }
+   else {
+      ALLEGRO_INFO("Update thread running with SCHED_FIFO priority %d\n",
+         param.sched_priority);
+   }
+}
+
+
 /* Underrun and suspend recovery */
-static int xrun_recovery(snd_pcm_t *handle, int err)
+static int xrun_recovery(ALLEGRO_VOICE *voice, snd_pcm_t *handle, int err)
 {
    if (err == -EPIPE) { /* under-run */
+      voice->xrun_count++;
       err = snd_pcm_prepare(handle);
       if (err < 0) {
          ALLEGRO_ERROR("Can't recover from underrun, prepare failed: %s\n", snd_strerror(err));
@@ -201,13 +260,15 @@ static int alsa_update_nonstream_voice(ALLEGRO_VOICE *voice, void **buf, int *by
 }
 
 
-/* Returns true if the voice is ready for more data. */
-static int alsa_voice_is_ready(ALSA_VOICE *alsa_voice)
+/* Waits up to one period for the device to want more data. Returns true if
+   the voice is ready for more data. */
+static int alsa_voice_is_ready(ALLEGRO_VOICE *voice)
 {
+   ALSA_VOICE *alsa_voice = (ALSA_VOICE*)voice->extra;
    unsigned short revents;
    int err;
 
-   poll(alsa_voice->ufds, alsa_voice->ufds_count, 0);
+   poll(alsa_voice->ufds, alsa_voice->ufds_count, alsa_voice->poll_timeout);
    snd_pcm_poll_descriptors_revents(alsa_voice->pcm_handle, alsa_voice->ufds,
                                     alsa_voice->ufds_count, &revents);
 
@@ -220,7 +281,7 @@ static int alsa_voice_is_ready(ALSA_VOICE *alsa_voice)
          else
             err = -ESTRPIPE;
 
-         if (xrun_recovery(alsa_voice->pcm_handle, err) < 0) {
+         if (xrun_recovery(voice, alsa_voice->pcm_handle, err) < 0) {
             ALLEGRO_ERROR("Write error: %s\n", snd_strerror(err));
             return -POLLERR;
          }
@@ -253,6 +314,8 @@ static void *alsa_update_mmap(ALLEGRO_THREAD *self, void *arg)
 
    ALLEGRO_INFO("ALSA update_mmap thread started\n");
 
+   set_thread_priority(alsa_voice);
+
    while (!al_get_thread_should_stop(self)) {
       if (alsa_voice->stop && !alsa_voice->stopped) {
          snd_pcm_drop(alsa_voice->pcm_handle);
@@ -292,19 +355,17 @@ static void *alsa_update_mmap(ALLEGRO_THREAD *self, void *arg)
          ALLEGRO_DEBUG("snd_pcm_start returned: %d\n", rc);
       }
 
-      ret = alsa_voice_is_ready(alsa_voice);
+      ret = alsa_voice_is_ready(voice);
       if (ret < 0)
          break;
-      if (ret == 0) {
-         al_rest(0.005); /* TODO: Why not use an event or condition variable? */
+      if (ret == 0)
          continue;
-      }
 
       snd_pcm_avail_update(alsa_voice->pcm_handle);
       frames = alsa_voice->frag_len;
       ret = snd_pcm_mmap_begin(alsa_voice->pcm_handle, &areas, &offset, &frames);
       if (ret < 0) {
-         if ((ret = xrun_recovery(alsa_voice->pcm_handle, ret)) < 0) {
+         if ((ret = xrun_recovery(voice, alsa_voice->pcm_handle, ret)) < 0) {
             ALLEGRO_ERROR("MMAP begin avail error: %s\n", snd_strerror(ret));
          }
          break;
@@ -353,7 +414,7 @@ silence:
 
       snd_pcm_sframes_t commitres = snd_pcm_mmap_commit(alsa_voice->pcm_handle, offset, frames);
       if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
-         if ((ret = xrun_recovery(alsa_voice->pcm_handle, commitres >= 0 ? -EPIPE : commitres)) < 0) {
+         if ((ret = xrun_recovery(voice, alsa_voice->pcm_handle, commitres >= 0 ? -EPIPE : commitres)) < 0) {
             ALLEGRO_ERROR("MMAP commit error: %s\n", snd_strerror(ret));
             break;
          }
@@ -377,6 +438,8 @@ static void *alsa_update_rw(ALLEGRO_THREAD *self, void *arg)
 
    ALLEGRO_INFO("ALSA update_rw thread started\n");
 
+   set_thread_priority(alsa_voice);
+
    while (!al_get_thread_should_stop(self)) {
       if (alsa_voice->stop && !alsa_voice->stopped) {
          snd_pcm_drop(alsa_voice->pcm_handle);
@@ -416,10 +479,11 @@ static void *alsa_update_rw(ALLEGRO_THREAD *self, void *arg)
          ALLEGRO_DEBUG("snd_pcm_start returned: %d\n", rc);
       }
 
-      snd_pcm_wait(alsa_voice->pcm_handle, 10);
+      snd_pcm_wait(alsa_voice->pcm_handle, alsa_voice->poll_timeout);
       err = snd_pcm_avail_update(alsa_voice->pcm_handle);
       if (err < 0) {
          if (err == -EPIPE) {
+            voice->xrun_count++;
             snd_pcm_prepare(alsa_voice->pcm_handle);
          }
          else {
@@ -460,6 +524,7 @@ silence:
       err = snd_pcm_writei(alsa_voice->pcm_handle, buf, frames);
       if (err < 0) {
          if (err == -EPIPE) {
+            voice->xrun_count++;
             snd_pcm_prepare(alsa_voice->pcm_handle);
          }
       }
@@ -554,6 +619,8 @@ static int alsa_allocate_voice(ALLEGRO_VOICE *voice)
    snd_pcm_format_t format;
    int chan_count;
    unsigned int req_freq;
+   unsigned int periods;
+   snd_pcm_uframes_t buffer_frames;
 
    ALSA_VOICE *ex_data = al_calloc(1, sizeof(ALSA_VOICE));
    if (!ex_data)
@@ -573,7 +640,18 @@ static int alsa_allocate_voice(ALLEGRO_VOICE *voice)
    // pw: But there are calls later which expect this variable to be set an on
    // my machine (without PulseAudio) the driver doesn't work properly with
    // anything lower than 32.
-   ex_data->frag_len = 32;
+   //
+   // A voice buffer hint or the period_size config key take precedence, for
+   // programs which need lower latency and know their device copes.
+   if (voice->requested_buffer_size)
+      ex_data->frag_len = voice->requested_buffer_size;
+   else
+      ex_data->frag_len = get_config_uint("period_size", 32);
+   if (voice->requested_num_buffers)
+      periods = voice->requested_num_buffers;
+   else
+      periods = get_config_uint("periods", 0);
+   ex_data->rt_priority = get_config_uint("realtime_priority", 0);
 
    if (voice->depth == ALLEGRO_AUDIO_DEPTH_INT8)
       format = SND_PCM_FORMAT_S8;
@@ -615,13 +693,22 @@ static int alsa_allocate_voice(ALLEGRO_VOICE *voice)
    ALSA_CHECK(snd_pcm_hw_params_set_channels(ex_data->pcm_handle, hwparams, chan_count));
    ALSA_CHECK(snd_pcm_hw_params_set_rate_near(ex_data->pcm_handle, hwparams, &req_freq, NULL));
    ALSA_CHECK(snd_pcm_hw_params_set_period_size_near(ex_data->pcm_handle, hwparams, &ex_data->frag_len, NULL));
+   if (periods)
+      ALSA_CHECK(snd_pcm_hw_params_set_periods_near(ex_data->pcm_handle, hwparams, &periods, NULL));
    ALSA_CHECK(snd_pcm_hw_params(ex_data->pcm_handle, hwparams));
+   ALSA_CHECK(snd_pcm_hw_params_get_period_size(hwparams, &ex_data->frag_len, NULL));
+   ALSA_CHECK(snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_frames));
 
    if (voice->frequency != req_freq) {
       ALLEGRO_ERROR("Unsupported rate! Requested %u, got %iu.\n", voice->frequency, req_freq);
       goto Error;
    }
 
+   ALLEGRO_INFO("Period size %lu, buffer size %lu frames (%.1f ms)\n",
+      (unsigned long)ex_data->frag_len, (unsigned long)buffer_frames,
+      buffer_frames * 1000.0 / req_freq);
+   ex_data->poll_timeout = ex_data->frag_len * 1000 / req_freq + 1;
+
    snd_pcm_sw_params_t *swparams;
    snd_pcm_sw_params_alloca(&swparams);
 
@@ -711,9 +798,7 @@ static void *alsa_update_recorder(ALLEGRO_THREAD *t, void *thread_data)
 {
    ALLEGRO_AUDIO_RECORDER *r = thread_data;
    ALSA_RECORDER_DATA *alsa = r->extra;
-   ALLEGRO_EVENT user_event;
    uint8_t *null_buffer;
-   unsigned int fragment_i = 0;
    
    null_buffer = al_malloc(1024 * r->sample_size);
    if (!null_buffer) {
@@ -734,19 +819,12 @@ static void *alsa_update_recorder(ALLEGRO_THREAD *t, void *thread_data)
          snd_pcm_readi(alsa->capture_handle, null_buffer, 1024);
       }
       else {
-         ALLEGRO_AUDIO_RECORDER_EVENT *e;
          snd_pcm_sframes_t count;
+         void *fragment;
          al_unlock_mutex(r->mutex);
-         if ((count = snd_pcm_readi(alsa->capture_handle, r->fragments[fragment_i], r->samples)) > 0) {
-            user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-            e = al_get_audio_recorder_event(&user_event);
-            e->buffer = r->fragments[fragment_i];
-            e->samples = count;
-            al_emit_user_event(&r->source, &user_event, NULL);
-         
-            if (++fragment_i == r->fragment_count) {
-               fragment_i = 0;
-            }
+         fragment = _al_kcm_recorder_begin_fragment(r);
+         if ((count = snd_pcm_readi(alsa->capture_handle, fragment, r->samples)) > 0) {
+            _al_kcm_recorder_end_fragment(r, count);
          }
       }
    }
@@ -860,7 +938,9 @@ ALLEGRO_AUDIO_DRIVER _al_kcm_alsa_driver =
    alsa_set_voice_position,
 
    alsa_allocate_recorder,
-   alsa_deallocate_recorder
+   alsa_deallocate_recorder,
+
+   NULL
 };
 
 /* vim: set sts=3 sw=3 et: */
@@ -397,13 +397,6 @@ typedef struct RECORDER_DATA
    int buffer_count;
    uint32_t buffer_size;
 
-   /* User fragment buffer information.
-    *   Which buffer are we writing into, and
-    *   how much data has already been written?
-    */
-   unsigned int fragment_i;
-   unsigned int samples_written;
-
 } RECORDER_DATA;
 
 static void _aqueue_recording_callback(void *user_data, AudioQueueRef aq,                          
@@ -425,40 +418,10 @@ static void _aqueue_recording_callback(void *user_data, AudioQueueRef aq,
    al_lock_mutex(recorder->mutex);
 
    if (recorder->is_recording) {
-      /* Process the full buffer, putting it into as many user fragments as it needs.
-       * Send an event for every full user fragment.
+      /* Put the buffer into as many user fragments as it needs.
+       * An event is sent for every full user fragment.
        */
-      while (sample_count > 0) {
-         unsigned int samples_left = recorder->samples - data->samples_written;
-         unsigned int samples_to_write = sample_count < samples_left ? sample_count : samples_left;
-         
-         /* Copy the incoming data into the user's fragment buffer */
-         memcpy(recorder->fragments[data->fragment_i] + data->samples_written * recorder->sample_size,
-                input, samples_to_write * recorder->sample_size);
-         
-         input += samples_to_write * recorder->sample_size;
-         data->samples_written += samples_to_write;
-         sample_count -= samples_to_write;
-         
-         /* We should have never written more samples than the user asked for */
-         ALLEGRO_ASSERT(recorder->samples >= data->samples_written);
-         
-         if (data->samples_written == recorder->samples) {
-            ALLEGRO_EVENT user_event;
-            ALLEGRO_AUDIO_RECORDER_EVENT *e;
-            user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-            e = al_get_audio_recorder_event(&user_event);
-            e->buffer = recorder->fragments[data->fragment_i];
-            e->samples = recorder->samples;
-            al_emit_user_event(&recorder->source, &user_event, NULL);
-            
-            if (++data->fragment_i == recorder->fragment_count) {
-               data->fragment_i = 0;
-            }
-            
-            data->samples_written = 0;
-         }
-      }
+      _al_kcm_recorder_write(recorder, input, sample_count);
    }
    
    al_unlock_mutex(recorder->mutex);
@@ -563,6 +526,8 @@ ALLEGRO_AUDIO_DRIVER _al_kcm_aqueue_driver = {
    _aqueue_set_voice_position,
 
    _aqueue_allocate_recorder,
-   _aqueue_deallocate_recorder
+   _aqueue_deallocate_recorder,
+
+   NULL
 };
 
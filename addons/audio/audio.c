@@ -24,6 +24,7 @@ void _al_set_error(int error, char* string)
 }
 
 ALLEGRO_AUDIO_DRIVER *_al_kcm_driver = NULL;
+ALLEGRO_MUTEX *_al_kcm_mutex = NULL;
 
 #if defined(ALLEGRO_CFG_KCM_OPENAL)
    extern struct ALLEGRO_AUDIO_DRIVER _al_kcm_openal_driver;
@@ -49,6 +50,7 @@ ALLEGRO_AUDIO_DRIVER *_al_kcm_driver = NULL;
 #if defined(ALLEGRO_SDL)
    extern struct ALLEGRO_AUDIO_DRIVER _al_kcm_sdl_driver;
 #endif
+extern struct ALLEGRO_AUDIO_DRIVER _al_kcm_null_driver;
 
 /* Channel configuration helpers */
 
@@ -196,6 +198,9 @@ static ALLEGRO_AUDIO_DRIVER_ENUM get_config_audio_driver(void)
    if (0 == _al_stricmp(value, "DSOUND") || 0 == _al_stricmp(value, "DIRECTSOUND"))
       return ALLEGRO_AUDIO_DRIVER_DSOUND;
 
+   if (0 == _al_stricmp(value, "NULL") || 0 == _al_stricmp(value, "OFFLINE"))
+      return ALLEGRO_AUDIO_DRIVER_NULL;
+
    return ALLEGRO_AUDIO_DRIVER_AUTODETECT;
 }
 
@@ -370,6 +375,15 @@ static bool do_install_audio(ALLEGRO_AUDIO_DRIVER_ENUM mode)
             return false;
          #endif
 
+      case ALLEGRO_AUDIO_DRIVER_NULL:
+         /* Never autodetected: only used when explicitly requested. */
+         if (_al_kcm_null_driver.open() == 0) {
+            ALLEGRO_INFO("Using offline (null) driver\n");
+            _al_kcm_driver = &_al_kcm_null_driver;
+            return true;
+         }
+         return false;
+
       default:
          _al_set_error(ALLEGRO_INVALID_PARAM, "Invalid audio driver");
          return false;
@@ -388,7 +402,12 @@ bool al_install_audio(void)
    /* The destructors are initialised even if the audio driver fails to install
     * because the user may still create samples.
     */
+   if (!_al_kcm_mutex)
+      _al_kcm_mutex = al_create_mutex();
    _al_kcm_init_destructors();
+   _al_kcm_init_dsp();
+   _al_kcm_init_stream_feeder();
+   _al_kcm_init_sample_cache();
    _al_add_exit_func(al_uninstall_audio, "al_uninstall_audio");
 
    ret = do_install_audio(ALLEGRO_AUDIO_DRIVER_AUTODETECT);
@@ -401,12 +420,16 @@ void al_uninstall_audio(void)
 {
    if (_al_kcm_driver) {
       _al_kcm_shutdown_default_mixer();
+      _al_kcm_shutdown_sample_cache();
       _al_kcm_shutdown_destructors();
+      _al_kcm_shutdown_stream_feeder();
       _al_kcm_driver->close();
       _al_kcm_driver = NULL;
    }
    else {
+      _al_kcm_shutdown_sample_cache();
       _al_kcm_shutdown_destructors();
+      _al_kcm_shutdown_stream_feeder();
    }
 }
 
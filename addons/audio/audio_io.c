@@ -27,6 +27,8 @@ struct ACODEC_TABLE
    bool              (*fs_saver)(ALLEGRO_FILE *fp, ALLEGRO_SAMPLE *spl);
    ALLEGRO_AUDIO_STREAM *(*fs_stream_loader)(ALLEGRO_FILE *fp,
                         size_t buffer_count, unsigned int samples);
+
+   ALLEGRO_SAMPLE *  (*mapper)(const char *filename);
 };
 
 
@@ -79,10 +81,383 @@ static ACODEC_TABLE *add_acodec_table_entry(const char *ext)
    ent->fs_saver = NULL;
    ent->fs_stream_loader = NULL;
 
+   ent->mapper = NULL;
+
    return ent;
 }
 
 
+/*
+ * Lazily decoded samples keep the file contents in memory and only decode
+ * them while a sample instance uses the sample.  The decoders read from a
+ * minimal read-only ALLEGRO_FILE over that memory.
+ */
+typedef struct MEMFILE
+{
+   const char        *data;
+   int64_t           size;
+   int64_t           pos;
+   bool              eof;
+} MEMFILE;
+
+
+static bool memfile_fclose(ALLEGRO_FILE *fp)
+{
+   al_free(al_get_file_userdata(fp));
+   return true;
+}
+
+
+static size_t memfile_fread(ALLEGRO_FILE *fp, void *ptr, size_t size)
+{
+   MEMFILE *mf = al_get_file_userdata(fp);
+   int64_t n = mf->size - mf->pos;
+
+   if ((int64_t)size > n) {
+      size = n;
+      mf->eof = true;
+   }
+
+   memcpy(ptr, mf->data + mf->pos, size);
+   mf->pos += size;
+
+   return size;
+}
+
+
+static size_t memfile_fwrite(ALLEGRO_FILE *fp, const void *ptr, size_t size)
+{
+   (void)fp;
+   (void)ptr;
+   (void)size;
+
+   return 0;
+}
+
+
+static bool memfile_fflush(ALLEGRO_FILE *fp)
+{
+   (void)fp;
+
+   return true;
+}
+
+
+static int64_t memfile_ftell(ALLEGRO_FILE *fp)
+{
+   MEMFILE *mf = al_get_file_userdata(fp);
+
+   return mf->pos;
+}
+
+
+static bool memfile_fseek(ALLEGRO_FILE *fp, int64_t offset, int whence)
+{
+   MEMFILE *mf = al_get_file_userdata(fp);
+   int64_t pos;
+
+   switch (whence) {
+      case ALLEGRO_SEEK_SET:
+         pos = offset;
+         break;
+      case ALLEGRO_SEEK_CUR:
+         pos = mf->pos + offset;
+         break;
+      case ALLEGRO_SEEK_END:
+         pos = mf->size + offset;
+         break;
+      default:
+         return false;
+   }
+
+   if (pos < 0 || pos > mf->size)
+      return false;
+
+   mf->pos = pos;
+   mf->eof = false;
+
+   return true;
+}
+
+
+static bool memfile_feof(ALLEGRO_FILE *fp)
+{
+   MEMFILE *mf = al_get_file_userdata(fp);
+
+   return mf->eof;
+}
+
+
+static int memfile_ferror(ALLEGRO_FILE *fp)
+{
+   (void)fp;
+
+   return 0;
+}
+
+
+static const char *memfile_ferrmsg(ALLEGRO_FILE *fp)
+{
+   (void)fp;
+
+   return "";
+}
+
+
+static void memfile_fclearerr(ALLEGRO_FILE *fp)
+{
+   MEMFILE *mf = al_get_file_userdata(fp);
+
+   mf->eof = false;
+}
+
+
+static off_t memfile_fsize(ALLEGRO_FILE *fp)
+{
+   MEMFILE *mf = al_get_file_userdata(fp);
+
+   return mf->size;
+}
+
+
+static const ALLEGRO_FILE_INTERFACE memfile_vtable =
+{
+   NULL,    /* fopen */
+   memfile_fclose,
+   memfile_fread,
+   memfile_fwrite,
+   memfile_fflush,
+   memfile_ftell,
+   memfile_fseek,
+   memfile_feof,
+   memfile_ferror,
+   memfile_ferrmsg,
+   memfile_fclearerr,
+   NULL,    /* ungetc */
+   memfile_fsize
+};
+
+
+/* _al_kcm_open_memory_file:
+ *  Opens a read-only file over the given memory, which must stay valid until
+ *  the file is closed.  Several files may share the same memory.
+ */
+ALLEGRO_FILE *_al_kcm_open_memory_file(const void *data, int64_t size)
+{
+   ALLEGRO_FILE *fp;
+   MEMFILE *mf;
+
+   mf = al_calloc(1, sizeof(*mf));
+   if (!mf)
+      return NULL;
+   mf->data = data;
+   mf->size = size;
+
+   fp = al_create_file_handle(&memfile_vtable, mf);
+   if (!fp) {
+      al_free(mf);
+      return NULL;
+   }
+
+   return fp;
+}
+
+
+/* Decode the file contents of a lazily loaded sample into a new sample. */
+static ALLEGRO_SAMPLE *decode_backing(_AL_SAMPLE_BACKING *backing)
+{
+   ALLEGRO_FILE *fp;
+   ALLEGRO_SAMPLE *spl;
+
+   fp = _al_kcm_open_memory_file(backing->file_data, backing->file_size);
+   if (!fp)
+      return NULL;
+
+   spl = backing->decoder(fp);
+   al_fclose(fp);
+
+   return spl;
+}
+
+
+static void *read_file_data(ALLEGRO_FILE *fp, size_t *ret_size)
+{
+   int64_t remaining = -1;
+   size_t capacity;
+   size_t size = 0;
+   char *data;
+   char *new_data;
+
+   if (al_fsize(fp) >= 0 && al_ftell(fp) >= 0)
+      remaining = al_fsize(fp) - al_ftell(fp);
+
+   if (remaining >= 0) {
+      data = al_malloc(remaining ? remaining : 1);
+      if (!data)
+         return NULL;
+      size = al_fread(fp, data, remaining);
+   }
+   else {
+      /* The size of the file is unknown, read it in chunks. */
+      capacity = 65536;
+      data = al_malloc(capacity);
+      if (!data)
+         return NULL;
+      while ((size += al_fread(fp, data + size, capacity - size)) == capacity) {
+         capacity *= 2;
+         new_data = al_realloc(data, capacity);
+         if (!new_data) {
+            al_free(data);
+            return NULL;
+         }
+         data = new_data;
+      }
+   }
+
+   if (al_ferror(fp)) {
+      al_free(data);
+      return NULL;
+   }
+
+   *ret_size = size;
+   return data;
+}
+
+
+static ALLEGRO_SAMPLE *load_lazy_sample(ALLEGRO_FILE *fp,
+   ALLEGRO_SAMPLE *(*decoder)(ALLEGRO_FILE *fp))
+{
+   _AL_SAMPLE_BACKING *backing;
+   ALLEGRO_SAMPLE *spl;
+
+   backing = al_calloc(1, sizeof(*backing));
+   if (!backing) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating sample backing");
+      return NULL;
+   }
+
+   backing->file_data = read_file_data(fp, &backing->file_size);
+   if (!backing->file_data) {
+      al_free(backing);
+      return NULL;
+   }
+   backing->decoder = decoder;
+   backing->mutex = al_create_mutex();
+   if (!backing->mutex) {
+      al_free(backing->file_data);
+      al_free(backing);
+      return NULL;
+   }
+
+   /* Decode once to check the file and to learn the sample format.  The
+    * decoded data is dropped again until the sample is played.
+    */
+   spl = decode_backing(backing);
+   if (!spl) {
+      al_destroy_mutex(backing->mutex);
+      al_free(backing->file_data);
+      al_free(backing);
+      return NULL;
+   }
+
+   if (spl->free_buf)
+      al_free(spl->buffer.ptr);
+   spl->buffer.ptr = NULL;
+   spl->free_buf = false;
+   spl->backing = backing;
+   backing->owner = spl;
+
+   return spl;
+}
+
+
+/* _al_kcm_acquire_sample_data:
+ *  Called when a sample instance starts using a sample.  Decodes the data
+ *  of a lazily loaded sample if no other instance is using it yet.  This
+ *  blocks the caller for as long as loading the sample would; instances
+ *  acquiring the same sample meanwhile wait for the one decode.
+ *  Returns the sample whose fields the instance should copy, or NULL if the
+ *  data could not be decoded.
+ */
+ALLEGRO_SAMPLE *_al_kcm_acquire_sample_data(ALLEGRO_SAMPLE *spl)
+{
+   _AL_SAMPLE_BACKING *backing = spl->backing;
+   ALLEGRO_SAMPLE *owner;
+   ALLEGRO_SAMPLE *decoded;
+
+   if (!backing || !backing->decoder)
+      return spl;
+
+   owner = backing->owner;
+
+   al_lock_mutex(backing->mutex);
+
+   if (backing->users == 0) {
+      decoded = decode_backing(backing);
+      if (!decoded) {
+         al_unlock_mutex(backing->mutex);
+         _al_set_error(ALLEGRO_GENERIC_ERROR, "Failed to decode sample");
+         return NULL;
+      }
+      ASSERT(decoded->free_buf);
+      owner->buffer = decoded->buffer;
+      owner->len = decoded->len;
+      decoded->buffer.ptr = NULL;
+      decoded->free_buf = false;
+      al_destroy_sample(decoded);
+   }
+
+   backing->users++;
+
+   al_unlock_mutex(backing->mutex);
+   return owner;
+}
+
+
+/* _al_kcm_release_sample_data:
+ *  Called with the sample data of an instance which stops using a sample.
+ *  Frees the decoded data of a lazily loaded sample when no instance uses
+ *  it any more.
+ */
+void _al_kcm_release_sample_data(ALLEGRO_SAMPLE *spl)
+{
+   _AL_SAMPLE_BACKING *backing = spl->backing;
+
+   if (!backing || !backing->decoder)
+      return;
+
+   al_lock_mutex(backing->mutex);
+   ASSERT(backing->users > 0);
+   if (--backing->users == 0) {
+      al_free(backing->owner->buffer.ptr);
+      backing->owner->buffer.ptr = NULL;
+   }
+   al_unlock_mutex(backing->mutex);
+}
+
+
+/* _al_kcm_destroy_sample_backing:
+ *  Free the decoded data and the file contents of a lazily loaded sample.
+ */
+void _al_kcm_destroy_sample_backing(_AL_SAMPLE_BACKING *backing)
+{
+   if (backing->decoder && backing->owner->buffer.ptr) {
+      al_free(backing->owner->buffer.ptr);
+      backing->owner->buffer.ptr = NULL;
+   }
+
+   if (backing->unmap)
+      backing->unmap(backing->file_data, backing->file_size);
+   else
+      al_free(backing->file_data);
+
+   if (backing->mutex)
+      al_destroy_mutex(backing->mutex);
+   al_free(backing);
+}
+
+
 /* Function: al_register_sample_loader
  */
 bool al_register_sample_loader(const char *ext,
@@ -247,6 +622,37 @@ bool al_register_audio_stream_loader_f(const char *ext,
 }
 
 
+/* _al_kcm_register_sample_mapper:
+ *  Register a loader used by al_load_sample_flags with ALLEGRO_SAMPLE_LAZY
+ *  which maps the file into memory, so the sample data can be played in
+ *  place.  The mapper returns NULL if it cannot map a particular file, in
+ *  which case the file is read into memory instead.
+ */
+bool _al_kcm_register_sample_mapper(const char *ext,
+   ALLEGRO_SAMPLE *(*mapper)(const char *filename))
+{
+   ACODEC_TABLE *ent;
+
+   if (strlen(ext) + 1 >= MAX_EXTENSION_LENGTH) {
+      return false;
+   }
+
+   ent = find_acodec_table_entry(ext);
+   if (!mapper) {
+      if (!ent || !ent->mapper) {
+         return false; /* Nothing to remove. */
+      }
+   }
+   else if (!ent) {
+      ent = add_acodec_table_entry(ext);
+   }
+
+   ent->mapper = mapper;
+
+   return true;
+}
+
+
 /* Function: al_load_sample
  */
 ALLEGRO_SAMPLE *al_load_sample(const char *filename)
@@ -286,6 +692,63 @@ ALLEGRO_SAMPLE *al_load_sample_f(ALLEGRO_FILE* fp, const char *ident)
 }
 
 
+/* Function: al_load_sample_flags
+ */
+ALLEGRO_SAMPLE *al_load_sample_flags(const char *filename, int flags)
+{
+   const char *ext;
+   ACODEC_TABLE *ent;
+   ALLEGRO_FILE *fp;
+   ALLEGRO_SAMPLE *spl;
+
+   if (!(flags & ALLEGRO_SAMPLE_LAZY))
+      return al_load_sample(filename);
+
+   ASSERT(filename);
+   ext = strrchr(filename, '.');
+   if (ext == NULL)
+      return NULL;
+
+   ent = find_acodec_table_entry(ext);
+   if (ent && ent->mapper) {
+      spl = (ent->mapper)(filename);
+      if (spl)
+         return spl;
+   }
+
+   fp = al_fopen(filename, "rb");
+   if (!fp)
+      return NULL;
+
+   spl = al_load_sample_flags_f(fp, ext, flags);
+   al_fclose(fp);
+
+   return spl;
+}
+
+
+/* Function: al_load_sample_flags_f
+ */
+ALLEGRO_SAMPLE *al_load_sample_flags_f(ALLEGRO_FILE* fp, const char *ident,
+   int flags)
+{
+   ACODEC_TABLE *ent;
+
+   ASSERT(fp);
+   ASSERT(ident);
+
+   if (!(flags & ALLEGRO_SAMPLE_LAZY))
+      return al_load_sample_f(fp, ident);
+
+   ent = find_acodec_table_entry(ident);
+   if (ent && ent->fs_loader) {
+      return load_lazy_sample(fp, ent->fs_loader);
+   }
+
+   return NULL;
+}
+
+
 /* Function: al_load_audio_stream
  */
 ALLEGRO_AUDIO_STREAM *al_load_audio_stream(const char *filename,
@@ -368,4 +831,381 @@ bool al_save_sample_f(ALLEGRO_FILE *fp, const char *ident, ALLEGRO_SAMPLE *spl)
 }
 
 
+/*
+ * Sample cache.  Samples loaded through al_load_cached_sample are shared
+ * between callers and reference counted.  Unreferenced samples stay in the
+ * cache until its memory budget is exceeded, when the least recently used
+ * ones are destroyed.
+ */
+typedef struct SAMPLE_CACHE_ENTRY
+{
+   char              *filename;
+   ALLEGRO_FILE      *fp;
+   int64_t           offset;
+   int64_t           end_offset;
+                     /* Samples loaded from an ALLEGRO_FILE are keyed by the
+                      * file handle and the position in it.  These are only
+                      * shared while referenced, since the handle may be
+                      * reused for another file once closed.  A hit seeks
+                      * to end_offset, where decoding left the file.
+                      */
+   ALLEGRO_SAMPLE    *spl;
+   size_t            size;
+   int               refcount;
+   uint64_t          last_use;
+} SAMPLE_CACHE_ENTRY;
+
+static _AL_VECTOR sample_cache = _AL_VECTOR_INITIALIZER(SAMPLE_CACHE_ENTRY *);
+static ALLEGRO_MUTEX *sample_cache_mutex = NULL;
+static size_t sample_cache_budget = 32 * 1024 * 1024;
+static size_t sample_cache_usage = 0;
+static uint64_t sample_cache_clock = 0;
+
+
+/* _al_kcm_init_sample_cache:
+ *  Create the mutex guarding the sample cache and read its budget from the
+ *  configuration.
+ */
+void _al_kcm_init_sample_cache(void)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *value;
+
+   if (!sample_cache_mutex) {
+      sample_cache_mutex = al_create_mutex();
+   }
+
+   if (config) {
+      value = al_get_config_value(config, "audio", "sample_cache_budget");
+      if (value && value[0] != '\0') {
+         sample_cache_budget = strtoul(value, NULL, 10) * 1024;
+      }
+   }
+}
+
+
+static size_t sample_memory_size(const ALLEGRO_SAMPLE *spl)
+{
+   return spl->len * al_get_channel_count(spl->chan_conf) *
+      al_get_audio_depth_size(spl->depth);
+}
+
+
+static void destroy_cache_entry(unsigned int i)
+{
+   SAMPLE_CACHE_ENTRY **slot = _al_vector_ref(&sample_cache, i);
+   SAMPLE_CACHE_ENTRY *entry = *slot;
+
+   _al_vector_delete_at(&sample_cache, i);
+   sample_cache_usage -= entry->size;
+
+   /* Unlink the sample first so al_destroy_sample doesn't look for it. */
+   entry->spl->is_cached = false;
+   al_destroy_sample(entry->spl);
+   al_free(entry->filename);
+   al_free(entry);
+}
+
+
+/* Destroy unreferenced samples, least recently used first, until the cache
+ * fits into the budget.  Called with sample_cache_mutex held.
+ */
+static void evict_cached_samples(size_t budget)
+{
+   while (sample_cache_usage > budget) {
+      int victim = -1;
+      uint64_t oldest = 0;
+      unsigned int i;
+
+      for (i = 0; i < _al_vector_size(&sample_cache); i++) {
+         SAMPLE_CACHE_ENTRY **slot = _al_vector_ref(&sample_cache, i);
+         SAMPLE_CACHE_ENTRY *entry = *slot;
+
+         if (entry->refcount == 0 && (victim < 0 || entry->last_use < oldest)) {
+            victim = i;
+            oldest = entry->last_use;
+         }
+      }
+
+      if (victim < 0)
+         break;
+
+      destroy_cache_entry(victim);
+   }
+}
+
+
+static SAMPLE_CACHE_ENTRY *find_cache_entry(const char *filename,
+   ALLEGRO_FILE *fp, int64_t offset)
+{
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&sample_cache); i++) {
+      SAMPLE_CACHE_ENTRY **slot = _al_vector_ref(&sample_cache, i);
+      SAMPLE_CACHE_ENTRY *entry = *slot;
+
+      if (filename) {
+         if (entry->filename && 0 == strcmp(entry->filename, filename))
+            return entry;
+      }
+      else if (entry->fp == fp && entry->offset == offset) {
+         return entry;
+      }
+   }
+
+   return NULL;
+}
+
+
+static ALLEGRO_SAMPLE *get_cached_sample(const char *filename,
+   ALLEGRO_FILE *fp, const char *ident)
+{
+   SAMPLE_CACHE_ENTRY *entry;
+   SAMPLE_CACHE_ENTRY **slot;
+   ALLEGRO_SAMPLE *spl;
+   int64_t offset = fp ? al_ftell(fp) : 0;
+
+   if (!sample_cache_mutex)
+      _al_kcm_init_sample_cache();
+
+   al_lock_mutex(sample_cache_mutex);
+   entry = find_cache_entry(filename, fp, offset);
+   if (entry) {
+      entry->refcount++;
+      entry->last_use = ++sample_cache_clock;
+      spl = entry->spl;
+      /* Leave the file where al_load_sample_f would have left it. */
+      if (fp)
+         al_fseek(fp, entry->end_offset, ALLEGRO_SEEK_SET);
+      al_unlock_mutex(sample_cache_mutex);
+      return spl;
+   }
+   al_unlock_mutex(sample_cache_mutex);
+
+   /* Decode without holding the lock.  Should another thread load the same
+    * sample meanwhile, its copy wins and ours is dropped.
+    */
+   spl = filename ? al_load_sample(filename) : al_load_sample_f(fp, ident);
+   if (!spl)
+      return NULL;
+
+   al_lock_mutex(sample_cache_mutex);
+
+   entry = find_cache_entry(filename, fp, offset);
+   if (entry) {
+      entry->refcount++;
+      entry->last_use = ++sample_cache_clock;
+      al_unlock_mutex(sample_cache_mutex);
+      al_destroy_sample(spl);
+      return entry->spl;
+   }
+
+   entry = al_calloc(1, sizeof(*entry));
+   if (!entry) {
+      al_unlock_mutex(sample_cache_mutex);
+      al_destroy_sample(spl);
+      return NULL;
+   }
+   if (filename) {
+      entry->filename = al_malloc(strlen(filename) + 1);
+      if (!entry->filename) {
+         al_unlock_mutex(sample_cache_mutex);
+         al_free(entry);
+         al_destroy_sample(spl);
+         return NULL;
+      }
+      strcpy(entry->filename, filename);
+   }
+   else {
+      entry->fp = fp;
+      entry->offset = offset;
+      entry->end_offset = al_ftell(fp);
+   }
+   entry->spl = spl;
+   entry->size = sample_memory_size(spl);
+   entry->refcount = 1;
+   entry->last_use = ++sample_cache_clock;
+   spl->is_cached = true;
+
+   slot = _al_vector_alloc_back(&sample_cache);
+   if (!slot) {
+      al_unlock_mutex(sample_cache_mutex);
+      al_free(entry->filename);
+      al_free(entry);
+      spl->is_cached = false;
+      al_destroy_sample(spl);
+      return NULL;
+   }
+   *slot = entry;
+   sample_cache_usage += entry->size;
+
+   evict_cached_samples(sample_cache_budget);
+
+   al_unlock_mutex(sample_cache_mutex);
+
+   return spl;
+}
+
+
+/* Function: al_load_cached_sample
+ */
+ALLEGRO_SAMPLE *al_load_cached_sample(const char *filename)
+{
+   ASSERT(filename);
+
+   return get_cached_sample(filename, NULL, NULL);
+}
+
+
+/* Function: al_load_cached_sample_f
+ */
+ALLEGRO_SAMPLE *al_load_cached_sample_f(ALLEGRO_FILE *fp, const char *ident)
+{
+   ASSERT(fp);
+   ASSERT(ident);
+
+   return get_cached_sample(NULL, fp, ident);
+}
+
+
+/* Function: al_release_cached_sample
+ */
+void al_release_cached_sample(ALLEGRO_SAMPLE *spl)
+{
+   unsigned int i;
+
+   if (!spl)
+      return;
+
+   if (!spl->is_cached) {
+      ALLEGRO_WARN("Releasing a sample which is not in the cache.\n");
+      return;
+   }
+
+   al_lock_mutex(sample_cache_mutex);
+
+   for (i = 0; i < _al_vector_size(&sample_cache); i++) {
+      SAMPLE_CACHE_ENTRY **slot = _al_vector_ref(&sample_cache, i);
+      SAMPLE_CACHE_ENTRY *entry = *slot;
+
+      if (entry->spl != spl)
+         continue;
+
+      ASSERT(entry->refcount > 0);
+      if (--entry->refcount == 0) {
+         if (entry->fp)
+            destroy_cache_entry(i);
+         else
+            evict_cached_samples(sample_cache_budget);
+      }
+      break;
+   }
+
+   al_unlock_mutex(sample_cache_mutex);
+}
+
+
+/* Function: al_set_sample_cache_budget
+ */
+void al_set_sample_cache_budget(size_t bytes)
+{
+   if (!sample_cache_mutex)
+      _al_kcm_init_sample_cache();
+
+   al_lock_mutex(sample_cache_mutex);
+   sample_cache_budget = bytes;
+   evict_cached_samples(sample_cache_budget);
+   al_unlock_mutex(sample_cache_mutex);
+}
+
+
+/* Function: al_get_sample_cache_budget
+ */
+size_t al_get_sample_cache_budget(void)
+{
+   return sample_cache_budget;
+}
+
+
+/* Function: al_get_sample_cache_usage
+ */
+size_t al_get_sample_cache_usage(void)
+{
+   return sample_cache_usage;
+}
+
+
+/* Function: al_clear_sample_cache
+ */
+void al_clear_sample_cache(void)
+{
+   if (!sample_cache_mutex)
+      return;
+
+   al_lock_mutex(sample_cache_mutex);
+   evict_cached_samples(0);
+   al_unlock_mutex(sample_cache_mutex);
+}
+
+
+/* _al_kcm_shutdown_sample_cache:
+ *  Destroy all cached samples, referenced or not.
+ */
+void _al_kcm_shutdown_sample_cache(void)
+{
+   if (!sample_cache_mutex)
+      return;
+
+   al_lock_mutex(sample_cache_mutex);
+   while (!_al_vector_is_empty(&sample_cache)) {
+      destroy_cache_entry(_al_vector_size(&sample_cache) - 1);
+   }
+   _al_vector_free(&sample_cache);
+   al_unlock_mutex(sample_cache_mutex);
+
+   al_destroy_mutex(sample_cache_mutex);
+   sample_cache_mutex = NULL;
+}
+
+
+/* _al_kcm_uncache_sample:
+ *  Drop the reference to a cached sample held by a caller of
+ *  al_destroy_sample.  Other callers of al_load_cached_sample may still be
+ *  using it, so only the last reference removes the sample from the cache.
+ *  Returns true if the caller should go on to destroy the sample.
+ */
+bool _al_kcm_uncache_sample(ALLEGRO_SAMPLE *spl)
+{
+   bool last = true;
+   unsigned int i;
+
+   al_lock_mutex(sample_cache_mutex);
+
+   for (i = 0; i < _al_vector_size(&sample_cache); i++) {
+      SAMPLE_CACHE_ENTRY **slot = _al_vector_ref(&sample_cache, i);
+      SAMPLE_CACHE_ENTRY *entry = *slot;
+
+      if (entry->spl == spl) {
+         if (entry->refcount > 1) {
+            entry->refcount--;
+            last = false;
+            break;
+         }
+         _al_vector_delete_at(&sample_cache, i);
+         sample_cache_usage -= entry->size;
+         al_free(entry->filename);
+         al_free(entry);
+         break;
+      }
+   }
+
+   if (last)
+      spl->is_cached = false;
+
+   al_unlock_mutex(sample_cache_mutex);
+
+   return last;
+}
+
+
 /* vim: set sts=3 sw=3 et: */
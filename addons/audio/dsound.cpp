@@ -648,12 +648,8 @@ static void *_dsound_update_recorder(ALLEGRO_THREAD *t, void *data)
    ALLEGRO_AUDIO_RECORDER *r = (ALLEGRO_AUDIO_RECORDER *) data;
    DSOUND_RECORD_DATA *extra = (DSOUND_RECORD_DATA *) r->extra;
    DWORD last_read_pos = 0;
-   ALLEGRO_EVENT user_event;
    bool is_dsound_recording = false;
 
-   size_t fragment_i = 0;
-   size_t bytes_written = 0;
-
    ALLEGRO_INFO("Starting recorder thread\n");
 
    while (!al_get_thread_should_stop(t)) {
@@ -687,43 +683,11 @@ static void *_dsound_update_recorder(ALLEGRO_THREAD *t, void *data)
          bytes_to_read = extra->desc.dwBufferBytes - last_read_pos;
 
       if (bytes_to_read) {
-         uint8_t *buffer;
-         size_t buffer_size;
-
          extra->buffer8->Lock(last_read_pos, bytes_to_read, &buffer1, &buffer1_size, &buffer2, &buffer2_size, 0);
 
          ALLEGRO_ASSERT(buffer2 == NULL);
 
-         buffer = (uint8_t *)buffer1;
-         buffer_size = buffer1_size;
-
-         while (buffer_size > 0) {
-            if (bytes_written + buffer_size <= r->fragment_size) {
-               memcpy((uint8_t*) r->fragments[fragment_i] + bytes_written, buffer, buffer_size);
-               bytes_written += buffer_size;
-               buffer_size = 0;
-            }
-            else {
-               ALLEGRO_AUDIO_RECORDER_EVENT *e;
-               size_t bytes_to_write = r->fragment_size - bytes_written;
-               memcpy((uint8_t*) r->fragments[fragment_i] + bytes_written, buffer, bytes_to_write);
-
-               buffer_size -= bytes_to_write;
-               buffer += bytes_to_write;
-
-               user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-               e = al_get_audio_recorder_event(&user_event);
-               e->buffer = r->fragments[fragment_i];
-               e->samples = r->samples;
-               al_emit_user_event(&r->source, &user_event, NULL);
-
-               /* advance to the next fragment */
-               if (++fragment_i == r->fragment_count) {
-                  fragment_i = 0;
-               }
-               bytes_written = 0;
-            }
-         }
+         _al_kcm_recorder_write(r, buffer1, buffer1_size / r->sample_size);
 
          extra->buffer8->Unlock(buffer1, buffer1_size, buffer2, buffer2_size);
 
@@ -853,7 +817,9 @@ ALLEGRO_AUDIO_DRIVER _al_kcm_dsound_driver = {
    _dsound_set_voice_position,
 
    _dsound_open_recorder,
-   _dsound_close_recorder
+   _dsound_close_recorder,
+
+   NULL
 };
 
 } /* End extern "C" */
@@ -0,0 +1,516 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Buffer operations run on every mixer buffer: applying the mixer
+ *      gain, adding a mixer into its parent, and clamping and converting
+ *      the mixed data to the voice depth.  There are SSE2 and AVX2 versions
+ *      which are picked at run time, depending on what the CPU supports.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+#include <math.h>
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+
+ALLEGRO_DEBUG_CHANNEL("audio")
+
+
+/* With GCC and Clang on x86 the vector versions are compiled even if the
+ * compiler flags don't enable the instruction sets, and they are only used
+ * if the CPU reports support for them.  Other compilers only get the SSE2
+ * versions, when SSE2 is enabled for the whole build.
+ */
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) && \
+   (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+   #include <immintrin.h>
+   #define ALLEGRO_KCM_DSP_SSE2
+   #define ALLEGRO_KCM_DSP_AVX2
+   #define ALLEGRO_KCM_DSP_CPU_SUPPORTS(x)   __builtin_cpu_supports(x)
+   #define ALLEGRO_KCM_DSP_TARGET(x)         __attribute__((target(x)))
+#elif defined(__SSE2__) || defined(_M_X64) || \
+   (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+   #include <emmintrin.h>
+   #define ALLEGRO_KCM_DSP_SSE2
+   #define ALLEGRO_KCM_DSP_CPU_SUPPORTS(x)   true
+   #define ALLEGRO_KCM_DSP_TARGET(x)
+#endif
+
+
+/* Dither noise.
+ *
+ * Each lane of the vector versions runs its own xorshift generator, and the
+ * scalar version uses the first one.  Two uniform values in [0, 1) are
+ * subtracted to give triangular noise of one step of the output depth.
+ */
+#define DITHER_ONE   (1.0f / 16777216.0f)
+
+
+static INLINE uint32_t xorshift(uint32_t *state)
+{
+   uint32_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+   return x;
+}
+
+
+static INLINE float tpdf(uint32_t *state)
+{
+   float a = (float)(xorshift(state) >> 8);
+   float b = (float)(xorshift(state) >> 8);
+   return (a - b) * DITHER_ONE;
+}
+
+
+/* _al_kcm_init_dither:
+ *  Seed the dither generators of a mixer.
+ */
+void _al_kcm_init_dither(uint32_t *state)
+{
+   int i;
+
+   for (i = 0; i < _AL_KCM_DITHER_LANES; i++) {
+      state[i] = 0x2545F491u + (uint32_t)i * 0x9E3779B9u;
+   }
+}
+
+
+/* Scalar versions.
+ *
+ * The conversions scale by 2^(bits-1) - 0.5 and truncate, unless dithering,
+ * in which case the noise is added and the result rounded.
+ */
+
+static void gain_f32_c(float *buf, size_t n, float gain)
+{
+   while (n-- > 0) {
+      *buf++ *= gain;
+   }
+}
+
+
+static void add_f32_c(float *dst, const float *src, size_t n)
+{
+   while (n-- > 0) {
+      *dst++ += *src++;
+   }
+}
+
+
+static void add_s16_c(int16_t *dst, const int16_t *src, size_t n)
+{
+   while (n-- > 0) {
+      int32_t x = *dst + *src++;
+      if (x < -32768)
+         x = -32768;
+      else if (x > 32767)
+         x = 32767;
+      *dst++ = (int16_t)x;
+   }
+}
+
+
+static INLINE int32_t to_int(float x, float scale, float lo, float hi,
+   uint32_t *dither)
+{
+   x *= scale;
+   if (dither)
+      x += tpdf(dither);
+   if (x < lo)
+      x = lo;
+   else if (x > hi)
+      x = hi;
+   return dither ? (int32_t)lrintf(x) : (int32_t)x;
+}
+
+
+/* The destination may be the same buffer as the source, so these must read
+ * each value before storing the converted one.
+ */
+static void f32_to_s8_c(int8_t *dst, const float *src, size_t n, int8_t off,
+   uint32_t *dither)
+{
+   while (n-- > 0) {
+      *dst++ = (int8_t)(to_int(*src++, 127.5f, -128.0f, 127.0f, dither) + off);
+   }
+}
+
+
+static void f32_to_s16_c(int16_t *dst, const float *src, size_t n,
+   int16_t off, uint32_t *dither)
+{
+   while (n-- > 0) {
+      *dst++ = (int16_t)(to_int(*src++, 32767.5f, -32768.0f, 32767.0f,
+         dither) + off);
+   }
+}
+
+
+static void f32_to_s24_c(int32_t *dst, const float *src, size_t n,
+   int32_t off, uint32_t *dither)
+{
+   while (n-- > 0) {
+      *dst++ = to_int(*src++, 8388607.5f, -8388608.0f, 8388607.0f, dither)
+         + off;
+   }
+}
+
+
+#ifdef ALLEGRO_KCM_DSP_SSE2
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static INLINE __m128 tpdf_sse2(__m128i *state)
+{
+   __m128i x = *state;
+   __m128i a, b;
+
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+   x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+   a = x;
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+   x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+   b = x;
+   *state = x;
+
+   return _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_srli_epi32(a, 8)),
+      _mm_cvtepi32_ps(_mm_srli_epi32(b, 8))), _mm_set1_ps(DITHER_ONE));
+}
+
+
+/* Scale, dither and clamp four values, and convert them to integers. */
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static INLINE __m128i to_int_sse2(const float *src, __m128 scale, __m128 lo,
+   __m128 hi, __m128i *dither)
+{
+   __m128 x = _mm_mul_ps(_mm_loadu_ps(src), scale);
+
+   if (dither) {
+      x = _mm_add_ps(x, tpdf_sse2(dither));
+      return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+   }
+   return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static void gain_f32_sse2(float *buf, size_t n, float gain)
+{
+   const __m128 g = _mm_set1_ps(gain);
+
+   for (; n >= 8; n -= 8, buf += 8) {
+      _mm_storeu_ps(buf, _mm_mul_ps(_mm_loadu_ps(buf), g));
+      _mm_storeu_ps(buf + 4, _mm_mul_ps(_mm_loadu_ps(buf + 4), g));
+   }
+   gain_f32_c(buf, n, gain);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static void add_f32_sse2(float *dst, const float *src, size_t n)
+{
+   for (; n >= 8; n -= 8, dst += 8, src += 8) {
+      _mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), _mm_loadu_ps(src)));
+      _mm_storeu_ps(dst + 4,
+         _mm_add_ps(_mm_loadu_ps(dst + 4), _mm_loadu_ps(src + 4)));
+   }
+   add_f32_c(dst, src, n);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static void add_s16_sse2(int16_t *dst, const int16_t *src, size_t n)
+{
+   for (; n >= 8; n -= 8, dst += 8, src += 8) {
+      __m128i a = _mm_loadu_si128((const __m128i *)dst);
+      __m128i b = _mm_loadu_si128((const __m128i *)src);
+      _mm_storeu_si128((__m128i *)dst, _mm_adds_epi16(a, b));
+   }
+   add_s16_c(dst, src, n);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static void f32_to_s8_sse2(int8_t *dst, const float *src, size_t n,
+   int8_t off, uint32_t *dither)
+{
+   const __m128 scale = _mm_set1_ps(127.5f);
+   const __m128 lo = _mm_set1_ps(-128.0f);
+   const __m128 hi = _mm_set1_ps(127.0f);
+   const __m128i voff = _mm_set1_epi8(off);
+   __m128i state = dither ? _mm_loadu_si128((__m128i *)dither) : _mm_setzero_si128();
+   __m128i *d = dither ? &state : NULL;
+
+   for (; n >= 16; n -= 16, dst += 16, src += 16) {
+      __m128i a = to_int_sse2(src, scale, lo, hi, d);
+      __m128i b = to_int_sse2(src + 4, scale, lo, hi, d);
+      __m128i c = to_int_sse2(src + 8, scale, lo, hi, d);
+      __m128i e = to_int_sse2(src + 12, scale, lo, hi, d);
+      __m128i x = _mm_packs_epi16(_mm_packs_epi32(a, b),
+         _mm_packs_epi32(c, e));
+      _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(x, voff));
+   }
+
+   if (dither)
+      _mm_storeu_si128((__m128i *)dither, state);
+   f32_to_s8_c(dst, src, n, off, dither);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static void f32_to_s16_sse2(int16_t *dst, const float *src, size_t n,
+   int16_t off, uint32_t *dither)
+{
+   const __m128 scale = _mm_set1_ps(32767.5f);
+   const __m128 lo = _mm_set1_ps(-32768.0f);
+   const __m128 hi = _mm_set1_ps(32767.0f);
+   const __m128i voff = _mm_set1_epi16(off);
+   __m128i state = dither ? _mm_loadu_si128((__m128i *)dither) : _mm_setzero_si128();
+   __m128i *d = dither ? &state : NULL;
+
+   for (; n >= 8; n -= 8, dst += 8, src += 8) {
+      __m128i a = to_int_sse2(src, scale, lo, hi, d);
+      __m128i b = to_int_sse2(src + 4, scale, lo, hi, d);
+      _mm_storeu_si128((__m128i *)dst,
+         _mm_add_epi16(_mm_packs_epi32(a, b), voff));
+   }
+
+   if (dither)
+      _mm_storeu_si128((__m128i *)dither, state);
+   f32_to_s16_c(dst, src, n, off, dither);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("sse2")
+static void f32_to_s24_sse2(int32_t *dst, const float *src, size_t n,
+   int32_t off, uint32_t *dither)
+{
+   const __m128 scale = _mm_set1_ps(8388607.5f);
+   const __m128 lo = _mm_set1_ps(-8388608.0f);
+   const __m128 hi = _mm_set1_ps(8388607.0f);
+   const __m128i voff = _mm_set1_epi32(off);
+   __m128i state = dither ? _mm_loadu_si128((__m128i *)dither) : _mm_setzero_si128();
+   __m128i *d = dither ? &state : NULL;
+
+   for (; n >= 4; n -= 4, dst += 4, src += 4) {
+      __m128i a = to_int_sse2(src, scale, lo, hi, d);
+      _mm_storeu_si128((__m128i *)dst, _mm_add_epi32(a, voff));
+   }
+
+   if (dither)
+      _mm_storeu_si128((__m128i *)dither, state);
+   f32_to_s24_c(dst, src, n, off, dither);
+}
+
+#endif /* ALLEGRO_KCM_DSP_SSE2 */
+
+
+#ifdef ALLEGRO_KCM_DSP_AVX2
+
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static INLINE __m256 tpdf_avx2(__m256i *state)
+{
+   __m256i x = *state;
+   __m256i a, b;
+
+   x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+   x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+   x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+   a = x;
+   x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+   x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+   x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+   b = x;
+   *state = x;
+
+   return _mm256_mul_ps(_mm256_sub_ps(
+      _mm256_cvtepi32_ps(_mm256_srli_epi32(a, 8)),
+      _mm256_cvtepi32_ps(_mm256_srli_epi32(b, 8))),
+      _mm256_set1_ps(DITHER_ONE));
+}
+
+
+/* Scale, dither and clamp eight values, and convert them to integers. */
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static INLINE __m256i to_int_avx2(const float *src, __m256 scale, __m256 lo,
+   __m256 hi, __m256i *dither)
+{
+   __m256 x = _mm256_mul_ps(_mm256_loadu_ps(src), scale);
+
+   if (dither) {
+      x = _mm256_add_ps(x, tpdf_avx2(dither));
+      return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(x, lo), hi));
+   }
+   return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(x, lo), hi));
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static void gain_f32_avx2(float *buf, size_t n, float gain)
+{
+   const __m256 g = _mm256_set1_ps(gain);
+
+   for (; n >= 16; n -= 16, buf += 16) {
+      _mm256_storeu_ps(buf, _mm256_mul_ps(_mm256_loadu_ps(buf), g));
+      _mm256_storeu_ps(buf + 8, _mm256_mul_ps(_mm256_loadu_ps(buf + 8), g));
+   }
+   gain_f32_c(buf, n, gain);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static void add_f32_avx2(float *dst, const float *src, size_t n)
+{
+   for (; n >= 16; n -= 16, dst += 16, src += 16) {
+      _mm256_storeu_ps(dst,
+         _mm256_add_ps(_mm256_loadu_ps(dst), _mm256_loadu_ps(src)));
+      _mm256_storeu_ps(dst + 8,
+         _mm256_add_ps(_mm256_loadu_ps(dst + 8), _mm256_loadu_ps(src + 8)));
+   }
+   add_f32_c(dst, src, n);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static void add_s16_avx2(int16_t *dst, const int16_t *src, size_t n)
+{
+   for (; n >= 16; n -= 16, dst += 16, src += 16) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)dst);
+      __m256i b = _mm256_loadu_si256((const __m256i *)src);
+      _mm256_storeu_si256((__m256i *)dst, _mm256_adds_epi16(a, b));
+   }
+   add_s16_c(dst, src, n);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static void f32_to_s16_avx2(int16_t *dst, const float *src, size_t n,
+   int16_t off, uint32_t *dither)
+{
+   const __m256 scale = _mm256_set1_ps(32767.5f);
+   const __m256 lo = _mm256_set1_ps(-32768.0f);
+   const __m256 hi = _mm256_set1_ps(32767.0f);
+   const __m256i voff = _mm256_set1_epi16(off);
+   __m256i state = dither ? _mm256_loadu_si256((__m256i *)dither) : _mm256_setzero_si256();
+   __m256i *d = dither ? &state : NULL;
+
+   for (; n >= 16; n -= 16, dst += 16, src += 16) {
+      __m256i a = to_int_avx2(src, scale, lo, hi, d);
+      __m256i b = to_int_avx2(src + 8, scale, lo, hi, d);
+      /* The pack works within each 128-bit half, so put the quarters
+       * back in order afterwards.
+       */
+      __m256i x = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+      _mm256_storeu_si256((__m256i *)dst, _mm256_add_epi16(x, voff));
+   }
+
+   if (dither)
+      _mm256_storeu_si256((__m256i *)dither, state);
+   f32_to_s16_c(dst, src, n, off, dither);
+}
+
+
+ALLEGRO_KCM_DSP_TARGET("avx2")
+static void f32_to_s24_avx2(int32_t *dst, const float *src, size_t n,
+   int32_t off, uint32_t *dither)
+{
+   const __m256 scale = _mm256_set1_ps(8388607.5f);
+   const __m256 lo = _mm256_set1_ps(-8388608.0f);
+   const __m256 hi = _mm256_set1_ps(8388607.0f);
+   const __m256i voff = _mm256_set1_epi32(off);
+   __m256i state = dither ? _mm256_loadu_si256((__m256i *)dither) : _mm256_setzero_si256();
+   __m256i *d = dither ? &state : NULL;
+
+   for (; n >= 8; n -= 8, dst += 8, src += 8) {
+      __m256i a = to_int_avx2(src, scale, lo, hi, d);
+      _mm256_storeu_si256((__m256i *)dst, _mm256_add_epi32(a, voff));
+   }
+
+   if (dither)
+      _mm256_storeu_si256((__m256i *)dither, state);
+   f32_to_s24_c(dst, src, n, off, dither);
+}
+
+#endif /* ALLEGRO_KCM_DSP_AVX2 */
+
+
+#define SCALAR_DSP   \
+   {                 \
+      "scalar",      \
+      gain_f32_c,    \
+      add_f32_c,     \
+      add_s16_c,     \
+      f32_to_s8_c,   \
+      f32_to_s16_c,  \
+      f32_to_s24_c   \
+   }
+
+static const _AL_KCM_DSP scalar_dsp = SCALAR_DSP;
+
+_AL_KCM_DSP _al_kcm_dsp = SCALAR_DSP;
+
+
+/* _al_kcm_init_dsp:
+ *  Pick the fastest versions of the buffer operations that the CPU
+ *  supports.  The [audio] dsp config key can force a slower set.
+ */
+void _al_kcm_init_dsp(void)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *force = NULL;
+
+   if (config) {
+      force = al_get_config_value(config, "audio", "dsp");
+      if (force && (force[0] == '\0' || !_al_stricmp(force, "auto")))
+         force = NULL;
+   }
+
+   _al_kcm_dsp = scalar_dsp;
+   if (force && !_al_stricmp(force, "scalar"))
+      goto done;
+
+#ifdef ALLEGRO_KCM_DSP_SSE2
+   if (ALLEGRO_KCM_DSP_CPU_SUPPORTS("sse2")) {
+      _al_kcm_dsp.name = "sse2";
+      _al_kcm_dsp.gain_f32 = gain_f32_sse2;
+      _al_kcm_dsp.add_f32 = add_f32_sse2;
+      _al_kcm_dsp.add_s16 = add_s16_sse2;
+      _al_kcm_dsp.f32_to_s8 = f32_to_s8_sse2;
+      _al_kcm_dsp.f32_to_s16 = f32_to_s16_sse2;
+      _al_kcm_dsp.f32_to_s24 = f32_to_s24_sse2;
+   }
+   if (force && !_al_stricmp(force, "sse2"))
+      goto done;
+#endif
+
+#ifdef ALLEGRO_KCM_DSP_AVX2
+   if (ALLEGRO_KCM_DSP_CPU_SUPPORTS("avx2")) {
+      /* 8-bit output is rare enough to leave to the SSE2 version. */
+      _al_kcm_dsp.name = "avx2";
+      _al_kcm_dsp.gain_f32 = gain_f32_avx2;
+      _al_kcm_dsp.add_f32 = add_f32_avx2;
+      _al_kcm_dsp.add_s16 = add_s16_avx2;
+      _al_kcm_dsp.f32_to_s16 = f32_to_s16_avx2;
+      _al_kcm_dsp.f32_to_s24 = f32_to_s24_avx2;
+   }
+#endif
+
+done:
+   ALLEGRO_INFO("Using %s buffer operations\n", _al_kcm_dsp.name);
+}
+
+/* vim: set sts=3 sw=3 et: */
@@ -84,6 +84,7 @@ static void stream_free(ALLEGRO_SAMPLE_INSTANCE *spl)
          }
 
          _al_vector_free(&mixer->streams);
+         _al_vector_free(&mixer->scheduled);
 
          if (spl->spl_data.buffer.ptr) {
             ASSERT(spl->spl_data.free_buf);
@@ -127,10 +128,12 @@ void _al_kcm_detach_from_parent(ALLEGRO_SAMPLE_INSTANCE *spl)
          maybe_lock_mutex(mixer->ss.mutex);
 
          _al_vector_delete_at(&mixer->streams, i);
+         _al_kcm_mixer_unschedule(mixer, spl);
          spl->parent.u.mixer = NULL;
          _al_kcm_stream_set_mutex(spl, NULL);
 
          spl->spl_read = NULL;
+         spl->converted = NULL;
 
          maybe_unlock_mutex(mixer->ss.mutex);
 
@@ -149,8 +152,16 @@ ALLEGRO_SAMPLE_INSTANCE *al_create_sample_instance(ALLEGRO_SAMPLE *sample_data)
 {
    ALLEGRO_SAMPLE_INSTANCE *spl;
 
+   if (sample_data) {
+      sample_data = _al_kcm_acquire_sample_data(sample_data);
+      if (!sample_data)
+         return NULL;
+   }
+
    spl = al_calloc(1, sizeof(*spl));
    if (!spl) {
+      if (sample_data)
+         _al_kcm_release_sample_data(sample_data);
       _al_set_error(ALLEGRO_GENERIC_ERROR,
          "Out of memory allocating sample object");
       return NULL;
@@ -203,6 +214,7 @@ void _al_kcm_destroy_sample(ALLEGRO_SAMPLE_INSTANCE *spl, bool unregister)
       }
 
       _al_kcm_detach_from_parent(spl);
+      _al_kcm_release_sample_data(&spl->spl_data);
       stream_free(spl);
    }
 }
@@ -564,6 +576,79 @@ bool al_set_sample_instance_playing(ALLEGRO_SAMPLE_INSTANCE *spl, bool val)
 }
 
 
+/* Function: al_schedule_sample_instance_playing
+ */
+bool al_schedule_sample_instance_playing(ALLEGRO_SAMPLE_INSTANCE *spl,
+   bool val, uint64_t frame)
+{
+   ASSERT(spl);
+
+   return _al_kcm_mixer_schedule(spl, SCHEDULED_PLAYING, val ? 1.0f : 0.0f,
+      frame);
+}
+
+
+/* Function: al_schedule_sample_instance_gain
+ */
+bool al_schedule_sample_instance_gain(ALLEGRO_SAMPLE_INSTANCE *spl,
+   float val, uint64_t frame)
+{
+   ASSERT(spl);
+
+   return _al_kcm_mixer_schedule(spl, SCHEDULED_GAIN, val, frame);
+}
+
+
+/* Function: al_schedule_sample_instance_pan
+ */
+bool al_schedule_sample_instance_pan(ALLEGRO_SAMPLE_INSTANCE *spl,
+   float val, uint64_t frame)
+{
+   ASSERT(spl);
+
+   if (val != ALLEGRO_AUDIO_PAN_NONE && (val < -1.0 || val > 1.0)) {
+      _al_set_error(ALLEGRO_GENERIC_ERROR, "Invalid pan value");
+      return false;
+   }
+
+   return _al_kcm_mixer_schedule(spl, SCHEDULED_PAN, val, frame);
+}
+
+
+/* Function: al_schedule_sample_instance_speed
+ */
+bool al_schedule_sample_instance_speed(ALLEGRO_SAMPLE_INSTANCE *spl,
+   float val, uint64_t frame)
+{
+   ASSERT(spl);
+
+   if (fabsf(val) < (1.0f/64.0f)) {
+      _al_set_error(ALLEGRO_INVALID_PARAM,
+         "Attempted to set zero speed");
+      return false;
+   }
+
+   return _al_kcm_mixer_schedule(spl, SCHEDULED_SPEED, val, frame);
+}
+
+
+/* Function: al_unschedule_sample_instance
+ */
+void al_unschedule_sample_instance(ALLEGRO_SAMPLE_INSTANCE *spl)
+{
+   ALLEGRO_MIXER *mixer;
+   ASSERT(spl);
+
+   if (!spl->parent.u.ptr || spl->parent.is_voice)
+      return;
+
+   mixer = spl->parent.u.mixer;
+   maybe_lock_mutex(mixer->ss.mutex);
+   _al_kcm_mixer_unschedule(mixer, spl);
+   maybe_unlock_mutex(mixer->ss.mutex);
+}
+
+
 /* Function: al_detach_sample_instance
  */
 bool al_detach_sample_instance(ALLEGRO_SAMPLE_INSTANCE *spl)
@@ -594,6 +679,17 @@ bool al_set_sample(ALLEGRO_SAMPLE_INSTANCE *spl, ALLEGRO_SAMPLE *data)
       }
    }
 
+   /* Decode the new sample before releasing the old one, in case they are
+    * one and the same lazily loaded sample.
+    */
+   if (data) {
+      data = _al_kcm_acquire_sample_data(data);
+      if (!data)
+         return false;
+   }
+   _al_kcm_release_sample_data(&spl->spl_data);
+   spl->spl_data.backing = NULL;
+
    if (!data) {
       if (spl->parent.u.ptr) {
          _al_kcm_detach_from_parent(spl);
@@ -606,9 +702,14 @@ bool al_set_sample(ALLEGRO_SAMPLE_INSTANCE *spl, ALLEGRO_SAMPLE *data)
 
    need_reattach = false;
    if (spl->parent.u.ptr != NULL) {
+      /* A preconverted sample needs its conversion for the mixer looked
+       * up again.
+       */
       if (spl->spl_data.frequency != data->frequency ||
             spl->spl_data.depth != data->depth ||
-            spl->spl_data.chan_conf != data->chan_conf) {
+            spl->spl_data.chan_conf != data->chan_conf ||
+            (!spl->parent.is_voice &&
+               (spl->converted || data->conversions))) {
          old_parent = spl->parent;
          need_reattach = true;
          _al_kcm_detach_from_parent(spl);
@@ -16,6 +16,12 @@
 #include "allegro5/internal/aintern_audio.h"
 #include "allegro5/internal/aintern_audio_cfg.h"
 
+#if defined(__SSE__) || defined(_M_X64) || \
+   (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+   #include <xmmintrin.h>
+   #define ALLEGRO_KCM_SINC_SSE
+#endif
+
 ALLEGRO_DEBUG_CHANNEL("audio")
 
 
@@ -159,6 +165,17 @@ void _al_kcm_mixer_rejig_sample_matrix(ALLEGRO_MIXER *mixer,
          spl->matrix[i*src_chans + j] = mat[i*ALLEGRO_MAX_CHANNELS + j];
       }
    }
+
+   /* The converted data is already in the mixer's channel layout, so only
+    * the gain and panning remain to be applied, one factor per channel.
+    */
+   if (spl->converted) {
+      mat = _al_rechannel_matrix(mixer->ss.spl_data.chan_conf,
+         mixer->ss.spl_data.chan_conf, spl->gain, spl->pan);
+      for (i = 0; i < dst_chans; i++) {
+         spl->converted_gain[i] = mat[i*ALLEGRO_MAX_CHANNELS + i];
+      }
+   }
 }
 
 
@@ -243,25 +260,219 @@ static bool fix_looped_position(ALLEGRO_SAMPLE_INSTANCE *spl)
 }
 
 
-#include "kcm_mixer_helpers.inc"
+/* Windowed-sinc interpolation.
+ *
+ * The kernel spans SINC_TAPS input samples and is tabulated at SINC_PHASES
+ * fractional positions between two input samples.  Positions in between
+ * two table rows are linearly interpolated.  The cutoff is set a little
+ * below the Nyquist frequency of the source so that the common 44.1 kHz
+ * <-> 48 kHz conversions don't alias.
+ *
+ * When downsampling the cutoff must follow the Nyquist frequency of the
+ * output instead, so there is one table per SINC_BANDS fraction of the
+ * source band and each instance picks the widest one that is still below
+ * out_rate / in_rate.  At large ratios the kernel is mostly window, which
+ * is soft but doesn't alias.
+ */
+#define SINC_TAPS       16
+#define SINC_PHASES     256
+#define SINC_BANDS      8
+#define SINC_CUTOFF     0.9
+
+static float sinc_table[SINC_BANDS][SINC_PHASES + 1][SINC_TAPS];
+static bool sinc_table_ready = false;
+
+
+static void init_sinc_band(int band)
+{
+   const double cutoff = SINC_CUTOFF * (SINC_BANDS - band) / SINC_BANDS;
+   int ph, j;
+
+   for (ph = 0; ph <= SINC_PHASES; ph++) {
+      float *h = sinc_table[band][ph];
+      double sum = 0.0;
+
+      for (j = 0; j < SINC_TAPS; j++) {
+         /* Distance from the interpolated position to tap j. */
+         double d = (j - (SINC_TAPS/2 - 1)) - (double)ph / SINC_PHASES;
+         double x = ALLEGRO_PI * cutoff * d;
+         double w = ALLEGRO_PI * d / (SINC_TAPS/2);
+         double s = (d == 0.0) ? 1.0 : sin(x) / x;
+
+         /* Blackman window. */
+         if (fabs(d) >= SINC_TAPS/2)
+            w = 0.0;
+         else
+            w = 0.42 + 0.5 * cos(w) + 0.08 * cos(2.0 * w);
+
+         h[j] = s * w;
+         sum += s * w;
+      }
+
+      /* Normalise for unity gain at DC. */
+      for (j = 0; j < SINC_TAPS; j++) {
+         h[j] /= sum;
+      }
+   }
+}
+
+
+/* init_sinc_table:
+ *  Mixers may be created from any thread, so the tables are built under
+ *  _al_kcm_mutex.  The mixer callback only reads them once a mixer with
+ *  sinc quality exists, which is after this returns.
+ */
+static void init_sinc_table(void)
+{
+   int band;
+
+   al_lock_mutex(_al_kcm_mutex);
+
+   if (!sinc_table_ready) {
+      for (band = 0; band < SINC_BANDS; band++) {
+         init_sinc_band(band);
+      }
+      sinc_table_ready = true;
+   }
+
+   al_unlock_mutex(_al_kcm_mutex);
+}
+
+
+/* sinc_positions:
+ *  Compute the buffer offsets of the SINC_TAPS samples around the current
+ *  position, taking the play mode into account.
+ */
+static INLINE void sinc_positions(const ALLEGRO_SAMPLE_INSTANCE *spl,
+   unsigned int maxc, int *p)
+{
+   const int first = spl->pos - (SINC_TAPS/2 - 1);
+   const int span = spl->loop_end - spl->loop_start;
+   int j;
+
+   switch (spl->loop) {
+      case ALLEGRO_PLAYMODE_LOOP:
+         if (span > 0) {
+            for (j = 0; j < SINC_TAPS; j++) {
+               int q = (first + j - spl->loop_start) % span;
+               if (q < 0)
+                  q += span;
+               p[j] = (spl->loop_start + q) * maxc;
+            }
+            break;
+         }
+         /* fallthrough */
+
+      case ALLEGRO_PLAYMODE_ONCE:
+         for (j = 0; j < SINC_TAPS; j++) {
+            int q = first + j;
+            if (q < 0)
+               q = 0;
+            else if (q >= spl->spl_data.len)
+               q = spl->spl_data.len - 1;
+            p[j] = q * maxc;
+         }
+         break;
 
+      case ALLEGRO_PLAYMODE_BIDIR:
+         /* These positions should really bounce instead of clamping
+          * but it's probably unnoticeable.
+          */
+         for (j = 0; j < SINC_TAPS; j++) {
+            int q = first + j;
+            if (q >= spl->loop_end)
+               q = spl->loop_end - 1;
+            if (q < spl->loop_start)
+               q = spl->loop_start;
+            p[j] = q * maxc;
+         }
+         break;
+
+      case _ALLEGRO_PLAYMODE_STREAM_ONCE:
+      case _ALLEGRO_PLAYMODE_STREAM_ONEDIR:
+         /* Lag by SINC_TAPS/2 samples so that the window never extends
+          * into the next fragment.  See MAX_LAG in kcm_stream.c.
+          */
+         for (j = 0; j < SINC_TAPS; j++) {
+            p[j] = (first + j - SINC_TAPS/2) * maxc;
+         }
+         break;
+   }
+}
 
-static INLINE int32_t clamp(int32_t val, int32_t min, int32_t max)
+
+/* sinc_band:
+ *  Pick the table whose cutoff is at or below the Nyquist frequency of the
+ *  output.  The step already includes the playback speed.
+ */
+static INLINE int sinc_band(const ALLEGRO_SAMPLE_INSTANCE *spl)
+{
+   const int step = (spl->step < 0) ? -spl->step : spl->step;
+   int band;
+
+   if (step <= spl->step_denom)
+      return 0;
+
+   band = SINC_BANDS - (int)((int64_t)spl->step_denom * SINC_BANDS / step);
+   return (band < SINC_BANDS - 1) ? band : SINC_BANDS - 1;
+}
+
+
+/* sinc_kernel:
+ *  Build the kernel for the current fractional position.
+ */
+static INLINE void sinc_kernel(const ALLEGRO_SAMPLE_INSTANCE *spl, float *k)
 {
-   /* Clamp to min */
-   val -= min;
-   val &= (~val) >> 31;
-   val += min;
+   const float t = (float)spl->pos_bresenham_error * SINC_PHASES /
+      spl->step_denom;
+   const int ph = (int)t;
+   const float f = t - ph;
+   const int band = sinc_band(spl);
+   const float *h0 = sinc_table[band][ph];
+   const float *h1 = sinc_table[band][ph + 1];
+   int j;
+
+   for (j = 0; j < SINC_TAPS; j++) {
+      k[j] = h0[j] + f * (h1[j] - h0[j]);
+   }
+}
 
-   /* Clamp to max */
-   val -= max;
-   val &= val >> 31;
-   val += max;
 
-   return val;
+/* sinc_dot:
+ *  The inner product of one channel's window with the kernel.
+ */
+static INLINE float sinc_dot(const float *x, const float *k)
+{
+#ifdef ALLEGRO_KCM_SINC_SSE
+   __m128 acc = _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(k));
+   float out[4];
+   int j;
+
+   for (j = 4; j < SINC_TAPS; j += 4) {
+      acc = _mm_add_ps(acc,
+         _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(k + j)));
+   }
+   _mm_storeu_ps(out, acc);
+   return (out[0] + out[1]) + (out[2] + out[3]);
+#else
+   float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+   int j;
+
+   /* Four independent sums, which compilers can readily vectorise. */
+   for (j = 0; j < SINC_TAPS; j += 4) {
+      acc[0] += x[j + 0] * k[j + 0];
+      acc[1] += x[j + 1] * k[j + 1];
+      acc[2] += x[j + 2] * k[j + 2];
+      acc[3] += x[j + 3] * k[j + 3];
+   }
+   return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
 }
 
 
+#include "kcm_mixer_helpers.inc"
+
+
 /* Mix as many sample values as possible from the source sample into a mixer
  * buffer.  Implements stream_reader_t.
  *
@@ -339,12 +550,420 @@ static void NAME(void *source, void **vbuf, unsigned int *samples,            \
 MAKE_MIXER(read_to_mixer_point_float_32, point_spl32, float)
 MAKE_MIXER(read_to_mixer_linear_float_32, linear_spl32, float)
 MAKE_MIXER(read_to_mixer_cubic_float_32, cubic_spl32, float)
+MAKE_MIXER(read_to_mixer_sinc_float_32, sinc_spl32, float)
 MAKE_MIXER(read_to_mixer_point_int16_t_16, point_spl16, int16_t)
 MAKE_MIXER(read_to_mixer_linear_int16_t_16, linear_spl16, int16_t)
 
 #undef MAKE_MIXER
 
 
+/* sample_reader:
+ *  Returns the reader which mixes a sample instance into the mixer,
+ *  resampling with the mixer's quality.
+ */
+static stream_reader_t sample_reader(const ALLEGRO_MIXER *mixer)
+{
+   switch (mixer->ss.spl_data.depth) {
+      case ALLEGRO_AUDIO_DEPTH_FLOAT32:
+         switch (mixer->quality) {
+            case ALLEGRO_MIXER_QUALITY_POINT:
+               return read_to_mixer_point_float_32;
+            case ALLEGRO_MIXER_QUALITY_LINEAR:
+               return read_to_mixer_linear_float_32;
+            case ALLEGRO_MIXER_QUALITY_CUBIC:
+               return read_to_mixer_cubic_float_32;
+            case ALLEGRO_MIXER_QUALITY_SINC:
+               return read_to_mixer_sinc_float_32;
+         }
+         break;
+
+      case ALLEGRO_AUDIO_DEPTH_INT16:
+         switch (mixer->quality) {
+            case ALLEGRO_MIXER_QUALITY_POINT:
+               return read_to_mixer_point_int16_t_16;
+            case ALLEGRO_MIXER_QUALITY_CUBIC:
+            case ALLEGRO_MIXER_QUALITY_SINC:
+               ALLEGRO_WARN("Falling back to linear interpolation\n");
+               /* fallthrough */
+            case ALLEGRO_MIXER_QUALITY_LINEAR:
+               return read_to_mixer_linear_int16_t_16;
+         }
+         break;
+
+      case ALLEGRO_AUDIO_DEPTH_INT8:
+      case ALLEGRO_AUDIO_DEPTH_INT24:
+      case ALLEGRO_AUDIO_DEPTH_UINT8:
+      case ALLEGRO_AUDIO_DEPTH_UINT16:
+      case ALLEGRO_AUDIO_DEPTH_UINT24:
+         /* Unsupported mixer depths. */
+         break;
+   }
+
+   ASSERT(false);
+   return NULL;
+}
+
+
+/* Mix a sample instance from its copy converted to the mixer's format into
+ * a mixer buffer.  Implements stream_reader_t.
+ *
+ * The position is still kept in frames of the original sample, so this
+ * hands over to the resampling reader whenever the instance is not playing
+ * forwards at its normal speed.  While it is, every output frame is the
+ * next converted frame times the channel gain.
+ */
+#define MAKE_CONVERTED_MIXER(NAME, TYPE, FIELD)                               \
+static void NAME(void *source, void **vbuf, unsigned int *samples,            \
+   ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc)                        \
+{                                                                             \
+   ALLEGRO_SAMPLE_INSTANCE *spl = (ALLEGRO_SAMPLE_INSTANCE *)source;          \
+   const _AL_SAMPLE_CONVERSION *conv = spl->converted;                        \
+   const int unit_step = spl->spl_data.frequency;                             \
+   TYPE *buf = *vbuf;                                                         \
+   size_t samples_l = *samples;                                               \
+   float gain[ALLEGRO_MAX_CHANNELS];                                          \
+   size_t c;                                                                  \
+                                                                              \
+   if (!spl->is_playing)                                                      \
+      return;                                                                 \
+                                                                              \
+   for (c = 0; c < dest_maxc; c++)                                            \
+      gain[c] = spl->converted_gain[c];                                       \
+                                                                              \
+   while (conv && samples_l > 0 && spl->step == unit_step) {                  \
+      const TYPE *s;                                                          \
+      uint64_t k, n, i, total;                                                \
+      int limit;                                                              \
+                                                                              \
+      if (!fix_looped_position(spl))                                          \
+         return;                                                              \
+      if (spl->step != unit_step)                                             \
+         break;                                                               \
+                                                                              \
+      limit = (spl->loop == ALLEGRO_PLAYMODE_ONCE) ?                          \
+         spl->spl_data.len : spl->loop_end;                                   \
+      if (spl->pos >= limit)                                                  \
+         break;                                                               \
+                                                                              \
+      /* The converted frame at the current position, and the number of      \
+       * frames until the position reaches the loop end or sample end.       \
+       */                                                                     \
+      k = ((uint64_t)spl->pos * spl->step_denom + spl->pos_bresenham_error)   \
+         / unit_step;                                                         \
+      if (k >= conv->len)                                                     \
+         break;                                                               \
+      n = ((uint64_t)(limit - spl->pos) * spl->step_denom                     \
+         - spl->pos_bresenham_error + unit_step - 1) / unit_step;             \
+      if (n > conv->len - k)                                                  \
+         n = conv->len - k;                                                   \
+      if (n > samples_l)                                                      \
+         n = samples_l;                                                       \
+                                                                              \
+      s = conv->buffer.FIELD + k * dest_maxc;                                 \
+      for (i = 0; i < n; i++) {                                               \
+         for (c = 0; c < dest_maxc; c++) {                                    \
+            *buf++ += *s++ * gain[c];                                         \
+         }                                                                    \
+      }                                                                       \
+                                                                              \
+      total = spl->pos_bresenham_error + n * unit_step;                       \
+      spl->pos += total / spl->step_denom;                                    \
+      spl->pos_bresenham_error = total % spl->step_denom;                     \
+      samples_l -= n;                                                         \
+   }                                                                          \
+                                                                              \
+   if (samples_l > 0 && spl->is_playing) {                                    \
+      void *rest = buf;                                                       \
+      unsigned int rest_samples = samples_l;                                  \
+      spl->converted_fallback(spl, &rest, &rest_samples, buffer_depth,        \
+         dest_maxc);                                                          \
+      return;                                                                 \
+   }                                                                          \
+   fix_looped_position(spl);                                                  \
+}
+
+MAKE_CONVERTED_MIXER(read_converted_to_mixer_float_32, float, f32)
+MAKE_CONVERTED_MIXER(read_converted_to_mixer_int16_t_16, int16_t, s16)
+
+#undef MAKE_CONVERTED_MIXER
+
+
+/* convert_sample:
+ *  Resample and rechannel a sample to the format of a mixer, using the
+ *  same reader as an instance of the sample attached to the mixer would.
+ */
+static _AL_SAMPLE_CONVERSION *convert_sample(const ALLEGRO_SAMPLE *spl,
+   ALLEGRO_MIXER *mixer)
+{
+   const unsigned int frequency = mixer->ss.spl_data.frequency;
+   const ALLEGRO_CHANNEL_CONF chan_conf = mixer->ss.spl_data.chan_conf;
+   const ALLEGRO_AUDIO_DEPTH depth = mixer->ss.spl_data.depth;
+   const size_t src_chans = al_get_channel_count(spl->chan_conf);
+   const size_t dst_chans = al_get_channel_count(chan_conf);
+   float matrix[ALLEGRO_MAX_CHANNELS * ALLEGRO_MAX_CHANNELS];
+   ALLEGRO_SAMPLE_INSTANCE tmp;
+   _AL_SAMPLE_CONVERSION *conv;
+   uint64_t len;
+   unsigned int n;
+   float *mat;
+   void *buf;
+   size_t i, j;
+
+   len = ((uint64_t)spl->len * frequency + spl->frequency - 1)
+      / spl->frequency;
+   if (len == 0 || len > INT_MAX)
+      return NULL;
+
+   conv = al_calloc(1, sizeof(*conv));
+   if (!conv)
+      return NULL;
+   conv->buffer.ptr = al_calloc(len, dst_chans * al_get_audio_depth_size(depth));
+   if (!conv->buffer.ptr) {
+      al_free(conv);
+      return NULL;
+   }
+   conv->frequency = frequency;
+   conv->chan_conf = chan_conf;
+   conv->depth = depth;
+   conv->quality = mixer->quality;
+   conv->source_len = spl->len;
+   conv->len = len;
+
+   /* _al_rechannel_matrix returns a shared buffer which the audio thread
+    * may be using.
+    */
+   maybe_lock_mutex(mixer->ss.mutex);
+   mat = _al_rechannel_matrix(spl->chan_conf, chan_conf, 1.0f,
+      ALLEGRO_AUDIO_PAN_NONE);
+   for (i = 0; i < dst_chans; i++) {
+      for (j = 0; j < src_chans; j++) {
+         matrix[i*src_chans + j] = mat[i*ALLEGRO_MAX_CHANNELS + j];
+      }
+   }
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   memset(&tmp, 0, sizeof(tmp));
+   tmp.spl_data = *spl;
+   tmp.is_playing = true;
+   tmp.loop = ALLEGRO_PLAYMODE_ONCE;
+   tmp.speed = 1.0f;
+   tmp.gain = 1.0f;
+   tmp.pan = ALLEGRO_AUDIO_PAN_NONE;
+   tmp.loop_end = spl->len;
+   tmp.step = spl->frequency;
+   tmp.step_denom = frequency;
+   tmp.matrix = matrix;
+
+   buf = conv->buffer.ptr;
+   n = len;
+   sample_reader(mixer)(&tmp, &buf, &n, depth, dst_chans);
+
+   ALLEGRO_DEBUG("Converted %d frames at %u Hz to %u frames at %u Hz\n",
+      spl->len, spl->frequency, conv->len, frequency);
+
+   return conv;
+}
+
+
+/* _al_kcm_get_sample_conversion:
+ *  Returns the sample data converted to the mixer's format, converting it
+ *  now if it hasn't been converted for this format before.  Returns NULL if
+ *  the sample isn't preconverted, or it already matches the mixer.
+ */
+const _AL_SAMPLE_CONVERSION *_al_kcm_get_sample_conversion(
+   const ALLEGRO_SAMPLE *spl, ALLEGRO_MIXER *mixer)
+{
+   _AL_SAMPLE_CONVERSIONS *conversions = spl->conversions;
+   _AL_SAMPLE_CONVERSION **slot;
+   _AL_SAMPLE_CONVERSION *conv = NULL;
+   unsigned int i;
+
+   if (!conversions || !spl->buffer.ptr || spl->len <= 0)
+      return NULL;
+
+   if (spl->frequency == mixer->ss.spl_data.frequency &&
+         spl->chan_conf == mixer->ss.spl_data.chan_conf &&
+         spl->depth == mixer->ss.spl_data.depth) {
+      return NULL;
+   }
+
+   al_lock_mutex(conversions->mutex);
+
+   for (i = 0; i < _al_vector_size(&conversions->entries); i++) {
+      slot = _al_vector_ref(&conversions->entries, i);
+      if ((*slot)->frequency == mixer->ss.spl_data.frequency &&
+            (*slot)->chan_conf == mixer->ss.spl_data.chan_conf &&
+            (*slot)->depth == mixer->ss.spl_data.depth &&
+            (*slot)->quality == mixer->quality &&
+            (*slot)->source_len == (unsigned int)spl->len) {
+         conv = *slot;
+         break;
+      }
+   }
+
+   if (!conv) {
+      conv = convert_sample(spl, mixer);
+      if (conv) {
+         slot = _al_vector_alloc_back(&conversions->entries);
+         if (slot) {
+            *slot = conv;
+         }
+         else {
+            al_free(conv->buffer.ptr);
+            al_free(conv);
+            conv = NULL;
+         }
+      }
+      if (!conv) {
+         ALLEGRO_WARN("Could not convert sample, resampling it instead\n");
+      }
+   }
+
+   al_unlock_mutex(conversions->mutex);
+
+   return conv;
+}
+
+
+/* _al_kcm_destroy_sample_conversions:
+ *  Free the converted copies of a sample.  No sample instance may be using
+ *  them any more.
+ */
+void _al_kcm_destroy_sample_conversions(_AL_SAMPLE_CONVERSIONS *conversions)
+{
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&conversions->entries); i++) {
+      _AL_SAMPLE_CONVERSION **slot = _al_vector_ref(&conversions->entries, i);
+      al_free((*slot)->buffer.ptr);
+      al_free(*slot);
+   }
+   _al_vector_free(&conversions->entries);
+   al_destroy_mutex(conversions->mutex);
+   al_free(conversions);
+}
+
+
+/* Applies a scheduled change.  Mirrors the al_set_sample_instance_* setters,
+ * but runs on the audio thread with the mixer mutex already held.
+ */
+static void apply_scheduled_change(ALLEGRO_MIXER *mixer,
+   const scheduled_change_t *change)
+{
+   ALLEGRO_SAMPLE_INSTANCE *spl = change->spl;
+
+   switch (change->type) {
+      case SCHEDULED_PLAYING:
+         spl->is_playing = (change->value != 0.0f);
+         if (!spl->is_playing)
+            spl->pos = 0;
+         break;
+
+      case SCHEDULED_GAIN:
+         spl->gain = change->value;
+         _al_kcm_mixer_rejig_sample_matrix(mixer, spl);
+         break;
+
+      case SCHEDULED_PAN:
+         spl->pan = change->value;
+         _al_kcm_mixer_rejig_sample_matrix(mixer, spl);
+         break;
+
+      case SCHEDULED_SPEED:
+         spl->speed = change->value;
+         spl->step = (spl->spl_data.frequency) * spl->speed;
+         spl->step_denom = mixer->ss.spl_data.frequency;
+         /* Don't want to be trapped with a step value of 0. */
+         if (spl->step == 0) {
+            if (spl->speed > 0.0f)
+               spl->step = 1;
+            else
+               spl->step = -1;
+         }
+         break;
+   }
+}
+
+
+/* Applies all changes scheduled at or before the given frame, and returns
+ * the frame of the next pending change (or UINT64_MAX if there is none).
+ */
+static uint64_t apply_due_changes(ALLEGRO_MIXER *mixer, uint64_t frame)
+{
+   while (!_al_vector_is_empty(&mixer->scheduled)) {
+      scheduled_change_t *change = _al_vector_ref_front(&mixer->scheduled);
+      if (change->frame > frame)
+         return change->frame;
+      apply_scheduled_change(mixer, change);
+      _al_vector_delete_at(&mixer->scheduled, 0);
+   }
+
+   return UINT64_MAX;
+}
+
+
+/* _al_kcm_mixer_schedule:
+ *  Queues a change to a sample instance attached to a mixer, to be applied
+ *  when the mixer reaches the given frame.  Changes for the same frame are
+ *  applied in the order they were scheduled.
+ */
+bool _al_kcm_mixer_schedule(ALLEGRO_SAMPLE_INSTANCE *spl,
+   scheduled_change_type_t type, float value, uint64_t frame)
+{
+   ALLEGRO_MIXER *mixer;
+   scheduled_change_t *change;
+   int i;
+
+   if (!spl->parent.u.ptr || spl->parent.is_voice) {
+      _al_set_error(ALLEGRO_INVALID_OBJECT,
+         "Only sample instances attached to a mixer can be scheduled");
+      return false;
+   }
+   mixer = spl->parent.u.mixer;
+
+   maybe_lock_mutex(mixer->ss.mutex);
+
+   for (i = _al_vector_size(&mixer->scheduled); i > 0; i--) {
+      scheduled_change_t *prev = _al_vector_ref(&mixer->scheduled, i - 1);
+      if (prev->frame <= frame)
+         break;
+   }
+
+   change = _al_vector_alloc_mid(&mixer->scheduled, i);
+   if (!change) {
+      maybe_unlock_mutex(mixer->ss.mutex);
+      _al_set_error(ALLEGRO_GENERIC_ERROR,
+         "Out of memory allocating scheduled change");
+      return false;
+   }
+   change->frame = frame;
+   change->spl = spl;
+   change->type = type;
+   change->value = value;
+
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   return true;
+}
+
+
+/* _al_kcm_mixer_unschedule:
+ *  Drops all pending changes for the sample instance.  The mixer mutex must
+ *  be held.
+ */
+void _al_kcm_mixer_unschedule(ALLEGRO_MIXER *mixer,
+   ALLEGRO_SAMPLE_INSTANCE *spl)
+{
+   int i;
+
+   for (i = _al_vector_size(&mixer->scheduled) - 1; i >= 0; i--) {
+      scheduled_change_t *change = _al_vector_ref(&mixer->scheduled, i);
+      if (change->spl == spl)
+         _al_vector_delete_at(&mixer->scheduled, i);
+   }
+}
+
+
 /* _al_kcm_mixer_read:
  *  Mixes the streams attached to the mixer and writes additively to the
  *  specified buffer (or if *buf is NULL, indicating a voice, convert it and
@@ -357,6 +976,8 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
    ALLEGRO_MIXER *m = (ALLEGRO_MIXER *)source;
    int maxc = al_get_channel_count(m->ss.spl_data.chan_conf);
    int samples_l = *samples;
+   unsigned int pos;
+   uint32_t *dither;
    int i;
 
    if (!m->ss.is_playing)
@@ -380,14 +1001,28 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
    /* Clear the buffer to silence. */
    memset(mixer->ss.spl_data.buffer.ptr, 0, samples_l * maxc * al_get_audio_depth_size(mixer->ss.spl_data.depth));
 
-   /* Mix the streams into the mixer buffer. */
-   for (i = _al_vector_size(&mixer->streams) - 1; i >= 0; i--) {
-      ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&mixer->streams, i);
-      ALLEGRO_SAMPLE_INSTANCE *spl = *slot;
-      ASSERT(spl->spl_read);
-      spl->spl_read(spl, (void **) &mixer->ss.spl_data.buffer.ptr, samples,
-         m->ss.spl_data.depth, maxc);
+   /* Mix the streams into the mixer buffer.  The block is split wherever a
+    * scheduled change falls, so that it takes effect on the exact frame.
+    */
+   for (pos = 0; pos < *samples; ) {
+      uint64_t next = apply_due_changes(m, m->played_samples + pos);
+      unsigned int n = *samples - pos;
+      void *p = (char *)mixer->ss.spl_data.buffer.ptr +
+         pos * maxc * al_get_audio_depth_size(mixer->ss.spl_data.depth);
+
+      if (next - m->played_samples < *samples)
+         n = (unsigned int)(next - m->played_samples) - pos;
+
+      for (i = _al_vector_size(&mixer->streams) - 1; i >= 0; i--) {
+         ALLEGRO_SAMPLE_INSTANCE **slot = _al_vector_ref(&mixer->streams, i);
+         ALLEGRO_SAMPLE_INSTANCE *spl = *slot;
+         ASSERT(spl->spl_read);
+         spl->spl_read(spl, &p, &n, m->ss.spl_data.depth, maxc);
+      }
+
+      pos += n;
    }
+   m->played_samples += *samples;
 
    /* Call the post-processing callback. */
    if (mixer->postprocess_callback) {
@@ -403,13 +1038,10 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
       unsigned long i = samples_l;
 
       switch (m->ss.spl_data.depth) {
-         case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
-            float *p = mixer->ss.spl_data.buffer.f32;
-            while (i-- > 0) {
-               *p++ *= mixer_gain;
-            }
+         case ALLEGRO_AUDIO_DEPTH_FLOAT32:
+            _al_kcm_dsp.gain_f32(mixer->ss.spl_data.buffer.f32, i,
+               mixer_gain);
             break;
-         }
 
          case ALLEGRO_AUDIO_DEPTH_INT16: {
             int16_t *p = mixer->ss.spl_data.buffer.s16;
@@ -435,32 +1067,16 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
     */
    if (*buf) {
       switch (m->ss.spl_data.depth) {
-         case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
+         case ALLEGRO_AUDIO_DEPTH_FLOAT32:
             /* We don't need to clamp in the mixer yet. */
-            float *lbuf = *buf;
-            float *src = mixer->ss.spl_data.buffer.f32;
-            while (samples_l-- > 0) {
-               *lbuf += *src;
-               lbuf++;
-               src++;
-            }
+            _al_kcm_dsp.add_f32(*buf, mixer->ss.spl_data.buffer.f32,
+               samples_l);
             break;
 
-         case ALLEGRO_AUDIO_DEPTH_INT16: {
-            int16_t *lbuf = *buf;
-            int16_t *src = mixer->ss.spl_data.buffer.s16;
-            while (samples_l-- > 0) {
-               int32_t x = *lbuf + *src;
-               if (x < -32768)
-                  x = -32768;
-               else if (x > 32767)
-                  x = 32767;
-               *lbuf = (int16_t)x;
-               lbuf++;
-               src++;
-            }
+         case ALLEGRO_AUDIO_DEPTH_INT16:
+            _al_kcm_dsp.add_s16(*buf, mixer->ss.spl_data.buffer.s16,
+               samples_l);
             break;
-         }
 
          case ALLEGRO_AUDIO_DEPTH_INT8:
          case ALLEGRO_AUDIO_DEPTH_INT24:
@@ -470,7 +1086,6 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
             /* Unsupported mixer depths. */
             ASSERT(false);
             break;
-         }
       }
       return;
    }
@@ -479,6 +1094,7 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
     * Clamp and convert the mixed data for the voice.
     */
    *buf = mixer->ss.spl_data.buffer.ptr;
+   dither = mixer->dither ? m->dither_state : NULL;
    switch (buffer_depth & ~ALLEGRO_AUDIO_DEPTH_UNSIGNED) {
 
       case ALLEGRO_AUDIO_DEPTH_FLOAT32:
@@ -490,16 +1106,8 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
             case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
                int32_t off = ((buffer_depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED)
                               ? 0x800000 : 0);
-               int32_t *lbuf = mixer->ss.spl_data.buffer.s24;
-               float *src = mixer->ss.spl_data.buffer.f32;
-
-               while (samples_l > 0) {
-                  *lbuf = clamp(*(src++) * ((float)0x7FFFFF + 0.5f),
-                     ~0x7FFFFF, 0x7FFFFF);
-                  *lbuf += off;
-                  lbuf++;
-                  samples_l--;
-               }
+               _al_kcm_dsp.f32_to_s24(mixer->ss.spl_data.buffer.s24,
+                  mixer->ss.spl_data.buffer.f32, samples_l, off, dither);
                break;
             }
 
@@ -524,15 +1132,8 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
             case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
                int16_t off = ((buffer_depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED)
                               ? 0x8000 : 0);
-               int16_t *lbuf = mixer->ss.spl_data.buffer.s16;
-               float *src = mixer->ss.spl_data.buffer.f32;
-
-               while (samples_l > 0) {
-                  *lbuf = clamp(*(src++) * ((float)0x7FFF + 0.5f), ~0x7FFF, 0x7FFF);
-                  *lbuf += off;
-                  lbuf++;
-                  samples_l--;
-               }
+               _al_kcm_dsp.f32_to_s16(mixer->ss.spl_data.buffer.s16,
+                  mixer->ss.spl_data.buffer.f32, samples_l, off, dither);
                break;
             }
 
@@ -564,15 +1165,8 @@ void _al_kcm_mixer_read(void *source, void **buf, unsigned int *samples,
             case ALLEGRO_AUDIO_DEPTH_FLOAT32: {
                int8_t off = ((buffer_depth & ALLEGRO_AUDIO_DEPTH_UNSIGNED)
                               ? 0x80 : 0);
-               int8_t *lbuf = mixer->ss.spl_data.buffer.s8;
-               float *src = mixer->ss.spl_data.buffer.f32;
-
-               while (samples_l > 0) {
-                  *lbuf = clamp(*(src++) * ((float)0x7F + 0.5f), ~0x7F, 0x7F);
-                  *lbuf += off;
-                  lbuf++;
-                  samples_l--;
-               }
+               _al_kcm_dsp.f32_to_s8(mixer->ss.spl_data.buffer.s8,
+                  mixer->ss.spl_data.buffer.f32, samples_l, off, dither);
                break;
             }
 
@@ -612,6 +1206,7 @@ ALLEGRO_MIXER *al_create_mixer(unsigned int freq,
    ALLEGRO_MIXER *mixer;
    ALLEGRO_CONFIG *config;
    int default_mixer_quality = ALLEGRO_MIXER_QUALITY_LINEAR;
+   bool dither = false;
 
    /* XXX this is in the wrong place */
    config = al_get_system_config();
@@ -631,6 +1226,14 @@ ALLEGRO_MIXER *al_create_mixer(unsigned int freq,
             ALLEGRO_INFO("Cubic interpolation\n");
             default_mixer_quality = ALLEGRO_MIXER_QUALITY_CUBIC;
          }
+         else if (!_al_stricmp(p, "sinc")) {
+            ALLEGRO_INFO("Windowed-sinc interpolation\n");
+            default_mixer_quality = ALLEGRO_MIXER_QUALITY_SINC;
+         }
+      }
+      p = al_get_config_value(config, "audio", "dither");
+      if (p && !strcmp(p, "yes")) {
+         dither = true;
       }
    }
 
@@ -667,8 +1270,14 @@ ALLEGRO_MIXER *al_create_mixer(unsigned int freq,
    mixer->ss.spl_read = NULL;
 
    mixer->quality = default_mixer_quality;
+   if (mixer->quality == ALLEGRO_MIXER_QUALITY_SINC)
+      init_sinc_table();
+
+   mixer->dither = dither;
+   _al_kcm_init_dither(mixer->dither_state);
 
    _al_vector_init(&mixer->streams, sizeof(ALLEGRO_SAMPLE_INSTANCE *));
+   _al_vector_init(&mixer->scheduled, sizeof(scheduled_change_t));
 
    _al_kcm_register_destructor(mixer, (void (*)(void *)) al_destroy_mixer);
 
@@ -694,6 +1303,7 @@ bool al_attach_sample_instance_to_mixer(ALLEGRO_SAMPLE_INSTANCE *spl,
    ALLEGRO_MIXER *mixer)
 {
    ALLEGRO_SAMPLE_INSTANCE **slot;
+   const _AL_SAMPLE_CONVERSION *converted = NULL;
 
    ASSERT(mixer);
    ASSERT(spl);
@@ -705,6 +1315,13 @@ bool al_attach_sample_instance_to_mixer(ALLEGRO_SAMPLE_INSTANCE *spl,
       return false;
    }
 
+   /* Converting may take a while, so do it before locking out the audio
+    * thread.
+    */
+   if (!spl->is_mixer) {
+      converted = _al_kcm_get_sample_conversion(&spl->spl_data, mixer);
+   }
+
    maybe_lock_mutex(mixer->ss.mutex);
    
    _al_kcm_stream_set_mutex(spl, mixer->ss.mutex);
@@ -736,44 +1353,14 @@ bool al_attach_sample_instance_to_mixer(ALLEGRO_SAMPLE_INSTANCE *spl,
       spl->spl_read = _al_kcm_mixer_read;
    }
    else {
-      switch (mixer->ss.spl_data.depth) {
-         case ALLEGRO_AUDIO_DEPTH_FLOAT32:
-            switch (mixer->quality) {
-               case ALLEGRO_MIXER_QUALITY_POINT:
-                  spl->spl_read = read_to_mixer_point_float_32;
-                  break;
-               case ALLEGRO_MIXER_QUALITY_LINEAR:
-                  spl->spl_read = read_to_mixer_linear_float_32;
-                  break;
-               case ALLEGRO_MIXER_QUALITY_CUBIC:
-                  spl->spl_read = read_to_mixer_cubic_float_32;
-                  break;
-            }
-            break;
-
-         case ALLEGRO_AUDIO_DEPTH_INT16:
-            switch (mixer->quality) {
-               case ALLEGRO_MIXER_QUALITY_POINT:
-                  spl->spl_read = read_to_mixer_point_int16_t_16;
-                  break;
-               case ALLEGRO_MIXER_QUALITY_CUBIC:
-                  ALLEGRO_WARN("Falling back to linear interpolation\n");
-                  /* fallthrough */
-               case ALLEGRO_MIXER_QUALITY_LINEAR:
-                  spl->spl_read = read_to_mixer_linear_int16_t_16;
-                  break;
-            }
-            break;
-
-         case ALLEGRO_AUDIO_DEPTH_INT8:
-         case ALLEGRO_AUDIO_DEPTH_INT24:
-         case ALLEGRO_AUDIO_DEPTH_UINT8:
-         case ALLEGRO_AUDIO_DEPTH_UINT16:
-         case ALLEGRO_AUDIO_DEPTH_UINT24:
-            /* Unsupported mixer depths. */
-            ASSERT(false);
-            break;
-      }
+      spl->converted = converted;
+      spl->converted_fallback = sample_reader(mixer);
+      if (!converted)
+         spl->spl_read = spl->converted_fallback;
+      else if (mixer->ss.spl_data.depth == ALLEGRO_AUDIO_DEPTH_INT16)
+         spl->spl_read = read_converted_to_mixer_int16_t_16;
+      else
+         spl->spl_read = read_converted_to_mixer_float_32;
 
       _al_kcm_mixer_rejig_sample_matrix(mixer, spl);
    }
@@ -851,6 +1438,21 @@ unsigned int al_get_mixer_frequency(const ALLEGRO_MIXER *mixer)
 }
 
 
+/* Function: al_get_mixer_played_samples
+ */
+uint64_t al_get_mixer_played_samples(const ALLEGRO_MIXER *mixer)
+{
+   uint64_t result;
+   ASSERT(mixer);
+
+   maybe_lock_mutex(mixer->ss.mutex);
+   result = mixer->played_samples;
+   maybe_unlock_mutex(mixer->ss.mutex);
+
+   return result;
+}
+
+
 /* Function: al_get_mixer_channels
  */
 ALLEGRO_CHANNEL_CONF al_get_mixer_channels(const ALLEGRO_MIXER *mixer)
@@ -944,6 +1546,8 @@ bool al_set_mixer_quality(ALLEGRO_MIXER *mixer, ALLEGRO_MIXER_QUALITY new_qualit
       ret = true;
    }
    else if (_al_vector_size(&mixer->streams) == 0) {
+      if (new_quality == ALLEGRO_MIXER_QUALITY_SINC)
+         init_sinc_table();
       mixer->quality = new_quality;
       ret = true;
    }
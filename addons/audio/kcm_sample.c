@@ -123,6 +123,19 @@ Error:
 }
 
 
+/* Whether new samples should be preconverted, see al_set_sample_preconvert. */
+static bool preconvert_by_default(void)
+{
+   ALLEGRO_CONFIG *config = al_get_system_config();
+   const char *p;
+
+   if (!config)
+      return false;
+   p = al_get_config_value(config, "audio", "preconvert_samples");
+   return p && !strcmp(p, "yes");
+}
+
+
 /* Function: al_create_sample
  */
 ALLEGRO_SAMPLE *al_create_sample(void *buf, unsigned int samples,
@@ -152,6 +165,10 @@ ALLEGRO_SAMPLE *al_create_sample(void *buf, unsigned int samples,
    spl->buffer.ptr = buf;
    spl->free_buf = free_buf;
 
+   if (preconvert_by_default()) {
+      al_set_sample_preconvert(spl, true);
+   }
+
    _al_kcm_register_destructor(spl, (void (*)(void *)) al_destroy_sample);
 
    return spl;
@@ -176,13 +193,63 @@ static void stop_sample_instances_helper(void *object, void (*func)(void *),
 }
 
 
+/* Stop any sample instances which use a lazily loaded sample which is about
+ * to be destroyed, and make them drop the decoded data.
+ */
+static void release_sample_instances_helper(void *object, void (*func)(void *),
+   void *userdata)
+{
+   ALLEGRO_SAMPLE_INSTANCE *splinst = object;
+
+   if (func == (void (*)(void *)) al_destroy_sample_instance
+      && splinst->spl_data.backing == userdata)
+   {
+      al_stop_sample_instance(splinst);
+      _al_kcm_release_sample_data(&splinst->spl_data);
+      splinst->spl_data.backing = NULL;
+      splinst->spl_data.buffer.ptr = NULL;
+   }
+}
+
+
+/* Make sample instances which share the conversions of a sample forget
+ * about them, as they are about to be destroyed.
+ */
+static void forget_conversions_helper(void *object, void (*func)(void *),
+   void *userdata)
+{
+   ALLEGRO_SAMPLE_INSTANCE *splinst = object;
+
+   if (func == (void (*)(void *)) al_destroy_sample_instance
+      && splinst->spl_data.conversions == userdata)
+   {
+      if (splinst->mutex)
+         al_lock_mutex(splinst->mutex);
+      splinst->converted = NULL;
+      splinst->spl_data.conversions = NULL;
+      if (splinst->mutex)
+         al_unlock_mutex(splinst->mutex);
+   }
+}
+
+
 /* Function: al_destroy_sample
  */
 void al_destroy_sample(ALLEGRO_SAMPLE *spl)
 {
    if (spl) {
+      if (spl->is_cached && !_al_kcm_uncache_sample(spl)) {
+         return;
+      }
+      if (spl->backing) {
+         _al_kcm_foreach_destructor(release_sample_instances_helper,
+            spl->backing);
+         _al_kcm_destroy_sample_backing(spl->backing);
+         spl->backing = NULL;
+      }
       _al_kcm_foreach_destructor(stop_sample_instances_helper,
          al_get_sample_data(spl));
+      al_set_sample_preconvert(spl, false);
       _al_kcm_unregister_destructor(spl);
 
       if (spl->free_buf && spl->buffer.ptr) {
@@ -456,6 +523,54 @@ void *al_get_sample_data(const ALLEGRO_SAMPLE *spl)
 }
 
 
+/* Function: al_get_sample_preconvert
+ */
+bool al_get_sample_preconvert(const ALLEGRO_SAMPLE *spl)
+{
+   ASSERT(spl);
+
+   return spl->conversions != NULL;
+}
+
+
+/* Function: al_set_sample_preconvert
+ */
+bool al_set_sample_preconvert(ALLEGRO_SAMPLE *spl, bool preconvert)
+{
+   _AL_SAMPLE_CONVERSIONS *conversions;
+   ASSERT(spl);
+
+   if (preconvert) {
+      if (spl->conversions)
+         return true;
+
+      conversions = al_calloc(1, sizeof(*conversions));
+      if (!conversions) {
+         _al_set_error(ALLEGRO_GENERIC_ERROR,
+            "Out of memory allocating sample conversions");
+         return false;
+      }
+      conversions->mutex = al_create_mutex();
+      if (!conversions->mutex) {
+         al_free(conversions);
+         _al_set_error(ALLEGRO_GENERIC_ERROR,
+            "Could not create sample conversions mutex");
+         return false;
+      }
+      _al_vector_init(&conversions->entries, sizeof(_AL_SAMPLE_CONVERSION *));
+      spl->conversions = conversions;
+      return true;
+   }
+
+   if (spl->conversions) {
+      _al_kcm_foreach_destructor(forget_conversions_helper, spl->conversions);
+      _al_kcm_destroy_sample_conversions(spl->conversions);
+      spl->conversions = NULL;
+   }
+   return true;
+}
+
+
 /* Destroy all sample instances, and frees the associated vectors. */
 static void free_sample_vector(void)
 {
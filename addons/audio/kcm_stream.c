@@ -17,11 +17,11 @@
 ALLEGRO_DEBUG_CHANNEL("audio")
 
 /*
- * The highest quality interpolator is a cubic interpolator requiring
- * four sample points.  In the streaming case we lag the true sample
- * position by three.
+ * The highest quality interpolator is a windowed-sinc interpolator requiring
+ * sixteen sample points.  In the streaming case it needs the fifteen sample
+ * values which came before the true sample position.
  */
-#define MAX_LAG   (3)
+#define MAX_LAG   (15)
 
 
 static void maybe_lock_mutex(ALLEGRO_MUTEX *mutex)
@@ -141,7 +141,7 @@ ALLEGRO_AUDIO_STREAM *al_create_audio_stream(size_t fragment_count,
 void al_destroy_audio_stream(ALLEGRO_AUDIO_STREAM *stream)
 {
    if (stream) {
-      if (stream->feed_thread) {
+      if (stream->is_fed) {
          stream->unload_feeder(stream);
       }
       /* See commented out call to _al_kcm_register_destructor. */
@@ -657,92 +657,260 @@ bool _al_kcm_refill_stream(ALLEGRO_AUDIO_STREAM *stream)
 }
 
 
-/* _al_kcm_feed_stream:
- * A routine running in another thread that feeds the stream buffers as
- * neccesary, usually getting data from some file reader backend.
+/*
+ * Streams created by the acodec loaders are all fed by one shared thread,
+ * rather than by a thread each.  Fragment events from every registered stream
+ * arrive on a single queue; each stream counts its outstanding requests and
+ * the thread always refills the stream which will run out of queued audio
+ * first.
  */
-void *_al_kcm_feed_stream(ALLEGRO_THREAD *self, void *vstream)
+static ALLEGRO_MUTEX *feeder_mutex = NULL;
+static ALLEGRO_COND *feeder_cond = NULL;
+static ALLEGRO_THREAD *feeder_thread = NULL;
+static ALLEGRO_EVENT_QUEUE *feeder_queue = NULL;
+static ALLEGRO_EVENT_SOURCE feeder_quit_es;
+static _AL_VECTOR feeder_streams = _AL_VECTOR_INITIALIZER(ALLEGRO_AUDIO_STREAM *);
+static ALLEGRO_AUDIO_STREAM *feeder_current = NULL;
+static bool feeder_quit = false;
+
+
+static void emit_stream_finished(ALLEGRO_AUDIO_STREAM *stream)
 {
-   ALLEGRO_AUDIO_STREAM *stream = vstream;
-   ALLEGRO_EVENT_QUEUE *queue;
    ALLEGRO_EVENT event;
-   (void)self;
 
-   ALLEGRO_DEBUG("Stream feeder thread started.\n");
+   stream->feed_finished = true;
 
-   queue = al_create_event_queue();
-   al_register_event_source(queue, &stream->spl.es);
+   event.user.type = ALLEGRO_EVENT_AUDIO_STREAM_FINISHED;
+   event.user.timestamp = al_get_time();
+   al_emit_user_event(&stream->spl.es, &event, NULL);
+}
 
-   al_lock_mutex(stream->feed_thread_started_mutex);
-   stream->feed_thread_started = true;
-   al_broadcast_cond(stream->feed_thread_started_cond);
-   al_unlock_mutex(stream->feed_thread_started_mutex);
 
-   stream->quit_feed_thread = false;
+/* Turn fragment events waiting in the feeder queue into requests on the
+ * streams which emitted them.  Called with feeder_mutex held.
+ */
+static void collect_feed_requests(void)
+{
+   ALLEGRO_EVENT event;
 
-   while (!stream->quit_feed_thread) {
-      char *fragment;
-      ALLEGRO_EVENT event;
+   while (al_get_next_event(feeder_queue, &event)) {
+      ALLEGRO_AUDIO_STREAM *stream;
 
-      al_wait_for_event(queue, &event);
+      if (event.type != ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT)
+         continue;
 
-      if (event.type == ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT
-          && !stream->is_draining) {
-         unsigned long bytes;
-         unsigned long bytes_written;
+      /* The event source is the first member of the stream. */
+      stream = (ALLEGRO_AUDIO_STREAM *)event.any.source;
+      if (_al_vector_contains(&feeder_streams, &stream))
+         stream->feed_requests++;
+   }
+}
 
-         fragment = al_get_audio_stream_fragment(stream);
-         if (!fragment) {
-            /* This is not an error. */
-            continue;
-         }
 
-         bytes = (stream->spl.spl_data.len) *
-               al_get_channel_count(stream->spl.spl_data.chan_conf) *
-               al_get_audio_depth_size(stream->spl.spl_data.depth);
+/* Return the number of seconds of audio queued for the mixer, i.e. how long
+ * until the stream underruns.  This is only a scheduling hint, so the pending
+ * buffers are read without locking the stream.
+ */
+static double stream_deadline(const ALLEGRO_AUDIO_STREAM *stream)
+{
+   double rate = stream->spl.spl_data.frequency;
+   size_t i;
 
-         maybe_lock_mutex(stream->spl.mutex);
-         bytes_written = stream->feeder(stream, fragment, bytes);
-         maybe_unlock_mutex(stream->spl.mutex);
+   for (i = 0; i < stream->buf_count; i++) {
+      if (!stream->pending_bufs[i])
+         break;
+   }
+
+   if (stream->spl.speed > 0.0f)
+      rate *= stream->spl.speed;
+
+   return (double)i * stream->spl.spl_data.len / rate;
+}
+
+
+/* Pick the stream with a pending request which is closest to underrunning.
+ * Called with feeder_mutex held.
+ */
+static ALLEGRO_AUDIO_STREAM *most_urgent_stream(void)
+{
+   ALLEGRO_AUDIO_STREAM *best = NULL;
+   double best_deadline = 0.0;
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&feeder_streams); i++) {
+      ALLEGRO_AUDIO_STREAM **slot = _al_vector_ref(&feeder_streams, i);
+      ALLEGRO_AUDIO_STREAM *stream = *slot;
+      double deadline;
+
+      if (!stream->feed_requests)
+         continue;
 
-        /* In case it reaches the end of the stream source, stream feeder will
-         * fill the remaining space with silence. If we should loop, rewind the
-         * stream and override the silence with the beginning.
-         * In extreme cases we need to repeat it multiple times.
-         */
-         while (bytes_written < bytes &&
-                  stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
-            size_t bw;
-            al_rewind_audio_stream(stream);
-            maybe_lock_mutex(stream->spl.mutex);
-            bw = stream->feeder(stream, fragment + bytes_written,
-               bytes - bytes_written);
-            bytes_written += bw;
-            maybe_unlock_mutex(stream->spl.mutex);
-         }
-
-         if (!al_set_audio_stream_fragment(stream, fragment)) {
-            ALLEGRO_ERROR("Error setting stream buffer.\n");
-            continue;
-         }
-
-         /* The streaming source doesn't feed any more, drain buffers and quit. */
-         if (bytes_written != bytes &&
-            stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONCE) {
-            al_drain_audio_stream(stream);
-            stream->quit_feed_thread = true;
-         }
+      if (stream->feed_draining || stream->feed_finished
+            || stream->is_draining) {
+         stream->feed_requests = 0;
+         continue;
       }
-      else if (event.type == _KCM_STREAM_FEEDER_QUIT_EVENT_TYPE) {
-         stream->quit_feed_thread = true;
+
+      deadline = stream_deadline(stream);
+      if (!best || deadline < best_deadline) {
+         best = stream;
+         best_deadline = deadline;
       }
    }
-   
-   event.user.type = ALLEGRO_EVENT_AUDIO_STREAM_FINISHED;
-   event.user.timestamp = al_get_time();
-   al_emit_user_event(&stream->spl.es, &event, NULL);
 
-   al_destroy_event_queue(queue);
+   return best;
+}
+
+
+/* Refill one fragment of the stream.  Returns true if the streaming source
+ * has run out of data and the stream should be drained.
+ */
+static bool feed_fragment(ALLEGRO_AUDIO_STREAM *stream)
+{
+   char *fragment;
+   unsigned long bytes;
+   unsigned long bytes_written;
+
+   fragment = al_get_audio_stream_fragment(stream);
+   if (!fragment) {
+      /* This is not an error. */
+      return false;
+   }
+
+   bytes = (stream->spl.spl_data.len) *
+         al_get_channel_count(stream->spl.spl_data.chan_conf) *
+         al_get_audio_depth_size(stream->spl.spl_data.depth);
+
+   maybe_lock_mutex(stream->spl.mutex);
+   bytes_written = stream->feeder(stream, fragment, bytes);
+   maybe_unlock_mutex(stream->spl.mutex);
+
+   /* In case it reaches the end of the stream source, stream feeder will
+    * fill the remaining space with silence. If we should loop, rewind the
+    * stream and override the silence with the beginning.
+    * In extreme cases we need to repeat it multiple times.
+    */
+   while (bytes_written < bytes &&
+            stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONEDIR) {
+      size_t bw;
+      al_rewind_audio_stream(stream);
+      maybe_lock_mutex(stream->spl.mutex);
+      bw = stream->feeder(stream, fragment + bytes_written,
+         bytes - bytes_written);
+      bytes_written += bw;
+      maybe_unlock_mutex(stream->spl.mutex);
+   }
+
+   if (!al_set_audio_stream_fragment(stream, fragment)) {
+      ALLEGRO_ERROR("Error setting stream buffer.\n");
+      return false;
+   }
+
+   return (bytes_written != bytes &&
+      stream->spl.loop == _ALLEGRO_PLAYMODE_STREAM_ONCE);
+}
+
+
+/* Start draining a stream whose source has run out, without blocking the
+ * other streams as al_drain_audio_stream would.  Called with feeder_mutex
+ * held.
+ */
+static void start_draining(ALLEGRO_AUDIO_STREAM *stream)
+{
+   if (!al_get_audio_stream_attached(stream)) {
+      al_set_audio_stream_playing(stream, false);
+      emit_stream_finished(stream);
+      return;
+   }
+
+   stream->is_draining = true;
+   stream->feed_draining = true;
+}
+
+
+/* Emit the finished event for drained streams which have stopped playing.
+ * Returns true if any stream is still draining.  Called with feeder_mutex
+ * held.
+ */
+static bool check_draining_streams(void)
+{
+   bool draining = false;
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&feeder_streams); i++) {
+      ALLEGRO_AUDIO_STREAM **slot = _al_vector_ref(&feeder_streams, i);
+      ALLEGRO_AUDIO_STREAM *stream = *slot;
+
+      if (!stream->feed_draining)
+         continue;
+
+      if (al_get_audio_stream_playing(stream)) {
+         draining = true;
+         continue;
+      }
+
+      stream->is_draining = false;
+      stream->feed_draining = false;
+      emit_stream_finished(stream);
+   }
+
+   return draining;
+}
+
+
+/* feed_streams:
+ * A routine running in another thread that feeds the buffers of every
+ * registered stream as neccesary, usually getting data from some file reader
+ * backend.
+ */
+static void *feed_streams(ALLEGRO_THREAD *self, void *unused)
+{
+   (void)self;
+   (void)unused;
+
+   ALLEGRO_DEBUG("Stream feeder thread started.\n");
+
+   al_lock_mutex(feeder_mutex);
+
+   while (!feeder_quit) {
+      ALLEGRO_AUDIO_STREAM *stream;
+      bool draining;
+
+      collect_feed_requests();
+
+      stream = most_urgent_stream();
+      if (stream) {
+         bool exhausted;
+
+         stream->feed_requests--;
+         feeder_current = stream;
+         al_unlock_mutex(feeder_mutex);
+
+         exhausted = feed_fragment(stream);
+
+         al_lock_mutex(feeder_mutex);
+         feeder_current = NULL;
+         al_broadcast_cond(feeder_cond);
+
+         if (exhausted)
+            start_draining(stream);
+         continue;
+      }
+
+      draining = check_draining_streams();
+
+      /* Wait for the next event but leave it in the queue, so it is picked
+       * up by collect_feed_requests.  Poll while any stream is draining.
+       */
+      al_unlock_mutex(feeder_mutex);
+      if (draining)
+         al_wait_for_event_timed(feeder_queue, NULL, 0.01);
+      else
+         al_wait_for_event(feeder_queue, NULL);
+      al_lock_mutex(feeder_mutex);
+   }
+
+   al_unlock_mutex(feeder_mutex);
 
    ALLEGRO_DEBUG("Stream feeder thread finished.\n");
 
@@ -750,6 +918,125 @@ void *_al_kcm_feed_stream(ALLEGRO_THREAD *self, void *vstream)
 }
 
 
+/* _al_kcm_init_stream_feeder:
+ *  Create the mutex guarding the shared stream feeder.
+ */
+void _al_kcm_init_stream_feeder(void)
+{
+   if (!feeder_mutex) {
+      feeder_mutex = al_create_mutex();
+      feeder_cond = al_create_cond();
+   }
+}
+
+
+/* _al_kcm_shutdown_stream_feeder:
+ *  Stop the shared stream feeder thread.  Streams still being fed keep it
+ *  running.
+ */
+void _al_kcm_shutdown_stream_feeder(void)
+{
+   ALLEGRO_EVENT quit_event;
+
+   if (!feeder_mutex)
+      return;
+
+   al_lock_mutex(feeder_mutex);
+   if (!_al_vector_is_empty(&feeder_streams)) {
+      ALLEGRO_WARN("%u audio streams are still being fed.\n",
+         (unsigned)_al_vector_size(&feeder_streams));
+      al_unlock_mutex(feeder_mutex);
+      return;
+   }
+   feeder_quit = true;
+   al_unlock_mutex(feeder_mutex);
+
+   if (feeder_thread) {
+      quit_event.user.type = _KCM_STREAM_FEEDER_QUIT_EVENT_TYPE;
+      al_emit_user_event(&feeder_quit_es, &quit_event, NULL);
+      al_join_thread(feeder_thread, NULL);
+      al_destroy_thread(feeder_thread);
+      al_destroy_event_queue(feeder_queue);
+      al_destroy_user_event_source(&feeder_quit_es);
+      feeder_thread = NULL;
+      feeder_queue = NULL;
+   }
+
+   _al_vector_free(&feeder_streams);
+   al_destroy_cond(feeder_cond);
+   al_destroy_mutex(feeder_mutex);
+   feeder_cond = NULL;
+   feeder_mutex = NULL;
+   feeder_quit = false;
+}
+
+
+/* _al_kcm_start_feeding_stream:
+ *  Register a stream with the shared feeder thread, starting the thread if
+ *  necessary.  The stream's feeder callbacks must already be set.
+ */
+void _al_kcm_start_feeding_stream(ALLEGRO_AUDIO_STREAM *stream)
+{
+   ALLEGRO_AUDIO_STREAM **slot;
+
+   ASSERT(stream);
+   ASSERT(stream->feeder);
+
+   _al_kcm_init_stream_feeder();
+
+   al_lock_mutex(feeder_mutex);
+
+   if (!feeder_thread) {
+      feeder_queue = al_create_event_queue();
+      al_init_user_event_source(&feeder_quit_es);
+      al_register_event_source(feeder_queue, &feeder_quit_es);
+      feeder_thread = al_create_thread(feed_streams, NULL);
+      al_start_thread(feeder_thread);
+   }
+
+   stream->feed_requests = 0;
+   stream->feed_draining = false;
+   stream->feed_finished = false;
+   stream->is_fed = true;
+
+   slot = _al_vector_alloc_back(&feeder_streams);
+   *slot = stream;
+   al_register_event_source(feeder_queue, &stream->spl.es);
+
+   al_unlock_mutex(feeder_mutex);
+}
+
+
+/* _al_kcm_stop_feeding_stream:
+ *  Unregister a stream from the shared feeder thread, waiting for it to
+ *  finish with the stream if it is being fed right now.
+ */
+void _al_kcm_stop_feeding_stream(ALLEGRO_AUDIO_STREAM *stream)
+{
+   ASSERT(stream);
+
+   if (!stream->is_fed)
+      return;
+
+   al_lock_mutex(feeder_mutex);
+
+   _al_vector_find_and_delete(&feeder_streams, &stream);
+   while (feeder_current == stream) {
+      al_wait_cond(feeder_cond, feeder_mutex);
+   }
+   al_unregister_event_source(feeder_queue, &stream->spl.es);
+
+   if (stream->feed_draining)
+      stream->is_draining = false;
+   if (!stream->feed_finished)
+      emit_stream_finished(stream);
+
+   stream->is_fed = false;
+
+   al_unlock_mutex(feeder_mutex);
+}
+
+
 void _al_kcm_emit_stream_events(ALLEGRO_AUDIO_STREAM *stream)
 {
    /* Emit one event for each stream fragment available right now.
@@ -22,6 +22,47 @@ static void stream_read(void *source, void **vbuf, unsigned int *samples,
    ALLEGRO_AUDIO_DEPTH buffer_depth, size_t dest_maxc);
 
 
+/* Buffering requested for voices created from now on; 0 means driver default. */
+static unsigned int new_voice_buffer_size = 0;
+static unsigned int new_voice_num_buffers = 0;
+
+
+
+#define DEFAULT_TIMING_WINDOW  1.0
+
+
+/* Records the cost of one voice update. Returns true when a timing window has
+ * been completed. Called with voice->mutex held.
+ */
+static bool update_voice_timing(ALLEGRO_VOICE *voice, double mix_time,
+   unsigned int samples)
+{
+   ALLEGRO_VOICE_TIMING *timing = &voice->timing;
+   double period = (double)samples / voice->frequency;
+   float load = (period > 0.0) ? mix_time / period : 0.0f;
+
+   timing->mix_time = mix_time;
+   timing->period = period;
+   timing->load = load;
+   timing->updates++;
+
+   voice->window_mix_time += mix_time;
+   voice->window_period += period;
+   if (load > voice->window_max_load)
+      voice->window_max_load = load;
+
+   if (voice->timing_window <= 0.0 ||
+         voice->window_period < voice->timing_window)
+      return false;
+
+   timing->average_load = voice->window_mix_time / voice->window_period;
+   timing->max_load = voice->window_max_load;
+   voice->window_mix_time = 0.0;
+   voice->window_period = 0.0;
+   voice->window_max_load = 0.0f;
+   return true;
+}
+
 
 /* _al_voice_update:
  *  Reads the attached stream and provides a buffer for the sound card. It is
@@ -40,6 +81,7 @@ const void *_al_voice_update(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
    unsigned int *samples)
 {
    void *buf = NULL;
+   bool window_done = false;
 
    /* The mutex parameter is intended to make it obvious at the call site
     * that the voice mutex will be acquired here.
@@ -50,12 +92,22 @@ const void *_al_voice_update(ALLEGRO_VOICE *voice, ALLEGRO_MUTEX *mutex,
 
    al_lock_mutex(voice->mutex);
    if (voice->attached_stream) {
+      double t0 = al_get_time();
       ASSERT(voice->attached_stream->spl_read);
       voice->attached_stream->spl_read(voice->attached_stream, &buf, samples,
          voice->depth, 0);
+      window_done = update_voice_timing(voice, al_get_time() - t0, *samples);
    }
    al_unlock_mutex(voice->mutex);
 
+   if (window_done) {
+      ALLEGRO_EVENT event;
+      event.user.type = ALLEGRO_EVENT_AUDIO_VOICE_TIMING;
+      event.user.timestamp = al_get_time();
+      event.user.data1 = (intptr_t)voice;
+      al_emit_user_event(&voice->es, &event, NULL);
+   }
+
    return buf;
 }
 
@@ -80,6 +132,9 @@ ALLEGRO_VOICE *al_create_voice(unsigned int freq,
    voice->depth     = depth;
    voice->chan_conf = chan_conf;
    voice->frequency = freq;
+   voice->requested_buffer_size = new_voice_buffer_size;
+   voice->requested_num_buffers = new_voice_num_buffers;
+   voice->timing_window = DEFAULT_TIMING_WINDOW;
 
    voice->mutex = al_create_mutex();
    voice->cond = al_create_cond();
@@ -94,6 +149,8 @@ ALLEGRO_VOICE *al_create_voice(unsigned int freq,
       return NULL;
    }
 
+   al_init_user_event_source(&voice->es);
+
    _al_kcm_register_destructor(voice, (void (*)(void *)) al_destroy_voice);
 
    return voice;
@@ -112,6 +169,7 @@ void al_destroy_voice(ALLEGRO_VOICE *voice)
 
       /* We do NOT lock the voice mutex when calling this method. */
       voice->driver->deallocate_voice(voice);
+      al_destroy_user_event_source(&voice->es);
       al_destroy_mutex(voice->mutex);
       al_destroy_cond(voice->cond);
 
@@ -396,6 +454,101 @@ void al_detach_voice(ALLEGRO_VOICE *voice)
 }
 
 
+/* Function: al_set_new_voice_buffers
+ */
+void al_set_new_voice_buffers(unsigned int buffer_size,
+   unsigned int num_buffers)
+{
+   new_voice_buffer_size = buffer_size;
+   new_voice_num_buffers = num_buffers;
+}
+
+
+/* Function: al_get_voice_xrun_count
+ */
+unsigned int al_get_voice_xrun_count(const ALLEGRO_VOICE *voice)
+{
+   ASSERT(voice);
+
+   return voice->xrun_count;
+}
+
+
+/* Function: al_get_voice_latency
+ */
+double al_get_voice_latency(const ALLEGRO_VOICE *voice)
+{
+   double ret = -1.0;
+
+   ASSERT(voice);
+
+   if (voice->driver->get_voice_latency) {
+      al_lock_mutex(voice->mutex);
+      ret = voice->driver->get_voice_latency(voice);
+      al_unlock_mutex(voice->mutex);
+   }
+
+   return ret;
+}
+
+
+/* Function: al_render_voice
+ */
+bool al_render_voice(ALLEGRO_VOICE *voice, void *buffer, unsigned int samples)
+{
+   ASSERT(voice);
+   ASSERT(buffer);
+
+   if (!voice->driver->render_voice) {
+      _al_set_error(ALLEGRO_INVALID_PARAM,
+         "Voice does not belong to the offline audio driver");
+      return false;
+   }
+
+   return voice->driver->render_voice(voice, buffer, samples);
+}
+
+
+/* Function: al_get_voice_timing
+ */
+void al_get_voice_timing(const ALLEGRO_VOICE *voice,
+   ALLEGRO_VOICE_TIMING *timing)
+{
+   ASSERT(voice);
+   ASSERT(timing);
+
+   al_lock_mutex(voice->mutex);
+   *timing = voice->timing;
+   al_unlock_mutex(voice->mutex);
+   timing->xruns = voice->xrun_count;
+}
+
+
+/* Function: al_set_voice_timing_window
+ */
+void al_set_voice_timing_window(ALLEGRO_VOICE *voice, double seconds)
+{
+   ASSERT(voice);
+
+   al_lock_mutex(voice->mutex);
+   voice->timing_window = seconds;
+   voice->window_mix_time = 0.0;
+   voice->window_period = 0.0;
+   voice->window_max_load = 0.0f;
+   al_unlock_mutex(voice->mutex);
+}
+
+
+/* Function: al_get_voice_event_source
+ */
+ALLEGRO_EVENT_SOURCE *al_get_voice_event_source(ALLEGRO_VOICE *voice)
+{
+   ASSERT(voice);
+
+   return &voice->es;
+}
+
+
 /* Function: al_get_voice_frequency
  */
 unsigned int al_get_voice_frequency(const ALLEGRO_VOICE *voice)
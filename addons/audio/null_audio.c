@@ -0,0 +1,228 @@
+/*         ______   ___    ___
+ *        /\  _  \ /\_ \  /\_ \
+ *        \ \ \L\ \\//\ \ \//\ \      __     __   _ __   ___
+ *         \ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\/\`'__\/ __`\
+ *          \ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \ \ \//\ \L\ \
+ *           \ \_\ \_\/\____\/\____\ \____\ \____ \ \_\\ \____/
+ *            \/_/\/_/\/____/\/____/\/____/\/___L\ \/_/ \/___/
+ *                                           /\____/
+ *                                           \_/__/
+ *
+ *      Offline audio driver.  Voices are not connected to any device; the
+ *      application pulls rendered audio out of them with al_render_voice,
+ *      as fast as the CPU allows.
+ *
+ *      See LICENSE.txt for copyright information.
+ */
+
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+#include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_audio.h"
+
+ALLEGRO_DEBUG_CHANNEL("null_audio")
+
+
+typedef struct NULL_VOICE
+{
+   unsigned int frame_size;
+   volatile bool is_playing;
+} NULL_VOICE;
+
+
+static int null_open(void)
+{
+   return 0;
+}
+
+
+static void null_close(void)
+{
+}
+
+
+static int null_allocate_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = al_calloc(1, sizeof(NULL_VOICE));
+   if (!ex_data)
+      return 1;
+
+   ex_data->frame_size = al_get_channel_count(voice->chan_conf) *
+      al_get_audio_depth_size(voice->depth);
+   ex_data->is_playing = false;
+
+   voice->extra = ex_data;
+   return 0;
+}
+
+
+static void null_deallocate_voice(ALLEGRO_VOICE *voice)
+{
+   al_free(voice->extra);
+   voice->extra = NULL;
+}
+
+
+static int null_load_voice(ALLEGRO_VOICE *voice, const void *data)
+{
+   (void)data;
+
+   if (voice->attached_stream->loop == ALLEGRO_PLAYMODE_BIDIR) {
+      ALLEGRO_INFO("Backwards playing not supported by the driver.\n");
+      return -1;
+   }
+
+   voice->attached_stream->pos = 0;
+   return 0;
+}
+
+
+static void null_unload_voice(ALLEGRO_VOICE *voice)
+{
+   (void)voice;
+}
+
+
+static int null_start_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+   ex_data->is_playing = true;
+   return 0;
+}
+
+
+static int null_stop_voice(ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+
+   ex_data->is_playing = false;
+   if (!voice->is_streaming) {
+      voice->attached_stream->pos = 0;
+   }
+   return 0;
+}
+
+
+static bool null_voice_is_playing(const ALLEGRO_VOICE *voice)
+{
+   NULL_VOICE *ex_data = voice->extra;
+   return ex_data->is_playing;
+}
+
+
+static unsigned int null_get_voice_position(const ALLEGRO_VOICE *voice)
+{
+   return voice->attached_stream->pos;
+}
+
+
+static int null_set_voice_position(ALLEGRO_VOICE *voice, unsigned int val)
+{
+   voice->attached_stream->pos = val;
+   return 0;
+}
+
+
+/* Copy up to 'samples' frames of a sample attached directly to the voice.
+ * Returns the number of frames copied; stops the voice at the end of a
+ * non-looping sample.
+ */
+static unsigned int render_nonstream_voice(ALLEGRO_VOICE *voice, char *buf,
+   unsigned int samples)
+{
+   NULL_VOICE *ex_data = voice->extra;
+   ALLEGRO_SAMPLE_INSTANCE *spl = voice->attached_stream;
+   unsigned int len = spl->spl_data.len;
+   unsigned int n;
+
+   if ((unsigned int)spl->pos >= len) {
+      if (spl->loop != ALLEGRO_PLAYMODE_LOOP || len == 0) {
+         ex_data->is_playing = false;
+         spl->pos = 0;
+         return 0;
+      }
+      spl->pos = 0;
+   }
+
+   n = len - spl->pos;
+   if (n > samples)
+      n = samples;
+
+   memcpy(buf, spl->spl_data.buffer.s8 + spl->pos * ex_data->frame_size,
+      n * ex_data->frame_size);
+   spl->pos += n;
+
+   return n;
+}
+
+
+/* The voice is rendered on the calling thread, through al_render_voice. */
+static bool null_render_voice(ALLEGRO_VOICE *voice, void *buffer,
+   unsigned int samples)
+{
+   NULL_VOICE *ex_data = voice->extra;
+   char *buf = buffer;
+
+   while (samples > 0) {
+      unsigned int n = samples;
+
+      if (!ex_data->is_playing || !voice->attached_stream) {
+         n = 0;
+      }
+      else if (voice->is_streaming) {
+         const void *data = _al_voice_update(voice, voice->mutex, &n);
+         if (data)
+            memcpy(buf, data, n * ex_data->frame_size);
+         else
+            n = 0;
+      }
+      else {
+         al_lock_mutex(voice->mutex);
+         n = render_nonstream_voice(voice, buf, samples);
+         al_unlock_mutex(voice->mutex);
+      }
+
+      if (n == 0) {
+         /* Nothing is playing; the rest of the buffer is silent. */
+         al_fill_silence(buf, samples, voice->depth, voice->chan_conf);
+         break;
+      }
+
+      buf += n * ex_data->frame_size;
+      samples -= n;
+   }
+
+   return true;
+}
+
+
+struct ALLEGRO_AUDIO_DRIVER _al_kcm_null_driver =
+{
+   "null",
+
+   null_open,
+   null_close,
+
+   null_allocate_voice,
+   null_deallocate_voice,
+
+   null_load_voice,
+   null_unload_voice,
+
+   null_start_voice,
+   null_stop_voice,
+
+   null_voice_is_playing,
+
+   null_get_voice_position,
+   null_set_voice_position,
+
+   NULL,
+   NULL,
+
+   NULL,
+
+   null_render_voice
+};
+
+/* vim: set sts=3 sw=3 et: */
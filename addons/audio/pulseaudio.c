@@ -18,14 +18,23 @@
 #include "allegro5/allegro.h"
 #include "allegro5/internal/aintern_audio.h"
 
-#include <pulse/simple.h>
 #include <pulse/error.h>
-#include <pulse/introspect.h>
-#include <pulse/mainloop.h>
+#include <pulse/thread-mainloop.h>
+#include <pulse/context.h>
+#include <pulse/stream.h>
 #include <stdlib.h>
 
 ALLEGRO_DEBUG_CHANNEL("PulseAudio")
 
+/* All streams share one context, served by one threaded mainloop. Every
+ * pa_stream and pa_context call must be made with the mainloop locked.
+ *
+ * Lock order: voice->mutex may be held while locking the mainloop, never the
+ * other way round. The mainloop thread itself only signals waiters.
+ */
+static pa_threaded_mainloop *mainloop = NULL;
+static pa_context *context = NULL;
+
 enum PULSEAUDIO_VOICE_STATUS {
    PV_IDLE,
    PV_PLAYING,
@@ -35,121 +44,216 @@ enum PULSEAUDIO_VOICE_STATUS {
 
 typedef struct PULSEAUDIO_VOICE
 {
-   pa_simple *s;
+   pa_stream *s;
    unsigned int buffer_size_in_frames;
    unsigned int frame_size_in_bytes;
+   bool corked;
+   char *silence;
 
    ALLEGRO_THREAD *poll_thread;
    /* status_cond and status are protected by voice->mutex.
     * Using another mutex introduces a deadlock if waiting for a change in
     * status (while holding voice->mutex, acquired by a higher layer)
     * and the background thread tries to acquire voice->mutex as well.
+    * The update thread also reads status while waiting on the mainloop.
     */
    ALLEGRO_COND *status_cond;
-   enum PULSEAUDIO_VOICE_STATUS status;
+   volatile enum PULSEAUDIO_VOICE_STATUS status;
 
    // direct buffer (non-streaming):
-   ALLEGRO_MUTEX *buffer_mutex;  
+   ALLEGRO_MUTEX *buffer_mutex;
    char *buffer;
    char *buffer_end;
 } PULSEAUDIO_VOICE;
 
 #define DEFAULT_BUFFER_SIZE   1024
 #define MIN_BUFFER_SIZE       128
+#define DEFAULT_BUFFER_COUNT  2
 
-static unsigned int get_buffer_size(const ALLEGRO_CONFIG *config)
+static unsigned int get_config_uint(const ALLEGRO_CONFIG *config,
+   const char *key, unsigned int def, unsigned int min)
 {
    if (config) {
-      const char *val = al_get_config_value(config,
-         "pulseaudio", "buffer_size");
+      const char *val = al_get_config_value(config, "pulseaudio", key);
       if (val && val[0] != '\0') {
          int n = atoi(val);
-         if (n < MIN_BUFFER_SIZE)
-            n = MIN_BUFFER_SIZE;
+         if (n < (int)min)
+            n = min;
          return n;
       }
    }
 
-   return DEFAULT_BUFFER_SIZE;
+   return def;
 }
 
-static void sink_info_cb(pa_context *c, const pa_sink_info *i, int eol,
-   void *userdata)
+static void context_state_cb(pa_context *c, void *userdata)
 {
    (void)c;
-   (void)eol;
+   (void)userdata;
+   pa_threaded_mainloop_signal(mainloop, 0);
+}
 
-   pa_sink_state_t *ret = userdata;
-   if (!i)
-      return;
-   *ret = i->state;
+static void stream_notify_cb(pa_stream *s, void *userdata)
+{
+   (void)s;
+   (void)userdata;
+   pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void stream_request_cb(pa_stream *s, size_t nbytes, void *userdata)
+{
+   (void)s;
+   (void)nbytes;
+   (void)userdata;
+   pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+/* The server ran out of data for a playback stream. */
+static void stream_underflow_cb(pa_stream *s, void *userdata)
+{
+   ALLEGRO_VOICE *voice = userdata;
+   (void)s;
+   voice->xrun_count++;
+}
+
+/* Waits for a freshly connected stream to become ready.
+ * Must be called with the mainloop locked.
+ */
+static bool wait_stream_ready(pa_stream *s)
+{
+   for (;;) {
+      pa_stream_state_t state = pa_stream_get_state(s);
+      if (state == PA_STREAM_READY)
+         return true;
+      if (!PA_STREAM_IS_GOOD(state)) {
+         ALLEGRO_ERROR("Stream failed: %s\n",
+            pa_strerror(pa_context_errno(context)));
+         return false;
+      }
+      pa_threaded_mainloop_wait(mainloop);
+   }
+}
+
+static void unref_operation(pa_operation *op)
+{
+   if (op)
+      pa_operation_unref(op);
 }
 
 static int pulseaudio_open(void)
 {
    /* Use PA_CONTEXT_NOAUTOSPAWN to see if a PA server is running.
     * If not, fail - we're better off using ALSA/OSS.
-    * 
-    * Also check for suspended PA - again better using ALSA/OSS in
-    * that case (pa_simple_write just blocks until PA is unsuspended
-    * otherwise).
-    * 
+    *
     * TODO: Maybe we should have a force flag to the audio driver
     * open method, which in the case of PA would spawn a server if
     * none is running (and also unsuspend?).
     */
+   pa_context_state_t state;
 
-   pa_mainloop *mainloop = pa_mainloop_new();
-   pa_context *c = pa_context_new(pa_mainloop_get_api(mainloop),
+   mainloop = pa_threaded_mainloop_new();
+   if (!mainloop) {
+      ALLEGRO_ERROR("pa_threaded_mainloop_new failed\n");
+      return 1;
+   }
+
+   context = pa_context_new(pa_threaded_mainloop_get_api(mainloop),
       al_get_app_name());
-   if (!c) {
-      pa_mainloop_free(mainloop);
+   if (!context) {
+      pa_threaded_mainloop_free(mainloop);
+      mainloop = NULL;
       return 1;
    }
+   pa_context_set_state_callback(context, context_state_cb, NULL);
 
-   pa_context_connect(c, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL);
+   pa_threaded_mainloop_lock(mainloop);
 
-   while (1) {
-      /* Don't block or it will hang if there is no server to connect to. */
-      const int blocking = 0;
-      if (pa_mainloop_iterate(mainloop, blocking, NULL) < 0) {
-         ALLEGRO_ERROR("pa_mainloop_iterate failed\n");
-         pa_context_disconnect(c);
-         pa_mainloop_free(mainloop);
-         break;
-      }
-      pa_context_state_t s = pa_context_get_state(c);
-      if (s == PA_CONTEXT_READY) {
+   if (pa_context_connect(context, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) < 0 ||
+         pa_threaded_mainloop_start(mainloop) < 0) {
+      ALLEGRO_ERROR("Could not connect to the PulseAudio server\n");
+      goto Error;
+   }
+
+   for (;;) {
+      state = pa_context_get_state(context);
+      if (state == PA_CONTEXT_READY) {
          ALLEGRO_DEBUG("PA_CONTEXT_READY\n");
          break;
       }
-      if (s == PA_CONTEXT_FAILED) {
+      if (!PA_CONTEXT_IS_GOOD(state)) {
          ALLEGRO_ERROR("PA_CONTEXT_FAILED\n");
-         pa_context_disconnect(c);
-         pa_mainloop_free(mainloop);
-         return 1;
+         goto Error;
       }
+      pa_threaded_mainloop_wait(mainloop);
    }
 
-   pa_sink_state_t state = 0;
-   pa_operation *op = pa_context_get_sink_info_list(c, sink_info_cb, &state);
-   while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
-      pa_mainloop_iterate(mainloop, 1, NULL);
-   }
-   /*if (state == PA_SINK_SUSPENDED) {
-      pa_context_disconnect(c);
-      pa_mainloop_free(mainloop);
-      return 1;
-   }*/
-   pa_operation_unref(op);
-   pa_context_disconnect(c);
-   pa_context_unref(c);
-   pa_mainloop_free(mainloop);
+   pa_threaded_mainloop_unlock(mainloop);
    return 0;
+
+Error:
+   pa_context_disconnect(context);
+   pa_context_unref(context);
+   context = NULL;
+   pa_threaded_mainloop_unlock(mainloop);
+   pa_threaded_mainloop_stop(mainloop);
+   pa_threaded_mainloop_free(mainloop);
+   mainloop = NULL;
+   return 1;
 }
 
 static void pulseaudio_close(void)
 {
+   if (!mainloop)
+      return;
+
+   pa_threaded_mainloop_lock(mainloop);
+   pa_context_disconnect(context);
+   pa_context_unref(context);
+   context = NULL;
+   pa_threaded_mainloop_unlock(mainloop);
+
+   pa_threaded_mainloop_stop(mainloop);
+   pa_threaded_mainloop_free(mainloop);
+   mainloop = NULL;
+}
+
+/* Waits until the server asks for more data, or the voice leaves the playing
+ * state. Returns the number of bytes that can be written (0 if we should
+ * check the status again).
+ */
+static size_t wait_writable(PULSEAUDIO_VOICE *pv)
+{
+   size_t writable = 0;
+
+   pa_threaded_mainloop_lock(mainloop);
+
+   if (pv->corked) {
+      unref_operation(pa_stream_cork(pv->s, 0, NULL, NULL));
+      pv->corked = false;
+   }
+
+   while (pv->status == PV_PLAYING &&
+         pa_stream_get_state(pv->s) == PA_STREAM_READY) {
+      writable = pa_stream_writable_size(pv->s);
+      if (writable == (size_t)-1) {
+         writable = 0;
+         break;
+      }
+      if (writable > 0)
+         break;
+      pa_threaded_mainloop_wait(mainloop);
+   }
+
+   pa_threaded_mainloop_unlock(mainloop);
+
+   return writable;
+}
+
+static void write_stream(PULSEAUDIO_VOICE *pv, const void *data, size_t bytes)
+{
+   pa_threaded_mainloop_lock(mainloop);
+   pa_stream_write(pv->s, data, bytes, NULL, 0, PA_SEEK_RELATIVE);
+   pa_threaded_mainloop_unlock(mainloop);
 }
 
 static void *pulseaudio_update(ALLEGRO_THREAD *self, void *data)
@@ -172,17 +276,23 @@ static void *pulseaudio_update(ALLEGRO_THREAD *self, void *data)
       }
 
       if (status == PV_PLAYING) {
-         unsigned int frames = pv->buffer_size_in_frames;
-         if (voice->is_streaming) { 
-            // streaming audio           
+         size_t writable = wait_writable(pv);
+         unsigned int frames = writable / pv->frame_size_in_bytes;
+         if (frames == 0)
+            continue;
+         if (frames > pv->buffer_size_in_frames)
+            frames = pv->buffer_size_in_frames;
+
+         if (voice->is_streaming) {
+            // streaming audio
             const void *data = _al_voice_update(voice, voice->mutex, &frames);
-            if (data) {
-               pa_simple_write(pv->s, data,
-                  frames * pv->frame_size_in_bytes, NULL);
-            }
+            if (!data)
+               data = pv->silence;
+            write_stream(pv, data, frames * pv->frame_size_in_bytes);
          }
          else {
             // direct buffer audio
+            bool finished = false;
             al_lock_mutex(pv->buffer_mutex);
             const char *data = pv->buffer;
             unsigned int len = frames * pv->frame_size_in_bytes;
@@ -191,26 +301,38 @@ static void *pulseaudio_update(ALLEGRO_THREAD *self, void *data)
                len = pv->buffer_end - data;
                pv->buffer = voice->attached_stream->spl_data.buffer.ptr;
                voice->attached_stream->pos = 0;
-               if (voice->attached_stream->loop == ALLEGRO_PLAYMODE_ONCE) {
-                  al_lock_mutex(voice->mutex);
-                  pv->status = PV_STOPPING;
-                  al_broadcast_cond(pv->status_cond);
-                  al_unlock_mutex(voice->mutex);
-               }
+               if (voice->attached_stream->loop == ALLEGRO_PLAYMODE_ONCE)
+                  finished = true;
             }
             else {
                voice->attached_stream->pos += frames;
             }
             al_unlock_mutex(pv->buffer_mutex);
 
-            pa_simple_write(pv->s, data, len, NULL);
+            write_stream(pv, data, len);
+
+            if (finished) {
+               al_lock_mutex(voice->mutex);
+               if (pv->status == PV_PLAYING) {
+                  pv->status = PV_STOPPING;
+                  al_broadcast_cond(pv->status_cond);
+               }
+               al_unlock_mutex(voice->mutex);
+            }
          }
       }
       else if (status == PV_STOPPING) {
-         pa_simple_flush(pv->s, NULL);
+         pa_threaded_mainloop_lock(mainloop);
+         unref_operation(pa_stream_cork(pv->s, 1, NULL, NULL));
+         unref_operation(pa_stream_flush(pv->s, NULL, NULL));
+         pv->corked = true;
+         pa_threaded_mainloop_unlock(mainloop);
+
          al_lock_mutex(voice->mutex);
-         pv->status = PV_IDLE;
-         al_broadcast_cond(pv->status_cond);
+         if (pv->status == PV_STOPPING) {
+            pv->status = PV_IDLE;
+            al_broadcast_cond(pv->status_cond);
+         }
          al_unlock_mutex(voice->mutex);
       }
    }
@@ -218,61 +340,129 @@ static void *pulseaudio_update(ALLEGRO_THREAD *self, void *data)
    return NULL;
 }
 
-static int pulseaudio_allocate_voice(ALLEGRO_VOICE *voice)
+/* Wakes the update thread if it is waiting for the server. */
+static void wake_update_thread(void)
 {
-   PULSEAUDIO_VOICE *pv = al_malloc(sizeof(PULSEAUDIO_VOICE));
-   pa_sample_spec ss;
-   pa_buffer_attr ba;
+   pa_threaded_mainloop_lock(mainloop);
+   pa_threaded_mainloop_signal(mainloop, 0);
+   pa_threaded_mainloop_unlock(mainloop);
+}
 
-   ss.channels = al_get_channel_count(voice->chan_conf);
-   ss.rate = voice->frequency;
+static bool get_sample_spec(ALLEGRO_AUDIO_DEPTH depth,
+   ALLEGRO_CHANNEL_CONF chan_conf, unsigned int frequency, pa_sample_spec *ss)
+{
+   ss->channels = al_get_channel_count(chan_conf);
+   ss->rate = frequency;
 
-   if (voice->depth == ALLEGRO_AUDIO_DEPTH_UINT8)
-      ss.format = PA_SAMPLE_U8;
-   else if (voice->depth == ALLEGRO_AUDIO_DEPTH_INT16)
-      ss.format = PA_SAMPLE_S16NE;
+   if (depth == ALLEGRO_AUDIO_DEPTH_UINT8)
+      ss->format = PA_SAMPLE_U8;
+   else if (depth == ALLEGRO_AUDIO_DEPTH_INT16)
+      ss->format = PA_SAMPLE_S16NE;
 #if PA_API_VERSION > 11
-   else if (voice->depth == ALLEGRO_AUDIO_DEPTH_INT24)
-      ss.format = PA_SAMPLE_S24NE;
+   else if (depth == ALLEGRO_AUDIO_DEPTH_INT24)
+      ss->format = PA_SAMPLE_S24NE;
 #endif
-   else if (voice->depth == ALLEGRO_AUDIO_DEPTH_FLOAT32)
-      ss.format = PA_SAMPLE_FLOAT32NE;
-   else {
+   else if (depth == ALLEGRO_AUDIO_DEPTH_FLOAT32)
+      ss->format = PA_SAMPLE_FLOAT32NE;
+   else
+      return false;
+
+   return true;
+}
+
+static int pulseaudio_allocate_voice(ALLEGRO_VOICE *voice)
+{
+   PULSEAUDIO_VOICE *pv;
+   const ALLEGRO_CONFIG *config = al_get_system_config();
+   pa_sample_spec ss;
+   pa_buffer_attr ba;
+   const pa_buffer_attr *actual;
+   unsigned int buffer_count;
+   pa_stream_flags_t flags;
+
+   if (!get_sample_spec(voice->depth, voice->chan_conf, voice->frequency,
+         &ss)) {
       ALLEGRO_ERROR("Unsupported PulseAudio sound format.\n");
-      al_free(pv);
       return 1;
    }
 
-   ba.maxlength = 0x10000; // maximum length of buffer
-   ba.tlength   = 0x2000;  // target length of buffer
+   pv = al_calloc(1, sizeof(PULSEAUDIO_VOICE));
+   if (!pv)
+      return 1;
+
+   pv->frame_size_in_bytes = ss.channels * al_get_audio_depth_size(voice->depth);
+
+   /* The server asks for data in pieces of buffer_size samples, and keeps
+    * buffer_count of them queued ahead of the hardware.
+    */
+   if (voice->requested_buffer_size)
+      pv->buffer_size_in_frames = voice->requested_buffer_size;
+   else
+      pv->buffer_size_in_frames = get_config_uint(config, "buffer_size",
+         DEFAULT_BUFFER_SIZE, MIN_BUFFER_SIZE);
+   if (voice->requested_num_buffers)
+      buffer_count = voice->requested_num_buffers;
+   else
+      buffer_count = get_config_uint(config, "buffer_count",
+         DEFAULT_BUFFER_COUNT, 1);
+
+   ba.maxlength = -1;      // maximum length of buffer
+   ba.tlength   = buffer_count * pv->buffer_size_in_frames
+      * pv->frame_size_in_bytes;   // target length of buffer
    ba.prebuf    = 0;       // minimum data size required before playback starts
-   ba.minreq    = 0;       // minimum size of request 
+   ba.minreq    = pv->buffer_size_in_frames
+      * pv->frame_size_in_bytes;   // minimum size of request
    ba.fragsize  = -1;      // fragment size (recording)
 
-   pv->s = pa_simple_new(
-      NULL,                // Use the default server.
-      al_get_app_name(),     
-      PA_STREAM_PLAYBACK,
-      NULL,                // Use the default device.
-      "Allegro Voice",    
-      &ss,                
-      NULL,                // Use default channel map
-      &ba,                
-      NULL                 // Ignore error code.
-   );
+   pv->silence = al_malloc(pv->buffer_size_in_frames * pv->frame_size_in_bytes);
+   if (!pv->silence) {
+      al_free(pv);
+      return 1;
+   }
+   al_fill_silence(pv->silence, pv->buffer_size_in_frames, voice->depth,
+      voice->chan_conf);
+
+   /* With ADJUST_LATENCY, tlength is the latency of the whole path to the
+    * speakers, not just our part of it.
+    */
+   flags = PA_STREAM_START_CORKED | PA_STREAM_ADJUST_LATENCY |
+      PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 
+   pa_threaded_mainloop_lock(mainloop);
+
+   pv->s = pa_stream_new(context, "Allegro Voice", &ss, NULL);
    if (!pv->s) {
+      pa_threaded_mainloop_unlock(mainloop);
+      al_free(pv->silence);
+      al_free(pv);
+      return 1;
+   }
+   pa_stream_set_state_callback(pv->s, stream_notify_cb, NULL);
+   pa_stream_set_write_callback(pv->s, stream_request_cb, NULL);
+   pa_stream_set_underflow_callback(pv->s, stream_underflow_cb, voice);
+
+   if (pa_stream_connect_playback(pv->s, NULL, &ba, flags, NULL, NULL) < 0 ||
+         !wait_stream_ready(pv->s)) {
+      pa_stream_unref(pv->s);
+      pa_threaded_mainloop_unlock(mainloop);
+      al_free(pv->silence);
       al_free(pv);
       return 1;
    }
+   pv->corked = true;
 
-   voice->extra = pv;
+   actual = pa_stream_get_buffer_attr(pv->s);
+   if (actual) {
+      ALLEGRO_INFO("tlength %u, minreq %u bytes (%.1f ms)\n",
+         actual->tlength, actual->minreq,
+         actual->tlength * 1000.0 / (pv->frame_size_in_bytes * ss.rate));
+   }
 
-   pv->buffer_size_in_frames = get_buffer_size(al_get_system_config());
-   pv->frame_size_in_bytes = ss.channels * al_get_audio_depth_size(voice->depth);
+   pa_threaded_mainloop_unlock(mainloop);
+
+   voice->extra = pv;
 
    pv->status = PV_IDLE;
-   //pv->status_mutex = al_create_mutex();
    pv->status_cond = al_create_cond();
    pv->buffer_mutex = al_create_mutex();
 
@@ -290,6 +480,7 @@ static void pulseaudio_deallocate_voice(ALLEGRO_VOICE *voice)
    pv->status = PV_JOIN;
    al_broadcast_cond(pv->status_cond);
    al_unlock_mutex(voice->mutex);
+   wake_update_thread();
 
    /* We do NOT hold the voice mutex here, so this does NOT result in a
     * deadlock when the thread calls _al_voice_update.
@@ -300,7 +491,12 @@ static void pulseaudio_deallocate_voice(ALLEGRO_VOICE *voice)
    al_destroy_cond(pv->status_cond);
    al_destroy_mutex(pv->buffer_mutex);
 
-   pa_simple_free(pv->s);
+   pa_threaded_mainloop_lock(mainloop);
+   pa_stream_disconnect(pv->s);
+   pa_stream_unref(pv->s);
+   pa_threaded_mainloop_unlock(mainloop);
+
+   al_free(pv->silence);
    al_free(pv);
 }
 
@@ -330,7 +526,7 @@ static void pulseaudio_unload_voice(ALLEGRO_VOICE *voice)
 
 static int pulseaudio_start_voice(ALLEGRO_VOICE *voice)
 {
-   PULSEAUDIO_VOICE *pv = voice->extra;   
+   PULSEAUDIO_VOICE *pv = voice->extra;
    int ret;
 
    /* We hold the voice->mutex already. */
@@ -356,6 +552,7 @@ static int pulseaudio_stop_voice(ALLEGRO_VOICE *voice)
    if (pv->status == PV_PLAYING) {
       pv->status = PV_STOPPING;
       al_broadcast_cond(pv->status_cond);
+      wake_update_thread();
    }
 
    while (pv->status != PV_IDLE) {
@@ -380,7 +577,10 @@ static int pulseaudio_set_voice_position(ALLEGRO_VOICE *voice, unsigned int pos)
 {
    PULSEAUDIO_VOICE *pv = voice->extra;
 
-   pa_simple_drain(pv->s, NULL);
+   /* Drop what was queued from the old position. */
+   pa_threaded_mainloop_lock(mainloop);
+   unref_operation(pa_stream_flush(pv->s, NULL, NULL));
+   pa_threaded_mainloop_unlock(mainloop);
 
    al_lock_mutex(pv->buffer_mutex);
    voice->attached_stream->pos = pos;
@@ -391,10 +591,26 @@ static int pulseaudio_set_voice_position(ALLEGRO_VOICE *voice, unsigned int pos)
    return 0;
 }
 
+static double pulseaudio_get_voice_latency(const ALLEGRO_VOICE *voice)
+{
+   PULSEAUDIO_VOICE *pv = voice->extra;
+   pa_usec_t usec;
+   int negative;
+   double ret = -1.0;
+
+   pa_threaded_mainloop_lock(mainloop);
+   if (pa_stream_get_latency(pv->s, &usec, &negative) == 0) {
+      ret = negative ? 0.0 : usec / 1000000.0;
+   }
+   pa_threaded_mainloop_unlock(mainloop);
+
+   return ret;
+}
+
 /* Recording */
 
 typedef struct PULSEAUDIO_RECORDER {
-   pa_simple *s;
+   pa_stream *s;
    pa_sample_spec ss;
    pa_buffer_attr ba;
 } PULSEAUDIO_RECORDER;
@@ -403,106 +619,132 @@ static void *pulse_audio_update_recorder(ALLEGRO_THREAD *t, void *data)
 {
    ALLEGRO_AUDIO_RECORDER *r = (ALLEGRO_AUDIO_RECORDER *) data;
    PULSEAUDIO_RECORDER *pa = (PULSEAUDIO_RECORDER *) r->extra;
-   ALLEGRO_EVENT user_event;
-   uint8_t *null_buffer;
-   unsigned int fragment_i = 0;
-   
-   null_buffer = al_malloc(1024);
-   if (!null_buffer) {
-      ALLEGRO_ERROR("Unable to create buffer for draining PulseAudio.\n");
-      return NULL;
-   }
-   
+
+   pa_threaded_mainloop_lock(mainloop);
+
    while (!al_get_thread_should_stop(t))
    {
-      al_lock_mutex(r->mutex);
-      if (!r->is_recording) {
-         /* Even if not recording, we still want to read from the PA server.
-            Otherwise it will buffer everything and spit it all out whenever
-            the recording resumes. */
-         al_unlock_mutex(r->mutex);
-         pa_simple_read(pa->s, null_buffer, 1024, NULL);
+      const void *chunk;
+      size_t bytes;
+      bool is_recording;
+
+      if (pa_stream_get_state(pa->s) != PA_STREAM_READY) {
+         ALLEGRO_ERROR("Recording stream failed.\n");
+         break;
       }
-      else {
-         ALLEGRO_AUDIO_RECORDER_EVENT *e;
-         al_unlock_mutex(r->mutex);
-         if (pa_simple_read(pa->s, r->fragments[fragment_i], r->fragment_size, NULL) >= 0) {
-            user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
-            e = al_get_audio_recorder_event(&user_event);
-            e->buffer = r->fragments[fragment_i];
-            e->samples = r->samples;           
-            al_emit_user_event(&r->source, &user_event, NULL);
-         
-            if (++fragment_i == r->fragment_count) {
-               fragment_i = 0;
-            }
-         }
+
+      if (pa_stream_readable_size(pa->s) == 0) {
+         /* The server delivers a fragment at least every fragsize bytes,
+            so we will notice should_stop soon enough. */
+         pa_threaded_mainloop_wait(mainloop);
+         continue;
+      }
+
+      if (pa_stream_peek(pa->s, &chunk, &bytes) < 0) {
+         ALLEGRO_ERROR("pa_stream_peek() failed: %s\n",
+            pa_strerror(pa_context_errno(context)));
+         break;
       }
+
+      if (bytes == 0) {
+         /* Data is readable but none was returned: some servers report a
+            hole at the read index this way.  Drop it, or the next peek
+            returns the same thing and we spin. */
+         if (pa_stream_drop(pa->s) < 0)
+            pa_threaded_mainloop_wait(mainloop);
+         continue;
+      }
+
+      /* The peeked data stays valid until pa_stream_drop, so let the
+         playback streams on the shared mainloop carry on meanwhile. */
+      pa_threaded_mainloop_unlock(mainloop);
+
+      al_lock_mutex(r->mutex);
+      is_recording = r->is_recording;
+      al_unlock_mutex(r->mutex);
+
+      /* Even if not recording, we still want to read from the PA server.
+         Otherwise it will buffer everything and spit it all out whenever
+         the recording resumes.
+         A NULL chunk is a hole in the stream; record silence. */
+      if (is_recording)
+         _al_kcm_recorder_write(r, chunk, bytes / r->sample_size);
+
+      pa_threaded_mainloop_lock(mainloop);
+      pa_stream_drop(pa->s);
    }
 
-   al_free(null_buffer);
+   pa_threaded_mainloop_unlock(mainloop);
+
    return NULL;
 };
 
 static int pulseaudio_allocate_recorder(ALLEGRO_AUDIO_RECORDER *r)
 {
    PULSEAUDIO_RECORDER *pa;
-   
+
    pa = al_calloc(1, sizeof(*pa));
    if (!pa) {
      ALLEGRO_ERROR("Unable to allocate memory for PULSEAUDIO_RECORDER.\n");
      return 1;
    }
-   
-   pa->ss.channels = al_get_channel_count(r->chan_conf);
-   pa->ss.rate = r->frequency;
-
-   if (r->depth == ALLEGRO_AUDIO_DEPTH_UINT8) 
-      pa->ss.format = PA_SAMPLE_U8;
-   else if (r->depth == ALLEGRO_AUDIO_DEPTH_INT16)
-      pa->ss.format = PA_SAMPLE_S16NE;
-#if PA_API_VERSION > 11
-   else if (r->depth == ALLEGRO_AUDIO_DEPTH_INT24)
-      pa->ss.format = PA_SAMPLE_S24NE;
-#endif
-   else if (r->depth == ALLEGRO_AUDIO_DEPTH_FLOAT32)
-      pa->ss.format = PA_SAMPLE_FLOAT32NE;
-   else {
+
+   if (!get_sample_spec(r->depth, r->chan_conf, r->frequency, &pa->ss)) {
       ALLEGRO_ERROR("Unsupported PulseAudio sound format (depth).\n");
       al_free(pa);
       return 1;
    }
-   
+
    /* maximum length of the PulseAudio buffer. -1 => let the server decide. */
    pa->ba.maxlength = -1;
-   
-   /* fragment size (bytes) controls how much data is returned back per read. 
+   pa->ba.tlength = -1;
+   pa->ba.prebuf = -1;
+   pa->ba.minreq = -1;
+
+   /* fragment size (bytes) controls how much data is returned back per read.
       The documentation recommends -1 for default behavior, but that sets a
-      latency of around 2 seconds. Lower value decreases latency but increases
-      overhead. 
-      
-      The following attempts to set it (the base latency) to 1/8 of a second. 
+      latency of around 2 seconds. Ask for exactly one recorder fragment, so
+      the latency follows the fragment size the user asked for.
     */
-   pa->ba.fragsize = (r->sample_size * r->frequency) / 8;
-   
-   pa->s = pa_simple_new(NULL, al_get_app_name(), PA_STREAM_RECORD, NULL, "Allegro Audio Recorder", &pa->ss, NULL, &pa->ba, NULL);
+   pa->ba.fragsize = r->fragment_size;
+
+   pa_threaded_mainloop_lock(mainloop);
+
+   pa->s = pa_stream_new(context, "Allegro Audio Recorder", &pa->ss, NULL);
    if (!pa->s) {
-      ALLEGRO_ERROR("pa_simple_new() failed.\n");
+      pa_threaded_mainloop_unlock(mainloop);
+      ALLEGRO_ERROR("pa_stream_new() failed.\n");
       al_free(pa);
       return 1;
    }
-   
-   r->thread = al_create_thread(pulse_audio_update_recorder, r);
+   pa_stream_set_state_callback(pa->s, stream_notify_cb, NULL);
+   pa_stream_set_read_callback(pa->s, stream_request_cb, NULL);
+
+   if (pa_stream_connect_record(pa->s, NULL, &pa->ba,
+         PA_STREAM_ADJUST_LATENCY) < 0 || !wait_stream_ready(pa->s)) {
+      pa_stream_unref(pa->s);
+      pa_threaded_mainloop_unlock(mainloop);
+      ALLEGRO_ERROR("pa_stream_connect_record() failed.\n");
+      al_free(pa);
+      return 1;
+   }
+
+   pa_threaded_mainloop_unlock(mainloop);
+
    r->extra = pa;
-   
-   return 0;   
+   r->thread = al_create_thread(pulse_audio_update_recorder, r);
+
+   return 0;
 };
 
 static void pulseaudio_deallocate_recorder(ALLEGRO_AUDIO_RECORDER *r)
 {
    PULSEAUDIO_RECORDER *pa = (PULSEAUDIO_RECORDER *) r->extra;
-   
-   pa_simple_free(pa->s);
+
+   pa_threaded_mainloop_lock(mainloop);
+   pa_stream_disconnect(pa->s);
+   pa_stream_unref(pa->s);
+   pa_threaded_mainloop_unlock(mainloop);
    al_free(r->extra);
 }
 
@@ -526,9 +768,11 @@ ALLEGRO_AUDIO_DRIVER _al_kcm_pulseaudio_driver =
 
    pulseaudio_get_voice_position,
    pulseaudio_set_voice_position,
-   
+
    pulseaudio_allocate_recorder,
-   pulseaudio_deallocate_recorder
+   pulseaudio_deallocate_recorder,
+
+   pulseaudio_get_voice_latency
 };
 
 /* vim: set sts=3 sw=3 et: */
@@ -43,26 +43,26 @@ ALLEGRO_AUDIO_RECORDER *al_create_audio_recorder(size_t fragment_count,
    
    r->sample_size = al_get_channel_count(chan_conf) * al_get_audio_depth_size(depth);
 
+   r->fragment_size = r->samples * r->sample_size;
    r->fragments = al_malloc(r->fragment_count * sizeof(uint8_t *));
-   if (!r->fragments) {
+   r->fragment_samples = al_calloc(r->fragment_count, sizeof(unsigned int));
+   r->fragment_held = al_calloc(r->fragment_count, sizeof(_AL_ATOMIC));
+   r->ring = al_malloc(r->fragment_count * r->fragment_size);
+   r->scratch = al_malloc(r->fragment_size);
+   if (!r->fragments || !r->fragment_samples || !r->fragment_held ||
+         !r->ring || !r->scratch) {
+      al_free(r->fragments);
+      al_free(r->fragment_samples);
+      al_free((void *)r->fragment_held);
+      al_free(r->ring);
+      al_free(r->scratch);
       al_free(r);
       ALLEGRO_ERROR("Unable to allocate memory for ALLEGRO_AUDIO_RECORDER fragments\n");
       return false;
    }
 
-   r->fragment_size = r->samples * r->sample_size;
    for (i = 0; i < fragment_count; ++i) {
-      r->fragments[i] = al_malloc(r->fragment_size);
-      if (!r->fragments[i]) {
-         size_t j;
-         for (j = 0; j < i; ++j) {
-            al_free(r->fragments[j]);
-         }
-         al_free(r->fragments);
-
-         ALLEGRO_ERROR("Unable to allocate memory for ALLEGRO_AUDIO_RECORDER fragments\n");
-         return false;
-      }
+      r->fragments[i] = (char *)r->ring + i * r->fragment_size;
    }
 
    if (_al_kcm_driver->allocate_recorder(r)) {
@@ -161,6 +161,202 @@ void al_destroy_audio_recorder(ALLEGRO_AUDIO_RECORDER *r)
    al_destroy_user_event_source(&r->source);     
    al_destroy_mutex(r->mutex);
    al_destroy_cond(r->cond);
-   
+
+   al_free(r->fragments);
+   al_free(r->fragment_samples);
+   al_free((void *)r->fragment_held);
+   al_free(r->ring);
+   al_free(r->scratch);
    al_free(r);
-}
\ No newline at end of file
+}
+
+
+/* _al_kcm_recorder_begin_fragment:
+ *  Returns the buffer the driver should record the next fragment into. If the
+ *  application reads spans and has not yet consumed the whole ring, or still
+ *  holds the FRAGMENT event of the fragment due to be reused, this is a
+ *  scratch buffer whose contents will be dropped and counted as an overrun.
+ *  Call _al_kcm_recorder_end_fragment once it has been filled.
+ */
+void *_al_kcm_recorder_begin_fragment(ALLEGRO_AUDIO_RECORDER *r)
+{
+   unsigned int written = r->fragments_written;
+   unsigned int read = r->fragments_read;
+
+   if ((r->has_reader && written - read >= r->fragment_count) ||
+         _al_atomic_load_acquire(&r->fragment_held[written % r->fragment_count])) {
+      r->writing_scratch = true;
+      return r->scratch;
+   }
+
+   r->writing_scratch = false;
+   return r->fragments[written % r->fragment_count];
+}
+
+
+/* release_fragment_event:
+ *  Destructor of FRAGMENT events, called once the last copy of the event is
+ *  released with al_unref_user_event (or dropped from its queues).
+ */
+static void release_fragment_event(ALLEGRO_USER_EVENT *event)
+{
+   ALLEGRO_AUDIO_RECORDER_EVENT *e = (ALLEGRO_AUDIO_RECORDER_EVENT *)event;
+   ALLEGRO_AUDIO_RECORDER *r = e->source;
+   size_t i = ((char *)e->buffer - (char *)r->ring) / r->fragment_size;
+
+   /* Also a barrier: we are done reading before the driver may reuse the
+    * fragment.
+    */
+   _al_atomic_store_release(&r->fragment_held[i], 0);
+}
+
+
+/* _al_kcm_recorder_end_fragment:
+ *  Publishes 'samples' samples recorded into the buffer returned by
+ *  _al_kcm_recorder_begin_fragment and emits a FRAGMENT event for them.
+ */
+void _al_kcm_recorder_end_fragment(ALLEGRO_AUDIO_RECORDER *r,
+   unsigned int samples)
+{
+   ALLEGRO_EVENT user_event;
+   ALLEGRO_AUDIO_RECORDER_EVENT *e;
+   unsigned int i;
+
+   if (r->writing_scratch) {
+      r->overrun_samples += samples;
+      return;
+   }
+
+   i = (unsigned int)r->fragments_written % r->fragment_count;
+   r->fragment_samples[i] = samples;
+   /* Also a full memory barrier: the data is visible before the count. */
+   _al_fetch_and_add1(&r->fragments_written);
+
+   user_event.user.type = ALLEGRO_EVENT_AUDIO_RECORDER_FRAGMENT;
+   e = al_get_audio_recorder_event(&user_event);
+   e->buffer = r->fragments[i];
+   e->samples = samples;
+   r->fragment_held[i] = 1;
+   al_emit_user_event(&r->source, &user_event, release_fragment_event);
+}
+
+
+/* _al_kcm_recorder_write:
+ *  Appends recorded samples, emitting an event for every fragment filled.
+ *  NULL data records silence.
+ */
+void _al_kcm_recorder_write(ALLEGRO_AUDIO_RECORDER *r, const void *data,
+   unsigned int samples)
+{
+   const char *src = data;
+
+   while (samples > 0) {
+      char *dest;
+      unsigned int n = r->samples - r->write_fill;
+      if (n > samples)
+         n = samples;
+
+      if (r->write_fill == 0)
+         dest = _al_kcm_recorder_begin_fragment(r);
+      else if (r->writing_scratch)
+         dest = r->scratch;
+      else
+         dest = r->fragments[(unsigned int)r->fragments_written % r->fragment_count];
+      dest += r->write_fill * r->sample_size;
+
+      if (src) {
+         memcpy(dest, src, n * r->sample_size);
+         src += n * r->sample_size;
+      }
+      else {
+         al_fill_silence(dest, n, r->depth, r->chan_conf);
+      }
+      r->write_fill += n;
+      samples -= n;
+
+      if (r->write_fill == r->samples) {
+         _al_kcm_recorder_end_fragment(r, r->samples);
+         r->write_fill = 0;
+      }
+   }
+}
+
+
+/* Function: al_get_audio_recorder_span
+ */
+void *al_get_audio_recorder_span(ALLEGRO_AUDIO_RECORDER *r,
+   unsigned int *samples)
+{
+   unsigned int read, avail, first, last, n;
+
+   ASSERT(r);
+   ASSERT(samples);
+
+   if (!r->has_reader) {
+      /* Older fragments may be overwritten right now; start afresh. */
+      r->fragments_read = r->fragments_written;
+      r->read_offset = 0;
+      r->has_reader = true;
+   }
+
+   read = r->fragments_read;
+   avail = (unsigned int)r->fragments_written - read;
+   if (avail == 0) {
+      *samples = 0;
+      return NULL;
+   }
+
+   /* Extend the span over the following fragments as long as they are
+    * adjacent in memory and the previous one was completely filled.
+    */
+   first = read % r->fragment_count;
+   n = r->fragment_samples[first] - r->read_offset;
+   for (last = first; last + 1 < r->fragment_count &&
+         last - first + 1 < avail &&
+         r->fragment_samples[last] == r->samples; last++) {
+      n += r->fragment_samples[last + 1];
+   }
+
+   *samples = n;
+   return (char *)r->fragments[first] + r->read_offset * r->sample_size;
+}
+
+
+/* Function: al_consume_audio_recorder_span
+ */
+void al_consume_audio_recorder_span(ALLEGRO_AUDIO_RECORDER *r,
+   unsigned int samples)
+{
+   ASSERT(r);
+
+   if (!r->has_reader)
+      return;
+
+   while (samples > 0 &&
+         (unsigned int)r->fragments_written != (unsigned int)r->fragments_read) {
+      unsigned int i = (unsigned int)r->fragments_read % r->fragment_count;
+      unsigned int left = r->fragment_samples[i] - r->read_offset;
+
+      if (samples < left) {
+         r->read_offset += samples;
+         break;
+      }
+
+      samples -= left;
+      r->read_offset = 0;
+      /* Also a full memory barrier: we are done reading before the
+       * driver may reuse the fragment.
+       */
+      _al_fetch_and_add1(&r->fragments_read);
+   }
+}
+
+
+/* Function: al_get_audio_recorder_overruns
+ */
+unsigned int al_get_audio_recorder_overruns(ALLEGRO_AUDIO_RECORDER *r)
+{
+   ASSERT(r);
+
+   return r->overrun_samples;
+}
@@ -138,5 +138,7 @@ ALLEGRO_AUDIO_DRIVER _al_kcm_sdl_driver =
    sdl_set_voice_position,
 
    NULL, //sdl_allocate_recorder,
-   NULL  //sdl_deallocate_recorder
+   NULL, //sdl_deallocate_recorder
+
+   NULL
 };
@@ -48,6 +48,23 @@
 typedef struct ALLEGRO_FONT ALLEGRO_FONT;
 typedef struct ALLEGRO_FONT_VTABLE ALLEGRO_FONT_VTABLE;
 
+/* Type: ALLEGRO_PREPARED_TEXT
+ */
+typedef struct ALLEGRO_PREPARED_TEXT ALLEGRO_PREPARED_TEXT;
+
+/* Type: ALLEGRO_TEXT_ITEM
+ */
+typedef struct ALLEGRO_TEXT_ITEM ALLEGRO_TEXT_ITEM;
+
+struct ALLEGRO_TEXT_ITEM
+{
+   const ALLEGRO_FONT *font;
+   ALLEGRO_COLOR color;
+   float x, y;
+   int flags;
+   const char *text;
+};
+
 struct ALLEGRO_FONT
 {
    void *data;
@@ -112,6 +129,13 @@ ALLEGRO_FONT_FUNC(uint32_t, al_get_allegro_font_version, (void));
 ALLEGRO_FONT_FUNC(int, al_get_font_ranges, (ALLEGRO_FONT *font,
    int ranges_count, int *ranges));
 
+ALLEGRO_FONT_FUNC(ALLEGRO_PREPARED_TEXT *, al_create_prepared_text, (const ALLEGRO_FONT *font, char const *text));
+ALLEGRO_FONT_FUNC(ALLEGRO_PREPARED_TEXT *, al_create_prepared_ustr, (const ALLEGRO_FONT *font, ALLEGRO_USTR const *ustr));
+ALLEGRO_FONT_FUNC(void, al_destroy_prepared_text, (ALLEGRO_PREPARED_TEXT *prep));
+ALLEGRO_FONT_FUNC(void, al_draw_prepared_text, (ALLEGRO_PREPARED_TEXT *prep, ALLEGRO_COLOR color, float x, float y, int flags));
+ALLEGRO_FONT_FUNC(int, al_get_prepared_text_width, (ALLEGRO_PREPARED_TEXT *prep));
+ALLEGRO_FONT_FUNC(void, al_draw_text_items, (const ALLEGRO_TEXT_ITEM *items, int count));
+
 ALLEGRO_FONT_FUNC(void, al_draw_multiline_text, (const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, float max_width, float line_height, int flags, const char *text));
 ALLEGRO_FONT_FUNC(void, al_draw_multiline_textf, (const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, float max_width, float line_height, int flags, const char *format, ...));
 ALLEGRO_FONT_FUNC(void, al_draw_multiline_ustr, (const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, float max_width, float line_height, int flags, const ALLEGRO_USTR *text));
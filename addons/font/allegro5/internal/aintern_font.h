@@ -0,0 +1,61 @@
+#ifndef __al_included_allegro_aintern_font_h
+#define __al_included_allegro_aintern_font_h
+
+#include "../allegro_font.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* One glyph of a prepared text, as handed out by a font's prepare_text
+ * method.  The source region is in bitmap coordinates, the destination
+ * relative to the origin of the text.
+ */
+typedef struct _AL_PREPARED_GLYPH
+{
+   ALLEGRO_BITMAP *bitmap;
+   float sx, sy, sw, sh;
+   float dx, dy;
+   /* Draw with this color instead of the one passed when drawing, e.g. for
+    * glyph borders.
+    */
+   bool own_color;
+   ALLEGRO_COLOR color;
+} _AL_PREPARED_GLYPH;
+
+ALLEGRO_FONT_FUNC(bool, _al_add_prepared_glyph, (ALLEGRO_PREPARED_TEXT *prep,
+   const _AL_PREPARED_GLYPH *glyph));
+
+/* Methods which fonts implemented inside Allegro have beyond those of
+ * ALLEGRO_FONT_VTABLE.  They are kept out of the public vtable, so that
+ * fonts from outside keep working.  Any of them may be NULL.
+ */
+typedef struct _AL_FONT_METHODS
+{
+   bool (*prepare_text)(const ALLEGRO_FONT *f, const ALLEGRO_USTR *text,
+      ALLEGRO_PREPARED_TEXT *prep);
+   int (*get_glyph_advances)(const ALLEGRO_FONT *f, const ALLEGRO_USTR *text,
+      float *kerning, float *advances);
+   void (*use_glyph_pages)(const ALLEGRO_FONT *f,
+      ALLEGRO_BITMAP * const *pages, int count);
+   /* Changes whenever glyphs already handed out by prepare_text may no
+    * longer be valid, or the text may have changed size.
+    */
+   int (*get_generation)(const ALLEGRO_FONT *f);
+} _AL_FONT_METHODS;
+
+ALLEGRO_FONT_FUNC(bool, _al_register_font_methods,
+   (const ALLEGRO_FONT_VTABLE *vtable, const _AL_FONT_METHODS *methods));
+ALLEGRO_FONT_FUNC(void, _al_unregister_font_methods,
+   (const ALLEGRO_FONT_VTABLE *vtable));
+ALLEGRO_FONT_FUNC(const _AL_FONT_METHODS *, _al_get_font_methods,
+   (const ALLEGRO_FONT *f));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim: set sts=3 sw=3 et: */
@@ -12,6 +12,7 @@
  *      See readme.txt for copyright information.
  */
 
+#include <limits.h>
 #include <string.h>
 #include "allegro5/allegro.h"
 #include "allegro5/allegro_font.h"
@@ -19,6 +20,7 @@
 #include "allegro5/internal/aintern_bitmap.h"
 #include "allegro5/internal/aintern_exitfunc.h"
 #include "allegro5/internal/aintern_vector.h"
+#include "allegro5/internal/aintern_font.h"
 
 #include "font.h"
 
@@ -32,9 +34,17 @@ typedef struct
 } FONT_HANDLER;
 
 
+typedef struct
+{
+   const ALLEGRO_FONT_VTABLE *vtable;
+   const _AL_FONT_METHODS *methods;
+} FONT_METHODS_ENTRY;
+
+
 /* globals */
 static bool font_inited = false;
 static _AL_VECTOR font_handlers;
+static _AL_VECTOR font_methods = _AL_VECTOR_INITIALIZER(FONT_METHODS_ENTRY);
 
 
 /* al_font_404_character:
@@ -106,6 +116,26 @@ static void color_get_text_dimensions(ALLEGRO_FONT const *f,
 
 
 
+/* Glyphs of color fonts are looked up through a two-level table: a
+ * directory of pages covering the codepoints between the lowest and highest
+ * range, and pages of LOOKUP_PAGE_SIZE glyph pointers allocated only where
+ * some range has glyphs. This keeps lookups constant time no matter how
+ * many ranges a font has, without allocating for the gaps between them.
+ */
+#define LOOKUP_PAGE_BITS   8
+#define LOOKUP_PAGE_SIZE   (1 << LOOKUP_PAGE_BITS)
+#define LOOKUP_PAGE_MASK   (LOOKUP_PAGE_SIZE - 1)
+
+struct ALLEGRO_FONT_COLOR_LOOKUP
+{
+   int first_page;            /* page number of pages[0] */
+   int page_count;
+   ALLEGRO_BITMAP ***pages;   /* NULL where no range has glyphs */
+   ALLEGRO_BITMAP *missing;   /* drawn for characters not in the font */
+};
+
+
+
 static ALLEGRO_FONT_COLOR_DATA *_al_font_find_page(
    ALLEGRO_FONT_COLOR_DATA *cf, int ch)
 {
@@ -118,6 +148,109 @@ static ALLEGRO_FONT_COLOR_DATA *_al_font_find_page(
 }
 
 
+
+static ALLEGRO_BITMAP *lookup_glyph(const ALLEGRO_FONT_COLOR_LOOKUP *lookup,
+   int ch)
+{
+   int page;
+
+   if (ch < 0)
+      return NULL;
+
+   page = (ch >> LOOKUP_PAGE_BITS) - lookup->first_page;
+   if (page < 0 || page >= lookup->page_count || !lookup->pages[page])
+      return NULL;
+
+   return lookup->pages[page][ch & LOOKUP_PAGE_MASK];
+}
+
+
+
+static void destroy_lookup(ALLEGRO_FONT_COLOR_LOOKUP *lookup)
+{
+   int i;
+
+   if (!lookup)
+      return;
+
+   if (lookup->pages) {
+      for (i = 0; i < lookup->page_count; i++)
+         al_free(lookup->pages[i]);
+      al_free(lookup->pages);
+   }
+   al_free(lookup);
+}
+
+
+
+/* Internal function: _al_font_color_build_lookup
+ *  Builds the glyph lookup table of a color font once all its ranges are
+ *  in place. Where ranges overlap the first one wins, as with the linked
+ *  list. Without the table glyphs are still found by walking the ranges.
+ */
+bool _al_font_color_build_lookup(ALLEGRO_FONT *f)
+{
+   ALLEGRO_FONT_COLOR_DATA *head = f->data;
+   ALLEGRO_FONT_COLOR_DATA *cf;
+   ALLEGRO_FONT_COLOR_LOOKUP *lookup;
+   int first_page = INT_MAX;
+   int last_page = -1;
+   int ch;
+
+   if (!head)
+      return true;
+
+   for (cf = head; cf; cf = cf->next) {
+      if (cf->end <= _ALLEGRO_MAX(cf->begin, 0))
+         continue;
+      first_page = _ALLEGRO_MIN(first_page,
+         _ALLEGRO_MAX(cf->begin, 0) >> LOOKUP_PAGE_BITS);
+      last_page = _ALLEGRO_MAX(last_page, (cf->end - 1) >> LOOKUP_PAGE_BITS);
+   }
+
+   lookup = al_calloc(1, sizeof *lookup);
+   if (!lookup)
+      return false;
+
+   if (last_page >= first_page) {
+      lookup->first_page = first_page;
+      lookup->page_count = 1 + last_page - first_page;
+      lookup->pages = al_calloc(lookup->page_count, sizeof *lookup->pages);
+      if (!lookup->pages) {
+         destroy_lookup(lookup);
+         return false;
+      }
+   }
+
+   for (cf = head; cf; cf = cf->next) {
+      for (ch = _ALLEGRO_MAX(cf->begin, 0); ch < cf->end; ch++) {
+         int page = (ch >> LOOKUP_PAGE_BITS) - lookup->first_page;
+         ALLEGRO_BITMAP **slot;
+
+         if (!lookup->pages[page]) {
+            lookup->pages[page] = al_calloc(LOOKUP_PAGE_SIZE,
+               sizeof(ALLEGRO_BITMAP *));
+            if (!lookup->pages[page]) {
+               destroy_lookup(lookup);
+               return false;
+            }
+         }
+
+         slot = &lookup->pages[page][ch & LOOKUP_PAGE_MASK];
+         if (!*slot)
+            *slot = cf->bitmaps[ch - cf->begin];
+      }
+   }
+
+   lookup->missing = lookup_glyph(lookup, al_font_404_character);
+
+   destroy_lookup(head->lookup);
+   head->lookup = lookup;
+   return true;
+}
+
+
+
 /* _color_find_glyph:
  *  Helper for color vtable entries, below.
  */
@@ -125,6 +258,11 @@ static ALLEGRO_BITMAP* _al_font_color_find_glyph(const ALLEGRO_FONT* f, int ch)
 {
     ALLEGRO_FONT_COLOR_DATA* cf = (ALLEGRO_FONT_COLOR_DATA*)(f->data);
 
+    if (cf && cf->lookup) {
+        ALLEGRO_BITMAP *g = lookup_glyph(cf->lookup, ch);
+        return g ? g : cf->lookup->missing;
+    }
+
     cf = _al_font_find_page(cf, ch);
     if (cf) {
         return cf->bitmaps[ch - cf->begin];
@@ -152,6 +290,29 @@ static int color_char_length(const ALLEGRO_FONT* f, int ch)
 
 
 
+/* color_get_glyph_advances:
+ *  (color vtable entry)
+ *  Color fonts have no kerning, each character simply advances by the
+ *  width of its glyph.
+ */
+static int color_get_glyph_advances(const ALLEGRO_FONT* f,
+   const ALLEGRO_USTR *text, float *kerning, float *advances)
+{
+    int pos = 0;
+    int i = 0;
+    int32_t ch;
+
+    while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+        kerning[i] = 0;
+        advances[i] = color_char_length(f, ch);
+        i++;
+    }
+
+    return 0;
+}
+
+
+
 /* color_render_char:
  *  (color vtable entry)
  *  Renders a color character onto a bitmap, at the specified location,
@@ -184,11 +345,14 @@ static int color_render_char(const ALLEGRO_FONT* f,
  *  Renders a color font onto a bitmap, at the specified location, using
  *  the specified colors. If fg == -1, render as color, else render as
  *  mono; if bg == -1, render as transparent, else render as opaque.
+ *  All glyphs are sub-bitmaps of the same glyph sheet, so with drawing
+ *  held the whole text goes out as a single batch.
  */
 static int color_render(const ALLEGRO_FONT* f, ALLEGRO_COLOR color,
    const ALLEGRO_USTR *text,
     float x, float y)
 {
+    float h = f->vtable->font_height(f);
     int pos = 0;
     int advance = 0;
     int32_t ch;
@@ -196,7 +360,14 @@ static int color_render(const ALLEGRO_FONT* f, ALLEGRO_COLOR color,
 
     al_hold_bitmap_drawing(true);
     while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
-        advance += f->vtable->render_char(f, color, ch, x + advance, y);
+        ALLEGRO_BITMAP *g = _al_font_color_find_glyph(f, ch);
+
+        if (!g)
+            continue;
+
+        al_draw_tinted_bitmap(g, color, x + advance,
+            y + (h - al_get_bitmap_height(g))/2.0f, 0);
+        advance += al_get_bitmap_width(g);
     }
     al_hold_bitmap_drawing(held);
     return advance;
@@ -204,6 +375,45 @@ static int color_render(const ALLEGRO_FONT* f, ALLEGRO_COLOR color,
 
 
 
+/* color_prepare_text:
+ *  (color vtable entry)
+ *  Hands out the glyphs of a text for al_create_prepared_text, placed as
+ *  color_render would draw them.
+ */
+static bool color_prepare_text(const ALLEGRO_FONT* f,
+   const ALLEGRO_USTR *text, ALLEGRO_PREPARED_TEXT *prep)
+{
+    int h = f->vtable->font_height(f);
+    int pos = 0;
+    int advance = 0;
+    int32_t ch;
+
+    while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+        ALLEGRO_BITMAP *g = _al_font_color_find_glyph(f, ch);
+        _AL_PREPARED_GLYPH glyph;
+
+        if (!g)
+            continue;
+
+        glyph.bitmap = g;
+        glyph.sx = 0;
+        glyph.sy = 0;
+        glyph.sw = al_get_bitmap_width(g);
+        glyph.sh = al_get_bitmap_height(g);
+        glyph.dx = advance;
+        glyph.dy = ((float)h - glyph.sh)/2.0f;
+        glyph.own_color = false;
+        if (!_al_add_prepared_glyph(prep, &glyph))
+            return false;
+
+        advance += glyph.sw;
+    }
+
+    return true;
+}
+
+
+
 /* color_destroy:
  *  (color vtable entry)
  *  Destroys a color font.
@@ -218,8 +428,10 @@ static void color_destroy(ALLEGRO_FONT* f)
 
     cf = (ALLEGRO_FONT_COLOR_DATA*)(f->data);
 
-    if (cf)
+    if (cf) {
         glyphs = cf->glyphs;
+        destroy_lookup(cf->lookup);
+    }
 
     while (cf) {
         ALLEGRO_FONT_COLOR_DATA* next = cf->next;
@@ -280,6 +492,14 @@ ALLEGRO_FONT_VTABLE _al_font_vtable_color = {
 };
 
 
+static const _AL_FONT_METHODS color_methods = {
+    color_prepare_text,
+    color_get_glyph_advances,
+    NULL,
+    NULL,
+};
+
+
 static void font_shutdown(void)
 {
     if (!font_inited)
@@ -291,6 +511,7 @@ static void font_shutdown(void)
        _al_vector_delete_at(&font_handlers, _al_vector_size(&font_handlers)-1);
     }
     _al_vector_free(&font_handlers);
+    _al_vector_free(&font_methods);
 
     font_inited = false;
 }
@@ -368,6 +589,73 @@ bool al_register_font_loader(char const *extension,
 
 
 
+/* Internal function: _al_register_font_methods
+ *  Associate the methods in aintern_font.h with the fonts of a vtable.
+ *  Must be called before such fonts are used, e.g. when the addon which
+ *  implements them is initialised.
+ */
+bool _al_register_font_methods(const ALLEGRO_FONT_VTABLE *vtable,
+   const _AL_FONT_METHODS *methods)
+{
+   FONT_METHODS_ENTRY *entry;
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&font_methods); i++) {
+      entry = _al_vector_ref(&font_methods, i);
+      if (entry->vtable == vtable) {
+         entry->methods = methods;
+         return true;
+      }
+   }
+
+   entry = _al_vector_alloc_back(&font_methods);
+   if (!entry)
+      return false;
+   entry->vtable = vtable;
+   entry->methods = methods;
+   return true;
+}
+
+
+
+/* Internal function: _al_unregister_font_methods
+ */
+void _al_unregister_font_methods(const ALLEGRO_FONT_VTABLE *vtable)
+{
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&font_methods); i++) {
+      FONT_METHODS_ENTRY *entry = _al_vector_ref(&font_methods, i);
+      if (entry->vtable == vtable) {
+         _al_vector_delete_at(&font_methods, i);
+         return;
+      }
+   }
+}
+
+
+
+/* Internal function: _al_get_font_methods
+ *  Returns the extra methods of a font, or NULL if it has none.
+ */
+const _AL_FONT_METHODS *_al_get_font_methods(const ALLEGRO_FONT *f)
+{
+   unsigned int i;
+
+   if (f->vtable == &_al_font_vtable_color)
+      return &color_methods;
+
+   for (i = 0; i < _al_vector_size(&font_methods); i++) {
+      FONT_METHODS_ENTRY *entry = _al_vector_ref(&font_methods, i);
+      if (entry->vtable == f->vtable)
+         return entry->methods;
+   }
+
+   return NULL;
+}
+
+
+
 /* Function: al_load_font
  */
 ALLEGRO_FONT *al_load_font(char const *filename, int size, int flags)
@@ -3,14 +3,19 @@
 
 extern ALLEGRO_FONT_VTABLE _al_font_vtable_color;
 
+typedef struct ALLEGRO_FONT_COLOR_LOOKUP ALLEGRO_FONT_COLOR_LOOKUP;
+
 typedef struct ALLEGRO_FONT_COLOR_DATA
 {
    int begin, end;                   /* first char and one-past-the-end char */
    ALLEGRO_BITMAP *glyphs;           /* our glyphs */
    ALLEGRO_BITMAP **bitmaps;         /* sub bitmaps pointing to our glyphs */
    struct ALLEGRO_FONT_COLOR_DATA *next;  /* linked list structure */
+   ALLEGRO_FONT_COLOR_LOOKUP *lookup;     /* first range only, may be NULL */
 } ALLEGRO_FONT_COLOR_DATA;
 
+bool _al_font_color_build_lookup(ALLEGRO_FONT *f);
+
 ALLEGRO_FONT *_al_load_bitmap_font(const char *filename,
    int size, int flags);
 
@@ -273,6 +273,9 @@ ALLEGRO_FONT *al_grab_font_from_bitmap(ALLEGRO_BITMAP *bmp,
       }
    }
    al_restore_state(&backup);
+
+   if (!_al_font_color_build_lookup(f))
+      goto cleanup_and_fail_on_error;
    
    cf = f->data;
    if (cf && cf->bitmaps[0])
@@ -21,12 +21,15 @@
 
 
 #include <math.h>
+#include <string.h>
 #include <ctype.h>
 #include "allegro5/allegro.h"
 
 #include "allegro5/allegro_font.h"
 #include "allegro5/internal/aintern_dtor.h"
 #include "allegro5/internal/aintern_system.h"
+#include "allegro5/internal/aintern_vector.h"
+#include "allegro5/internal/aintern_font.h"
 
 /* If you call this, you're probably making a mistake. */
 /*
@@ -39,6 +42,25 @@
 
 
 
+struct ALLEGRO_PREPARED_TEXT
+{
+   const ALLEGRO_FONT *font;
+   ALLEGRO_USTR *text;
+   int width;
+   /* The glyphs are prepared again if the font has changed since, or if
+    * the font could not provide all of them last time (e.g. there was no
+    * display to create glyph pages with).
+    */
+   int generation;
+   bool complete;
+   /* Fonts without a prepare_text method are drawn through render. */
+   bool direct;
+   _AL_VECTOR glyphs;   /* of _AL_PREPARED_GLYPH */
+   _AL_VECTOR pages;    /* of ALLEGRO_BITMAP *, each one once */
+};
+
+
+
 /* Text usually looks best when aligned to pixels -
  * but if x is 0.5 it may very well end up at an integer
  * position if the current transformation scales by 2 or
@@ -405,118 +427,293 @@ static const ALLEGRO_USTR *ustr_split_next(const ALLEGRO_USTR *ustr,
 
 
 
-/* This returns the next "soft" line of text from ustr
- * that will fit in max_with using the font font, starting at pos *pos.
- * These are "soft" lines because they are broken up if needed at a space
- * or tab character.
- * This function updates pos if needed, and returns the next "soft" line,
- * or NULL if no more soft lines.
- * The soft line will not include the trailing space where the
- * line was split, but pos will be set to point to after that trailing
- * space so iteration can continue easily.
+/* Metrics of the hard line being wrapped. Every character is measured
+ * once per hard line; the width of any soft line is then a running sum
+ * over its characters. The buffers are reused from one hard line to the
+ * next.
  */
-static const ALLEGRO_USTR *get_next_soft_line(const ALLEGRO_USTR *ustr,
-   ALLEGRO_USTR_INFO *info, int *pos,
-   const ALLEGRO_FONT *font, float max_width)
+typedef struct TEXT_LAYOUT {
+   const ALLEGRO_FONT *font;
+   float max_width;
+   const ALLEGRO_USTR *line;
+   int count;           /* characters in line */
+   int capacity;
+   int *chars;
+   int *offsets;        /* byte offset of each character, then the size */
+   /* Only if the font has a get_glyph_advances method, otherwise soft
+    * lines are measured with al_get_ustr_width.
+    */
+   bool have_advances;
+   float *kerning;
+   float *advances;
+   int tail;
+} TEXT_LAYOUT;
+
+
+/* Called with each line of wrapped text and its width, in order. */
+typedef bool (*TEXT_LINE_CB)(int line_num, const ALLEGRO_USTR *line,
+   int width, void *extra);
+
+
+
+static void free_layout(TEXT_LAYOUT *layout)
 {
-   const ALLEGRO_USTR *result = NULL;
-   const char *whitespace = " \t";
-   int old_end = 0;
-   int end = 0;
-   int size = al_ustr_size(ustr);
-   bool first_word = true;
+   al_free(layout->chars);
+   al_free(layout->offsets);
+   al_free(layout->kerning);
+   al_free(layout->advances);
+}
 
-   if (*pos >= size) {
-      return NULL;
+
+
+static bool grow_layout(TEXT_LAYOUT *layout, int count)
+{
+   int *chars, *offsets;
+   float *kerning, *advances;
+   int capacity = 2 * layout->capacity;
+
+   if (count + 1 <= layout->capacity)
+      return true;
+   if (capacity < count + 1)
+      capacity = count + 1;
+
+   chars = al_realloc(layout->chars, capacity * sizeof *chars);
+   if (chars)
+      layout->chars = chars;
+   offsets = al_realloc(layout->offsets, capacity * sizeof *offsets);
+   if (offsets)
+      layout->offsets = offsets;
+   kerning = al_realloc(layout->kerning, capacity * sizeof *kerning);
+   if (kerning)
+      layout->kerning = kerning;
+   advances = al_realloc(layout->advances, capacity * sizeof *advances);
+   if (advances)
+      layout->advances = advances;
+
+   if (!chars || !offsets || !kerning || !advances)
+      return false;
+
+   layout->capacity = capacity;
+   return true;
+}
+
+
+
+/* Decodes the hard line and asks the font for the advance of every
+ * character in it.
+ */
+static bool measure_hard_line(TEXT_LAYOUT *layout, const ALLEGRO_USTR *line)
+{
+   const ALLEGRO_FONT *font = layout->font;
+   const _AL_FONT_METHODS *methods;
+   int pos = 0;
+   int i = 0;
+   int32_t ch;
+
+   layout->line = line;
+   layout->count = al_ustr_length(line);
+   if (!grow_layout(layout, layout->count))
+      return false;
+
+   layout->offsets[0] = 0;
+   while ((ch = al_ustr_get_next(line, &pos)) >= 0) {
+      layout->chars[i] = ch;
+      layout->offsets[++i] = pos;
    }
+   layout->count = i;
 
-   end = *pos;
-   old_end = end;
-   do {
-      /* On to the next word. */
-      end = al_ustr_find_set_cstr(ustr, end, whitespace);
-      if (end < 0)
-         end = size;
-
-      /* Reference to the line that is being built. */
-      result = al_ref_ustr(info, ustr, *pos, end);
-
-      /* Check if the line is too long. If it is, return a soft line. */
-      if (al_get_ustr_width(font, result) > max_width) {
-         /* Corner case: a single word may not even fit the line.
-          * In that case, return the word/line anyway as the "soft line",
-          * the user can set a clip rectangle to cut it. */
-
-         if (first_word) {
-            /* Set pos to character AFTER end to allow easy iteration. */
-            al_ustr_next(ustr, &end);
-            *pos = end;
-            return result;
-         }
-         else {
-            /* Not first word, return old end position without the new word */
-            result = al_ref_ustr(info, ustr, *pos, old_end);
-            /* Set pos to character AFTER end to allow easy iteration. */
-            al_ustr_next(ustr, &old_end);
-            *pos = old_end;
-            return result;
-         }
+   methods = _al_get_font_methods(font);
+   layout->have_advances = methods && methods->get_glyph_advances;
+   if (layout->have_advances) {
+      layout->tail = methods->get_glyph_advances(font, line,
+         layout->kerning, layout->advances);
+   }
+
+   return true;
+}
+
+
+
+/* Width of the characters from first up to end, as al_get_ustr_width
+ * would measure them. *measured and *sum carry the running sum between
+ * calls for the same first character, so extending a line only measures
+ * the new characters.
+ */
+static int soft_line_width(const TEXT_LAYOUT *layout, int first, int end,
+   int *measured, float *sum)
+{
+   ALLEGRO_USTR_INFO info;
+   const ALLEGRO_USTR *ref;
+
+   if (layout->have_advances) {
+      for (; *measured < end; (*measured)++) {
+         /* Kerning against the character before the line does not count. */
+         if (*measured > first)
+            *sum += layout->kerning[*measured];
+         *sum += layout->advances[*measured];
       }
-      first_word = false;
-      old_end    = end;
-      /* Skip the character at end which normally is whitespace. */
-      al_ustr_next(ustr, &end);
-   } while (end < size);
-
-   /* If we get here the whole ustr will fit.*/
-   result = al_ref_ustr(info, ustr, *pos, size);
-   *pos = size;
-   return result;
+      return floor(*sum + 0.5) + layout->tail;
+   }
+
+   ref = al_ref_ustr(&info, layout->line, layout->offsets[first],
+      layout->offsets[end]);
+   return al_get_ustr_width(layout->font, ref);
 }
 
 
-/* Function: al_do_multiline_ustr
+
+static bool is_soft_break(int ch)
+{
+   return ch == ' ' || ch == '\t';
+}
+
+
+
+/* Splits the measured hard line into "soft" lines that fit in max_width,
+ * breaking at a space or tab character, and passes them to the callback.
+ * A soft line does not include the whitespace where the line was split.
+ * A single word that does not even fit on a line becomes a soft line of
+ * its own; the user can set a clip rectangle to cut it.
+ * Returns false if the callback asked to stop.
  */
-void al_do_multiline_ustr(const ALLEGRO_FONT *font, float max_width,
-   const ALLEGRO_USTR *ustr,
-   bool (*cb)(int line_num, const ALLEGRO_USTR * line, void *extra),
-   void *extra)
+static bool break_hard_line(TEXT_LAYOUT *layout, int *line_num,
+   TEXT_LINE_CB cb, void *extra)
+{
+   const int count = layout->count;
+   int first = 0;
+
+   while (first < count) {
+      ALLEGRO_USTR_INFO info;
+      const ALLEGRO_USTR *soft_line;
+      int end = first;
+      int old_end = first;
+      int old_width = 0;
+      int width = 0;
+      int measured = first;
+      float sum = 0;
+      bool first_word = true;
+      bool fits = true;
+
+      do {
+         /* On to the next word. */
+         while (end < count && !is_soft_break(layout->chars[end]))
+            end++;
+
+         width = soft_line_width(layout, first, end, &measured, &sum);
+         if (width > layout->max_width) {
+            fits = false;
+            /* Unless it is the first word, leave the new word for the
+             * next line.
+             */
+            if (!first_word) {
+               end = old_end;
+               width = old_width;
+            }
+            break;
+         }
+
+         first_word = false;
+         old_end = end;
+         old_width = width;
+         /* Skip the character at end which normally is whitespace. */
+         if (end < count)
+            end++;
+      } while (end < count);
+
+      /* If we get here with fits set, the rest of the line fits. */
+      if (fits && end != old_end)
+         width = soft_line_width(layout, first, end, &measured, &sum);
+
+      soft_line = al_ref_ustr(&info, layout->line, layout->offsets[first],
+         layout->offsets[end]);
+      if (!cb(*line_num, soft_line, width, extra))
+         return false;
+      (*line_num)++;
+
+      /* Continue after the whitespace where the line was split. */
+      first = (fits || end == count) ? end : end + 1;
+   }
+
+   return true;
+}
+
+
+
+/* Wraps ustr the way al_do_multiline_ustr documents it, passing every line
+ * to cb together with its width.
+ */
+static void do_multiline_ustr(const ALLEGRO_FONT *font, float max_width,
+   const ALLEGRO_USTR *ustr, TEXT_LINE_CB cb, void *extra)
 {
    const char *linebreak  = "\n";
-   const ALLEGRO_USTR *hard_line, *soft_line;
-   ALLEGRO_USTR_INFO hard_line_info, soft_line_info;
-   int hard_line_pos = 0, soft_line_pos = 0;
+   const ALLEGRO_USTR *hard_line;
+   ALLEGRO_USTR_INFO hard_line_info;
+   TEXT_LAYOUT layout;
+   int hard_line_pos = 0;
    int line_num = 0;
-   bool proceed;
+
+   memset(&layout, 0, sizeof layout);
+   layout.font = font;
+   layout.max_width = max_width;
 
    /* For every "hard" line separated by a newline character... */
    hard_line = ustr_split_next(ustr, &hard_line_info, &hard_line_pos,
       linebreak);
    while (hard_line) {
-      /* For every "soft" line in the "hard" line... */
-      soft_line_pos = 0;
-      soft_line =
-      get_next_soft_line(hard_line, &soft_line_info, &soft_line_pos, font,
-         max_width);
-      /* No soft line here because it's an empty hard line. */
-      if (!soft_line) {
+      if (al_ustr_size(hard_line) == 0) {
          /* Call the callback with empty string to indicate an empty line. */
-         proceed = cb(line_num, al_ustr_empty_string(), extra);
-         if (!proceed) return;
-         line_num ++;
-      }
-      while(soft_line) {
-         /* Call the callback on the next soft line. */
-         proceed = cb(line_num, soft_line, extra);
-         if (!proceed) return;
+         if (!cb(line_num, al_ustr_empty_string(), 0, extra))
+            break;
          line_num++;
-
-         soft_line = get_next_soft_line(hard_line, &soft_line_info,
-            &soft_line_pos, font, max_width);
+      }
+      else {
+         if (!measure_hard_line(&layout, hard_line))
+            break;
+         /* For every "soft" line in the "hard" line... */
+         if (!break_hard_line(&layout, &line_num, cb, extra))
+            break;
       }
       hard_line = ustr_split_next(ustr, &hard_line_info, &hard_line_pos,
          linebreak);
    }
+
+   free_layout(&layout);
+}
+
+
+
+/* Helper struct for al_do_multiline_ustr. */
+typedef struct DO_MULTILINE_USTR_EXTRA {
+   bool (*callback)(int line_num, const ALLEGRO_USTR *line, void *extra);
+   void *extra;
+} DO_MULTILINE_USTR_EXTRA;
+
+
+
+static bool do_multiline_ustr_cb(int line_num, const ALLEGRO_USTR *line,
+   int width, void *extra) {
+   DO_MULTILINE_USTR_EXTRA *s = extra;
+   (void)width;
+
+   return s->callback(line_num, line, s->extra);
+}
+
+
+
+/* Function: al_do_multiline_ustr
+ */
+void al_do_multiline_ustr(const ALLEGRO_FONT *font, float max_width,
+   const ALLEGRO_USTR *ustr,
+   bool (*cb)(int line_num, const ALLEGRO_USTR * line, void *extra),
+   void *extra)
+{
+   DO_MULTILINE_USTR_EXTRA extra2;
+   ASSERT(font);
+   ASSERT(ustr);
+
+   extra2.callback = cb;
+   extra2.extra = extra;
+   do_multiline_ustr(font, max_width, ustr, do_multiline_ustr_cb, &extra2);
 }
 
 
@@ -575,14 +772,31 @@ typedef struct DRAW_MULTILINE_USTR_EXTRA {
 
 /* The function draw_multiline_ustr_cb is the helper callback
  * that implements the actual drawing for al_draw_multiline_ustr.
+ * The width comes from the layout, so aligned lines are not measured
+ * a second time.
  */
 static bool draw_multiline_ustr_cb(int line_num, const ALLEGRO_USTR *line,
-   void *extra) {
+   int width, void *extra) {
    DRAW_MULTILINE_USTR_EXTRA *s = extra;
+   float x = s->x;
    float y;
 
    y  = s->y + (s->line_height * line_num);
-   al_draw_ustr(s->font, s->color, s->x, y, s->flags, line);
+
+   if (s->flags & ALLEGRO_ALIGN_CENTRE) {
+      /* Use integer division to avoid introducing a fractional
+       * component to an integer x value.
+       */
+      x -= width / 2;
+   }
+   else if (s->flags & ALLEGRO_ALIGN_RIGHT) {
+      x -= width;
+   }
+
+   if (s->flags & ALLEGRO_ALIGN_INTEGER)
+      align_to_integer_pixel(&x, &y);
+
+   s->font->vtable->render(s->font, s->color, line, x, y);
    return true;
 }
 
@@ -610,7 +824,7 @@ void al_draw_multiline_ustr(const ALLEGRO_FONT *font,
    }
    extra.flags = flags;
 
-   al_do_multiline_ustr(font, max_width, ustr, draw_multiline_ustr_cb, &extra);
+   do_multiline_ustr(font, max_width, ustr, draw_multiline_ustr_cb, &extra);
 }
 
 
@@ -655,8 +869,415 @@ void al_draw_multiline_textf(const ALLEGRO_FONT *font,
 
 
 
+/* Internal function: _al_add_prepared_glyph
+ *  Called by a font's prepare_text method for each glyph, in drawing order.
+ */
+bool _al_add_prepared_glyph(ALLEGRO_PREPARED_TEXT *prep,
+   const _AL_PREPARED_GLYPH *glyph)
+{
+   _AL_PREPARED_GLYPH *g = _al_vector_alloc_back(&prep->glyphs);
+   if (!g)
+      return false;
+   *g = *glyph;
+   return true;
+}
+
 
 
+/* Collect the bitmaps the glyphs are drawn from, for the font's
+ * use_glyph_pages method.
+ */
+static void collect_prepared_pages(ALLEGRO_PREPARED_TEXT *prep)
+{
+   unsigned int i, j;
 
+   for (i = 0; i < _al_vector_size(&prep->glyphs); i++) {
+      _AL_PREPARED_GLYPH *g = _al_vector_ref(&prep->glyphs, i);
+      ALLEGRO_BITMAP **page;
+
+      for (j = 0; j < _al_vector_size(&prep->pages); j++) {
+         page = _al_vector_ref(&prep->pages, j);
+         if (*page == g->bitmap)
+            break;
+      }
+      if (j < _al_vector_size(&prep->pages))
+         continue;
+
+      page = _al_vector_alloc_back(&prep->pages);
+      if (page)
+         *page = g->bitmap;
+   }
+}
+
+
+
+static int font_generation(const ALLEGRO_FONT *font)
+{
+   const _AL_FONT_METHODS *methods = _al_get_font_methods(font);
+
+   if (methods && methods->get_generation)
+      return methods->get_generation(font);
+   return 0;
+}
+
+
+
+static void prepare_text(ALLEGRO_PREPARED_TEXT *prep)
+{
+   const ALLEGRO_FONT *font = prep->font;
+   const _AL_FONT_METHODS *methods = _al_get_font_methods(font);
+
+   _al_vector_free(&prep->glyphs);
+   _al_vector_free(&prep->pages);
+
+   prep->width = font->vtable->text_length(font, prep->text);
+   prep->generation = font_generation(font);
+
+   if (methods && methods->prepare_text) {
+      prep->direct = false;
+      prep->complete = methods->prepare_text(font, prep->text, prep);
+      if (methods->use_glyph_pages)
+         collect_prepared_pages(prep);
+   }
+   else {
+      prep->direct = true;
+      prep->complete = true;
+   }
+}
+
+
+
+static bool prepared_text_is_current(const ALLEGRO_PREPARED_TEXT *prep)
+{
+   return prep->complete && prep->generation == font_generation(prep->font);
+}
+
+
+
+/* Function: al_create_prepared_ustr
+ */
+ALLEGRO_PREPARED_TEXT *al_create_prepared_ustr(const ALLEGRO_FONT *font,
+   ALLEGRO_USTR const *ustr)
+{
+   ALLEGRO_PREPARED_TEXT *prep;
+   ASSERT(font);
+   ASSERT(ustr);
+
+   prep = al_calloc(1, sizeof *prep);
+   if (!prep)
+      return NULL;
+
+   prep->font = font;
+   prep->text = al_ustr_dup(ustr);
+   if (!prep->text) {
+      al_free(prep);
+      return NULL;
+   }
+   _al_vector_init(&prep->glyphs, sizeof(_AL_PREPARED_GLYPH));
+   _al_vector_init(&prep->pages, sizeof(ALLEGRO_BITMAP *));
+
+   prepare_text(prep);
+
+   return prep;
+}
+
+
+
+/* Function: al_create_prepared_text
+ */
+ALLEGRO_PREPARED_TEXT *al_create_prepared_text(const ALLEGRO_FONT *font,
+   char const *text)
+{
+   ALLEGRO_USTR_INFO info;
+   ASSERT(text);
+   return al_create_prepared_ustr(font, al_ref_cstr(&info, text));
+}
+
+
+
+/* Function: al_destroy_prepared_text
+ */
+void al_destroy_prepared_text(ALLEGRO_PREPARED_TEXT *prep)
+{
+   if (!prep)
+      return;
+
+   _al_vector_free(&prep->glyphs);
+   _al_vector_free(&prep->pages);
+   al_ustr_free(prep->text);
+   al_free(prep);
+}
+
+
+
+/* Function: al_draw_prepared_text
+ */
+void al_draw_prepared_text(ALLEGRO_PREPARED_TEXT *prep,
+   ALLEGRO_COLOR color, float x, float y, int flags)
+{
+   const _AL_FONT_METHODS *methods;
+   unsigned int i;
+   bool held;
+   ASSERT(prep);
+
+   methods = _al_get_font_methods(prep->font);
+   if (!prepared_text_is_current(prep))
+      prepare_text(prep);
+   else if (methods && methods->use_glyph_pages &&
+         !_al_vector_is_empty(&prep->pages)) {
+      /* Preparing marked the glyphs as used, drawing again does not. */
+      methods->use_glyph_pages(prep->font,
+         _al_vector_ref_front(&prep->pages), _al_vector_size(&prep->pages));
+   }
+
+   if (flags & ALLEGRO_ALIGN_CENTRE) {
+      /* Use integer division to avoid introducing a fractional
+       * component to an integer x value.
+       */
+      x -= prep->width / 2;
+   }
+   else if (flags & ALLEGRO_ALIGN_RIGHT) {
+      x -= prep->width;
+   }
+
+   if (flags & ALLEGRO_ALIGN_INTEGER)
+      align_to_integer_pixel(&x, &y);
+
+   if (prep->direct) {
+      prep->font->vtable->render(prep->font, color, prep->text, x, y);
+      return;
+   }
+
+   /* Consecutive glyphs from the same page are batched into one draw. */
+   held = al_is_bitmap_drawing_held();
+   al_hold_bitmap_drawing(true);
+   for (i = 0; i < _al_vector_size(&prep->glyphs); i++) {
+      _AL_PREPARED_GLYPH *g = _al_vector_ref(&prep->glyphs, i);
+      al_draw_tinted_bitmap_region(g->bitmap, g->own_color ? g->color : color,
+         g->sx, g->sy, g->sw, g->sh, x + g->dx, y + g->dy, 0);
+   }
+   al_hold_bitmap_drawing(held);
+}
+
+
+
+/* Function: al_get_prepared_text_width
+ */
+int al_get_prepared_text_width(ALLEGRO_PREPARED_TEXT *prep)
+{
+   ASSERT(prep);
+
+   if (prep->generation != font_generation(prep->font))
+      prepare_text(prep);
+
+   return prep->width;
+}
+
+
+
+/* Glyphs of al_draw_text_items are sorted by the bitmap they are drawn
+ * from, keeping the order of the items for glyphs on the same bitmap.
+ * Glyphs with their own color, i.e. TTF borders, come first so they can
+ * never end up on top of the text they surround.
+ */
+typedef struct TEXT_ITEM_GLYPH {
+   int layer;
+   ALLEGRO_BITMAP *page;
+   int index;
+} TEXT_ITEM_GLYPH;
+
+
+/* Where an item goes, and which glyphs were prepared for it.  Items which
+ * could not be prepared, or whose font dropped glyphs while later items
+ * were prepared, are drawn through the font's render method instead.
+ */
+typedef struct TEXT_ITEM_PLACED {
+   const ALLEGRO_TEXT_ITEM *item;
+   float x, y;
+   bool prepared;
+   int generation;
+   unsigned int first_glyph;
+   unsigned int end_glyph;
+} TEXT_ITEM_PLACED;
+
+
+
+static int compare_text_item_glyphs(const void *a, const void *b)
+{
+   const TEXT_ITEM_GLYPH *ga = a;
+   const TEXT_ITEM_GLYPH *gb = b;
+
+   if (ga->layer != gb->layer)
+      return ga->layer - gb->layer;
+   if (ga->page != gb->page)
+      return (uintptr_t)ga->page < (uintptr_t)gb->page ? -1 : 1;
+   return ga->index - gb->index;
+}
+
+
+
+/* Lays out one item, appending its glyphs to prep->glyphs with their
+ * final position and color. Returns false if the font could not provide
+ * all glyphs, in which case none are kept.
+ */
+static bool prepare_text_item(ALLEGRO_PREPARED_TEXT *prep,
+   const ALLEGRO_TEXT_ITEM *item, const ALLEGRO_USTR *ustr, float x, float y)
+{
+   const ALLEGRO_FONT *font = item->font;
+   const _AL_FONT_METHODS *methods = _al_get_font_methods(font);
+   unsigned int first = _al_vector_size(&prep->glyphs);
+   unsigned int i;
+
+   if (!methods || !methods->prepare_text)
+      return false;
+
+   prep->font = font;
+   if (!methods->prepare_text(font, ustr, prep)) {
+      while (_al_vector_size(&prep->glyphs) > first)
+         _al_vector_delete_at(&prep->glyphs,
+            _al_vector_size(&prep->glyphs) - 1);
+      return false;
+   }
+
+   for (i = first; i < _al_vector_size(&prep->glyphs); i++) {
+      _AL_PREPARED_GLYPH *g = _al_vector_ref(&prep->glyphs, i);
+      g->dx += x;
+      g->dy += y;
+      if (!g->own_color)
+         g->color = item->color;
+   }
+
+   return true;
+}
+
+
+
+/* Function: al_draw_text_items
+ */
+void al_draw_text_items(const ALLEGRO_TEXT_ITEM *items, int count)
+{
+   ALLEGRO_PREPARED_TEXT prep;
+   _AL_VECTOR placed;
+   TEXT_ITEM_GLYPH *order = NULL;
+   const ALLEGRO_TRANSFORM *fwd = NULL;
+   ALLEGRO_TRANSFORM inv;
+   unsigned int num_glyphs;
+   unsigned int i;
+   int j;
+   bool held;
+   ASSERT(items || count == 0);
+
+   memset(&prep, 0, sizeof prep);
+   _al_vector_init(&prep.glyphs, sizeof(_AL_PREPARED_GLYPH));
+   _al_vector_init(&placed, sizeof(TEXT_ITEM_PLACED));
+
+   for (j = 0; j < count; j++) {
+      const ALLEGRO_TEXT_ITEM *item = &items[j];
+      const ALLEGRO_FONT *font = item->font;
+      ALLEGRO_USTR_INFO info;
+      const ALLEGRO_USTR *ustr;
+      TEXT_ITEM_PLACED *p;
+      float x = item->x;
+      float y = item->y;
+      ASSERT(font);
+      ASSERT(item->text);
+
+      ustr = al_ref_cstr(&info, item->text);
+
+      /* Same placement as al_draw_ustr. */
+      if (item->flags & ALLEGRO_ALIGN_CENTRE) {
+         x -= font->vtable->text_length(font, ustr) / 2;
+      }
+      else if (item->flags & ALLEGRO_ALIGN_RIGHT) {
+         x -= font->vtable->text_length(font, ustr);
+      }
+
+      if (item->flags & ALLEGRO_ALIGN_INTEGER) {
+         /* The transformation is the same for all items. */
+         if (!fwd) {
+            fwd = al_get_current_transform();
+            al_copy_transform(&inv, fwd);
+            al_invert_transform(&inv);
+         }
+         align_to_integer_pixel_inner(fwd, &inv, &x, &y);
+      }
+
+      p = _al_vector_alloc_back(&placed);
+      if (!p)
+         continue;
+      p->item = item;
+      p->x = x;
+      p->y = y;
+      p->first_glyph = _al_vector_size(&prep.glyphs);
+      p->prepared = prepare_text_item(&prep, item, ustr, x, y);
+      p->end_glyph = _al_vector_size(&prep.glyphs);
+      p->generation = font_generation(font);
+   }
+
+   /* Preparing a later item may have emptied a glyph page which an
+    * earlier one draws from; drop the glyphs of such items.
+    */
+   for (i = 0; i < _al_vector_size(&placed); i++) {
+      TEXT_ITEM_PLACED *p = _al_vector_ref(&placed, i);
+      unsigned int k;
+      if (!p->prepared || p->generation == font_generation(p->item->font))
+         continue;
+      p->prepared = false;
+      for (k = p->first_glyph; k < p->end_glyph; k++) {
+         _AL_PREPARED_GLYPH *g = _al_vector_ref(&prep.glyphs, k);
+         g->bitmap = NULL;
+      }
+   }
+
+   num_glyphs = _al_vector_size(&prep.glyphs);
+   if (num_glyphs > 0)
+      order = al_malloc(num_glyphs * sizeof *order);
+   if (order) {
+      num_glyphs = 0;
+      for (i = 0; i < _al_vector_size(&prep.glyphs); i++) {
+         _AL_PREPARED_GLYPH *g = _al_vector_ref(&prep.glyphs, i);
+         ALLEGRO_BITMAP *parent;
+         if (!g->bitmap)
+            continue;
+         parent = al_get_parent_bitmap(g->bitmap);
+         order[num_glyphs].layer = g->own_color ? 0 : 1;
+         order[num_glyphs].page = parent ? parent : g->bitmap;
+         order[num_glyphs].index = i;
+         num_glyphs++;
+      }
+      qsort(order, num_glyphs, sizeof *order, compare_text_item_glyphs);
+   }
+
+   /* With drawing held, each run of glyphs from the same page becomes a
+    * single draw.
+    */
+   held = al_is_bitmap_drawing_held();
+   al_hold_bitmap_drawing(true);
+
+   for (i = 0; i < num_glyphs; i++) {
+      _AL_PREPARED_GLYPH *g = _al_vector_ref(&prep.glyphs,
+         order ? (unsigned int)order[i].index : i);
+      if (!g->bitmap)
+         continue;
+      al_draw_tinted_bitmap_region(g->bitmap, g->color,
+         g->sx, g->sy, g->sw, g->sh, g->dx, g->dy, 0);
+   }
+
+   for (i = 0; i < _al_vector_size(&placed); i++) {
+      TEXT_ITEM_PLACED *p = _al_vector_ref(&placed, i);
+      ALLEGRO_USTR_INFO info;
+      const ALLEGRO_FONT *font = p->item->font;
+      if (p->prepared)
+         continue;
+      font->vtable->render(font, p->item->color,
+         al_ref_cstr(&info, p->item->text), p->x, p->y);
+   }
+
+   al_hold_bitmap_drawing(held);
+
+   al_free(order);
+   _al_vector_free(&prep.glyphs);
+   _al_vector_free(&placed);
+}
 
 /* vim: set sts=3 sw=3 et: */
@@ -12,6 +12,8 @@
 #define ALLEGRO_TTF_MONOCHROME  2
 #define ALLEGRO_TTF_NO_AUTOHINT 4
 #define ALLEGRO_TTF_RENDER_BORDER 8
+#define ALLEGRO_TTF_BACKGROUND_RASTERIZE 16
+#define ALLEGRO_TTF_DISTANCE_FIELD 32
 
 #if (defined ALLEGRO_MINGW32) || (defined ALLEGRO_MSVC) || (defined ALLEGRO_BCC32)
    #ifndef ALLEGRO_STATICLINK
@@ -45,6 +47,8 @@ ALLEGRO_TTF_FUNC(uint32_t, al_get_allegro_ttf_version, (void));
 ALLEGRO_TTF_FUNC(void, al_set_ttf_border_color, (ALLEGRO_FONT *font, ALLEGRO_COLOR color));
 ALLEGRO_TTF_FUNC(void, al_set_ttf_border_width, (ALLEGRO_FONT *font, float width));
 ALLEGRO_TTF_FUNC(void, al_set_ttf_border, (ALLEGRO_FONT *font, float width, ALLEGRO_COLOR color));
+ALLEGRO_TTF_FUNC(bool, al_cache_ttf_glyphs, (ALLEGRO_FONT *font, int ranges_n, const int ranges[]));
+ALLEGRO_TTF_FUNC(void, al_set_ttf_cache_budget, (ALLEGRO_FONT *font, size_t bytes));
 
 #ifdef __cplusplus
    }
@@ -3,20 +3,34 @@
 #include "allegro5/allegro_opengl.h"
 #endif
 #include "allegro5/internal/aintern.h"
+#include "allegro5/internal/aintern_atomicops.h"
+#include "allegro5/internal/aintern_bitmap.h"
+#include "allegro5/internal/aintern_display.h"
+#include "allegro5/internal/aintern_file.h"
 #include "allegro5/internal/aintern_vector.h"
 
 #include "allegro5/allegro_ttf.h"
+#include "allegro5/internal/aintern_font.h"
 #include "allegro5/internal/aintern_ttf_cfg.h"
 #include "allegro5/internal/aintern_dtor.h"
 #include "allegro5/internal/aintern_system.h"
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_ADVANCES_H
+#include FT_SIZES_H
 #include FT_STROKER_H
 
 #include <stdlib.h>
 #include <math.h>
 
+#ifdef ALLEGRO_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 ALLEGRO_DEBUG_CHANNEL("font")
 
 
@@ -34,9 +48,29 @@ ALLEGRO_DEBUG_CHANNEL("font")
 
 #define RANGE_SIZE   128
 
+/* Codepoints below LATIN_SIZE are cached in a flat array, the rest in a
+ * hash table which starts at CHAR_TABLE_SIZE entries and doubles when half
+ * full.
+ */
+#define LATIN_SIZE         256
+#define CHAR_TABLE_SIZE    256
+
+/* Kerning pairs are cached in a fixed size table; pairs which don't fit in
+ * KERNING_PROBES slots from their hash position go to FreeType every time.
+ */
+#define KERNING_CACHE_SIZE 2048
+#define KERNING_PROBES     8
+
 /* Freetype expreses font metrics in units equal to 1/64 of a pixel */
 #define FREETYPE_UNITS_PER_PIXEL 64.0
 
+/* Distance fields are computed from outlines rendered this many times
+ * larger than the field itself.  Glyph metrics of distance field fonts are
+ * kept at that resolution too.
+ */
+#define DISTANCE_FIELD_OVERSAMPLE   4
+#define DISTANCE_FIELD_FAR          16000
+
 typedef struct REGION
 {
    short x;
@@ -46,6 +80,14 @@ typedef struct REGION
 } REGION;
 
 
+enum
+{
+   GLYPH_EMPTY,      /* nothing is known about the glyph yet */
+   GLYPH_METRICS,    /* offsets, advance and size are valid */
+   GLYPH_CACHED      /* the glyph is on a page, or has zero size */
+};
+
+
 typedef struct ALLEGRO_TTF_GLYPH_DATA
 {
    ALLEGRO_BITMAP *page_bitmap;
@@ -53,34 +95,211 @@ typedef struct ALLEGRO_TTF_GLYPH_DATA
    short offset_x;
    short offset_y;
    short advance;
+   /* Written with a release store once the fields above are filled in. */
+   volatile _AL_ATOMIC state;
+   /* Waiting for the background worker or for upload; protected by the
+    * font lock.
+    */
+   bool queued;
+   /* Value of the font's use clock when the glyph was last drawn; only
+    * kept up to date if the font has a cache budget.
+    */
+   volatile _AL_ATOMIC last_use;
+   /* Distance field fonts only: the field, (region.w - 2) x (region.h - 2)
+    * bytes.  It is kept after the glyph is put on a page, for drawing to
+    * memory bitmaps and for putting the glyph back after an eviction.
+    */
+   unsigned char *field;
 } ALLEGRO_TTF_GLYPH_DATA;
 
 
-typedef struct ALLEGRO_TTF_GLYPH_RANGE
+/* A codepoint with its glyph index and glyphs.  The entry is complete once
+ * key is set, and never changes after that.
+ */
+typedef struct CHAR_ENTRY
+{
+   volatile _AL_ATOMIC key;   /* codepoint + 1, or 0 if empty */
+   int ft_index;
+   ALLEGRO_TTF_GLYPH_DATA *glyph;
+   ALLEGRO_TTF_GLYPH_DATA *border_glyph;
+} CHAR_ENTRY;
+
+
+typedef struct CHAR_TABLE
 {
-   int32_t range_start;
-   ALLEGRO_TTF_GLYPH_DATA *glyphs;  /* [RANGE_SIZE] */
-} ALLEGRO_TTF_GLYPH_RANGE;
+   int size;                  /* power of two */
+   int count;
+   CHAR_ENTRY *entries;
+   /* Tables which were replaced by a bigger one may still be in use by
+    * another thread, so they are only freed with the font.
+    */
+   struct CHAR_TABLE *old;
+} CHAR_TABLE;
 
 
-typedef struct ALLEGRO_TTF_FONT_DATA
+/* A glyph for the background worker to rasterize. */
+typedef struct GLYPH_REQUEST
+{
+   ALLEGRO_TTF_GLYPH_DATA *glyph;
+   int ft_index;
+   bool border;
+} GLYPH_REQUEST;
+
+
+/* A glyph rasterized by the background worker, waiting to be put on a page
+ * by a thread with a display.  The bitmap buffer is our own copy.
+ */
+typedef struct STAGED_GLYPH
+{
+   ALLEGRO_TTF_GLYPH_DATA *glyph;
+   int ft_index;
+   FT_Bitmap bitmap;
+} STAGED_GLYPH;
+
+
+/* A segment of the skyline of a page: the rows above y are in use between
+ * x and x + w.
+ */
+typedef struct SKYLINE_NODE
+{
+   short x;
+   short y;
+   short w;
+} SKYLINE_NODE;
+
+
+typedef struct GLYPH_PAGE
+{
+   ALLEGRO_BITMAP *bitmap;
+   _AL_VECTOR skyline;        /* of SKYLINE_NODE, from left to right */
+   /* Value of the use clock when a prepared text last drew from the page;
+    * protected by the font lock.
+    */
+   _AL_ATOMIC last_use;
+} GLYPH_PAGE;
+
+
+typedef struct KERNING_ENTRY
+{
+   int prev_ft_index;
+   int ft_index;
+   int kerning;
+   volatile _AL_ATOMIC used;  /* set once the fields above are valid */
+} KERNING_ENTRY;
+
+
+/* An offset to the nearest seed pixel, for the distance transform. */
+typedef struct FIELD_CELL
+{
+   short dx;
+   short dy;
+} FIELD_CELL;
+
+
+/* The distance field of a glyph, rendered before it is given to the glyph
+ * along with its metrics.
+ */
+typedef struct FIELD_GLYPH
+{
+   unsigned char *field;      /* NULL if the glyph has nothing to draw */
+   int w, h;
+   int left, top;
+   int advance;
+} FIELD_GLYPH;
+
+
+/* A font file opened with FreeType.  Fonts loaded by name share the face
+ * of their file, each with its own FT_Size.
+ */
+/* What makes two font files the same, for sharing their face.  Files on
+ * disk are compared by device and inode where there are such, otherwise
+ * by canonical path, so that any name of a file finds its face.
+ */
+typedef struct FACE_ID
+{
+   const ALLEGRO_FILE_INTERFACE *file_interface;
+   ALLEGRO_USTR *name;
+#ifdef ALLEGRO_HAVE_MMAP
+   bool have_inode;
+   dev_t dev;
+   ino_t ino;
+#endif
+} FACE_ID;
+
+
+typedef struct TTF_FACE
 {
    FT_Face face;
-   int flags;
-   _AL_VECTOR glyph_ranges;  /* sorted array of of ALLEGRO_TTF_GLYPH_RANGE */
-   _AL_VECTOR glyph_border_ranges; /* used only when the flag ALLEGRO_TTF_RENDER_BORDER is on, to store the border bitmaps */
+   int refcount;              /* protected by freetype_mutex */
+   FACE_ID id;                /* id.name is NULL if not shared */
 
-   _AL_VECTOR page_bitmaps;  /* of ALLEGRO_BITMAP pointers */
-   int page_pos_x;
-   int page_pos_y;
-   int page_line_height;
-   REGION lock_rect;
-   ALLEGRO_LOCKED_REGION *page_lr;
+   /* Protects the face, and the glyph caches of all fonts using it. */
+   ALLEGRO_MUTEX *mutex;
 
+   /* The file is either mapped into memory or read through a stream. */
+   void *map;
+   size_t map_size;
    FT_StreamRec stream;
    ALLEGRO_FILE *file;
    unsigned long base_offset;
    unsigned long offset;
+} TTF_FACE;
+
+
+typedef struct ALLEGRO_TTF_FONT_DATA
+{
+   ALLEGRO_FONT *font;        /* NULL if shared by distance field fonts */
+   /* Incremented whenever glyphs already handed out for prepared text may
+    * no longer be valid.
+    */
+   volatile _AL_ATOMIC generation;
+   TTF_FACE *ttf_face;
+   FT_Face face;              /* ttf_face->face */
+   FT_Size size;
+   FT_Size_RequestRec size_req;
+   int flags;
+   bool has_kerning;
+
+   /* Glyphs are kept in ranges of RANGE_SIZE, indexed directly by
+    * ft_index / RANGE_SIZE.  Ranges and cache entries are only ever
+    * added, and are published with a release store so that glyphs which
+    * are already cached can be looked up without taking the lock (except
+    * with a cache budget, where pages can be emptied).
+    */
+   int num_glyph_ranges;
+   ALLEGRO_TTF_GLYPH_DATA **glyph_ranges;
+   ALLEGRO_TTF_GLYPH_DATA **glyph_border_ranges; /* used only when the flag ALLEGRO_TTF_RENDER_BORDER is on, to store the border bitmaps */
+   CHAR_ENTRY latin[LATIN_SIZE];
+   CHAR_TABLE * volatile char_table;
+   KERNING_ENTRY *kerning_cache;  /* [KERNING_CACHE_SIZE], if has_kerning */
+
+   /* Protects the face, the glyph pages and the caching of glyphs.  This
+    * is the mutex of the face, so fonts sharing a face share it too.
+    */
+   ALLEGRO_MUTEX *mutex;
+
+   /* Used only when the flag ALLEGRO_TTF_BACKGROUND_RASTERIZE is on. */
+   bool background;
+   ALLEGRO_THREAD *worker;    /* started on first use */
+   ALLEGRO_COND *worker_cond;
+   bool worker_quit;
+   _AL_VECTOR requests;       /* of GLYPH_REQUEST */
+   unsigned int next_request;
+   _AL_VECTOR staged;         /* of STAGED_GLYPH */
+   volatile _AL_ATOMIC num_staged;
+
+   _AL_VECTOR pages;          /* of GLYPH_PAGE */
+   ALLEGRO_BITMAP *lock_page;
+   REGION lock_rect;
+   ALLEGRO_LOCKED_REGION *page_lr;
+
+   /* If the pages would take more than cache_budget bytes, the least
+    * recently used page is emptied and reused instead of adding one.
+    * cache_size is what the pages take now, at 4 bytes per pixel.
+    */
+   size_t cache_budget;       /* 0 for no limit */
+   size_t cache_size;
+   volatile _AL_ATOMIC use_clock;   /* ticks once per drawn string */
 
    int bitmap_format;
    int bitmap_flags;
@@ -88,16 +307,101 @@ typedef struct ALLEGRO_TTF_FONT_DATA
    int min_page_size;
    int max_page_size;
 
+   /* Used only when the flag ALLEGRO_TTF_DISTANCE_FIELD is on.  The size
+    * is set to field_size * DISTANCE_FIELD_OVERSAMPLE pixels, and the data
+    * is shared by all sizes loaded from the same file.
+    */
+   bool distance_field;
+   int field_size;
+   int field_spread;          /* in field pixels */
+   ALLEGRO_USTR *filename;
+   int refcount;              /* protected by freetype_mutex */
+   ALLEGRO_BITMAP *scratch;   /* for drawing to memory bitmaps */
+
    ALLEGRO_COLOR border_color; /* used only when the flag ALLEGRO_TTF_RENDER_BORDER is on */
    int border_width; /* used only when the flag ALLEGRO_TTF_RENDER_BORDER is on (otherwise defaults to 0) */
 } ALLEGRO_TTF_FONT_DATA;
 
 
+/* A size of a distance field font.  All sizes loaded from the same file
+ * share one ALLEGRO_TTF_FONT_DATA, with its glyph pages.
+ */
+typedef struct DISTANCE_FIELD_FONT
+{
+   ALLEGRO_TTF_FONT_DATA *data;
+   int flags;
+   float scale_x;             /* screen pixels per glyph metrics unit */
+   float scale_y;
+   ALLEGRO_COLOR border_color;
+   float border_width;        /* in pixels */
+   volatile _AL_ATOMIC generation;  /* incremented when the border changes */
+} DISTANCE_FIELD_FONT;
+
+
+typedef struct FIELD_SHADER
+{
+   ALLEGRO_DISPLAY *display;
+   ALLEGRO_SHADER *shader;    /* NULL if it could not be built */
+} FIELD_SHADER;
+
+
 /* globals */
 static bool ttf_inited;
 static FT_Library ft;
 static ALLEGRO_FONT_VTABLE vt;
+static ALLEGRO_FONT_VTABLE df_vt;
+static _AL_FONT_METHODS ttf_methods;
+static _AL_FONT_METHODS df_methods;
+/* Protects the library itself: creating and destroying faces and strokers.
+ * Also protects the lists of shared faces, distance field fonts and
+ * shaders.
+ */
 static ALLEGRO_MUTEX *freetype_mutex;
+static _AL_VECTOR faces = _AL_VECTOR_INITIALIZER(TTF_FACE *);
+static _AL_VECTOR field_fonts = _AL_VECTOR_INITIALIZER(ALLEGRO_TTF_FONT_DATA *);
+static _AL_VECTOR field_shaders = _AL_VECTOR_INITIALIZER(FIELD_SHADER);
+
+
+static const char *field_glsl_pixel_source =
+   "#ifdef GL_ES\n"
+   "precision mediump float;\n"
+   "#endif\n"
+   "uniform sampler2D " ALLEGRO_SHADER_VAR_TEX ";\n"
+   "uniform float ttf_fill_edge;\n"
+   "uniform float ttf_border_edge;\n"
+   "uniform float ttf_smoothing;\n"
+   "uniform vec4 ttf_border_color;\n"
+   "varying vec4 varying_color;\n"
+   "varying vec2 varying_texcoord;\n"
+   "void main()\n"
+   "{\n"
+   "  float d = texture2D(" ALLEGRO_SHADER_VAR_TEX ", varying_texcoord).a;\n"
+   "  float fill = smoothstep(ttf_fill_edge - ttf_smoothing,\n"
+   "    ttf_fill_edge + ttf_smoothing, d);\n"
+   "  float outer = smoothstep(ttf_border_edge - ttf_smoothing,\n"
+   "    ttf_border_edge + ttf_smoothing, d);\n"
+   "  gl_FragColor = varying_color * fill + ttf_border_color * (outer - fill);\n"
+   "}\n";
+
+static const char *field_hlsl_pixel_source =
+   "texture " ALLEGRO_SHADER_VAR_TEX ";\n"
+   "sampler2D s = sampler_state {\n"
+   "   texture = <" ALLEGRO_SHADER_VAR_TEX ">;\n"
+   "};\n"
+   "float ttf_fill_edge;\n"
+   "float ttf_border_edge;\n"
+   "float ttf_smoothing;\n"
+   "float4 ttf_border_color;\n"
+   "\n"
+   "float4 ps_main(VS_OUTPUT Input) : COLOR0\n"
+   "{\n"
+   "   float d = tex2D(s, Input.TexCoord).a;\n"
+   "   float fill = smoothstep(ttf_fill_edge - ttf_smoothing,\n"
+   "      ttf_fill_edge + ttf_smoothing, d);\n"
+   "   float outer = smoothstep(ttf_border_edge - ttf_smoothing,\n"
+   "      ttf_border_edge + ttf_smoothing, d);\n"
+   "   return Input.Color * fill + ttf_border_color * (outer - fill);\n"
+   "}\n";
 
 
 static INLINE int align4(int x)
@@ -110,77 +414,338 @@ static INLINE int align4(int x)
 }
 
 
-static ALLEGRO_TTF_GLYPH_DATA *get_glyph(_AL_VECTOR *ranges,
-   int ft_index)
+static void lock_font(ALLEGRO_TTF_FONT_DATA *data, bool *locked)
+{
+   if (!*locked) {
+      al_lock_mutex(data->mutex);
+      *locked = true;
+   }
+}
+
+
+/* Make FreeType use the size of this font for the face, which may be
+ * shared with other sizes.  Must be called with the font locked.
+ */
+static void use_size(ALLEGRO_TTF_FONT_DATA *data)
 {
-   ALLEGRO_TTF_GLYPH_RANGE *range;
-   int32_t range_start;
-   int lo, hi, mid;
+   if (data->face->size != data->size)
+      FT_Activate_Size(data->size);
+}
 
-   range_start = ft_index - (ft_index % RANGE_SIZE);
 
-   /* Binary search for the range. */
-   lo = 0;
-   hi = _al_vector_size(ranges);
-   mid = (hi + lo)/2;
-   range = NULL;
+/* Return the glyph for ft_index, allocating its range if needed.  Must be
+ * called with the font locked.
+ */
+static ALLEGRO_TTF_GLYPH_DATA *get_glyph(ALLEGRO_TTF_FONT_DATA *data,
+   ALLEGRO_TTF_GLYPH_DATA **ranges, int ft_index)
+{
+   ALLEGRO_TTF_GLYPH_DATA **range;
 
-   while (lo < hi) {
-      ALLEGRO_TTF_GLYPH_RANGE *r = _al_vector_ref(ranges, mid);
-      if (r->range_start == range_start) {
-         range = r;
-         break;
+   ASSERT(ft_index >= 0 && ft_index / RANGE_SIZE < data->num_glyph_ranges);
+   (void)data;
+
+   range = &ranges[ft_index / RANGE_SIZE];
+   if (!*range) {
+      *range = al_calloc(RANGE_SIZE, sizeof(ALLEGRO_TTF_GLYPH_DATA));
+      if (!*range)
+         return NULL;
+   }
+
+   return &(*range)[ft_index % RANGE_SIZE];
+}
+
+
+static INLINE unsigned int hash_char(int32_t ch)
+{
+   /* Multiplying by an odd constant keeps consecutive codepoints apart in
+    * the low bits.
+    */
+   return (uint32_t)ch * 2654435761u;
+}
+
+
+/* Look up a codepoint without taking the lock.  Returns NULL if it hasn't
+ * been cached yet.
+ */
+static CHAR_ENTRY *lookup_char(ALLEGRO_TTF_FONT_DATA *data, int32_t ch)
+{
+   CHAR_TABLE *table;
+   unsigned int i;
+
+   if ((uint32_t)ch < LATIN_SIZE) {
+      CHAR_ENTRY *e = &data->latin[ch];
+      return _al_atomic_load_acquire(&e->key) ? e : NULL;
+   }
+
+   table = _al_atomic_load_acquire_ptr(&data->char_table);
+   if (!table)
+      return NULL;
+
+   for (i = hash_char(ch); ; i++) {
+      CHAR_ENTRY *e = &table->entries[i & (table->size - 1)];
+      _AL_ATOMIC key = _al_atomic_load_acquire(&e->key);
+      if (key == ch + 1)
+         return e;
+      if (key == 0)
+         return NULL;
+   }
+}
+
+
+/* Double the size of the character hash table.  The old table stays valid
+ * for threads which are still reading it.
+ */
+static bool grow_char_table(ALLEGRO_TTF_FONT_DATA *data)
+{
+   CHAR_TABLE *old = data->char_table;
+   CHAR_TABLE *table;
+   int i;
+
+   table = al_calloc(1, sizeof *table);
+   if (!table)
+      return false;
+   table->size = old ? old->size * 2 : CHAR_TABLE_SIZE;
+   table->entries = al_calloc(table->size, sizeof(CHAR_ENTRY));
+   if (!table->entries) {
+      al_free(table);
+      return false;
+   }
+
+   if (old) {
+      for (i = 0; i < old->size; i++) {
+         CHAR_ENTRY *e = &old->entries[i];
+         unsigned int j;
+         if (!e->key)
+            continue;
+         for (j = hash_char(e->key - 1); ; j++) {
+            CHAR_ENTRY *dst = &table->entries[j & (table->size - 1)];
+            if (!dst->key) {
+               *dst = *e;
+               break;
+            }
+         }
       }
-      else if (r->range_start < range_start) {
-         lo = mid + 1;
+      table->count = old->count;
+      table->old = old;
+   }
+
+   _al_atomic_store_release_ptr(&data->char_table, table);
+   return true;
+}
+
+
+/* Return the cache entry for a codepoint, creating it the first time the
+ * codepoint is seen.  Only that first time locks the font and asks FreeType
+ * for the glyph index.  Returns NULL if out of memory.
+ */
+static CHAR_ENTRY *get_char(ALLEGRO_TTF_FONT_DATA *data, int32_t ch,
+   bool *locked)
+{
+   CHAR_ENTRY *e;
+   int ft_index;
+
+   e = lookup_char(data, ch);
+   if (e)
+      return e;
+
+   lock_font(data, locked);
+
+   /* Another thread may have added it in the meantime. */
+   e = lookup_char(data, ch);
+   if (e)
+      return e;
+
+   if ((uint32_t)ch < LATIN_SIZE) {
+      e = &data->latin[ch];
+   }
+   else {
+      CHAR_TABLE *table = data->char_table;
+      unsigned int i;
+
+      if (!table || (table->count + 1) * 2 > table->size) {
+         if (!grow_char_table(data))
+            return NULL;
+         table = data->char_table;
       }
-      else {
-         hi = mid;
+      for (i = hash_char(ch); ; i++) {
+         e = &table->entries[i & (table->size - 1)];
+         if (!e->key)
+            break;
       }
-      mid = (hi + lo)/2;
+      table->count++;
    }
 
-   if (!range) {
-      range = _al_vector_alloc_mid(ranges, mid);
-      range->range_start = range_start;
-      range->glyphs = al_calloc(RANGE_SIZE, sizeof(ALLEGRO_TTF_GLYPH_DATA));
+   ft_index = FT_Get_Char_Index(data->face, ch);
+   if (ft_index >= data->num_glyph_ranges * RANGE_SIZE)
+      ft_index = 0;
+
+   e->ft_index = ft_index;
+   e->glyph = get_glyph(data, data->glyph_ranges, ft_index);
+   if (!e->glyph)
+      return NULL;
+   if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
+      e->border_glyph = get_glyph(data, data->glyph_border_ranges, ft_index);
+      if (!e->border_glyph)
+         return NULL;
    }
+   _al_atomic_store_release(&e->key, ch + 1);
 
-   return &range->glyphs[ft_index - range_start];
+   return e;
 }
 
 
 static void unlock_current_page(ALLEGRO_TTF_FONT_DATA *data)
 {
    if (data->page_lr) {
-      ALLEGRO_BITMAP **back = _al_vector_ref_back(&data->page_bitmaps);
-      ASSERT(al_is_bitmap_locked(*back));
-      al_unlock_bitmap(*back);
+      ASSERT(al_is_bitmap_locked(data->lock_page));
+      al_unlock_bitmap(data->lock_page);
       data->page_lr = NULL;
+      data->lock_page = NULL;
+   }
+}
+
+
+static void unlock_font(ALLEGRO_TTF_FONT_DATA *data, bool locked)
+{
+   if (locked) {
+      unlock_current_page(data);
+      al_unlock_mutex(data->mutex);
+   }
+}
+
+
+static size_t page_bytes(ALLEGRO_BITMAP *bitmap)
+{
+   return (size_t)al_get_bitmap_width(bitmap) * al_get_bitmap_height(bitmap)
+      * 4;
+}
+
+
+static void reset_skyline(GLYPH_PAGE *page)
+{
+   SKYLINE_NODE *node;
+
+   _al_vector_free(&page->skyline);
+   node = _al_vector_alloc_back(&page->skyline);
+   if (node) {
+      node->x = 0;
+      node->y = 0;
+      node->w = al_get_bitmap_width(page->bitmap);
+   }
+}
+
+
+/* Find the lowest place on the page where a w x h rectangle fits, and the
+ * skyline node where it starts.  Returns -1 if there is no room.
+ */
+static int skyline_find(GLYPH_PAGE *page, int w, int h, int *px, int *py)
+{
+   int page_w = al_get_bitmap_width(page->bitmap);
+   int page_h = al_get_bitmap_height(page->bitmap);
+   int n = _al_vector_size(&page->skyline);
+   int best = -1;
+   int best_y = 0;
+   int best_w = 0;
+   int i, j;
+
+   for (i = 0; i < n; i++) {
+      SKYLINE_NODE *node = _al_vector_ref(&page->skyline, i);
+      int y = 0;
+      int left = w;
+
+      if (node->x + w > page_w)
+         break;
+
+      /* The rectangle rests on the highest node it spans. */
+      for (j = i; left > 0 && j < n; j++) {
+         SKYLINE_NODE *next = _al_vector_ref(&page->skyline, j);
+         if (next->y > y)
+            y = next->y;
+         left -= next->w;
+      }
+      if (y + h > page_h)
+         continue;
+
+      if (best < 0 || y < best_y || (y == best_y && node->w < best_w)) {
+         best = i;
+         best_y = y;
+         best_w = node->w;
+         *px = node->x;
+      }
+   }
+
+   *py = best_y;
+   return best;
+}
+
+
+/* Return how wide the free space at height y is, starting at node i. */
+static int skyline_span(GLYPH_PAGE *page, int i, int y)
+{
+   int n = _al_vector_size(&page->skyline);
+   int w = 0;
+
+   for (; i < n; i++) {
+      SKYLINE_NODE *node = _al_vector_ref(&page->skyline, i);
+      if (node->y > y)
+         break;
+      w += node->w;
+   }
+   return w;
+}
+
+
+/* Raise the skyline over a rectangle found with skyline_find. */
+static bool skyline_add(GLYPH_PAGE *page, int i, int x, int y, int w, int h)
+{
+   SKYLINE_NODE *node;
+   unsigned int j;
+
+   node = _al_vector_alloc_mid(&page->skyline, i);
+   if (!node)
+      return false;
+   node->x = x;
+   node->y = y + h;
+   node->w = w;
+
+   /* Cut away what the new node covers from the nodes to its right. */
+   j = i + 1;
+   while (j < _al_vector_size(&page->skyline)) {
+      SKYLINE_NODE *next = _al_vector_ref(&page->skyline, j);
+      int covered = x + w - next->x;
+      if (covered <= 0)
+         break;
+      if (covered < next->w) {
+         next->x += covered;
+         next->w -= covered;
+         break;
+      }
+      _al_vector_delete_at(&page->skyline, j);
+   }
+
+   /* Merge neighbours of the same height. */
+   j = 0;
+   while (j + 1 < _al_vector_size(&page->skyline)) {
+      SKYLINE_NODE *a = _al_vector_ref(&page->skyline, j);
+      SKYLINE_NODE *b = _al_vector_ref(&page->skyline, j + 1);
+      if (a->y == b->y) {
+         a->w += b->w;
+         _al_vector_delete_at(&page->skyline, j + 1);
+      }
+      else {
+         j++;
+      }
    }
+
+   return true;
 }
 
 
-static ALLEGRO_BITMAP *push_new_page(ALLEGRO_TTF_FONT_DATA *data, int glyph_size)
+static GLYPH_PAGE *push_new_page(ALLEGRO_TTF_FONT_DATA *data, int page_size)
 {
-    ALLEGRO_BITMAP **back;
-    ALLEGRO_BITMAP *page;
+    GLYPH_PAGE *page;
+    ALLEGRO_BITMAP *bitmap;
     ALLEGRO_STATE state;
-    int page_size = 1;
-    /* 16 seems to work well. A particular problem are fixed width fonts which
-     * take an inordinate amount of space. */
-    while (page_size < 16 * glyph_size) {
-      page_size *= 2;
-    }
-    if (page_size < data->min_page_size) {
-      page_size = data->min_page_size;
-    }
-    if (page_size > data->max_page_size) {
-      page_size = data->max_page_size;
-    }
-    if (glyph_size > page_size) {
-      return NULL;
-    }
 
     unlock_current_page(data);
 
@@ -191,113 +756,269 @@ static ALLEGRO_BITMAP *push_new_page(ALLEGRO_TTF_FONT_DATA *data, int glyph_size
     al_store_state(&state, ALLEGRO_STATE_NEW_BITMAP_PARAMETERS);
     al_set_new_bitmap_format(data->bitmap_format);
     al_set_new_bitmap_flags(data->bitmap_flags);
-    page = al_create_bitmap(page_size, page_size);
+    bitmap = al_create_bitmap(page_size, page_size);
     al_restore_state(&state);
     _al_pop_destructor_owner();
 
-    if (page) {
-       back = _al_vector_alloc_back(&data->page_bitmaps);
-       *back = page;
+    if (!bitmap)
+       return NULL;
 
-       data->page_pos_x = 0;
-       data->page_pos_y = 0;
-       data->page_line_height = 0;
+    page = _al_vector_alloc_back(&data->pages);
+    if (!page) {
+       al_destroy_bitmap(bitmap);
+       return NULL;
     }
+    page->bitmap = bitmap;
+    page->last_use = 0;
+    _al_vector_init(&page->skyline, sizeof(SKYLINE_NODE));
+    reset_skyline(page);
+    data->cache_size += page_bytes(bitmap);
 
     return page;
 }
 
 
-static unsigned char *alloc_glyph_region(ALLEGRO_TTF_FONT_DATA *data,
-   int ft_index, int w, int h, bool new, ALLEGRO_TTF_GLYPH_DATA *glyph,
-   bool lock_more)
+static int find_page(ALLEGRO_TTF_FONT_DATA *data, ALLEGRO_BITMAP *bitmap)
 {
-   ALLEGRO_BITMAP *page;
-   bool relock;
-   int w4 = align4(w);
-   int h4 = align4(h);
-   int glyph_size = w4 > h4 ? w4 : h4;
+   int i;
 
-   if (_al_vector_is_empty(&data->page_bitmaps) || new) {
-      page = push_new_page(data, glyph_size);
-      relock = true;
-      if (!page)
-         return NULL;
-   }
-   else {
-      ALLEGRO_BITMAP **back = _al_vector_ref_back(&data->page_bitmaps);
-      page = *back;
-      relock = !data->page_lr;
+   for (i = 0; i < (int)_al_vector_size(&data->pages); i++) {
+      GLYPH_PAGE *page = _al_vector_ref(&data->pages, i);
+      if (page->bitmap == bitmap)
+         return i;
    }
+   return -1;
+}
 
-   ALLEGRO_DEBUG("Glyph %d: %dx%d (%dx%d)%s\n",
-      ft_index, w, h, w4, h4, new ? " new" : "");
-
-   if (data->page_pos_x + w4 > al_get_bitmap_width(page)) {
-      data->page_pos_y += data->page_line_height;
-      data->page_pos_y = align4(data->page_pos_y);
-      data->page_pos_x = 0;
-      data->page_line_height = 0;
-      relock = true;
-   }
 
-   if (data->page_pos_y + h4 > al_get_bitmap_height(page)) {
-      return alloc_glyph_region(data, ft_index, w, h, true, glyph, lock_more);
+/* Find when the glyphs on each page were last drawn. */
+static void scan_page_use(ALLEGRO_TTF_FONT_DATA *data,
+   ALLEGRO_TTF_GLYPH_DATA **ranges, _AL_ATOMIC *last_use)
+{
+   int r, i;
+
+   for (r = 0; r < data->num_glyph_ranges; r++) {
+      if (!ranges[r])
+         continue;
+      for (i = 0; i < RANGE_SIZE; i++) {
+         ALLEGRO_TTF_GLYPH_DATA *glyph = &ranges[r][i];
+         _AL_ATOMIC use;
+         int p;
+         if (glyph->state != GLYPH_CACHED || !glyph->page_bitmap)
+            continue;
+         p = find_page(data, glyph->page_bitmap);
+         ASSERT(p >= 0);
+         use = _al_atomic_load_acquire(&glyph->last_use);
+         if (use > last_use[p])
+            last_use[p] = use;
+      }
    }
+}
 
-   glyph->page_bitmap = page;
-   glyph->region.x = data->page_pos_x;
-   glyph->region.y = data->page_pos_y;
-   glyph->region.w = w;
-   glyph->region.h = h;
 
-   data->page_pos_x = align4(data->page_pos_x + w4);
-   if (h > data->page_line_height) {
-      data->page_line_height = h4;
-      relock = true;
+/* Only fonts with a cache budget evict glyphs, and those never look at
+ * their glyphs without the lock, so the state may go back here.
+ */
+static void evict_glyphs(ALLEGRO_TTF_FONT_DATA *data,
+   ALLEGRO_TTF_GLYPH_DATA **ranges, ALLEGRO_BITMAP *bitmap)
+{
+   int r, i;
+
+   for (r = 0; r < data->num_glyph_ranges; r++) {
+      if (!ranges[r])
+         continue;
+      for (i = 0; i < RANGE_SIZE; i++) {
+         ALLEGRO_TTF_GLYPH_DATA *glyph = &ranges[r][i];
+         if (glyph->state == GLYPH_CACHED && glyph->page_bitmap == bitmap) {
+            /* The metrics stay valid. */
+            _al_atomic_store_release(&glyph->state, GLYPH_METRICS);
+            glyph->page_bitmap = NULL;
+         }
+      }
    }
+}
 
-   if (relock) {
-      char *ptr;
-      int i;
-      unlock_current_page(data);
-
-      data->lock_rect.x = glyph->region.x;
-      data->lock_rect.y = glyph->region.y;
-      /* Do we lock up to the right edge in anticipation of caching more
-       * glyphs, or just enough for the current glyph?
-       */
-      if (lock_more) {
-         data->lock_rect.w = al_get_bitmap_width(page) - data->lock_rect.x;
-         data->lock_rect.h = data->page_line_height;
-      }
-      else {
-         data->lock_rect.w = w4;
-         data->lock_rect.h = h4;
-      }
 
-      data->page_lr = al_lock_bitmap_region(page,
-         data->lock_rect.x, data->lock_rect.y,
-         data->lock_rect.w, data->lock_rect.h,
-         ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+/* Empty the least recently used page which can hold a glyph of the given
+ * size, so its space can be reused.  Pages with glyphs of the string being
+ * drawn right now are kept.  Returns NULL if no page can be emptied.
+ */
+static GLYPH_PAGE *evict_page(ALLEGRO_TTF_FONT_DATA *data, int glyph_size)
+{
+   int num_pages = _al_vector_size(&data->pages);
+   _AL_ATOMIC now = _al_atomic_load_acquire(&data->use_clock);
+   _AL_ATOMIC *last_use;
+   GLYPH_PAGE *victim = NULL;
+   _AL_ATOMIC victim_use = 0;
+   int i;
 
-      if (!data->page_lr) {
-         return NULL;
-      }
+   last_use = al_calloc(num_pages, sizeof *last_use);
+   if (!last_use)
+      return NULL;
 
-      /* Clear the data so we don't get garbage when using filtering
-       * FIXME We could clear just the border but I'm not convinced that
-       * would be faster (yet)
-       */
-      for (i = 0; i < data->lock_rect.h; i++) {
-          ptr = (char *)(data->page_lr->data) + (i * data->page_lr->pitch);
-          memset(ptr, 0, data->lock_rect.w * 4);
+   for (i = 0; i < num_pages; i++) {
+      GLYPH_PAGE *page = _al_vector_ref(&data->pages, i);
+      last_use[i] = page->last_use;
+   }
+   scan_page_use(data, data->glyph_ranges, last_use);
+   if (data->glyph_border_ranges)
+      scan_page_use(data, data->glyph_border_ranges, last_use);
+
+   for (i = 0; i < num_pages; i++) {
+      GLYPH_PAGE *page = _al_vector_ref(&data->pages, i);
+      if (al_get_bitmap_width(page->bitmap) < glyph_size ||
+            al_get_bitmap_height(page->bitmap) < glyph_size)
+         continue;
+      if (last_use[i] == now)
+         continue;
+      if (!victim || last_use[i] < victim_use) {
+         victim = page;
+         victim_use = last_use[i];
       }
-
+   }
+   al_free(last_use);
+
+   if (!victim)
+      return NULL;
+
+   ALLEGRO_DEBUG("Evicting glyph page %p, last used at %d.\n",
+      victim->bitmap, (int)victim_use);
+
+   unlock_current_page(data);
+
+   /* Text drawn earlier may still be waiting in the held drawing cache,
+    * so draw it before its glyphs are overwritten.
+    */
+   if (al_is_bitmap_drawing_held()) {
+      al_hold_bitmap_drawing(false);
+      al_hold_bitmap_drawing(true);
+   }
+
+   evict_glyphs(data, data->glyph_ranges, victim->bitmap);
+   if (data->glyph_border_ranges)
+      evict_glyphs(data, data->glyph_border_ranges, victim->bitmap);
+   reset_skyline(victim);
+
+   /* Prepared texts may refer to the evicted glyphs. */
+   _al_fetch_and_add1(&data->generation);
+
+   return victim;
+}
+
+
+/* Get a page with room for a glyph of the given size: a new one, or an
+ * emptied one if the font would go over its cache budget.
+ */
+static GLYPH_PAGE *make_room(ALLEGRO_TTF_FONT_DATA *data, int glyph_size)
+{
+    GLYPH_PAGE *page;
+    int page_size = 1;
+    /* 16 seems to work well. A particular problem are fixed width fonts which
+     * take an inordinate amount of space. */
+    while (page_size < 16 * glyph_size) {
+      page_size *= 2;
+    }
+    if (page_size < data->min_page_size) {
+      page_size = data->min_page_size;
+    }
+    if (page_size > data->max_page_size) {
+      page_size = data->max_page_size;
+    }
+    if (glyph_size > page_size) {
+      return NULL;
+    }
+
+    if (data->cache_budget > 0 && !_al_vector_is_empty(&data->pages) &&
+          data->cache_size + (size_t)page_size * page_size * 4 >
+             data->cache_budget) {
+       page = evict_page(data, glyph_size);
+       if (page)
+          return page;
+    }
+
+    return push_new_page(data, page_size);
+}
+
+
+static unsigned char *alloc_glyph_region(ALLEGRO_TTF_FONT_DATA *data,
+   int ft_index, int w, int h, ALLEGRO_TTF_GLYPH_DATA *glyph, bool lock_more)
+{
+   GLYPH_PAGE *page = NULL;
+   int w4 = align4(w);
+   int h4 = align4(h);
+   int glyph_size = w4 > h4 ? w4 : h4;
+   int node = -1;
+   int lock_w;
+   int x = 0, y = 0;
+   unsigned int i;
+
+   for (i = 0; i < _al_vector_size(&data->pages) && node < 0; i++) {
+      page = _al_vector_ref(&data->pages, i);
+      node = skyline_find(page, w4, h4, &x, &y);
+   }
+
+   if (node < 0) {
+      page = make_room(data, glyph_size);
+      if (!page)
+         return NULL;
+      node = skyline_find(page, w4, h4, &x, &y);
+      if (node < 0)
+         return NULL;
+   }
+
+   ALLEGRO_DEBUG("Glyph %d: %dx%d (%dx%d) at %d,%d\n",
+      ft_index, w, h, w4, h4, x, y);
+
+   /* Do we lock the free space to the right in anticipation of caching
+    * more glyphs, or just enough for the current glyph?
+    */
+   lock_w = lock_more ? skyline_span(page, node, y) : w4;
+
+   if (!skyline_add(page, node, x, y, w4, h4))
+      return NULL;
+
+   if (!data->page_lr || data->lock_page != page->bitmap ||
+         x < data->lock_rect.x || y < data->lock_rect.y ||
+         x + w4 > data->lock_rect.x + data->lock_rect.w ||
+         y + h4 > data->lock_rect.y + data->lock_rect.h) {
+      char *ptr;
+      int row;
+      unlock_current_page(data);
+
+      data->lock_rect.x = x;
+      data->lock_rect.y = y;
+      data->lock_rect.w = lock_w;
+      data->lock_rect.h = h4;
+
+      data->page_lr = al_lock_bitmap_region(page->bitmap,
+         data->lock_rect.x, data->lock_rect.y,
+         data->lock_rect.w, data->lock_rect.h,
+         ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+
+      if (!data->page_lr) {
+         return NULL;
+      }
+      data->lock_page = page->bitmap;
+
+      /* Clear the data so we don't get garbage when using filtering
+       * FIXME We could clear just the border but I'm not convinced that
+       * would be faster (yet)
+       */
+      for (row = 0; row < data->lock_rect.h; row++) {
+          ptr = (char *)(data->page_lr->data) + (row * data->page_lr->pitch);
+          memset(ptr, 0, data->lock_rect.w * 4);
+      }
+
    }
 
    ASSERT(data->page_lr);
 
+   glyph->page_bitmap = page->bitmap;
+   glyph->region.x = x;
+   glyph->region.y = y;
+   glyph->region.w = w;
+   glyph->region.h = h;
+
    /* Copy a displaced pointer for the glyph. */
    return (unsigned char *)data->page_lr->data
       + ((glyph->region.y + 1) - data->lock_rect.y) * data->page_lr->pitch
@@ -311,22 +1032,13 @@ static void copy_glyph_mono(ALLEGRO_TTF_FONT_DATA *font_data, FT_Bitmap *bitmap,
    int pitch = font_data->page_lr->pitch;
    int x, y;
 
-<<<<<<< HEAD
-   for (y = 0; y < (int)face->glyph->bitmap.rows; y++) {
-      unsigned char const *ptr = face->glyph->bitmap.buffer + face->glyph->bitmap.pitch * y;
-=======
-   for (y = 0; y < bitmap->rows; y++) {
+   for (y = 0; y < (int)bitmap->rows; y++) {
       unsigned char const *ptr = bitmap->buffer + bitmap->pitch * y;
->>>>>>> Cumulative changes of the changes made for Factorio version of allegro.
       unsigned char *dptr = glyph_data + pitch * y;
       int bit = 0;
 
       if (font_data->flags & ALLEGRO_NO_PREMULTIPLIED_ALPHA) {
-<<<<<<< HEAD
-         for (x = 0; x < (int)face->glyph->bitmap.width; x++) {
-=======
-         for (x = 0; x < bitmap->width; x++) {
->>>>>>> Cumulative changes of the changes made for Factorio version of allegro.
+         for (x = 0; x < (int)bitmap->width; x++) {
             unsigned char set = ((*ptr >> (7-bit)) & 1) ? 255 : 0;
             *dptr++ = 255;
             *dptr++ = 255;
@@ -339,11 +1051,7 @@ static void copy_glyph_mono(ALLEGRO_TTF_FONT_DATA *font_data, FT_Bitmap *bitmap,
          }
       }
       else {
-<<<<<<< HEAD
-         for (x = 0; x < (int)face->glyph->bitmap.width; x++) {
-=======
-         for (x = 0; x < bitmap->width; x++) {
->>>>>>> Cumulative changes of the changes made for Factorio version of allegro.
+         for (x = 0; x < (int)bitmap->width; x++) {
             unsigned char set = ((*ptr >> (7-bit)) & 1) ? 255 : 0;
             *dptr++ = set;
             *dptr++ = set;
@@ -365,21 +1073,12 @@ static void copy_glyph_color(ALLEGRO_TTF_FONT_DATA *font_data, FT_Bitmap *bitmap
    int pitch = font_data->page_lr->pitch;
    int x, y;
 
-<<<<<<< HEAD
-   for (y = 0; y < (int)face->glyph->bitmap.rows; y++) {
-      unsigned char const *ptr = face->glyph->bitmap.buffer + face->glyph->bitmap.pitch * y;
-      unsigned char *dptr = glyph_data + pitch * y;
-
-      if (font_data->flags & ALLEGRO_NO_PREMULTIPLIED_ALPHA) {
-         for (x = 0; x < (int)face->glyph->bitmap.width; x++) {
-=======
-   for (y = 0; y < bitmap->rows; y++) {
+   for (y = 0; y < (int)bitmap->rows; y++) {
       unsigned char const *ptr = bitmap->buffer + bitmap->pitch * y;
       unsigned char *dptr = glyph_data + pitch * y;
 
       if (font_data->flags & ALLEGRO_NO_PREMULTIPLIED_ALPHA) {
-         for (x = 0; x < bitmap->width; x++) {
->>>>>>> Cumulative changes of the changes made for Factorio version of allegro.
+         for (x = 0; x < (int)bitmap->width; x++) {
             unsigned char c = *ptr;
             *dptr++ = 255;
             *dptr++ = 255;
@@ -389,11 +1088,7 @@ static void copy_glyph_color(ALLEGRO_TTF_FONT_DATA *font_data, FT_Bitmap *bitmap
          }
       }
       else {
-<<<<<<< HEAD
-         for (x = 0; x < (int)face->glyph->bitmap.width; x++) {
-=======
-         for (x = 0; x < bitmap->width; x++) {
->>>>>>> Cumulative changes of the changes made for Factorio version of allegro.
+         for (x = 0; x < (int)bitmap->width; x++) {
             unsigned char c = *ptr;
             *dptr++ = c;
             *dptr++ = c;
@@ -405,23 +1100,9 @@ static void copy_glyph_color(ALLEGRO_TTF_FONT_DATA *font_data, FT_Bitmap *bitmap
    }
 }
 
-/* NOTE: this function may disable the bitmap hold drawing state
- * and leave the current page bitmap locked.
- */
-static void cache_glyph(ALLEGRO_TTF_FONT_DATA *font_data, FT_Face face,
-   int ft_index, ALLEGRO_TTF_GLYPH_DATA *glyph, bool lock_more, bool border)
+static FT_Int32 get_load_flags(ALLEGRO_TTF_FONT_DATA const *font_data)
 {
     FT_Int32 ft_load_flags;
-    FT_Error e;
-    int w, h;
-    unsigned char *glyph_data;
-    FT_Glyph ftglyph;
-    FT_Stroker ftstroker;
-    FT_Vector ftorigin = {0, 0};
-
-    if (glyph->page_bitmap || glyph->region.x < 0)
-        /* this glyph has already been rendered */
-        return;
 
     // FIXME: make this a config setting? FT_LOAD_FORCE_AUTOHINT
 
@@ -433,8 +1114,31 @@ static void cache_glyph(ALLEGRO_TTF_FONT_DATA *font_data, FT_Face face,
        ft_load_flags |= FT_LOAD_TARGET_MONO;
     if (font_data->flags & ALLEGRO_TTF_NO_AUTOHINT)
        ft_load_flags |= FT_LOAD_NO_AUTOHINT;
+    /* Distance fields are drawn at any size, so don't fit them to the
+     * pixel grid of one.
+     */
+    if (font_data->distance_field)
+       ft_load_flags |= FT_LOAD_NO_HINTING;
+
+    return ft_load_flags;
+}
 
-    e = FT_Load_Glyph(face, ft_index, ft_load_flags);
+
+/* Load a glyph with FreeType and render it to a bitmap glyph, which the
+ * caller must release with FT_Done_Glyph.  Must be called with the font
+ * locked, unless face is the private face of the glyph worker.
+ */
+static FT_Glyph load_glyph_bitmap(ALLEGRO_TTF_FONT_DATA *font_data,
+   FT_Face face, int ft_index, bool border)
+{
+    FT_Error e;
+    FT_Glyph ftglyph;
+    FT_Stroker ftstroker;
+    FT_Vector ftorigin = {0, 0};
+
+    if (face == font_data->face)
+       use_size(font_data);
+    e = FT_Load_Glyph(face, ft_index, get_load_flags(font_data));
     if (e) {
        ALLEGRO_WARN("Failed loading glyph %d from.\n", ft_index);
     }
@@ -444,7 +1148,9 @@ static void cache_glyph(ALLEGRO_TTF_FONT_DATA *font_data, FT_Face face,
       ALLEGRO_WARN("FT_Get_Glyph error: %d\n", e);
     if (border) {
       /* create the stroker, which will be used to render the border */
+      al_lock_mutex(freetype_mutex);
       FT_Stroker_New(ft, &ftstroker);
+      al_unlock_mutex(freetype_mutex);
       FT_Stroker_Set(ftstroker,
                        font_data->border_width,
                        FT_STROKER_LINECAP_ROUND,
@@ -453,6 +1159,9 @@ static void cache_glyph(ALLEGRO_TTF_FONT_DATA *font_data, FT_Face face,
       /* set the border to be rendered, instead of the normal glyph */
       /* the last parameter MUST be 1, otherwise we would get a memory leak */
       FT_Glyph_Stroke(&ftglyph, ftstroker, 1);
+      al_lock_mutex(freetype_mutex);
+      FT_Stroker_Done(ftstroker);
+      al_unlock_mutex(freetype_mutex);
     }
     /* render the glyph (normal glyph only, or the border only) */
     /* the last parameter MUST be 1, otherwise we would get a memory leak */
@@ -460,393 +1169,2099 @@ static void cache_glyph(ALLEGRO_TTF_FONT_DATA *font_data, FT_Face face,
     if (e)
       ALLEGRO_WARN("Glyph_to_Bitmap error: %d\n", e);
 
-    /* adjust the glyph offset by the border with (if no border is used, then border_width == 0) */
-    glyph->offset_x = ((FT_BitmapGlyph)ftglyph)->left + ceil((float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
-    glyph->offset_y = (face->size->metrics.ascender >> 6) - ((FT_BitmapGlyph)ftglyph)->top + ceil((float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+    return ftglyph;
+}
+
+
+/* Fill in the metrics of a glyph from its rendered bitmap.  Returns the
+ * rendered glyph, or NULL if the glyph has nothing to draw, in which case
+ * it is released.  Must be called with the font locked.
+ */
+static FT_Glyph set_glyph_metrics(ALLEGRO_TTF_FONT_DATA *font_data,
+   FT_Glyph ftglyph, int ft_index, ALLEGRO_TTF_GLYPH_DATA *glyph)
+{
+    int w, h;
+
     /* adjust the glyph dimensions by twice the border width */
     w = ((FT_BitmapGlyph)ftglyph)->bitmap.width + ceil(2 * (float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
     h = ((FT_BitmapGlyph)ftglyph)->bitmap.rows + ceil(2 * (float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
-    /* adjust the glyph advance by the border width (this amount can be discutable; using twice the border width looks ugly for not so thick borders) */
-    glyph->advance = (ftglyph->advance.x >> 16) + ceil((float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+
+    /* A glyph which was evicted from its page keeps its metrics, which
+     * other threads may be reading.
+     */
+    if (glyph->state < GLYPH_METRICS) {
+       /* adjust the glyph offset by the border with (if no border is used, then border_width == 0) */
+       glyph->offset_x = ((FT_BitmapGlyph)ftglyph)->left + ceil((float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+       glyph->offset_y = (font_data->size->metrics.ascender >> 6) - ((FT_BitmapGlyph)ftglyph)->top + ceil((float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+       /* adjust the glyph advance by the border width (this amount can be discutable; using twice the border width looks ugly for not so thick borders) */
+       glyph->advance = (ftglyph->advance.x >> 16) + ceil((float)(font_data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+    }
 
     if (w == 0 || h == 0) {
        /* Mark this glyph so we won't try to cache it next time. */
        glyph->region.x = -1;
        glyph->region.y = -1;
        ALLEGRO_DEBUG("Glyph %d has zero size.\n", ft_index);
-       /* release the glyph (the scalable format) and stroker */
+       _al_atomic_store_release(&glyph->state, GLYPH_CACHED);
+       /* release the glyph (the scalable format) */
        FT_Done_Glyph(ftglyph);
-       if (border)
-          FT_Stroker_Done(ftstroker);
-       return;
+       return NULL;
     }
 
-    if(al_get_current_display())
-    {
-
-    /* Each glyph has a 1-pixel border all around. Note: The border is kept
-     * even against the outer bitmap edge, to ensure consistent rendering.
-     */
-    glyph_data = alloc_glyph_region(font_data, ft_index,
-       w + 2, h + 2, false, glyph, lock_more);
-
-    if (glyph_data == NULL) {
-       return;
+    if (glyph->state < GLYPH_METRICS) {
+       /* Each glyph has a 1-pixel border all around. */
+       glyph->region.w = w + 2;
+       glyph->region.h = h + 2;
+       _al_atomic_store_release(&glyph->state, GLYPH_METRICS);
     }
 
-    if (font_data->flags & ALLEGRO_TTF_MONOCHROME)
-        copy_glyph_mono(font_data, &((FT_BitmapGlyph)ftglyph)->bitmap, glyph_data);
-    else
-        copy_glyph_color(font_data, &((FT_BitmapGlyph)ftglyph)->bitmap, glyph_data);
-    }
- 
-     /* release the glyph (the scalable format) and stroker */
-     FT_Done_Glyph(ftglyph);
-     if (border)
-       FT_Stroker_Done(ftstroker); 
+    return ftglyph;
 }
 
 
-static int get_kerning(ALLEGRO_TTF_FONT_DATA const *data, FT_Face face,
-   int prev_ft_index, int ft_index)
+/* Load and render a glyph with FreeType and fill in its metrics.  Returns
+ * the rendered glyph, which the caller must release with FT_Done_Glyph, or
+ * NULL if the glyph has nothing to draw.  Must be called with the font
+ * locked.
+ */
+static FT_Glyph rasterize_glyph(ALLEGRO_TTF_FONT_DATA *font_data,
+   FT_Face face, int ft_index, ALLEGRO_TTF_GLYPH_DATA *glyph, bool border)
 {
-   /* Do kerning? */
-   if (!(data->flags & ALLEGRO_TTF_NO_KERNING) && prev_ft_index != -1) {
-      FT_Vector delta;
-      FT_Get_Kerning(face, prev_ft_index, ft_index,
-         FT_KERNING_DEFAULT, &delta);
-      return delta.x >> 6;
-   }
+    FT_Glyph ftglyph = load_glyph_bitmap(font_data, face, ft_index, border);
+    return set_glyph_metrics(font_data, ftglyph, ft_index, glyph);
+}
 
-   return 0;
+
+static INLINE int cell_distance(FIELD_CELL c)
+{
+   return c.dx * c.dx + c.dy * c.dy;
 }
 
 
-static int render_glyph(ALLEGRO_FONT const *f,
-   ALLEGRO_COLOR color, int prev_ft_index, int ft_index,
-   float xpos, float ypos)
+static INLINE void edt_compare(FIELD_CELL *grid, int w, int h,
+   FIELD_CELL *p, int x, int y, int ox, int oy)
 {
-   ALLEGRO_TTF_FONT_DATA *data = f->data;
-   FT_Face face = data->face;
-   ALLEGRO_TTF_GLYPH_DATA *glyph;
-   int advance = 0;
+   FIELD_CELL other;
 
-   /* We don't try to cache all glyphs in a pre-pass before drawing them.
-    * While that would indeed save us making separate texture uploads, it
-    * implies two passes over a string even in the common case when all glyphs
-    * are already cached.  This turns out to have an measureable impact on
-    * performance.
-    */
+   x += ox;
+   y += oy;
+   if (x < 0 || y < 0 || x >= w || y >= h)
+      return;
 
-   advance += get_kerning(data, face, prev_ft_index, ft_index);
-<<<<<<< HEAD
-=======
+   other = grid[y * w + x];
+   other.dx += ox;
+   other.dy += oy;
+   if (cell_distance(other) < cell_distance(*p))
+      *p = other;
+}
 
-   if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
-       /* render the border of the glyph */
-       glyph = get_glyph(&data->glyph_border_ranges, ft_index);
-       cache_glyph(data, face, ft_index, glyph, false, true);
-       unlock_current_page(data);
-       if (glyph->page_bitmap) {
-         al_draw_tinted_bitmap_region(glyph->page_bitmap, data->border_color,
-             glyph->region.x + 1, glyph->region.y + 1,
-             glyph->region.w - 2, glyph->region.h - 2,
-             xpos + glyph->offset_x + advance,
-             ypos + glyph->offset_y, 0);
-       }
+
+/* Euclidean distance transform in two passes (8SSEDT).  Seed cells hold a
+ * zero offset and all others DISTANCE_FIELD_FAR; afterwards each cell holds
+ * the offset to the nearest seed.
+ */
+static void distance_transform(FIELD_CELL *grid, int w, int h)
+{
+   int x, y;
+
+   for (y = 0; y < h; y++) {
+      for (x = 0; x < w; x++) {
+         FIELD_CELL *p = &grid[y * w + x];
+         edt_compare(grid, w, h, p, x, y, -1, 0);
+         edt_compare(grid, w, h, p, x, y, 0, -1);
+         edt_compare(grid, w, h, p, x, y, -1, -1);
+         edt_compare(grid, w, h, p, x, y, 1, -1);
+      }
+      for (x = w - 1; x >= 0; x--)
+         edt_compare(grid, w, h, &grid[y * w + x], x, y, 1, 0);
    }
 
-    /* render the original (inner) glyph */
-    glyph = get_glyph(&data->glyph_ranges, ft_index);
-    cache_glyph(data, face, ft_index, glyph, false, false);
-    unlock_current_page(data); 
->>>>>>> Cumulative changes of the changes made for Factorio version of allegro.
+   for (y = h - 1; y >= 0; y--) {
+      for (x = w - 1; x >= 0; x--) {
+         FIELD_CELL *p = &grid[y * w + x];
+         edt_compare(grid, w, h, p, x, y, 1, 0);
+         edt_compare(grid, w, h, p, x, y, 0, 1);
+         edt_compare(grid, w, h, p, x, y, -1, 1);
+         edt_compare(grid, w, h, p, x, y, 1, 1);
+      }
+      for (x = 0; x < w; x++)
+         edt_compare(grid, w, h, &grid[y * w + x], x, y, -1, 0);
+   }
+}
 
-   if (glyph->page_bitmap) {
-      /* Each glyph has a 1-pixel border all around. */
-      al_draw_tinted_bitmap_region(glyph->page_bitmap, color,
-         glyph->region.x + 1, glyph->region.y + 1,
-         glyph->region.w - 2, glyph->region.h - 2,
-         xpos + glyph->offset_x + advance,
-         ypos + glyph->offset_y, 0);
+
+/* Turn a glyph rendered at DISTANCE_FIELD_OVERSAMPLE times the field size
+ * into a fw x fh field.  The glyph is centered with a margin of spread
+ * field pixels, and distances are stored as 128 + 127 * d / spread, with d
+ * positive inside the glyph.
+ */
+static bool compute_distance_field(FT_Bitmap const *bitmap,
+   unsigned char *field, int fw, int fh, int spread)
+{
+   const int os = DISTANCE_FIELD_OVERSAMPLE;
+   const FIELD_CELL far_cell = {DISTANCE_FIELD_FAR, DISTANCE_FIELD_FAR};
+   const FIELD_CELL seed = {0, 0};
+   int gw = fw * os;
+   int gh = fh * os;
+   FIELD_CELL *to_inside;
+   FIELD_CELL *to_outside;
+   int x, y, i, j;
+
+   to_inside = al_malloc(gw * gh * sizeof(FIELD_CELL));
+   to_outside = al_malloc(gw * gh * sizeof(FIELD_CELL));
+   if (!to_inside || !to_outside) {
+      al_free(to_inside);
+      al_free(to_outside);
+      return false;
    }
-   else if (glyph->region.x > 0) {
-      ALLEGRO_ERROR("Glyph %d not on any page.\n", ft_index);
+
+   for (y = 0; y < gh; y++) {
+      int by = y - spread * os;
+      for (x = 0; x < gw; x++) {
+         int bx = x - spread * os;
+         bool inside = bx >= 0 && by >= 0 &&
+            bx < (int)bitmap->width && by < (int)bitmap->rows &&
+            bitmap->buffer[by * bitmap->pitch + bx] >= 128;
+         to_inside[y * gw + x] = inside ? seed : far_cell;
+         to_outside[y * gw + x] = inside ? far_cell : seed;
+      }
    }
 
-   advance += glyph->advance;
+   distance_transform(to_inside, gw, gh);
+   distance_transform(to_outside, gw, gh);
 
-   return advance;
+   /* Sample the distance at the center of each field pixel, from the four
+    * subpixels around it.  The edge lies half a subpixel beyond the last
+    * inside subpixel.
+    */
+   for (y = 0; y < fh; y++) {
+      for (x = 0; x < fw; x++) {
+         float d = 0;
+         int v;
+         for (j = os / 2 - 1; j <= os / 2; j++) {
+            for (i = os / 2 - 1; i <= os / 2; i++) {
+               int k = (y * os + j) * gw + x * os + i;
+               if (cell_distance(to_inside[k]) == 0)
+                  d += sqrtf(cell_distance(to_outside[k])) - 0.5f;
+               else
+                  d -= sqrtf(cell_distance(to_inside[k])) - 0.5f;
+            }
+         }
+         d /= 4 * os;
+         v = 128 + (int)floorf(d * 127 / spread + 0.5f);
+         field[y * fw + x] = _ALLEGRO_CLAMP(0, v, 255);
+      }
+   }
+
+   al_free(to_inside);
+   al_free(to_outside);
+   return true;
 }
 
 
-static int ttf_font_height(ALLEGRO_FONT const *f)
+/* Render the distance field of a glyph, keeping what its metrics are
+ * made from.  fg->field is left NULL if the glyph has nothing to draw.
+ * Returns false on failure.  Must be called with the font locked, unless
+ * face is the private face of the glyph worker.
+ */
+static bool render_field_glyph(ALLEGRO_TTF_FONT_DATA *data, FT_Face face,
+   int ft_index, FIELD_GLYPH *fg)
 {
-   ASSERT(f);
-   return f->height;
-}
+   const int os = DISTANCE_FIELD_OVERSAMPLE;
+   int spread = data->field_spread;
+   FT_Glyph ftglyph;
+   FT_BitmapGlyph bitmap_glyph;
 
+   ftglyph = load_glyph_bitmap(data, face, ft_index, false);
+   bitmap_glyph = (FT_BitmapGlyph)ftglyph;
 
-static int ttf_font_ascent(ALLEGRO_FONT const *f)
-{
-    ALLEGRO_TTF_FONT_DATA *data;
-    FT_Face face;
+   memset(fg, 0, sizeof *fg);
+   fg->left = bitmap_glyph->left;
+   fg->top = bitmap_glyph->top;
+   fg->advance = ftglyph->advance.x >> 16;
 
-    ASSERT(f);
+   if (bitmap_glyph->bitmap.width == 0 || bitmap_glyph->bitmap.rows == 0) {
+      FT_Done_Glyph(ftglyph);
+      return true;
+   }
 
-    data = f->data;
-    face = data->face;
+   fg->w = (bitmap_glyph->bitmap.width + os - 1) / os + 2 * spread;
+   fg->h = (bitmap_glyph->bitmap.rows + os - 1) / os + 2 * spread;
+   fg->field = al_malloc(fg->w * fg->h);
+   if (!fg->field || !compute_distance_field(&bitmap_glyph->bitmap,
+         fg->field, fg->w, fg->h, spread)) {
+      ALLEGRO_ERROR("Out of memory making distance field of glyph %d.\n",
+         ft_index);
+      al_free(fg->field);
+      fg->field = NULL;
+      FT_Done_Glyph(ftglyph);
+      return false;
+   }
 
-    /* adjust the height by the border width */
-    return (face->size->metrics.ascender >> 6) + ceil((float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+   FT_Done_Glyph(ftglyph);
+   return true;
 }
 
 
-static int ttf_font_descent(ALLEGRO_FONT const *f)
+/* Give a glyph its rendered distance field and fill in its metrics, which
+ * are in pixels of the oversampled face.  The glyph takes over fg->field.
+ * Returns false if the glyph has nothing to draw.  Must be called with the
+ * font locked.
+ */
+static bool set_field_glyph(ALLEGRO_TTF_FONT_DATA *data, int ft_index,
+   ALLEGRO_TTF_GLYPH_DATA *glyph, FIELD_GLYPH const *fg)
 {
-    ALLEGRO_TTF_FONT_DATA *data;
-    FT_Face face;
-
-    ASSERT(f);
+   const int os = DISTANCE_FIELD_OVERSAMPLE;
+   int spread = data->field_spread;
+
+   ASSERT(!glyph->field);
+
+   if (!fg->field) {
+      glyph->offset_x = 0;
+      glyph->offset_y = 0;
+      glyph->advance = fg->advance;
+      glyph->region.x = -1;
+      glyph->region.y = -1;
+      ALLEGRO_DEBUG("Glyph %d has zero size.\n", ft_index);
+      _al_atomic_store_release(&glyph->state, GLYPH_CACHED);
+      return false;
+   }
 
-    data = f->data;
-    face = data->face;
+   glyph->field = fg->field;
+   if (glyph->state < GLYPH_METRICS) {
+      glyph->offset_x = fg->left - spread * os;
+      glyph->offset_y = (data->size->metrics.ascender >> 6) -
+         fg->top - spread * os;
+      glyph->advance = fg->advance;
+      /* Each glyph has a 1-pixel border all around. */
+      glyph->region.w = fg->w + 2;
+      glyph->region.h = fg->h + 2;
+      _al_atomic_store_release(&glyph->state, GLYPH_METRICS);
+   }
 
-    /* adjust the height by the border width */
-    return ((-face->size->metrics.descender) >> 6) + ceil((float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+   return true;
 }
 
 
-static int ttf_render_char(ALLEGRO_FONT const *f, ALLEGRO_COLOR color,
-   int ch, float xpos, float ypos)
+/* Make the distance field of a glyph and fill in its metrics.  Returns
+ * false if the glyph has nothing to draw, or on failure.  Must be called
+ * with the font locked.
+ */
+static bool make_field_glyph(ALLEGRO_TTF_FONT_DATA *data, FT_Face face,
+   int ft_index, ALLEGRO_TTF_GLYPH_DATA *glyph)
 {
-   /* Unused method. */
-   ASSERT(false);
-   (void)f;
-   (void)color;
-   (void)ch;
-   (void)xpos;
-   (void)ypos;
-   return 0;
+   FIELD_GLYPH fg;
+
+   if (!render_field_glyph(data, face, ft_index, &fg))
+      return false;
+   return set_field_glyph(data, ft_index, glyph, &fg);
 }
 
 
-static int ttf_char_length(ALLEGRO_FONT const *f, int ch)
+/* Describe the field of a glyph as an 8-bit FreeType bitmap. */
+static void field_bitmap(ALLEGRO_TTF_GLYPH_DATA const *glyph,
+   FT_Bitmap *bitmap)
 {
-   /* Unused method. */
-   ASSERT(false);
-   (void)f;
-   (void)ch;
-   return 0;
+   memset(bitmap, 0, sizeof *bitmap);
+   bitmap->width = glyph->region.w - 2;
+   bitmap->rows = glyph->region.h - 2;
+   bitmap->pitch = bitmap->width;
+   bitmap->buffer = glyph->field;
+   bitmap->num_grays = 256;
+   bitmap->pixel_mode = FT_PIXEL_MODE_GRAY;
 }
 
 
-static int ttf_render(ALLEGRO_FONT const *f, ALLEGRO_COLOR color,
-   const ALLEGRO_USTR *text, float x, float y)
+/* Put a rendered glyph on a page.  Must be called with the font locked and
+ * a current display.
+ *
+ * NOTE: this function may disable the bitmap hold drawing state
+ * and leave the current page bitmap locked.
+ */
+static void upload_glyph(ALLEGRO_TTF_FONT_DATA *font_data, int ft_index,
+   ALLEGRO_TTF_GLYPH_DATA *glyph, FT_Bitmap *bitmap, bool lock_more)
 {
-   ALLEGRO_TTF_FONT_DATA *data = f->data;
-   FT_Face face = data->face;
-   int pos = 0;
-   int advance = 0;
-   int prev_ft_index = -1;
-   int32_t ch;
-   bool hold;
+    unsigned char *glyph_data;
 
-   hold = al_is_bitmap_drawing_held();
-   al_hold_bitmap_drawing(true);
+    /* Note: The border is kept even against the outer bitmap edge, to
+     * ensure consistent rendering.
+     */
+    glyph_data = alloc_glyph_region(font_data, ft_index,
+       glyph->region.w, glyph->region.h, glyph, lock_more);
 
-   al_lock_mutex(freetype_mutex);
-   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
-      int ft_index = FT_Get_Char_Index(face, ch);
-      advance += render_glyph(f, color, prev_ft_index, ft_index,
-         x + advance, y);
-      prev_ft_index = ft_index;
-   }
-   al_unlock_mutex(freetype_mutex);
+    if (glyph_data == NULL) {
+       return;
+    }
 
-   al_hold_bitmap_drawing(hold);
+    if (font_data->flags & ALLEGRO_TTF_MONOCHROME)
+        copy_glyph_mono(font_data, bitmap, glyph_data);
+    else
+        copy_glyph_color(font_data, bitmap, glyph_data);
 
-   return advance;
+    _al_atomic_store_release(&glyph->last_use,
+       _al_atomic_load_acquire(&font_data->use_clock));
+    _al_atomic_store_release(&glyph->state, GLYPH_CACHED);
 }
 
 
-static int ttf_text_length(ALLEGRO_FONT const *f, const ALLEGRO_USTR *text)
+/* Rasterize a glyph and put it on a page, or only fill in its metrics if
+ * there is no display to create pages with.  Must be called with the font
+ * locked.
+ *
+ * NOTE: this function may disable the bitmap hold drawing state
+ * and leave the current page bitmap locked.
+ */
+static void cache_glyph(ALLEGRO_TTF_FONT_DATA *font_data, FT_Face face,
+   int ft_index, ALLEGRO_TTF_GLYPH_DATA *glyph, bool lock_more, bool border)
+{
+    FT_Glyph ftglyph;
+
+    if (glyph->state == GLYPH_CACHED)
+        /* this glyph has already been rendered */
+        return;
+    if (glyph->state == GLYPH_METRICS && !al_get_current_display())
+        /* and we can't do any better without a display */
+        return;
+
+    if (font_data->distance_field) {
+       FT_Bitmap bitmap;
+       if (!glyph->field &&
+             !make_field_glyph(font_data, face, ft_index, glyph))
+          return;
+       if (al_get_current_display()) {
+          field_bitmap(glyph, &bitmap);
+          upload_glyph(font_data, ft_index, glyph, &bitmap, lock_more);
+       }
+       return;
+    }
+
+    ftglyph = rasterize_glyph(font_data, face, ft_index, glyph, border);
+    if (!ftglyph)
+       return;
+
+    if (al_get_current_display()) {
+       upload_glyph(font_data, ft_index, glyph,
+          &((FT_BitmapGlyph)ftglyph)->bitmap, lock_more);
+    }
+
+    /* release the glyph (the scalable format) */
+    FT_Done_Glyph(ftglyph);
+}
+
+
+/* Whether a queued glyph still has to be rendered.  Must be called with
+ * the font locked.
+ */
+static bool needs_render(ALLEGRO_TTF_FONT_DATA *data,
+   ALLEGRO_TTF_GLYPH_DATA const *glyph)
+{
+   if (glyph->state == GLYPH_CACHED)
+      return false;
+   return !(data->distance_field && glyph->field);
+}
+
+
+/* Render a queued glyph, into *ftglyph or, for distance field fonts, into
+ * *fg.  Returns false on failure.  Must be called with the font locked,
+ * unless face is the private face of the glyph worker.
+ */
+static bool render_request(ALLEGRO_TTF_FONT_DATA *data, FT_Face face,
+   GLYPH_REQUEST const *req, FT_Glyph *ftglyph, FIELD_GLYPH *fg)
+{
+   if (data->distance_field)
+      return render_field_glyph(data, face, req->ft_index, fg);
+
+   *ftglyph = load_glyph_bitmap(data, face, req->ft_index, req->border);
+   return true;
+}
+
+
+/* Fill in the metrics of a glyph the worker rendered and copy its bitmap
+ * into a staging buffer.  Takes over ftglyph and fg->field, either of
+ * which is unset if the glyph needed no rendering.  Called by the worker
+ * with the font locked.
+ */
+static void stage_glyph(ALLEGRO_TTF_FONT_DATA *data, GLYPH_REQUEST const *req,
+   FT_Glyph ftglyph, FIELD_GLYPH const *fg)
+{
+   ALLEGRO_TTF_GLYPH_DATA *glyph = req->glyph;
+   FT_Bitmap *bitmap;
+   STAGED_GLYPH *staged;
+   size_t size;
+
+   if (glyph->state == GLYPH_CACHED) {
+      /* It was cached in place in the meantime. */
+      glyph->queued = false;
+      if (ftglyph)
+         FT_Done_Glyph(ftglyph);
+      al_free(fg->field);
+      return;
+   }
+
+   if (data->distance_field) {
+      /* The field is the staging buffer. */
+      if (glyph->field) {
+         /* It was made in place in the meantime. */
+         al_free(fg->field);
+      }
+      else if (!set_field_glyph(data, req->ft_index, glyph, fg)) {
+         glyph->queued = false;
+         return;
+      }
+      staged = _al_vector_alloc_back(&data->staged);
+      if (!staged) {
+         glyph->queued = false;
+         return;
+      }
+      staged->glyph = glyph;
+      staged->ft_index = req->ft_index;
+      field_bitmap(glyph, &staged->bitmap);
+      _al_atomic_store_release(&data->num_staged,
+         _al_vector_size(&data->staged));
+      return;
+   }
+
+   ASSERT(ftglyph);
+   ftglyph = set_glyph_metrics(data, ftglyph, req->ft_index, glyph);
+   if (!ftglyph) {
+      glyph->queued = false;
+      return;
+   }
+
+   bitmap = &((FT_BitmapGlyph)ftglyph)->bitmap;
+   ASSERT(bitmap->pitch >= 0);
+   size = bitmap->rows * bitmap->pitch;
+
+   staged = _al_vector_alloc_back(&data->staged);
+   if (staged) {
+      staged->glyph = glyph;
+      staged->ft_index = req->ft_index;
+      staged->bitmap = *bitmap;
+      staged->bitmap.buffer = al_malloc(size > 0 ? size : 1);
+      if (staged->bitmap.buffer) {
+         memcpy(staged->bitmap.buffer, bitmap->buffer, size);
+         _al_atomic_store_release(&data->num_staged,
+            _al_vector_size(&data->staged));
+      }
+      else {
+         _al_vector_delete_at(&data->staged,
+            _al_vector_size(&data->staged) - 1);
+         staged = NULL;
+      }
+   }
+   if (!staged)
+      glyph->queued = false;
+
+   FT_Done_Glyph(ftglyph);
+}
+
+
+/* Open a face of the worker's own on the font file, sized like the font.
+ * A FreeType face can't be used by two threads at once even with separate
+ * sizes, since the glyph slot belongs to the face.  Only a file mapped into
+ * memory can be opened a second time cheaply, so for streamed files this
+ * returns NULL and the worker renders on the shared face under the lock.
+ */
+static FT_Face open_worker_face(ALLEGRO_TTF_FONT_DATA *data)
+{
+   TTF_FACE *tf = data->ttf_face;
+   FT_Face face;
+   int result;
+
+   if (!tf->map)
+      return NULL;
+
+   al_lock_mutex(freetype_mutex);
+   result = FT_New_Memory_Face(ft, tf->map, tf->map_size, 0, &face);
+   al_unlock_mutex(freetype_mutex);
+   if (result != 0) {
+      ALLEGRO_WARN("Could not open a face for the glyph worker. "
+         "Freetype error code %d\n", result);
+      return NULL;
+   }
+
+   if (FT_Request_Size(face, &data->size_req) != 0) {
+      ALLEGRO_WARN("Could not size the face of the glyph worker.\n");
+      al_lock_mutex(freetype_mutex);
+      FT_Done_Face(face);
+      al_unlock_mutex(freetype_mutex);
+      return NULL;
+   }
+
+   return face;
+}
+
+
+static void *glyph_worker(ALLEGRO_THREAD *thread, void *arg)
+{
+   ALLEGRO_TTF_FONT_DATA *data = arg;
+   FT_Face face = open_worker_face(data);
+   (void)thread;
+
+   al_lock_mutex(data->mutex);
+   while (!data->worker_quit) {
+      GLYPH_REQUEST req;
+      FT_Glyph ftglyph = NULL;
+      FIELD_GLYPH fg;
+      bool ok = true;
+
+      if (data->next_request >= _al_vector_size(&data->requests)) {
+         _al_vector_free(&data->requests);
+         data->next_request = 0;
+         al_wait_cond(data->worker_cond, data->mutex);
+         continue;
+      }
+
+      req = *(GLYPH_REQUEST *)_al_vector_ref(&data->requests,
+         data->next_request++);
+      memset(&fg, 0, sizeof fg);
+
+      if (needs_render(data, req.glyph)) {
+         if (face) {
+            /* The lock is only needed again to publish the glyph. */
+            al_unlock_mutex(data->mutex);
+            ok = render_request(data, face, &req, &ftglyph, &fg);
+            al_lock_mutex(data->mutex);
+         }
+         else {
+            ok = render_request(data, data->face, &req, &ftglyph, &fg);
+         }
+      }
+
+      if (ok)
+         stage_glyph(data, &req, ftglyph, &fg);
+      else
+         req.glyph->queued = false;
+
+      /* Give drawing threads a chance to get the lock between glyphs. */
+      al_unlock_mutex(data->mutex);
+      al_lock_mutex(data->mutex);
+   }
+   al_unlock_mutex(data->mutex);
+
+   if (face) {
+      al_lock_mutex(freetype_mutex);
+      FT_Done_Face(face);
+      al_unlock_mutex(freetype_mutex);
+   }
+
+   return NULL;
+}
+
+
+/* Queue a glyph for the background worker, starting the worker if needed.
+ * The advance of the glyph is filled in straight away, so text can be laid
+ * out before the glyph is ready.  Returns false if the glyph has to be
+ * cached in place instead.  Must be called with the font locked.
+ */
+static bool queue_glyph(ALLEGRO_TTF_FONT_DATA *data, CHAR_ENTRY const *c,
+   bool border)
+{
+   ALLEGRO_TTF_GLYPH_DATA *glyph = border ? c->border_glyph : c->glyph;
+   GLYPH_REQUEST *req;
+
+   if (glyph->queued)
+      return true;
+
+   if (!data->worker) {
+      data->worker = al_create_thread(glyph_worker, data);
+      if (!data->worker) {
+         ALLEGRO_WARN("Could not start the glyph worker thread.\n");
+         data->background = false;
+         return false;
+      }
+      al_start_thread(data->worker);
+   }
+
+   req = _al_vector_alloc_back(&data->requests);
+   if (!req)
+      return false;
+   req->glyph = glyph;
+   req->ft_index = c->ft_index;
+   req->border = border;
+   glyph->queued = true;
+
+   if (glyph->state < GLYPH_METRICS) {
+      FT_Fixed advance;
+      use_size(data);
+      if (FT_Get_Advance(data->face, c->ft_index, get_load_flags(data),
+            &advance) == 0) {
+         /* Same as rasterize_glyph will work out. */
+         glyph->advance = (advance >> 16) + ceil((float)(data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+      }
+   }
+
+   al_signal_cond(data->worker_cond);
+   return true;
+}
+
+
+/* Put all glyphs the worker has finished on pages, in one go.  Must be
+ * called with the font locked; does nothing without a current display.
+ */
+static void upload_staged_glyphs(ALLEGRO_TTF_FONT_DATA *data)
+{
+   unsigned int i;
+
+   if (_al_vector_is_empty(&data->staged) || !al_get_current_display())
+      return;
+
+   for (i = 0; i < _al_vector_size(&data->staged); i++) {
+      STAGED_GLYPH *staged = _al_vector_ref(&data->staged, i);
+      if (staged->glyph->state != GLYPH_CACHED) {
+         upload_glyph(data, staged->ft_index, staged->glyph,
+            &staged->bitmap, true);
+      }
+      staged->glyph->queued = false;
+      if (staged->bitmap.buffer != staged->glyph->field)
+         al_free(staged->bitmap.buffer);
+   }
+   _al_vector_free(&data->staged);
+   _al_atomic_store_release(&data->num_staged, 0);
+
+   unlock_current_page(data);
+}
+
+
+/* Return a glyph which has reached at least the given state.  Glyphs which
+ * are already cached are returned without locking; otherwise the font is
+ * locked and stays locked until the caller is done with the string.
+ * A font with a cache budget is always locked, since another string may
+ * empty a page and take glyphs back to GLYPH_METRICS at any time.
+ *
+ * If defer is true and the font rasterizes in the background, a glyph
+ * which is not ready is queued and returned as it is; only its advance is
+ * valid then.
+ */
+static ALLEGRO_TTF_GLYPH_DATA *get_cached_glyph(ALLEGRO_TTF_FONT_DATA *data,
+   CHAR_ENTRY const *c, bool border, int state, bool defer, bool lock_more,
+   bool *locked)
+{
+   ALLEGRO_TTF_GLYPH_DATA *glyph = border ? c->border_glyph : c->glyph;
+
+   if (data->cache_budget > 0)
+      lock_font(data, locked);
+
+   if (_al_atomic_load_acquire(&glyph->state) < state) {
+      lock_font(data, locked);
+      if (data->background) {
+         upload_staged_glyphs(data);
+         if (glyph->state >= state)
+            return glyph;
+         if (defer && queue_glyph(data, c, border))
+            return glyph;
+      }
+      cache_glyph(data, data->face, c->ft_index, glyph, lock_more, border);
+   }
+   else if (state == GLYPH_CACHED && data->cache_budget > 0) {
+      _AL_ATOMIC now = _al_atomic_load_acquire(&data->use_clock);
+      if (_al_atomic_load_acquire(&glyph->last_use) != now)
+         _al_atomic_store_release(&glyph->last_use, now);
+   }
+   return glyph;
+}
+
+
+static INLINE unsigned int hash_kerning_pair(int prev_ft_index, int ft_index)
+{
+   return ((uint32_t)prev_ft_index * 2654435761u) ^ (uint32_t)ft_index;
+}
+
+
+static int get_kerning(ALLEGRO_TTF_FONT_DATA *data, int prev_ft_index,
+   int ft_index, bool *locked)
+{
+   KERNING_ENTRY *free_entry = NULL;
+   FT_Vector delta;
+   unsigned int h;
+   int i;
+
+   /* Do kerning? */
+   if (!data->has_kerning || prev_ft_index == -1)
+      return 0;
+
+   h = hash_kerning_pair(prev_ft_index, ft_index);
+   for (i = 0; i < KERNING_PROBES; i++) {
+      KERNING_ENTRY *e =
+         &data->kerning_cache[(h + i) & (KERNING_CACHE_SIZE - 1)];
+      if (!_al_atomic_load_acquire(&e->used))
+         break;
+      if (e->prev_ft_index == prev_ft_index && e->ft_index == ft_index)
+         return e->kerning;
+   }
+
+   lock_font(data, locked);
+
+   /* Probe again under the lock, both for a free slot and in case another
+    * thread has added the pair in the meantime.
+    */
+   for (i = 0; i < KERNING_PROBES; i++) {
+      KERNING_ENTRY *e =
+         &data->kerning_cache[(h + i) & (KERNING_CACHE_SIZE - 1)];
+      if (!e->used) {
+         free_entry = e;
+         break;
+      }
+      if (e->prev_ft_index == prev_ft_index && e->ft_index == ft_index)
+         return e->kerning;
+   }
+
+   use_size(data);
+   FT_Get_Kerning(data->face, prev_ft_index, ft_index,
+      FT_KERNING_DEFAULT, &delta);
+
+   if (free_entry) {
+      free_entry->prev_ft_index = prev_ft_index;
+      free_entry->ft_index = ft_index;
+      free_entry->kerning = delta.x >> 6;
+      _al_atomic_store_release(&free_entry->used, 1);
+   }
+
+   return delta.x >> 6;
+}
+
+
+static int render_glyph(ALLEGRO_FONT const *f,
+   ALLEGRO_COLOR color, int prev_ft_index, CHAR_ENTRY const *c,
+   float xpos, float ypos, bool *locked)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   ALLEGRO_TTF_GLYPH_DATA *glyph;
+   int advance = 0;
+
+   /* We don't try to cache all glyphs in a pre-pass before drawing them.
+    * While that would indeed save us making separate texture uploads, it
+    * implies two passes over a string even in the common case when all glyphs
+    * are already cached.  This turns out to have an measureable impact on
+    * performance.
+    */
+
+   advance += get_kerning(data, prev_ft_index, c->ft_index, locked);
+
+   if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
+       /* render the border of the glyph */
+       glyph = get_cached_glyph(data, c, true, GLYPH_CACHED, true, false,
+          locked);
+       unlock_current_page(data);
+       if (glyph->page_bitmap) {
+         al_draw_tinted_bitmap_region(glyph->page_bitmap, data->border_color,
+             glyph->region.x + 1, glyph->region.y + 1,
+             glyph->region.w - 2, glyph->region.h - 2,
+             xpos + glyph->offset_x + advance,
+             ypos + glyph->offset_y, 0);
+       }
+   }
+
+   /* render the original (inner) glyph */
+   glyph = get_cached_glyph(data, c, false, GLYPH_CACHED, true, false,
+      locked);
+   unlock_current_page(data);
+
+   if (glyph->page_bitmap) {
+      /* Each glyph has a 1-pixel border all around. */
+      al_draw_tinted_bitmap_region(glyph->page_bitmap, color,
+         glyph->region.x + 1, glyph->region.y + 1,
+         glyph->region.w - 2, glyph->region.h - 2,
+         xpos + glyph->offset_x + advance,
+         ypos + glyph->offset_y, 0);
+   }
+   else if (glyph->region.x > 0 &&
+         _al_atomic_load_acquire(&glyph->state) == GLYPH_CACHED) {
+      ALLEGRO_ERROR("Glyph %d not on any page.\n", c->ft_index);
+   }
+
+   advance += glyph->advance;
+
+   return advance;
+}
+
+
+static int ttf_font_height(ALLEGRO_FONT const *f)
+{
+   ASSERT(f);
+   return f->height;
+}
+
+
+static int ttf_font_ascent(ALLEGRO_FONT const *f)
+{
+    ALLEGRO_TTF_FONT_DATA *data;
+
+    ASSERT(f);
+
+    data = f->data;
+
+    /* adjust the height by the border width */
+    return (data->size->metrics.ascender >> 6) + ceil((float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+}
+
+
+static int ttf_font_descent(ALLEGRO_FONT const *f)
+{
+    ALLEGRO_TTF_FONT_DATA *data;
+
+    ASSERT(f);
+
+    data = f->data;
+
+    /* adjust the height by the border width */
+    return ((-data->size->metrics.descender) >> 6) + ceil((float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+}
+
+
+static int ttf_render_char(ALLEGRO_FONT const *f, ALLEGRO_COLOR color,
+   int ch, float xpos, float ypos)
+{
+   /* Unused method. */
+   ASSERT(false);
+   (void)f;
+   (void)color;
+   (void)ch;
+   (void)xpos;
+   (void)ypos;
+   return 0;
+}
+
+
+static int ttf_char_length(ALLEGRO_FONT const *f, int ch)
+{
+   /* Unused method. */
+   ASSERT(false);
+   (void)f;
+   (void)ch;
+   return 0;
+}
+
+
+static int ttf_render(ALLEGRO_FONT const *f, ALLEGRO_COLOR color,
+   const ALLEGRO_USTR *text, float x, float y)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   int pos = 0;
+   int advance = 0;
+   int prev_ft_index = -1;
+   bool locked = false;
+   int32_t ch;
+   bool hold;
+
+   if (data->cache_budget > 0)
+      _al_fetch_and_add1(&data->use_clock);
+
+   hold = al_is_bitmap_drawing_held();
+   al_hold_bitmap_drawing(true);
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      if (!c)
+         continue;
+      advance += render_glyph(f, color, prev_ft_index, c,
+         x + advance, y, &locked);
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   al_hold_bitmap_drawing(hold);
+
+   return advance;
+}
+
+
+/* Add a glyph to a prepared text.  Returns false if the glyph should have
+ * something to draw but could not be put on a page.
+ */
+static bool add_prepared_glyph(ALLEGRO_PREPARED_TEXT *prep,
+   ALLEGRO_TTF_GLYPH_DATA *glyph, bool own_color, ALLEGRO_COLOR color,
+   int advance)
+{
+   _AL_PREPARED_GLYPH g;
+
+   if (!glyph->page_bitmap)
+      return _al_atomic_load_acquire(&glyph->state) == GLYPH_CACHED;
+
+   /* Each glyph has a 1-pixel border all around. */
+   g.bitmap = glyph->page_bitmap;
+   g.sx = glyph->region.x + 1;
+   g.sy = glyph->region.y + 1;
+   g.sw = glyph->region.w - 2;
+   g.sh = glyph->region.h - 2;
+   g.dx = glyph->offset_x + advance;
+   g.dy = glyph->offset_y;
+   g.own_color = own_color;
+   g.color = color;
+   return _al_add_prepared_glyph(prep, &g);
+}
+
+
+static bool ttf_prepare_text(ALLEGRO_FONT const *f,
+   const ALLEGRO_USTR *text, ALLEGRO_PREPARED_TEXT *prep)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   ALLEGRO_COLOR no_color = {0, 0, 0, 0};
+   int pos = 0;
+   int advance = 0;
+   int prev_ft_index = -1;
+   bool locked = false;
+   bool complete = true;
+   int32_t ch;
+
+   /* Same placement as ttf_render, but nothing is drawn so the page can
+    * stay locked while glyphs are cached.
+    */
+   if (data->cache_budget > 0)
+      _al_fetch_and_add1(&data->use_clock);
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      if (!c) {
+         complete = false;
+         continue;
+      }
+
+      advance += get_kerning(data, prev_ft_index, c->ft_index, &locked);
+
+      if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
+         glyph = get_cached_glyph(data, c, true, GLYPH_CACHED, true, true,
+            &locked);
+         if (!add_prepared_glyph(prep, glyph, true, data->border_color,
+               advance))
+            complete = false;
+      }
+
+      glyph = get_cached_glyph(data, c, false, GLYPH_CACHED, true, true,
+         &locked);
+      if (!add_prepared_glyph(prep, glyph, false, no_color, advance))
+         complete = false;
+
+      advance += glyph->advance;
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   return complete;
+}
+
+
+/* Drawing a prepared text does not look its glyphs up again, so mark the
+ * pages it draws from as used instead; otherwise they would look idle and
+ * be the first to be emptied.
+ */
+static void ttf_use_glyph_pages(ALLEGRO_FONT const *f,
+   ALLEGRO_BITMAP * const *pages, int count)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   _AL_ATOMIC now;
+   int i;
+
+   if (data->cache_budget == 0)
+      return;
+
+   al_lock_mutex(data->mutex);
+   _al_fetch_and_add1(&data->use_clock);
+   now = _al_atomic_load_acquire(&data->use_clock);
+   for (i = 0; i < count; i++) {
+      int p = find_page(data, pages[i]);
+      if (p >= 0) {
+         GLYPH_PAGE *page = _al_vector_ref(&data->pages, p);
+         page->last_use = now;
+      }
+   }
+   al_unlock_mutex(data->mutex);
+}
+
+
+static int ttf_text_length(ALLEGRO_FONT const *f, const ALLEGRO_USTR *text)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   /* the border glyph has bigger metric values, so use it */
+   bool border = data->flags & ALLEGRO_TTF_RENDER_BORDER;
+   int pos = 0;
+   int prev_ft_index = -1;
+   int x = 0;
+   bool locked = false;
+   int32_t ch;
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      if (!c)
+         continue;
+      glyph = get_cached_glyph(data, c, border, GLYPH_METRICS, true, true,
+         &locked);
+
+      x += get_kerning(data, prev_ft_index, c->ft_index, &locked);
+      x += glyph->advance;
+
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   /* because the border glyph advance is adjusted by only once the border width,
+      we have to add this amount once more at the end of the string */
+   return x + ceil((float)(data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+}
+
+
+/* Splits ttf_text_length into the kerning and advance of each character,
+ * so callers can measure any part of the text without going back to the
+ * glyphs.
+ */
+static int ttf_get_glyph_advances(ALLEGRO_FONT const *f,
+   const ALLEGRO_USTR *text, float *kerning, float *advances)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   bool border = data->flags & ALLEGRO_TTF_RENDER_BORDER;
+   int pos = 0;
+   int prev_ft_index = -1;
+   int i = 0;
+   bool locked = false;
+   int32_t ch;
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      kerning[i] = 0;
+      advances[i] = 0;
+      i++;
+      if (!c)
+         continue;
+      glyph = get_cached_glyph(data, c, border, GLYPH_METRICS, true, true,
+         &locked);
+
+      kerning[i - 1] = get_kerning(data, prev_ft_index, c->ft_index, &locked);
+      advances[i - 1] = glyph->advance;
+
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   return ceil((float)(data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+}
+
+
+static int ttf_get_generation(ALLEGRO_FONT const *f)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   return _al_atomic_load_acquire(&data->generation);
+}
+
+
+static void ttf_get_text_dimensions(ALLEGRO_FONT const *f,
+   ALLEGRO_USTR const *text,
+   int *bbx, int *bby, int *bbw, int *bbh)
+{
+   ALLEGRO_TTF_FONT_DATA *data = f->data;
+   /* the border glyph has bigger metric values, so use it */
+   bool border = data->flags & ALLEGRO_TTF_RENDER_BORDER;
+   int end;
+   int pos = 0;
+   int prev_ft_index = -1;
+   bool first = true;
+   int x = 0;
+   bool locked = false;
+   int32_t ch;
+
+   end = al_ustr_size(text);
+   *bbx = 0;
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      if (!c)
+         continue;
+      glyph = get_cached_glyph(data, c, border, GLYPH_METRICS, false, true,
+         &locked);
+
+      if (pos == end) {
+         x += glyph->offset_x + glyph->region.w;
+      }
+      else {
+         x += get_kerning(data, prev_ft_index, c->ft_index, &locked);
+         x += glyph->advance;
+      }
+
+      if (first) {
+         *bbx = glyph->offset_x;
+         first = false;
+      }
+
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   /* because the border glyph advance is adjusted by only once the border width,
+      we have to add this amount once more at the end of the string */
+   x += ceil((float)(data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+
+   *bby = 0; // FIXME
+   *bbw = x - *bbx;
+   *bbh = f->height; // FIXME, we want the bounding box!
+}
+
+
+static ALLEGRO_SHADER *create_field_shader(void)
+{
+   ALLEGRO_SHADER *shader;
+   ALLEGRO_SHADER_PLATFORM platform;
+   const char *pixel_source;
+
+   shader = al_create_shader(ALLEGRO_SHADER_AUTO);
+   if (!shader)
+      return NULL;
+
+   platform = al_get_shader_platform(shader);
+   if (platform == ALLEGRO_SHADER_HLSL)
+      pixel_source = field_hlsl_pixel_source;
+   else
+      pixel_source = field_glsl_pixel_source;
+
+   if (!al_attach_shader_source(shader, ALLEGRO_VERTEX_SHADER,
+         al_get_default_shader_source(platform, ALLEGRO_VERTEX_SHADER)) ||
+       !al_attach_shader_source(shader, ALLEGRO_PIXEL_SHADER,
+         pixel_source) ||
+       !al_build_shader(shader)) {
+      ALLEGRO_WARN("Could not build the distance field shader: %s\n",
+         al_get_shader_log(shader));
+      al_destroy_shader(shader);
+      return NULL;
+   }
+
+   return shader;
+}
+
+
+/* Called when a display is destroyed, so that its shader goes with it and
+ * a display created later at the same address gets a new one.
+ */
+static void destroy_field_shader(ALLEGRO_DISPLAY *display)
+{
+   unsigned int i;
+
+   al_lock_mutex(freetype_mutex);
+   for (i = 0; i < _al_vector_size(&field_shaders); i++) {
+      FIELD_SHADER *fs = _al_vector_ref(&field_shaders, i);
+      if (fs->display == display) {
+         al_destroy_shader(fs->shader);
+         _al_vector_delete_at(&field_shaders, i);
+         break;
+      }
+   }
+   al_unlock_mutex(freetype_mutex);
+
+   _al_remove_display_destroyed_callback(display, destroy_field_shader);
+}
+
+
+/* Return the shader for drawing distance fields to the target bitmap, or
+ * NULL if they have to be drawn in software.  Shaders are made once per
+ * display, and destroyed with it.
+ */
+static ALLEGRO_SHADER *get_field_shader(void)
+{
+   ALLEGRO_BITMAP *target = al_get_target_bitmap();
+   ALLEGRO_DISPLAY *display = al_get_current_display();
+   FIELD_SHADER *fs = NULL;
+   unsigned int i;
+
+   if (!target || !display ||
+         (al_get_bitmap_flags(target) & ALLEGRO_MEMORY_BITMAP) ||
+         !(al_get_display_flags(display) & ALLEGRO_PROGRAMMABLE_PIPELINE))
+      return NULL;
+
+   al_lock_mutex(freetype_mutex);
+   for (i = 0; i < _al_vector_size(&field_shaders); i++) {
+      fs = _al_vector_ref(&field_shaders, i);
+      if (fs->display == display)
+         break;
+      fs = NULL;
+   }
+   if (!fs) {
+      fs = _al_vector_alloc_back(&field_shaders);
+      if (fs) {
+         fs->display = display;
+         fs->shader = create_field_shader();
+         _al_add_display_destroyed_callback(display, destroy_field_shader);
+      }
+   }
+   al_unlock_mutex(freetype_mutex);
+
+   return fs ? fs->shader : NULL;
+}
+
+
+/* Work out where the edges of the glyph and of its border are, as field
+ * values between 0 and 1, and how far to either side of an edge to blend.
+ */
+static void get_field_edges(DISTANCE_FIELD_FONT const *df,
+   float *fill_edge, float *border_edge, float *smoothing)
+{
+   /* Screen pixels per field pixel, and field value per field pixel. */
+   float scale = df->scale_x * DISTANCE_FIELD_OVERSAMPLE;
+   float unit = (127.0f / 255.0f) / df->data->field_spread;
+
+   *fill_edge = 128.0f / 255.0f;
+   *border_edge = *fill_edge;
+   *smoothing = 0.5f * unit / scale;
+
+   if (df->flags & ALLEGRO_TTF_RENDER_BORDER) {
+      /* Borders are limited by the spread of the field. */
+      *border_edge -= df->border_width * unit / scale;
+      if (*border_edge < *smoothing)
+         *border_edge = *smoothing;
+   }
+}
+
+
+static void use_field_shader(DISTANCE_FIELD_FONT const *df,
+   ALLEGRO_SHADER *shader)
+{
+   ALLEGRO_COLOR border_color = df->border_color;
+   float fill_edge, border_edge, smoothing;
+
+   get_field_edges(df, &fill_edge, &border_edge, &smoothing);
+
+   al_use_shader(shader);
+   al_set_shader_float("ttf_fill_edge", fill_edge);
+   al_set_shader_float("ttf_border_edge", border_edge);
+   al_set_shader_float("ttf_smoothing", smoothing);
+   al_set_shader_float_vector("ttf_border_color", 4, &border_color.r, 1);
+}
+
+
+static INLINE float field_smoothstep(float edge0, float edge1, float x)
+{
+   float t = (x - edge0) / (edge1 - edge0);
+   t = _ALLEGRO_CLAMP(0.0f, t, 1.0f);
+   return t * t * (3 - 2 * t);
+}
+
+
+static INLINE float field_texel(ALLEGRO_TTF_GLYPH_DATA const *glyph,
+   int fw, int fh, int x, int y)
+{
+   if (x < 0 || y < 0 || x >= fw || y >= fh)
+      return 0;
+   return glyph->field[y * fw + x];
+}
+
+
+/* Bilinear sample of a field, between 0 and 1. */
+static float sample_field(ALLEGRO_TTF_GLYPH_DATA const *glyph, int fw,
+   int fh, float u, float v)
+{
+   int x = (int)floorf(u);
+   int y = (int)floorf(v);
+   float fx = u - x;
+   float fy = v - y;
+   float top = field_texel(glyph, fw, fh, x, y) * (1 - fx) +
+      field_texel(glyph, fw, fh, x + 1, y) * fx;
+   float bottom = field_texel(glyph, fw, fh, x, y + 1) * (1 - fx) +
+      field_texel(glyph, fw, fh, x + 1, y + 1) * fx;
+   return (top * (1 - fy) + bottom * fy) / 255.0f;
+}
+
+
+/* Make sure the scratch bitmap is at least w x h. */
+static bool get_scratch(ALLEGRO_TTF_FONT_DATA *data, int w, int h)
+{
+   ALLEGRO_STATE state;
+
+   if (data->scratch) {
+      if (al_get_bitmap_width(data->scratch) >= w &&
+            al_get_bitmap_height(data->scratch) >= h)
+         return true;
+      w = _ALLEGRO_MAX(w, al_get_bitmap_width(data->scratch));
+      h = _ALLEGRO_MAX(h, al_get_bitmap_height(data->scratch));
+      al_destroy_bitmap(data->scratch);
+   }
+
+   _al_push_destructor_owner();
+   al_store_state(&state, ALLEGRO_STATE_NEW_BITMAP_PARAMETERS);
+   al_set_new_bitmap_format(ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE);
+   al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+   data->scratch = al_create_bitmap(w, h);
+   al_restore_state(&state);
+   _al_pop_destructor_owner();
+
+   return data->scratch != NULL;
+}
+
+
+/* Draw a glyph from its field without a shader, by evaluating the field
+ * into the scratch bitmap.  Must be called with the font locked.
+ */
+static void draw_field_glyph(DISTANCE_FIELD_FONT const *df,
+   ALLEGRO_TTF_GLYPH_DATA const *glyph, ALLEGRO_COLOR color,
+   float gx, float gy)
+{
+   ALLEGRO_TTF_FONT_DATA *data = df->data;
+   ALLEGRO_COLOR border = df->border_color;
+   ALLEGRO_LOCKED_REGION *lr;
+   int fw = glyph->region.w - 2;
+   int fh = glyph->region.h - 2;
+   float scale_x = df->scale_x * DISTANCE_FIELD_OVERSAMPLE;
+   float scale_y = df->scale_y * DISTANCE_FIELD_OVERSAMPLE;
+   float fill_edge, border_edge, smoothing;
+   int x0 = (int)floorf(gx);
+   int y0 = (int)floorf(gy);
+   int w = (int)ceilf(gx + fw * scale_x) - x0;
+   int h = (int)ceilf(gy + fh * scale_y) - y0;
+   int x, y;
+
+   if (w <= 0 || h <= 0 || !get_scratch(data, w, h))
+      return;
+
+   lr = al_lock_bitmap_region(data->scratch, 0, 0, w, h,
+      ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+   if (!lr)
+      return;
+
+   get_field_edges(df, &fill_edge, &border_edge, &smoothing);
+
+   for (y = 0; y < h; y++) {
+      unsigned char *dptr = (unsigned char *)lr->data + y * lr->pitch;
+      float v = (y0 + y + 0.5f - gy) / scale_y - 0.5f;
+      for (x = 0; x < w; x++) {
+         float u = (x0 + x + 0.5f - gx) / scale_x - 0.5f;
+         float d = sample_field(glyph, fw, fh, u, v);
+         float fill = field_smoothstep(fill_edge - smoothing,
+            fill_edge + smoothing, d);
+         float outer = field_smoothstep(border_edge - smoothing,
+            border_edge + smoothing, d);
+         float rim = outer - fill;
+         *dptr++ = _ALLEGRO_CLAMP(0, (int)((color.r * fill + border.r * rim) * 255 + 0.5f), 255);
+         *dptr++ = _ALLEGRO_CLAMP(0, (int)((color.g * fill + border.g * rim) * 255 + 0.5f), 255);
+         *dptr++ = _ALLEGRO_CLAMP(0, (int)((color.b * fill + border.b * rim) * 255 + 0.5f), 255);
+         *dptr++ = _ALLEGRO_CLAMP(0, (int)((color.a * fill + border.a * rim) * 255 + 0.5f), 255);
+      }
+   }
+
+   al_unlock_bitmap(data->scratch);
+   al_draw_bitmap_region(data->scratch, 0, 0, w, h, x0, y0, 0);
+}
+
+
+/* Extra space around glyphs of a distance field font with a border. */
+static int field_border_extra(DISTANCE_FIELD_FONT const *df)
 {
-   ALLEGRO_TTF_FONT_DATA *data = f->data;
-   FT_Face face = data->face;
+   if (df->flags & ALLEGRO_TTF_RENDER_BORDER)
+      return ceil(df->border_width);
+   return 0;
+}
+
+
+static int field_font_height(DISTANCE_FIELD_FONT const *df)
+{
+   FT_Size size = df->data->size;
+   return floor((size->metrics.height >> 6) * df->scale_y + 0.5) +
+      2 * field_border_extra(df);
+}
+
+
+static int df_font_ascent(ALLEGRO_FONT const *f)
+{
+   DISTANCE_FIELD_FONT *df;
+   FT_Size size;
+
+   ASSERT(f);
+
+   df = f->data;
+   size = df->data->size;
+
+   return floor((size->metrics.ascender >> 6) * df->scale_y + 0.5) +
+      field_border_extra(df);
+}
+
+
+static int df_font_descent(ALLEGRO_FONT const *f)
+{
+   DISTANCE_FIELD_FONT *df;
+   FT_Size size;
+
+   ASSERT(f);
+
+   df = f->data;
+   size = df->data->size;
+
+   return floor(((-size->metrics.descender) >> 6) * df->scale_y + 0.5) +
+      field_border_extra(df);
+}
+
+
+static int df_render(ALLEGRO_FONT const *f, ALLEGRO_COLOR color,
+   const ALLEGRO_USTR *text, float x, float y)
+{
+   DISTANCE_FIELD_FONT *df = f->data;
+   ALLEGRO_TTF_FONT_DATA *data = df->data;
+   ALLEGRO_SHADER *shader;
+   ALLEGRO_SHADER *old_shader = NULL;
+   int extra = field_border_extra(df);
+   float advance = 0;
    int pos = 0;
    int prev_ft_index = -1;
-   int x = 0;
+   bool locked = false;
    int32_t ch;
+   bool hold;
 
-   al_lock_mutex(freetype_mutex);
+   if (data->cache_budget > 0)
+      _al_fetch_and_add1(&data->use_clock);
+
+   hold = al_is_bitmap_drawing_held();
+   al_hold_bitmap_drawing(false);
+
+   shader = get_field_shader();
+   if (shader) {
+      old_shader = al_get_target_bitmap()->shader;
+      use_field_shader(df, shader);
+      al_hold_bitmap_drawing(true);
+   }
 
    while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
-      int ft_index = FT_Get_Char_Index(face, ch);
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
       ALLEGRO_TTF_GLYPH_DATA *glyph;
-      if (data->flags & ALLEGRO_TTF_RENDER_BORDER)
-        /* the border glyph has bigger metric values, so use it */
-        glyph = get_glyph(&data->glyph_border_ranges, ft_index);
-      else
-        glyph = get_glyph(&data->glyph_ranges, ft_index);
+      float gx, gy;
+      if (!c)
+         continue;
 
-      cache_glyph(data, face, ft_index, glyph, true, data->flags & ALLEGRO_TTF_RENDER_BORDER);
+      advance += get_kerning(data, prev_ft_index, c->ft_index, &locked) *
+         df->scale_x;
 
-      x += get_kerning(data, face, prev_ft_index, ft_index);
-      x += glyph->advance;
+      if (shader) {
+         glyph = get_cached_glyph(data, c, false, GLYPH_CACHED, true, false,
+            &locked);
+         unlock_current_page(data);
+      }
+      else {
+         /* The field itself is all we need. */
+         glyph = get_cached_glyph(data, c, false, GLYPH_METRICS, false,
+            false, &locked);
+         lock_font(data, &locked);
+         unlock_current_page(data);
+      }
+
+      gx = x + advance + extra + glyph->offset_x * df->scale_x;
+      gy = y + extra + glyph->offset_y * df->scale_y;
+
+      if (shader && glyph->page_bitmap) {
+         /* Each glyph has a 1-pixel border all around. */
+         al_draw_tinted_scaled_bitmap(glyph->page_bitmap, color,
+            glyph->region.x + 1, glyph->region.y + 1,
+            glyph->region.w - 2, glyph->region.h - 2,
+            gx, gy,
+            (glyph->region.w - 2) * DISTANCE_FIELD_OVERSAMPLE * df->scale_x,
+            (glyph->region.h - 2) * DISTANCE_FIELD_OVERSAMPLE * df->scale_y,
+            0);
+      }
+      else if (!shader && glyph->field) {
+         draw_field_glyph(df, glyph, color, gx, gy);
+      }
 
-      prev_ft_index = ft_index;
+      advance += glyph->advance * df->scale_x + extra;
+      prev_ft_index = c->ft_index;
    }
 
-   unlock_current_page(data);
+   unlock_font(data, locked);
 
-   al_unlock_mutex(freetype_mutex);
+   if (shader) {
+      al_hold_bitmap_drawing(false);
+      al_use_shader(old_shader);
+   }
+   al_hold_bitmap_drawing(hold);
 
-   /* because the border glyph advance is adjusted by only once the border width,
-      we have to add this amount once more at the end of the string */
-   return x + ceil((float)(data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+   return floor(advance + 0.5);
 }
 
 
-static void ttf_get_text_dimensions(ALLEGRO_FONT const *f,
+static int df_text_length(ALLEGRO_FONT const *f, const ALLEGRO_USTR *text)
+{
+   DISTANCE_FIELD_FONT *df = f->data;
+   ALLEGRO_TTF_FONT_DATA *data = df->data;
+   int extra = field_border_extra(df);
+   int pos = 0;
+   int prev_ft_index = -1;
+   float x = 0;
+   bool locked = false;
+   int32_t ch;
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      if (!c)
+         continue;
+      glyph = get_cached_glyph(data, c, false, GLYPH_METRICS, true, true,
+         &locked);
+
+      x += get_kerning(data, prev_ft_index, c->ft_index, &locked) *
+         df->scale_x;
+      x += glyph->advance * df->scale_x + extra;
+
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   return floor(x + 0.5) + extra;
+}
+
+
+static int df_get_glyph_advances(ALLEGRO_FONT const *f,
+   const ALLEGRO_USTR *text, float *kerning, float *advances)
+{
+   DISTANCE_FIELD_FONT *df = f->data;
+   ALLEGRO_TTF_FONT_DATA *data = df->data;
+   int extra = field_border_extra(df);
+   int pos = 0;
+   int prev_ft_index = -1;
+   int i = 0;
+   bool locked = false;
+   int32_t ch;
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      kerning[i] = 0;
+      advances[i] = 0;
+      i++;
+      if (!c)
+         continue;
+      glyph = get_cached_glyph(data, c, false, GLYPH_METRICS, true, true,
+         &locked);
+
+      kerning[i - 1] = get_kerning(data, prev_ft_index, c->ft_index,
+         &locked) * df->scale_x;
+      advances[i - 1] = glyph->advance * df->scale_x + extra;
+
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   return extra;
+}
+
+
+static int df_get_generation(ALLEGRO_FONT const *f)
+{
+   DISTANCE_FIELD_FONT *df = f->data;
+   return _al_atomic_load_acquire(&df->generation);
+}
+
+
+static void df_get_text_dimensions(ALLEGRO_FONT const *f,
    ALLEGRO_USTR const *text,
    int *bbx, int *bby, int *bbw, int *bbh)
 {
-   ALLEGRO_TTF_FONT_DATA *data = f->data;
-   FT_Face face = data->face;
+   DISTANCE_FIELD_FONT *df = f->data;
+   ALLEGRO_TTF_FONT_DATA *data = df->data;
+   int margin = data->field_spread * DISTANCE_FIELD_OVERSAMPLE;
+   int extra = field_border_extra(df);
    int end;
    int pos = 0;
    int prev_ft_index = -1;
    bool first = true;
-   int x = 0;
+   float x = 0;
+   float left = 0;
+   bool locked = false;
    int32_t ch;
 
-   al_lock_mutex(freetype_mutex);
+   end = al_ustr_size(text);
+
+   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
+      CHAR_ENTRY *c = get_char(data, ch, &locked);
+      ALLEGRO_TTF_GLYPH_DATA *glyph;
+      if (!c)
+         continue;
+      glyph = get_cached_glyph(data, c, false, GLYPH_METRICS, false, true,
+         &locked);
+
+      x += get_kerning(data, prev_ft_index, c->ft_index, &locked) *
+         df->scale_x;
+
+      /* The field has a margin around the outline of the glyph. */
+      if (first) {
+         left = x + extra + (glyph->offset_x + margin) * df->scale_x;
+         first = false;
+      }
+
+      if (pos == end) {
+         x += extra + (glyph->offset_x + (glyph->region.w - 2) *
+            DISTANCE_FIELD_OVERSAMPLE - margin) * df->scale_x;
+      }
+      else {
+         x += glyph->advance * df->scale_x + extra;
+      }
+
+      prev_ft_index = c->ft_index;
+   }
+
+   unlock_font(data, locked);
+
+   *bbx = floor(left + 0.5) - extra;
+   *bby = 0; // FIXME
+   *bbw = floor(x + 0.5) + extra - *bbx;
+   *bbh = f->height; // FIXME, we want the bounding box!
+}
+
+
+#ifdef DEBUG_CACHE
+#include "allegro5/allegro_image.h"
+static void debug_cache(ALLEGRO_TTF_FONT_DATA *data)
+{
+   _AL_VECTOR *v = &data->pages;
+   static int j = 0;
+   int i;
+
+   al_init_image_addon();
+
+   for (i = 0; i < (int)_al_vector_size(v); i++) {
+      GLYPH_PAGE *page = _al_vector_ref(v, i);
+      ALLEGRO_USTR *u = al_ustr_newf("font%d_%d.png", j, i);
+      al_save_bitmap(al_cstr(u), page->bitmap);
+      al_ustr_free(u);
+   }
+   j++;
+}
+#endif
+
+
+static void free_tables(ALLEGRO_TTF_FONT_DATA *data)
+{
+   int i, j;
+
+   if (data->glyph_ranges) {
+      for (i = 0; i < data->num_glyph_ranges; i++) {
+         if (!data->glyph_ranges[i])
+            continue;
+         for (j = 0; j < RANGE_SIZE; j++)
+            al_free(data->glyph_ranges[i][j].field);
+         al_free(data->glyph_ranges[i]);
+      }
+      al_free(data->glyph_ranges);
+   }
+   if (data->glyph_border_ranges) {
+      for (i = 0; i < data->num_glyph_ranges; i++)
+         al_free(data->glyph_border_ranges[i]);
+      al_free(data->glyph_border_ranges);
+   }
+   while (data->char_table) {
+      CHAR_TABLE *old = data->char_table->old;
+      al_free(data->char_table->entries);
+      al_free(data->char_table);
+      data->char_table = old;
+   }
+   al_free(data->kerning_cache);
+}
+
+
+static bool alloc_tables(ALLEGRO_TTF_FONT_DATA *data)
+{
+   data->num_glyph_ranges = (data->face->num_glyphs + RANGE_SIZE - 1) /
+      RANGE_SIZE;
+   if (data->num_glyph_ranges < 1)
+      data->num_glyph_ranges = 1;
+
+   data->glyph_ranges = al_calloc(data->num_glyph_ranges,
+      sizeof(ALLEGRO_TTF_GLYPH_DATA *));
+   if (data->flags & ALLEGRO_TTF_RENDER_BORDER)
+      data->glyph_border_ranges = al_calloc(data->num_glyph_ranges,
+         sizeof(ALLEGRO_TTF_GLYPH_DATA *));
+   if (data->has_kerning)
+      data->kerning_cache = al_calloc(KERNING_CACHE_SIZE,
+         sizeof(KERNING_ENTRY));
+
+   if (!data->glyph_ranges ||
+         (data->has_kerning && !data->kerning_cache) ||
+         ((data->flags & ALLEGRO_TTF_RENDER_BORDER) &&
+            !data->glyph_border_ranges)) {
+      free_tables(data);
+      return false;
+   }
+
+   return true;
+}
+
+
+static unsigned long ftread(FT_Stream stream, unsigned long offset,
+    unsigned char *buffer, unsigned long count)
+{
+    TTF_FACE *tf = stream->pathname.pointer;
+    unsigned long bytes;
+
+    if (count == 0)
+       return 0;
+
+    if (offset != tf->offset)
+       al_fseek(tf->file, tf->base_offset + offset, ALLEGRO_SEEK_SET);
+    bytes = al_fread(tf->file, buffer, count);
+    tf->offset = offset + bytes;
+    return bytes;
+}
+
+
+static void ftclose(FT_Stream  stream)
+{
+    TTF_FACE *tf = stream->pathname.pointer;
+    al_fclose(tf->file);
+    tf->file = NULL;
+}
+
+
+#ifdef ALLEGRO_HAVE_MMAP
+
+/* Map a font file into memory, so that FreeType reads it straight from the
+ * page cache instead of through a stream.  Returns false if the file is
+ * not on disk or could not be mapped.
+ */
+static bool map_font_file(TTF_FACE *tf, char const *filename)
+{
+   struct stat st;
+   void *map;
+   int fd;
+
+   /* Only files opened through the standard file interface are on disk. */
+   if (al_get_new_file_interface() != &_al_file_interface_stdio)
+      return false;
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0)
+      return false;
+
+   if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+      close(fd);
+      return false;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return false;
+
+   tf->map = map;
+   tf->map_size = st.st_size;
+   return true;
+}
+
+#endif
+
+
+/* Open a face for a font file, read from file.  If file is NULL the font
+ * file is mapped into memory if possible, or opened by name.  The file is
+ * owned by the face, even if this fails.
+ */
+static TTF_FACE *open_face(ALLEGRO_FILE *file, char const *filename)
+{
+    TTF_FACE *tf;
+    FT_Face face;
+    ALLEGRO_PATH *path;
+    FT_Open_Args args;
+    int result;
+
+    tf = al_calloc(1, sizeof *tf);
+    if (tf)
+       tf->mutex = al_create_mutex();
+    if (!tf || !tf->mutex) {
+       ALLEGRO_ERROR("Out of memory loading %s.\n", filename);
+       if (file)
+          al_fclose(file);
+       al_free(tf);
+       return NULL;
+    }
+    tf->refcount = 1;
+
+    memset(&args, 0, sizeof args);
+
+#ifdef ALLEGRO_HAVE_MMAP
+    if (!file && map_font_file(tf, filename)) {
+       ALLEGRO_DEBUG("Mapped %s into memory.\n", filename);
+       args.flags = FT_OPEN_MEMORY;
+       args.memory_base = tf->map;
+       args.memory_size = tf->map_size;
+    }
+#endif
+
+    if (!tf->map) {
+       if (!file)
+          file = al_fopen(filename, "rb");
+       if (!file) {
+          al_destroy_mutex(tf->mutex);
+          al_free(tf);
+          return NULL;
+       }
+       tf->stream.read = ftread;
+       tf->stream.close = ftclose;
+       tf->stream.pathname.pointer = tf;
+       tf->base_offset = al_ftell(file);
+       tf->stream.size = al_fsize(file);
+       tf->file = file;
+       args.flags = FT_OPEN_STREAM;
+       args.stream = &tf->stream;
+    }
+
+    al_lock_mutex(freetype_mutex);
+    result = FT_Open_Face(ft, &args, 0, &face);
+    al_unlock_mutex(freetype_mutex);
+
+    if (result != 0) {
+        ALLEGRO_ERROR("Reading %s failed. Freetype error code %d\n", filename,
+	   result);
+        // Note: Freetype already closed the file for us.
+#ifdef ALLEGRO_HAVE_MMAP
+        if (tf->map)
+           munmap(tf->map, tf->map_size);
+#endif
+        al_destroy_mutex(tf->mutex);
+        al_free(tf);
+        return NULL;
+    }
+
+    // FIXME: The below doesn't use Allegro's streaming.
+    /* Small hack for Type1 fonts which store kerning information in
+     * a separate file - and we try to guess the name of that file.
+     */
+    path = al_create_path(filename);
+    if (!strcmp(al_get_path_extension(path), ".pfa")) {
+        const char *helper;
+        ALLEGRO_DEBUG("Type1 font assumed for %s.\n", filename);
+
+        al_set_path_extension(path, ".afm");
+        helper = al_path_cstr(path, '/');
+        FT_Attach_File(face, helper);
+        ALLEGRO_DEBUG("Guessed afm file %s.\n", helper);
+
+        al_set_path_extension(path, ".tfm");
+        helper = al_path_cstr(path, '/');
+        FT_Attach_File(face, helper);
+        ALLEGRO_DEBUG("Guessed tfm file %s.\n", helper);
+    }
+    al_destroy_path(path);
+
+    tf->face = face;
+    return tf;
+}
+
+
+/* Fill in the id of the font file filename, opened through the current
+ * file interface.  Returns false if there is no memory for it.
+ */
+static bool make_face_id(FACE_ID *id, char const *filename)
+{
+    ALLEGRO_PATH *path;
+    char *cwd;
+
+    memset(id, 0, sizeof *id);
+    id->file_interface = al_get_new_file_interface();
+
+    if (id->file_interface != &_al_file_interface_stdio) {
+       id->name = al_ustr_new(filename);
+       return id->name != NULL;
+    }
+
+#ifdef ALLEGRO_HAVE_MMAP
+    {
+       struct stat st;
+       if (stat(filename, &st) == 0) {
+          id->have_inode = true;
+          id->dev = st.st_dev;
+          id->ino = st.st_ino;
+       }
+    }
+#endif
+
+    path = al_create_path(filename);
+    if (!path)
+       return false;
+    cwd = al_get_current_directory();
+    if (cwd) {
+       ALLEGRO_PATH *head = al_create_path_for_directory(cwd);
+       if (head) {
+          al_rebase_path(head, path);
+          al_destroy_path(head);
+       }
+       al_free(cwd);
+    }
+    al_make_path_canonical(path);
+    id->name = al_ustr_new(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+    al_destroy_path(path);
+
+    return id->name != NULL;
+}
+
+
+static bool same_face_id(const FACE_ID *a, const FACE_ID *b)
+{
+    if (a->file_interface != b->file_interface)
+       return false;
+#ifdef ALLEGRO_HAVE_MMAP
+    if (a->have_inode || b->have_inode)
+       return a->have_inode && b->have_inode &&
+          a->dev == b->dev && a->ino == b->ino;
+#endif
+    return al_ustr_equal(a->name, b->name);
+}
+
 
-   end = al_ustr_size(text);
-   *bbx = 0;
+/* Return the face of a font file, opening it only if no other font has it
+ * open already.
+ */
+static TTF_FACE *get_shared_face(char const *filename)
+{
+    FACE_ID id;
+    TTF_FACE *tf = NULL;
+    TTF_FACE **slot = NULL;
+    unsigned int i;
 
-   while ((ch = al_ustr_get_next(text, &pos)) >= 0) {
-      int ft_index = FT_Get_Char_Index(face, ch);
-      ALLEGRO_TTF_GLYPH_DATA *glyph;
-      if (data->flags & ALLEGRO_TTF_RENDER_BORDER)
-        /* the border glyph has bigger metric values, so use it */
-        glyph = get_glyph(&data->glyph_border_ranges, ft_index);
-      else
-        glyph = get_glyph(&data->glyph_ranges, ft_index);
+    if (!make_face_id(&id, filename))
+       return open_face(NULL, filename);
 
-      cache_glyph(data, face, ft_index, glyph, true, data->flags & ALLEGRO_TTF_RENDER_BORDER);
+    al_lock_mutex(freetype_mutex);
+    for (i = 0; i < _al_vector_size(&faces); i++) {
+       TTF_FACE *other = *(TTF_FACE **)_al_vector_ref(&faces, i);
+       if (same_face_id(&other->id, &id)) {
+          other->refcount++;
+          tf = other;
+          break;
+       }
+    }
+    al_unlock_mutex(freetype_mutex);
 
-      if (pos == end) {
-         x += glyph->offset_x + glyph->region.w;
-      }
-      else {
-         x += get_kerning(data, face, prev_ft_index, ft_index);
-         x += glyph->advance;
-      }
+    if (tf) {
+       ALLEGRO_DEBUG("Sharing the face of %s.\n", filename);
+       al_ustr_free(id.name);
+       return tf;
+    }
 
-      if (first) {
-         *bbx = glyph->offset_x;
-         first = false;
-      }
+    tf = open_face(NULL, filename);
+    if (!tf) {
+       al_ustr_free(id.name);
+       return NULL;
+    }
 
-      prev_ft_index = ft_index;
-   }
-   al_unlock_mutex(freetype_mutex);
+    tf->id = id;
 
-   /* because the border glyph advance is adjusted by only once the border width,
-      we have to add this amount once more at the end of the string */
-   x += ceil((float)(data->border_width) / FREETYPE_UNITS_PER_PIXEL);
+    al_lock_mutex(freetype_mutex);
+    slot = _al_vector_alloc_back(&faces);
+    if (slot)
+       *slot = tf;
+    al_unlock_mutex(freetype_mutex);
 
-   *bby = 0; // FIXME
-   *bbw = x - *bbx;
-   *bbh = f->height; // FIXME, we want the bounding box!
+    if (!slot) {
+       al_ustr_free(tf->id.name);
+       tf->id.name = NULL;
+    }
 
-   unlock_current_page(data);
+    return tf;
 }
 
 
-#ifdef DEBUG_CACHE
-#include "allegro5/allegro_image.h"
-static void debug_cache(ALLEGRO_FONT *f)
+static void release_face(TTF_FACE *tf)
 {
-   ALLEGRO_TTF_FONT_DATA *data = f->data;
-   _AL_VECTOR *v = &data->page_bitmaps;
-   static int j = 0;
-   int i;
+    bool last;
 
-   al_init_image_addon();
+    al_lock_mutex(freetype_mutex);
+    last = (--tf->refcount == 0);
+    if (last) {
+       if (tf->id.name)
+          _al_vector_find_and_delete(&faces, &tf);
+       FT_Done_Face(tf->face);
+    }
+    al_unlock_mutex(freetype_mutex);
 
-   for (i = 0; i < (int)_al_vector_size(v); i++) {
-      ALLEGRO_BITMAP **bmp = _al_vector_ref(v, i);
-      ALLEGRO_USTR *u = al_ustr_newf("font%d_%d.png", j, i);
-      al_save_bitmap(al_cstr(u), *bmp);
-      al_ustr_free(u);
-   }
-   j++;
-}
+    if (!last)
+       return;
+
+#ifdef ALLEGRO_HAVE_MMAP
+    if (tf->map)
+       munmap(tf->map, tf->map_size);
 #endif
+    al_destroy_mutex(tf->mutex);
+    al_ustr_free(tf->id.name);
+    al_free(tf);
+}
 
 
-static void ttf_destroy(ALLEGRO_FONT *f)
+static void destroy_font_data(ALLEGRO_TTF_FONT_DATA *data)
 {
-   ALLEGRO_TTF_FONT_DATA *data = f->data;
    int i;
 
    unlock_current_page(data);
 
+   if (data->worker) {
+      al_lock_mutex(data->mutex);
+      data->worker_quit = true;
+      al_broadcast_cond(data->worker_cond);
+      al_unlock_mutex(data->mutex);
+      al_join_thread(data->worker, NULL);
+      al_destroy_thread(data->worker);
+   }
+   if (data->worker_cond)
+      al_destroy_cond(data->worker_cond);
+   _al_vector_free(&data->requests);
+   for (i = 0; i < (int)_al_vector_size(&data->staged); i++) {
+      STAGED_GLYPH *staged = _al_vector_ref(&data->staged, i);
+      if (staged->bitmap.buffer != staged->glyph->field)
+         al_free(staged->bitmap.buffer);
+   }
+   _al_vector_free(&data->staged);
+
 #ifdef DEBUG_CACHE
-   debug_cache(f);
+   debug_cache(data);
 #endif
 
-   al_lock_mutex(freetype_mutex);
-   FT_Done_Face(data->face);
-   al_unlock_mutex(freetype_mutex);
+   al_lock_mutex(data->mutex);
+   FT_Done_Size(data->size);
+   al_unlock_mutex(data->mutex);
+   release_face(data->ttf_face);
 
-   for (i = _al_vector_size(&data->glyph_ranges) - 1; i >= 0; i--) {
-      ALLEGRO_TTF_GLYPH_RANGE *range = _al_vector_ref(&data->glyph_ranges, i);
-      al_free(range->glyphs);
-   }
-   _al_vector_free(&data->glyph_ranges);
-   if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
-    for (i = _al_vector_size(&data->glyph_border_ranges) - 1; i >= 0; i--) {
-      ALLEGRO_TTF_GLYPH_RANGE *range = _al_vector_ref(&data->glyph_border_ranges, i);
-      al_free(range->glyphs);
-   }
-   _al_vector_free(&data->glyph_border_ranges);
-   }
-   for (i = _al_vector_size(&data->page_bitmaps) - 1; i >= 0; i--) {
-      ALLEGRO_BITMAP **bmp = _al_vector_ref(&data->page_bitmaps, i);
-      al_destroy_bitmap(*bmp);
+   free_tables(data);
+
+   for (i = _al_vector_size(&data->pages) - 1; i >= 0; i--) {
+      GLYPH_PAGE *page = _al_vector_ref(&data->pages, i);
+      al_destroy_bitmap(page->bitmap);
+      _al_vector_free(&page->skyline);
    }
-   _al_vector_free(&data->page_bitmaps);
+   _al_vector_free(&data->pages);
+   if (data->scratch)
+      al_destroy_bitmap(data->scratch);
+   al_ustr_free(data->filename);
    al_free(data);
+}
+
+
+static void ttf_destroy(ALLEGRO_FONT *f)
+{
+   destroy_font_data(f->data);
    al_free(f);
 }
 
 
-static unsigned long ftread(FT_Stream stream, unsigned long offset,
-    unsigned char *buffer, unsigned long count)
+/* Drop a reference to the data shared by distance field fonts. */
+static void release_field_font(ALLEGRO_TTF_FONT_DATA *data)
 {
-    ALLEGRO_TTF_FONT_DATA *data = stream->pathname.pointer;
-    unsigned long bytes;
+   bool last;
 
-    if (count == 0)
-       return 0;
+   al_lock_mutex(freetype_mutex);
+   last = (--data->refcount == 0);
+   if (last)
+      _al_vector_find_and_delete(&field_fonts, &data);
+   al_unlock_mutex(freetype_mutex);
 
-    if (offset != data->offset)
-       al_fseek(data->file, data->base_offset + offset, ALLEGRO_SEEK_SET);
-    bytes = al_fread(data->file, buffer, count);
-    data->offset = offset + bytes;
-    return bytes;
+   if (last)
+      destroy_font_data(data);
 }
 
 
-static void ftclose(FT_Stream  stream)
+static void df_destroy(ALLEGRO_FONT *f)
 {
-    ALLEGRO_TTF_FONT_DATA *data = stream->pathname.pointer;
-    al_fclose(data->file);
-    data->file = NULL;
+   DISTANCE_FIELD_FONT *df = f->data;
+
+   release_field_font(df->data);
+   al_free(df);
+   al_free(f);
 }
 
 
@@ -859,35 +3274,30 @@ ALLEGRO_FONT *al_load_ttf_font_f(ALLEGRO_FILE *file,
 }
 
 
-/* Function: al_load_ttf_font_stretch_f
+/* Make the data of a font of the given size on a face.  The reference to
+ * the face is passed to the font, unless this fails.
  */
-ALLEGRO_FONT *al_load_ttf_font_stretch_f(ALLEGRO_FILE *file,
+static ALLEGRO_TTF_FONT_DATA *load_font_data(TTF_FACE *tf,
     char const *filename, int w, int h, int flags)
 {
-    FT_Face face;
+    FT_Face face = tf->face;
     ALLEGRO_TTF_FONT_DATA *data;
-    ALLEGRO_FONT *f;
-    ALLEGRO_PATH *path;
-    FT_Open_Args args;
-    int result;
     ALLEGRO_CONFIG* system_cfg = al_get_system_config();
     const char* min_page_size_str =
       system_cfg ? al_get_config_value(system_cfg, "ttf", "min_page_size") : NULL;
     const char* max_page_size_str =
       system_cfg ? al_get_config_value(system_cfg, "ttf", "max_page_size") : NULL;
-
-    if ((h > 0 && w < 0) || (h < 0 && w > 0)) {
-       ALLEGRO_ERROR("Height/width have opposite signs (w = %d, h = %d).\n", w, h);
-       return NULL;
-    }
+    const char* cache_budget_str =
+      system_cfg ? al_get_config_value(system_cfg, "ttf", "cache_budget") : NULL;
 
     data = al_calloc(1, sizeof *data);
-    data->stream.read = ftread;
-    data->stream.close = ftclose;
-    data->stream.pathname.pointer = data;
-    data->base_offset = al_ftell(file);
-    data->stream.size = al_fsize(file);
-    data->file = file;
+    if (!data) {
+        ALLEGRO_ERROR("Out of memory loading %s.\n", filename);
+        return NULL;
+    }
+    data->ttf_face = tf;
+    data->face = face;
+    data->mutex = tf->mutex;
     data->bitmap_format = al_get_new_bitmap_format();
     data->bitmap_flags = al_get_new_bitmap_flags();
     data->min_page_size = 256;
@@ -907,69 +3317,58 @@ ALLEGRO_FONT *al_load_ttf_font_stretch_f(ALLEGRO_FILE *file,
       }
     }
 
-    memset(&args, 0, sizeof args);
-    args.flags = FT_OPEN_STREAM;
-    args.stream = &data->stream;
+    if (cache_budget_str) {
+      data->cache_budget = strtoul(cache_budget_str, NULL, 10);
+    }
 
-    al_lock_mutex(freetype_mutex);
+    /* Other fonts may be using the face, so the size is set up with the
+     * face locked.
+     */
+    al_lock_mutex(data->mutex);
 
-    if ((result = FT_Open_Face(ft, &args, 0, &face)) != 0) {
-        ALLEGRO_ERROR("Reading %s failed. Freetype error code %d\n", filename,
-	   result);
-        // Note: Freetype already closed the file for us.
+    if (FT_New_Size(face, &data->size) != 0) {
+        ALLEGRO_ERROR("Out of memory loading %s.\n", filename);
+        al_unlock_mutex(data->mutex);
         al_free(data);
-        al_unlock_mutex(freetype_mutex);
         return NULL;
     }
+    FT_Activate_Size(data->size);
 
-    // FIXME: The below doesn't use Allegro's streaming.
-    /* Small hack for Type1 fonts which store kerning information in
-     * a separate file - and we try to guess the name of that file.
+    /* The request is kept so that the glyph worker can size a face of its
+     * own the same way.
      */
-    path = al_create_path(filename);
-    if (!strcmp(al_get_path_extension(path), ".pfa")) {
-        const char *helper;
-        ALLEGRO_DEBUG("Type1 font assumed for %s.\n", filename);
-
-        al_set_path_extension(path, ".afm");
-        helper = al_path_cstr(path, '/');
-        FT_Attach_File(face, helper);
-        ALLEGRO_DEBUG("Guessed afm file %s.\n", helper);
-
-        al_set_path_extension(path, ".tfm");
-        helper = al_path_cstr(path, '/');
-        FT_Attach_File(face, helper);
-        ALLEGRO_DEBUG("Guessed tfm file %s.\n", helper);
-    }
-    al_destroy_path(path);
-
     if (h > 0) {
-       FT_Set_Pixel_Sizes(face, w, h);
+       /* What FT_Set_Pixel_Sizes does. */
+       data->size_req.type = FT_SIZE_REQUEST_TYPE_NOMINAL;
+       data->size_req.width = (w > 0 ? w : h) << 6;
+       data->size_req.height = h << 6;
     }
     else {
        /* Set the "real dimension" of the font to be the passed size,
         * in pixels.
         */
-       FT_Size_RequestRec req;
        ASSERT(w <= 0);
        ASSERT(h <= 0);
-       req.type = FT_SIZE_REQUEST_TYPE_REAL_DIM;
-       req.width = (-w) << 6;
-       req.height = (-h) << 6;
-       req.horiResolution = 0;
-       req.vertResolution = 0;
-       FT_Request_Size(face, &req);
+       data->size_req.type = FT_SIZE_REQUEST_TYPE_REAL_DIM;
+       data->size_req.width = (-w) << 6;
+       data->size_req.height = (-h) << 6;
     }
+    data->size_req.horiResolution = 0;
+    data->size_req.vertResolution = 0;
+    FT_Request_Size(face, &data->size_req);
+
+    al_unlock_mutex(data->mutex);
 
     ALLEGRO_DEBUG("Font %s loaded with pixel size %d x %d.\n", filename,
         w, h);
     ALLEGRO_DEBUG("    ascent=%.1f, descent=%.1f, height=%.1f\n",
-        face->size->metrics.ascender / FREETYPE_UNITS_PER_PIXEL,
-        face->size->metrics.descender / FREETYPE_UNITS_PER_PIXEL,
-        face->size->metrics.height / FREETYPE_UNITS_PER_PIXEL);
+        data->size->metrics.ascender / FREETYPE_UNITS_PER_PIXEL,
+        data->size->metrics.descender / FREETYPE_UNITS_PER_PIXEL,
+        data->size->metrics.height / FREETYPE_UNITS_PER_PIXEL);
 
-    data->face = face;
     data->flags = flags;
+    data->has_kerning = !(flags & ALLEGRO_TTF_NO_KERNING) &&
+       FT_HAS_KERNING(face);
 
     if (flags & ALLEGRO_TTF_RENDER_BORDER) {
       /* default settings for the border */
@@ -978,26 +3377,218 @@ ALLEGRO_FONT *al_load_ttf_font_stretch_f(ALLEGRO_FILE *file,
     } else
     data->border_width = 0;
 
-    _al_vector_init(&data->glyph_ranges, sizeof(ALLEGRO_TTF_GLYPH_RANGE));
-    if (flags & ALLEGRO_TTF_RENDER_BORDER)
-      _al_vector_init(&data->glyph_border_ranges, sizeof(ALLEGRO_TTF_GLYPH_RANGE));
-    _al_vector_init(&data->page_bitmaps, sizeof(ALLEGRO_BITMAP*));
+    if (!alloc_tables(data)) {
+        ALLEGRO_ERROR("Out of memory loading %s.\n", filename);
+        al_lock_mutex(data->mutex);
+        FT_Done_Size(data->size);
+        al_unlock_mutex(data->mutex);
+        al_free(data);
+        return NULL;
+    }
+    _al_vector_init(&data->pages, sizeof(GLYPH_PAGE));
+
+    _al_vector_init(&data->requests, sizeof(GLYPH_REQUEST));
+    _al_vector_init(&data->staged, sizeof(STAGED_GLYPH));
+    if (flags & ALLEGRO_TTF_BACKGROUND_RASTERIZE) {
+       /* The worker thread itself is only started for the first glyph. */
+       data->worker_cond = al_create_cond();
+       data->background = (data->worker_cond != NULL);
+    }
+
+    return data;
+}
+
+
+/* Return the data of a distance field font loaded from the same file with
+ * the same settings, with a new reference, or NULL.
+ */
+static ALLEGRO_TTF_FONT_DATA *find_field_font(char const *filename,
+    int flags)
+{
+    ALLEGRO_TTF_FONT_DATA *found = NULL;
+    int bitmap_flags = al_get_new_bitmap_flags() |
+       ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR;
+    unsigned int i;
+
+    al_lock_mutex(freetype_mutex);
+    for (i = 0; i < _al_vector_size(&field_fonts); i++) {
+       ALLEGRO_TTF_FONT_DATA *data =
+          *(ALLEGRO_TTF_FONT_DATA **)_al_vector_ref(&field_fonts, i);
+       if (data->flags == flags &&
+             data->bitmap_format == al_get_new_bitmap_format() &&
+             data->bitmap_flags == bitmap_flags &&
+             !strcmp(al_cstr(data->filename), filename)) {
+          data->refcount++;
+          found = data;
+          break;
+       }
+    }
+    al_unlock_mutex(freetype_mutex);
+
+    return found;
+}
+
+
+/* Load a distance field font.  Its glyphs are shared with all other sizes
+ * of the same file; only the scale and the border are its own.
+ */
+static ALLEGRO_FONT *load_distance_field_font(TTF_FACE *tf,
+    char const *filename, int w, int h, int flags)
+{
+    /* Borders are drawn from the same field as the glyph. */
+    int data_flags = flags &
+       ~(ALLEGRO_TTF_RENDER_BORDER | ALLEGRO_TTF_MONOCHROME);
+    ALLEGRO_TTF_FONT_DATA *data;
+    DISTANCE_FIELD_FONT *df;
+    ALLEGRO_FONT *f;
+    FT_Size size;
+    float em;
+
+    data = find_field_font(filename, data_flags);
+    if (data) {
+       release_face(tf);
+    }
+    else {
+       ALLEGRO_CONFIG* system_cfg = al_get_system_config();
+       const char* field_size_str = system_cfg ?
+          al_get_config_value(system_cfg, "ttf", "distance_field_size") : NULL;
+       ALLEGRO_TTF_FONT_DATA **slot;
+       int field_size = 48;
+
+       if (field_size_str) {
+          int n = atoi(field_size_str);
+          if (n > 0) {
+             field_size = n;
+          }
+       }
+
+       data = load_font_data(tf, filename,
+          0, field_size * DISTANCE_FIELD_OVERSAMPLE, data_flags);
+       if (!data) {
+          release_face(tf);
+          return NULL;
+       }
+       data->distance_field = true;
+       data->field_size = field_size;
+       data->field_spread = _ALLEGRO_MAX(field_size / 6, 1);
+       data->filename = al_ustr_new(filename);
+       data->bitmap_flags |= ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR;
+       data->refcount = 1;
+
+       al_lock_mutex(freetype_mutex);
+       slot = _al_vector_alloc_back(&field_fonts);
+       if (slot)
+          *slot = data;
+       al_unlock_mutex(freetype_mutex);
+    }
+
+    size = data->size;
+    df = al_calloc(1, sizeof *df);
+    if (!df) {
+       release_field_font(data);
+       return NULL;
+    }
+    df->data = data;
+    df->flags = flags;
+
+    em = data->field_size * DISTANCE_FIELD_OVERSAMPLE;
+    if (h > 0) {
+       df->scale_y = h / em;
+       df->scale_x = (w > 0) ? w / em : df->scale_y;
+    }
+    else {
+       /* Make the "real dimension" of the font the passed size, in
+        * pixels.
+        */
+       float real_h = (size->metrics.ascender -
+          size->metrics.descender) / FREETYPE_UNITS_PER_PIXEL;
+       df->scale_y = -h / real_h;
+       df->scale_x = (w < 0) ? df->scale_y * w / h : df->scale_y;
+    }
+
+    if (flags & ALLEGRO_TTF_RENDER_BORDER) {
+       /* default settings for the border */
+       df->border_color = al_map_rgb(0, 64, 0);
+       df->border_width = 1.0;
+    }
+
+    ALLEGRO_DEBUG("Distance field font %s at %d x %d, scale %.3f x %.3f.\n",
+       filename, w, h, df->scale_x, df->scale_y);
+
+    f = al_malloc(sizeof *f);
+    if (!f) {
+       release_field_font(data);
+       al_free(df);
+       return NULL;
+    }
+    f->height = field_font_height(df);
+    f->vtable = &df_vt;
+    f->data = df;
+
+    _al_register_destructor(_al_dtor_list, f,
+       (void (*)(void *))al_destroy_font);
+
+    return f;
+}
+
+
+/* Make a font of the given size on a face.  The reference to the face is
+ * passed to the font.
+ */
+static ALLEGRO_FONT *load_font(TTF_FACE *tf, char const *filename,
+    int w, int h, int flags)
+{
+    ALLEGRO_TTF_FONT_DATA *data;
+    ALLEGRO_FONT *f;
+
+    if (flags & ALLEGRO_TTF_DISTANCE_FIELD)
+       return load_distance_field_font(tf, filename, w, h, flags);
+
+    data = load_font_data(tf, filename, w, h, flags);
+    if (!data) {
+       release_face(tf);
+       return NULL;
+    }
 
     f = al_malloc(sizeof *f);
+    if (!f) {
+       destroy_font_data(data);
+       return NULL;
+    }
     /* adjust the height by the border width */
-    f->height = (face->size->metrics.height >> 6) + ceil(2 * (float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+    f->height = (data->size->metrics.height >> 6) + ceil(2 * (float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
     f->vtable = &vt;
     f->data = data;
+    data->font = f;
 
     _al_register_destructor(_al_dtor_list, f,
        (void (*)(void *))al_destroy_font);
 
-    al_unlock_mutex(freetype_mutex);
-
     return f;
 }
 
 
+/* Function: al_load_ttf_font_stretch_f
+ */
+ALLEGRO_FONT *al_load_ttf_font_stretch_f(ALLEGRO_FILE *file,
+    char const *filename, int w, int h, int flags)
+{
+    TTF_FACE *tf;
+
+    if ((h > 0 && w < 0) || (h < 0 && w > 0)) {
+       ALLEGRO_ERROR("Height/width have opposite signs (w = %d, h = %d).\n", w, h);
+       return NULL;
+    }
+
+    /* The file may not be the same each time, so the face isn't shared. */
+    tf = open_face(file, filename);
+    if (!tf)
+       return NULL;
+
+    return load_font(tf, filename, w, h, flags);
+}
+
+
 /* Function: al_load_ttf_font
  */
 ALLEGRO_FONT *al_load_ttf_font(char const *filename, int size, int flags)
@@ -1011,20 +3602,34 @@ ALLEGRO_FONT *al_load_ttf_font(char const *filename, int size, int flags)
 ALLEGRO_FONT *al_load_ttf_font_stretch(char const *filename, int w, int h,
    int flags)
 {
-   ALLEGRO_FILE *f;
-   ALLEGRO_FONT *font;
+   TTF_FACE *tf;
    ASSERT(filename);
 
-   f = al_fopen(filename, "rb");
-   if (!f)
+   if ((h > 0 && w < 0) || (h < 0 && w > 0)) {
+      ALLEGRO_ERROR("Height/width have opposite signs (w = %d, h = %d).\n", w, h);
       return NULL;
+   }
 
-   /* The file handle is owned by the function and the file is usually only
-    * closed when the font is destroyed, in case Freetype has to load data
-    * at a later time.
+   /* All sizes loaded from the same file share its face.  The file is
+    * usually only closed when the last of them is destroyed, in case
+    * Freetype has to load data at a later time.
     */
-   font = al_load_ttf_font_stretch_f(f, filename, w, h, flags);
-   return font;
+   tf = get_shared_face(filename);
+   if (!tf)
+      return NULL;
+
+   return load_font(tf, filename, w, h, flags);
+}
+
+
+/* Return the data of a TTF font of either kind, or NULL for other fonts. */
+static ALLEGRO_TTF_FONT_DATA *get_font_data(ALLEGRO_FONT const *font)
+{
+   if (font->vtable == &vt)
+      return font->data;
+   if (font->vtable == &df_vt)
+      return ((DISTANCE_FIELD_FONT *)font->data)->data;
+   return NULL;
 }
 
 
@@ -1035,9 +3640,9 @@ static int ttf_get_font_ranges(ALLEGRO_FONT *font, int ranges_count,
    FT_UInt g;
    FT_ULong unicode;
    int i = 0;
-   al_lock_mutex(freetype_mutex);
 
-   data = font->data;
+   data = get_font_data(font);
+   al_lock_mutex(data->mutex);
    unicode = FT_Get_First_Char(data->face, &g);
 
    if (i < ranges_count) {
@@ -1060,11 +3665,65 @@ static int ttf_get_font_ranges(ALLEGRO_FONT *font, int ranges_count,
       }
       unicode = unicode2;
    }
-   al_unlock_mutex(freetype_mutex);
+   al_unlock_mutex(data->mutex);
    return i;
 }
 
 
+/* Function: al_cache_ttf_glyphs
+ */
+bool al_cache_ttf_glyphs(ALLEGRO_FONT *font, int ranges_n, const int ranges[])
+{
+   ALLEGRO_TTF_FONT_DATA *data;
+   bool locked = false;
+   bool ok = true;
+   int i;
+   int32_t ch;
+   ASSERT(font);
+   ASSERT(ranges_n >= 0);
+   ASSERT(ranges_n == 0 || ranges);
+
+   data = get_font_data(font);
+   if (!data)
+      return false;
+
+   for (i = 0; i < ranges_n; i++) {
+      for (ch = _ALLEGRO_MAX(ranges[i * 2], 0); ch <= ranges[i * 2 + 1]; ch++) {
+         CHAR_ENTRY *c = get_char(data, ch, &locked);
+         if (!c) {
+            ok = false;
+            continue;
+         }
+         if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
+            get_cached_glyph(data, c, true, GLYPH_CACHED, true, true,
+               &locked);
+         }
+         get_cached_glyph(data, c, false, GLYPH_CACHED, true, true, &locked);
+      }
+   }
+
+   unlock_font(data, locked);
+   return ok;
+}
+
+
+/* Function: al_set_ttf_cache_budget
+ */
+void al_set_ttf_cache_budget(ALLEGRO_FONT *font, size_t bytes)
+{
+   ALLEGRO_TTF_FONT_DATA *data;
+   ASSERT(font);
+
+   data = get_font_data(font);
+   if (!data)
+      return;
+
+   al_lock_mutex(data->mutex);
+   data->cache_budget = bytes;
+   al_unlock_mutex(data->mutex);
+}
+
+
 /* Function: al_init_ttf_addon
  */
 bool al_init_ttf_addon(void)
@@ -1085,6 +3744,31 @@ bool al_init_ttf_addon(void)
    vt.destroy = ttf_destroy;
    vt.get_text_dimensions = ttf_get_text_dimensions;
    vt.get_font_ranges = ttf_get_font_ranges;
+   ttf_methods.prepare_text = ttf_prepare_text;
+   ttf_methods.get_glyph_advances = ttf_get_glyph_advances;
+   ttf_methods.use_glyph_pages = ttf_use_glyph_pages;
+   ttf_methods.get_generation = ttf_get_generation;
+
+   /* Distance field fonts have no prepared texts; they are cheap to draw
+    * directly.
+    */
+   df_vt.font_height = ttf_font_height;
+   df_vt.font_ascent = df_font_ascent;
+   df_vt.font_descent = df_font_descent;
+   df_vt.char_length = ttf_char_length;
+   df_vt.text_length = df_text_length;
+   df_vt.render_char = ttf_render_char;
+   df_vt.render = df_render;
+   df_vt.destroy = df_destroy;
+   df_vt.get_text_dimensions = df_get_text_dimensions;
+   df_vt.get_font_ranges = ttf_get_font_ranges;
+   df_methods.prepare_text = NULL;
+   df_methods.get_glyph_advances = df_get_glyph_advances;
+   df_methods.use_glyph_pages = NULL;
+   df_methods.get_generation = df_get_generation;
+
+   _al_register_font_methods(&vt, &ttf_methods);
+   _al_register_font_methods(&df_vt, &df_methods);
 
    al_register_font_loader(".ttf", al_load_ttf_font);
 
@@ -1103,15 +3787,32 @@ bool al_init_ttf_addon(void)
  */
 void al_shutdown_ttf_addon(void)
 {
+   unsigned int i;
+
    if (!ttf_inited) {
       ALLEGRO_ERROR("TTF addon not initialised.\n");
       return;
    }
 
    al_register_font_loader(".ttf", NULL);
+   _al_unregister_font_methods(&vt);
+   _al_unregister_font_methods(&df_vt);
 
    FT_Done_FreeType(ft);
 
+   /* The displays must not call back into the addon any more.  Their
+    * callbacks take freetype_mutex, so it goes last.
+    */
+   al_lock_mutex(freetype_mutex);
+   for (i = 0; i < _al_vector_size(&field_shaders); i++) {
+      FIELD_SHADER *fs = _al_vector_ref(&field_shaders, i);
+      al_destroy_shader(fs->shader);
+      _al_remove_display_destroyed_callback(fs->display,
+         destroy_field_shader);
+   }
+   _al_vector_free(&field_shaders);
+   al_unlock_mutex(freetype_mutex);
+
    al_destroy_mutex(freetype_mutex);
 
    ttf_inited = false;
@@ -1130,16 +3831,36 @@ uint32_t al_get_allegro_ttf_version(void)
 void al_set_ttf_border_color(ALLEGRO_FONT *font, ALLEGRO_COLOR color)
 {
   ALLEGRO_TTF_FONT_DATA *data = font->data;
-  if (data->flags & ALLEGRO_TTF_RENDER_BORDER)
+  if (font->vtable == &df_vt) {
+    DISTANCE_FIELD_FONT *df = font->data;
+    if (df->flags & ALLEGRO_TTF_RENDER_BORDER) {
+      df->border_color = color;
+      _al_fetch_and_add1(&df->generation);
+    }
+    return;
+  }
+  if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
     data->border_color = color;
+    _al_fetch_and_add1(&data->generation);
+  }
 }
 
 void al_set_ttf_border_width(ALLEGRO_FONT *font, float width)
 {
   ALLEGRO_TTF_FONT_DATA *data = font->data;
+  if (font->vtable == &df_vt) {
+    DISTANCE_FIELD_FONT *df = font->data;
+    if (df->flags & ALLEGRO_TTF_RENDER_BORDER) {
+      df->border_width = width;
+      font->height = field_font_height(df);
+      _al_fetch_and_add1(&df->generation);
+    }
+    return;
+  }
   if (data->flags & ALLEGRO_TTF_RENDER_BORDER) {
     data->border_width = floor(width * FREETYPE_UNITS_PER_PIXEL + 0.5);
-  font->height = (data->face->size->metrics.height >> 6) + 2*ceil((float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+  font->height = (data->size->metrics.height >> 6) + 2*ceil((float)(data->border_width)/FREETYPE_UNITS_PER_PIXEL);
+    _al_fetch_and_add1(&data->generation);
   }
 }
 
@@ -0,0 +1,163 @@
+/*
+ *    Example program for the Allegro library.
+ *
+ *    Benchmark the mixer by rendering audio through the offline audio
+ *    driver as fast as possible, and report how many output frames per
+ *    second the mixer sustains.
+ *
+ *    usage: ./ex_mixer_bench [--null] [instances] [seconds]
+ *              [point|linear|cubic|sinc]
+ *
+ *    --null selects the offline driver for this run. Without it, the driver
+ *    set in the [audio] section of allegro5.cfg is used, and it must be
+ *    "null".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "allegro5/allegro.h"
+#include "allegro5/allegro_audio.h"
+
+#include "common.c"
+
+#define FREQUENCY    44100
+#define SAMPLE_FREQ  22050
+#define SAMPLE_LEN   (SAMPLE_FREQ / 2)
+#define BLOCK_FRAMES 1024
+
+static ALLEGRO_SAMPLE *create_sine_sample(void)
+{
+   float *buf = al_malloc(SAMPLE_LEN * sizeof(float));
+   int i;
+
+   if (!buf)
+      return NULL;
+
+   for (i = 0; i < SAMPLE_LEN; i++)
+      buf[i] = 0.5f * sinf(2.0f * ALLEGRO_PI * 440.0f * i / SAMPLE_FREQ);
+
+   return al_create_sample(buf, SAMPLE_LEN, SAMPLE_FREQ,
+      ALLEGRO_AUDIO_DEPTH_FLOAT32, ALLEGRO_CHANNEL_CONF_1, true);
+}
+
+static ALLEGRO_MIXER_QUALITY parse_quality(const char *s)
+{
+   if (!strcmp(s, "point"))
+      return ALLEGRO_MIXER_QUALITY_POINT;
+   if (!strcmp(s, "cubic"))
+      return ALLEGRO_MIXER_QUALITY_CUBIC;
+   if (!strcmp(s, "sinc"))
+      return ALLEGRO_MIXER_QUALITY_SINC;
+   return ALLEGRO_MIXER_QUALITY_LINEAR;
+}
+
+int main(int argc, char **argv)
+{
+   int num_instances = 64;
+   double seconds = 10.0;
+   ALLEGRO_MIXER_QUALITY quality = ALLEGRO_MIXER_QUALITY_LINEAR;
+   ALLEGRO_VOICE *voice;
+   ALLEGRO_MIXER *mixer;
+   ALLEGRO_SAMPLE *sample;
+   ALLEGRO_SAMPLE_INSTANCE **instances;
+   int16_t *block;
+   unsigned int total_frames;
+   unsigned int frames_done = 0;
+   double t0, elapsed;
+   bool use_null = false;
+   int arg = 1;
+   int i;
+
+   if (argc > arg && !strcmp(argv[arg], "--null")) {
+      use_null = true;
+      arg++;
+   }
+   if (argc > arg)
+      num_instances = atoi(argv[arg]);
+   if (argc > arg + 1)
+      seconds = atof(argv[arg + 1]);
+   if (argc > arg + 2)
+      quality = parse_quality(argv[arg + 2]);
+   if (num_instances < 0 || seconds <= 0.0) {
+      abort_example("Usage: %s [--null] [instances] [seconds] "
+         "[point|linear|cubic|sinc]\n", argv[0]);
+   }
+
+   if (!al_init()) {
+      abort_example("Could not init Allegro.\n");
+   }
+
+   open_log();
+
+   /* The offline driver lets the mixer run faster than real time. */
+   if (use_null)
+      al_set_config_value(al_get_system_config(), "audio", "driver", "null");
+   if (!al_install_audio()) {
+      abort_example("Could not init sound!\n");
+   }
+
+   voice = al_create_voice(FREQUENCY, ALLEGRO_AUDIO_DEPTH_INT16,
+      ALLEGRO_CHANNEL_CONF_2);
+   mixer = al_create_mixer(FREQUENCY, ALLEGRO_AUDIO_DEPTH_FLOAT32,
+      ALLEGRO_CHANNEL_CONF_2);
+   if (!voice || !mixer) {
+      abort_example("Could not create voice or mixer.\n");
+   }
+   al_set_mixer_quality(mixer, quality);
+   if (!al_attach_mixer_to_voice(mixer, voice)) {
+      abort_example("al_attach_mixer_to_voice failed.\n");
+   }
+
+   sample = create_sine_sample();
+   if (!sample) {
+      abort_example("Could not create sample.\n");
+   }
+
+   instances = al_calloc(num_instances + 1, sizeof(*instances));
+   for (i = 0; i < num_instances; i++) {
+      instances[i] = al_create_sample_instance(sample);
+      al_set_sample_instance_playmode(instances[i], ALLEGRO_PLAYMODE_LOOP);
+      /* Spread the speeds so that every instance needs resampling. */
+      al_set_sample_instance_speed(instances[i], 0.75f + 0.5f * i / (num_instances + 1));
+      al_set_sample_instance_pan(instances[i], -1.0f + 2.0f * i / (num_instances + 1));
+      al_set_sample_instance_gain(instances[i], 1.0f / (num_instances + 1));
+      al_attach_sample_instance_to_mixer(instances[i], mixer);
+      al_play_sample_instance(instances[i]);
+   }
+
+   block = al_malloc(BLOCK_FRAMES * 2 * sizeof(int16_t));
+   total_frames = (unsigned int)(seconds * FREQUENCY);
+
+   log_printf("Rendering %.1f s of audio with %d instances...\n",
+      seconds, num_instances);
+
+   t0 = al_get_time();
+   while (frames_done < total_frames) {
+      if (!al_render_voice(voice, block, BLOCK_FRAMES)) {
+         abort_example("The audio driver cannot render offline; "
+            "pass --null.\n");
+      }
+      frames_done += BLOCK_FRAMES;
+   }
+   elapsed = al_get_time() - t0;
+
+   log_printf("%u frames in %.3f s: %.0f frames/s, %.1fx real time\n",
+      frames_done, elapsed, frames_done / elapsed,
+      (frames_done / (double)FREQUENCY) / elapsed);
+
+   for (i = 0; i < num_instances; i++)
+      al_destroy_sample_instance(instances[i]);
+   al_free(instances);
+   al_free(block);
+   al_destroy_sample(sample);
+   al_destroy_mixer(mixer);
+   al_destroy_voice(voice);
+   al_uninstall_audio();
+
+   close_log(true);
+
+   return 0;
+}
+
+/* vim: set sts=3 sw=3 et: */
@@ -219,6 +219,9 @@ int main(int argc, char **argv)
             0, 256, al_map_rgba(0, 255, 0, 128));
             
          al_flip_display();
+
+         /* Done with the fragment; the recorder may reuse it. */
+         al_unref_user_event(&e.user);
       }
       else if (e.type == ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT) {
          /* This event is received when we are playing back the audio clip.
@@ -204,6 +204,9 @@ int main(int argc, char *argv[])
                is_recording = false;
             }
          }
+
+         /* Done with the fragment; the recorder may reuse it. */
+         al_unref_user_event(&event.user);
          
          if (!is_recording && name_buffer_pos != name_buffer && !spl) {
             /* finished recording, but haven't created the sample yet */
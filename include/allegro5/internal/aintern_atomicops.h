@@ -19,6 +19,19 @@
       return __sync_sub_and_fetch(ptr, 1);
    })
 
+   #if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
+      #define _al_atomic_load_acquire(ptr) \
+         __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+      #define _al_atomic_store_release(ptr, value) \
+         __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+   #else
+      #define _al_atomic_load_acquire(ptr) \
+         __extension__ ({ __typeof__(*(ptr)) _v = *(ptr); \
+            __sync_synchronize(); _v; })
+      #define _al_atomic_store_release(ptr, value) \
+         do { __sync_synchronize(); *(ptr) = (value); } while (0)
+   #endif
+
 #elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
 
    /* gcc, x86 or x86-64 */
@@ -49,11 +62,24 @@
       return old - 1;
    })
 
-#elif defined(_MSC_VER) && _M_IX86 >= 400
+   /* x86 doesn't reorder loads with loads or stores with stores, so only
+    * the compiler needs to be kept from doing so.
+    */
+   #define _al_atomic_load_acquire(ptr) \
+      __extension__ ({ __typeof__(*(ptr)) _v = *(ptr); \
+         __asm__ __volatile__ ("" : : : "memory"); _v; })
+   #define _al_atomic_store_release(ptr, value) \
+      do { __asm__ __volatile__ ("" : : : "memory"); *(ptr) = (value); } \
+      while (0)
+
+#elif defined(_MSC_VER) && \
+   (_M_IX86 >= 400 || defined(_M_X64) || defined(_M_ARM64))
 
-   /* MSVC, x86 */
+   /* MSVC, x86, x86-64 or ARM64 */
    /* MinGW supports these too, but we already have asm code above. */
 
+   #include <intrin.h>
+
    typedef LONG _AL_ATOMIC;
 
    AL_INLINE(_AL_ATOMIC,
@@ -68,6 +94,52 @@
       return InterlockedDecrement(ptr);
    })
 
+   /* x86 and x86-64 don't reorder loads with loads or stores with stores,
+    * so only the compiler needs to be kept from doing so.  ARM64 does, and
+    * volatile accesses are plain ones there under the default /volatile:iso.
+    */
+   #if defined(_M_ARM64)
+      #define __al_memory_barrier()    __dmb(_ARM64_BARRIER_ISH)
+   #else
+      #define __al_memory_barrier()    _ReadWriteBarrier()
+   #endif
+
+   AL_INLINE(_AL_ATOMIC,
+      _al_atomic_load_acquire, (volatile _AL_ATOMIC *ptr),
+   {
+      _AL_ATOMIC value = *(volatile _AL_ATOMIC *)ptr;
+      __al_memory_barrier();
+      return value;
+   })
+
+   AL_INLINE(void,
+      _al_atomic_store_release, (volatile _AL_ATOMIC *ptr, _AL_ATOMIC value),
+   {
+      __al_memory_barrier();
+      *(volatile _AL_ATOMIC *)ptr = value;
+   })
+
+   /* MSVC has no typeof, so pointers need their own functions. */
+   AL_INLINE(void *,
+      __al_atomic_load_acquire_ptr, (void * volatile *ptr),
+   {
+      void *value = *(void * volatile *)ptr;
+      __al_memory_barrier();
+      return value;
+   })
+
+   AL_INLINE(void,
+      __al_atomic_store_release_ptr, (void * volatile *ptr, void *value),
+   {
+      __al_memory_barrier();
+      *(void * volatile *)ptr = value;
+   })
+
+   #define _al_atomic_load_acquire_ptr(ptr) \
+      __al_atomic_load_acquire_ptr((void * volatile *)(ptr))
+   #define _al_atomic_store_release_ptr(ptr, value) \
+      __al_atomic_store_release_ptr((void * volatile *)(ptr), (value))
+
 #elif defined(ALLEGRO_HAVE_OSATOMIC_H)
 
    /* OS X, GCC < 4.1
@@ -93,6 +165,12 @@
       return OSAtomicDecrement32Barrier((_AL_ATOMIC *)ptr);
    })
 
+   #define _al_atomic_load_acquire(ptr) \
+      __extension__ ({ __typeof__(*(ptr)) _v = *(ptr); \
+         OSMemoryBarrier(); _v; })
+   #define _al_atomic_store_release(ptr, value) \
+      do { OSMemoryBarrier(); *(ptr) = (value); } while (0)
+
 
 #else
 
@@ -113,6 +191,17 @@
       return --(*ptr);
    })
 
+   #define _al_atomic_load_acquire(ptr)            (*(ptr))
+   #define _al_atomic_store_release(ptr, value)    (*(ptr) = (value))
+
+#endif
+
+/* Elsewhere the generic versions work for pointers too. */
+#ifndef _al_atomic_load_acquire_ptr
+   #define _al_atomic_load_acquire_ptr(ptr) \
+      _al_atomic_load_acquire(ptr)
+   #define _al_atomic_store_release_ptr(ptr, value) \
+      _al_atomic_store_release((ptr), (value))
 #endif
 
 #endif
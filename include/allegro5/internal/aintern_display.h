@@ -147,6 +147,7 @@ struct ALLEGRO_DISPLAY
 
    _AL_VECTOR display_invalidated_callbacks;
    _AL_VECTOR display_validated_callbacks;
+   _AL_VECTOR display_destroyed_callbacks;
 };
 
 int  _al_score_display_settings(ALLEGRO_EXTRA_DISPLAY_SETTINGS *eds, ALLEGRO_EXTRA_DISPLAY_SETTINGS *ref);
@@ -165,6 +166,12 @@ AL_FUNC(void, _al_remove_display_invalidated_callback, (ALLEGRO_DISPLAY *display
 AL_FUNC(void, _al_remove_display_validated_callback, (ALLEGRO_DISPLAY *display,
    void (*display_validated)(ALLEGRO_DISPLAY*)));
 
+/* For addons which keep resources per display, e.g. shaders. */
+AL_FUNC(void, _al_add_display_destroyed_callback, (ALLEGRO_DISPLAY *display,
+   void (*display_destroyed)(ALLEGRO_DISPLAY*)));
+AL_FUNC(void, _al_remove_display_destroyed_callback, (ALLEGRO_DISPLAY *display,
+   void (*display_destroyed)(ALLEGRO_DISPLAY*)));
+
 /* Defined in tls.c */
 bool _al_set_current_display_only(ALLEGRO_DISPLAY *display);
 void _al_set_new_display_settings(ALLEGRO_EXTRA_DISPLAY_SETTINGS *settings);
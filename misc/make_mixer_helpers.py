@@ -293,6 +293,49 @@ def make_cubic_interpolator(name, fmt):
       return samp_buf-> #{fmt} ;
    }""")
 
+def make_sinc_interpolator(name, fmt):
+   assert fmt == "f32"
+
+   # The sample positions and the kernel for the current fractional
+   # position are worked out by sinc_positions() and sinc_kernel() in
+   # kcm_mixer.c; here we only need to gather the window for each channel
+   # in the right format.
+   print interp("""\
+   static INLINE const void *
+      #{name}
+      (SAMP_BUF *samp_buf,
+       const ALLEGRO_SAMPLE_INSTANCE *spl,
+       unsigned int maxc)
+   {
+      int p[SINC_TAPS];
+      float k[SINC_TAPS];
+      float x[SINC_TAPS];
+      int i, j;
+
+      sinc_positions(spl, maxc, p);
+      sinc_kernel(spl, k);
+
+      switch (spl->spl_data.depth) {
+      """)
+
+   for depth in depths:
+      value = depth.index(fmt)("spl->spl_data.buffer", "p[j] + i")
+      print interp("""\
+         case #{depth.constant()}:
+            for (i = 0; i < (int)maxc; i++) {
+               for (j = 0; j < SINC_TAPS; j++) {
+                  x[j] = #{value};
+               }
+               samp_buf->f32[i] = sinc_dot(x, k);
+            }
+            break;
+         """)
+
+   print interp("""\
+      }
+      return samp_buf-> #{fmt} ;
+   }""")
+
 if __name__ == "__main__":
    print "// Warning: This file was created by make_resamplers.py - do not edit."
    print "// vim: set ft=c:"
@@ -302,5 +345,6 @@ if __name__ == "__main__":
    make_linear_interpolator("linear_spl32", "f32")
    make_linear_interpolator("linear_spl16", "s16")
    make_cubic_interpolator("cubic_spl32", "f32")
+   make_sinc_interpolator("sinc_spl32", "f32")
 
 # vim: set sts=3 sw=3 et: